@@ -31,44 +31,38 @@ DAMAGE.
 #include <sys/malloc.h>
 #include <sys/kernel.h>
 #include <sys/buf.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <machine/atomic.h>
 #include "btrfs.h"
+#include "btrfs_accessors.h"
 
 
-static MALLOC_DEFINE(M_BTRFSOPS, "btrfs_ops", "btrfs operations malloc");
+MALLOC_DEFINE(M_BTRFSOPS, "btrfs_ops", "btrfs operations malloc");
 
 int btrfs_lookup_dir_item(struct btrfsmount_internal *bmp, struct btrfs_dir_item *dir_result, const char *name, int name_len) {
     return(0);
 }
 
-int bo_read_key_into_buf(struct vnode *devvp, struct btrfs_key key, struct btrfs_sys_chunks *cache_head, uint8_t *dest) {
-        // tmp_chunk_entry->key
+// read `size` bytes starting at a physical byte address on the device.
+// logical_addr is only passed along to the read probe.
+static int bo_read_phys_into_buf(struct btrfsmount_internal *bmp, uint64_t logical_addr, uint64_t phys_addr, uint32_t size, uint8_t *dest) {
         struct buf *bp;
-        int error = 1, offset = 0;
-        struct b_chunk_list *chunk_entry;
-        uint64_t phys_addr;
+        sbintime_t start = BS_PROBE_START();
+        int error = 0, offset = 0;
 
-        if(dest == NULL) {
-                uprintf("[BTRFS] bad buffer passed to btrfs_read_key_into_buf()\n");
-                goto read_fail;
-        }
-        chunk_entry = bc_find_logical_in_cache(key.offset, cache_head);
-        if(!chunk_entry) {
-                uprintf("[BTRFS] Failed to find a chunk tree cache entry for %lu\n", key.offset);
-                goto read_fail;
-        }
-
-        phys_addr = bc_logical_to_physical(chunk_entry->key, key.offset, cache_head);
-
-        int bytes_remaining = chunk_entry->chunk_item.size;
+        int bytes_remaining = size;
         while(bytes_remaining > 0) {
                 size_t bytes_to_read = (bytes_remaining > MAXBCACHEBUF) ? MAXBCACHEBUF : bytes_remaining;
                 daddr_t block_num = (phys_addr + offset) / DEV_BSIZE; // phys addr to blocknr
                 size_t block_offset = (phys_addr + offset) % DEV_BSIZE; // offset in blocknr
 
-                error = bread(devvp, block_num, bytes_to_read + block_offset, NOCRED, &bp);
+                error = bread(bmp->pm_devvp, block_num, bytes_to_read + block_offset, NOCRED, &bp);
+                BS_INC(bmp, BTRFS_STAT_BREAD);
+                BS_ADD(bmp, BTRFS_STAT_BREAD_BYTES, bytes_to_read + block_offset);
                 if (error != 0) {
                         brelse(bp);
-                        goto read_fail;
+                        break;
                 }
 
                 memcpy(dest + offset, bp->b_data + block_offset, bytes_to_read);
@@ -77,65 +71,169 @@ int bo_read_key_into_buf(struct vnode *devvp, struct btrfs_key key, struct btrfs
                 offset += bytes_to_read;
                 bytes_remaining -= bytes_to_read;
         }
-        return(bytes_remaining); // should be zero
-
-read_fail:
+        SDT_PROBE5(btrfs, , bo, read, logical_addr, phys_addr, size, BS_PROBE_NS(start), error);
         return(error);
 }
 
-struct b_chunk_list *bc_find_key_in_cache(struct btrfs_key key, struct btrfs_sys_chunks *head) {
-    struct b_chunk_list *cache_entry;
+// read `size` bytes starting at a logical address, e.g. a single tree block of node_size
+int bo_read_logical_into_buf(struct btrfsmount_internal *bmp, uint64_t logical_addr, uint32_t size, uint8_t *dest) {
+        struct b_chunk_list *chunk_entry;
 
-	LIST_FOREACH(cache_entry, head, entries) {
-		if(cache_entry->key.obj_id == key.obj_id && cache_entry->key.obj_type == key.obj_type && (key.offset == 0 || cache_entry->key.offset == key.offset))
-			return(cache_entry);
-	}
+        if(dest == NULL) {
+                uprintf("[BTRFS] bad buffer passed to bo_read_logical_into_buf()\n");
+                return(1);
+        }
+        chunk_entry = bc_map_find_logical(bmp, logical_addr);
+        if(!chunk_entry) {
+                uprintf("[BTRFS] Failed to find a chunk tree cache entry for %lu\n", logical_addr);
+                return(1);
+        }
+        // a read may not straddle two chunks, they need not be contiguous on disk
+        if(logical_addr + size > chunk_entry->key.offset + chunk_entry->chunk_item.size) {
+                uprintf("[BTRFS] Read of %u bytes at %lu crosses a chunk boundary\n", size, logical_addr);
+                return(1);
+        }
 
-	return NULL;
+        return(bo_read_phys_into_buf(bmp, logical_addr, chunk_entry->chunk_stripe.offset + (logical_addr - chunk_entry->key.offset),
+            size, dest));
 }
 
-struct b_chunk_list *bc_find_logical_in_cache(uint64_t logical_addr, struct btrfs_sys_chunks *head) {
-	struct b_chunk_list *cache_entry;
-	
-	LIST_FOREACH(cache_entry, head, entries) {
-		if(logical_addr >= cache_entry->key.offset && logical_addr < (cache_entry->key.offset + cache_entry->chunk_item.size))
-			return(cache_entry);
+// one past the last entry starting at or before logical_addr, 0 when there is none
+static uint32_t bc_map_search(const struct bc_chunk_map *map, uint64_t logical_addr) {
+	uint32_t lo = 0, hi = map->count, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(map->entries[mid]->key.offset <= logical_addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return NULL;
+	return(lo);
 }
 
-uint64_t bc_logical_to_physical(struct btrfs_key search_key, uint64_t logical_addr, struct btrfs_sys_chunks *head) {
+// `chunk` points at an on-disk CHUNK_ITEM and its stripes; only the first stripe is kept
+// entries come from the mount's arena and are released with it
+int bc_add_to_chunk_cache(struct btrfsmount_internal *bmp, const struct btrfs_key *key, const uint8_t *chunk) {
+	struct btrfs_sys_chunks *head = &bmp->pm_backing_dev_bootstrap;
 	struct b_chunk_list *cache_entry;
-	cache_entry = bc_find_key_in_cache(search_key, head);
-	if(cache_entry)
-		return(cache_entry->chunk_stripe.offset + (logical_addr - cache_entry->key.offset));
-	return(0);
+	struct bc_chunk_map *map;
+	const uint8_t *stripe;
+	uint32_t i;
+
+	/*
+	 * Chunk keys are unique within sys_chunk_array and within the chunk tree,
+	 * the only repeats are SYSTEM chunks met again in the tree. Those were
+	 * published before the tree walk started, so the sorted map catches them.
+	 */
+	map = (struct bc_chunk_map *)atomic_load_acq_ptr((uintptr_t *)&bmp->pm_chunk_map);
+	if(map != NULL) {
+		i = bc_map_search(map, key->offset);
+		if(i > 0 && map->entries[i - 1]->key.offset == key->offset)
+			return(0);
+	}
+
+	cache_entry = ba_arena_alloc(&bmp->pm_arena, sizeof(struct b_chunk_list));
+	cache_entry->key = *key;
+	cache_entry->chunk_item.size = btrfs_chunk_length(chunk);
+	cache_entry->chunk_item.type = btrfs_chunk_type(chunk);
+	cache_entry->chunk_item.num_stripes = btrfs_chunk_num_stripes(chunk);
+	stripe = btrfs_chunk_stripe(chunk, 0);
+	cache_entry->chunk_stripe.dev_id = btrfs_stripe_devid(stripe);
+	cache_entry->chunk_stripe.offset = btrfs_stripe_offset(stripe);
+	LIST_INSERT_HEAD(head, cache_entry, entries);
+	return(1);
 }
 
-int bc_add_to_chunk_cache(struct btrfs_key key, struct btrfs_chunk_item item, struct btrfs_chunk_item_stripe stripe, struct btrfs_sys_chunks *head) {
-	struct b_chunk_list *cache_entry;
-	if(bc_find_key_in_cache(key, head) == NULL) {
-		// this key isn't already cached in the chunk_tree list we hold
-		cache_entry = malloc(sizeof(struct b_chunk_list), M_BTRFSOPS, M_WAITOK | M_ZERO);
-		cache_entry->key = key;
-		cache_entry->chunk_item = item;
-		cache_entry->chunk_stripe = stripe;
-		LIST_INSERT_HEAD(head, cache_entry, entries);
-		return(1);
+// Queue asynchronous reads of `count` blocks of `size` bytes so that later
+// bo_read_logical_into_buf() calls for them find the data in the buffer cache.
+// Blocks that can't be mapped or aren't sector aligned are skipped, the real
+// read will report them.
+void bo_readahead_logical(struct btrfsmount_internal *bmp, const uint64_t *logical_addrs, int count, uint32_t size) {
+	struct b_chunk_list *chunk_entry;
+	daddr_t *blknos;
+	int *sizes, n = 0;
+	uint64_t phys;
+
+	if(count == 0 || size > MAXBCACHEBUF)
+		return;
+	blknos = mallocarray(count, sizeof(*blknos), M_BTRFSOPS, M_WAITOK);
+	sizes = mallocarray(count, sizeof(*sizes), M_BTRFSOPS, M_WAITOK);
+	for(int i = 0; i < count; ++i) {
+		chunk_entry = bc_map_find_logical(bmp, logical_addrs[i]);
+		if(chunk_entry == NULL || logical_addrs[i] + size > chunk_entry->key.offset + chunk_entry->chunk_item.size)
+			continue;
+		phys = chunk_entry->chunk_stripe.offset + (logical_addrs[i] - chunk_entry->key.offset);
+		if(phys % DEV_BSIZE != 0)
+			continue;
+		blknos[n] = phys / DEV_BSIZE;
+		sizes[n] = size;
+		n++;
 	}
+	if(n > 0)
+		breada(bmp->pm_devvp, blknos, sizes, n, NOCRED, 0, NULL);
+	free(sizes, M_BTRFSOPS);
+	free(blknos, M_BTRFSOPS);
+}
 
-	// there is a key in the chunk_tree list
-	return(0);
+/*
+ * The chunk list above is only touched by whoever is loading the chunk tree.
+ * Readers use an immutable array of the entries sorted by logical address,
+ * swapped in atomically each time the list grows. A reader may keep using the
+ * snapshot it loaded, so snapshots come from the mount's arena and are only
+ * released at unmount; the list stops growing once the chunk tree is read, so
+ * there are only a few.
+ */
+static int bc_chunk_cmp(const void *a, const void *b) {
+	const struct b_chunk_list *ca = *(struct b_chunk_list * const *)a;
+	const struct b_chunk_list *cb = *(struct b_chunk_list * const *)b;
+
+	if(ca->key.offset == cb->key.offset)
+		return(0);
+	return(ca->key.offset < cb->key.offset ? -1 : 1);
 }
 
-void bc_free_cache_list(struct btrfs_sys_chunks *head) {
-	if(!LIST_EMPTY(head)) {
-		struct b_chunk_list *clr_np;
-		while(!LIST_EMPTY(head)) {
-			clr_np = LIST_FIRST(head);
-			LIST_REMOVE(clr_np, entries);
-			free(clr_np, M_BTRFSOPS);
-			clr_np = NULL;
-		}
+void bc_publish_chunk_map(struct btrfsmount_internal *bmp) {
+	struct bc_chunk_map *map;
+	struct b_chunk_list *cache_entry;
+	uint32_t count = 0;
+
+	mtx_lock(&bmp->pm_chunklock);
+	LIST_FOREACH(cache_entry, &bmp->pm_backing_dev_bootstrap, entries)
+		count++;
+
+	map = ba_arena_alloc(&bmp->pm_arena, sizeof(*map) + count * sizeof(map->entries[0]));
+	LIST_FOREACH(cache_entry, &bmp->pm_backing_dev_bootstrap, entries)
+		map->entries[map->count++] = cache_entry;
+	qsort(map->entries, map->count, sizeof(map->entries[0]), bc_chunk_cmp);
+
+	atomic_store_rel_ptr((uintptr_t *)&bmp->pm_chunk_map, (uintptr_t)map);
+	mtx_unlock(&bmp->pm_chunklock);
+}
+
+// lock-free logical address lookup against the current snapshot
+struct b_chunk_list *bc_map_find_logical(struct btrfsmount_internal *bmp, uint64_t logical_addr) {
+	struct bc_chunk_map *map;
+	struct b_chunk_list *cache_entry;
+	uint32_t lo;
+
+	BS_INC(bmp, BTRFS_STAT_CHUNK_LOOKUP);
+	map = (struct bc_chunk_map *)atomic_load_acq_ptr((uintptr_t *)&bmp->pm_chunk_map);
+	if(map == NULL)
+		goto not_found;
+
+	lo = bc_map_search(map, logical_addr);
+	if(lo == 0)
+		goto not_found;
+	cache_entry = map->entries[lo - 1];
+	if(logical_addr < cache_entry->key.offset + cache_entry->chunk_item.size) {
+		SDT_PROBE3(btrfs, , bc, map, logical_addr, cache_entry->key.offset,
+		    cache_entry->chunk_stripe.offset + (logical_addr - cache_entry->key.offset));
+		return(cache_entry);
 	}
-}
\ No newline at end of file
+
+not_found:
+	BS_INC(bmp, BTRFS_STAT_CHUNK_MISS);
+	SDT_PROBE3(btrfs, , bc, map, logical_addr, 0, 0);
+	return NULL;
+}
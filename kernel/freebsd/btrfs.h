@@ -27,18 +27,24 @@ DAMAGE.
 #ifndef _BTRFS_H
 #define _BTRFS_H
 
+#include <sys/malloc.h>
 #include "btrfs_mount.h"
 
+int btrfs_wait_loaded(struct btrfsmount_internal *bmp);
 int btrfs_lookup_dir_item(struct btrfsmount_internal *bmp, struct btrfs_dir_item *dir_result, const char *name, int name_len);
 
 // bo_ - Block operations
 // bc_ - BTRFS Cache
+// bz_ - Decompression
 
-int bo_read_key_into_buf(struct vnode *devvp, struct btrfs_key key, struct btrfs_sys_chunks *cache_head, uint8_t *dest);
-struct b_chunk_list *bc_find_key_in_cache(struct btrfs_key key, struct btrfs_sys_chunks *head);
-struct b_chunk_list *bc_find_logical_in_cache(uint64_t logical_addr, struct btrfs_sys_chunks *head);
-uint64_t bc_logical_to_physical(struct btrfs_key search_key, uint64_t logical_addr, struct btrfs_sys_chunks *head);
-int bc_add_to_chunk_cache(struct btrfs_key key, struct btrfs_chunk_item item, struct btrfs_chunk_item_stripe stripe, struct btrfs_sys_chunks *head);
-void bc_free_cache_list(struct btrfs_sys_chunks *head);
+MALLOC_DECLARE(M_BTRFSOPS);
+
+int bo_read_logical_into_buf(struct btrfsmount_internal *bmp, uint64_t logical_addr, uint32_t size, uint8_t *dest);
+void bo_readahead_logical(struct btrfsmount_internal *bmp, const uint64_t *logical_addrs, int count, uint32_t size);
+int bc_add_to_chunk_cache(struct btrfsmount_internal *bmp, const struct btrfs_key *key, const uint8_t *chunk);
+void bc_publish_chunk_map(struct btrfsmount_internal *bmp);
+struct b_chunk_list *bc_map_find_logical(struct btrfsmount_internal *bmp, uint64_t logical_addr);
+
+int bz_decompress(uint8_t compression, const uint8_t *src, size_t src_len, uint64_t skip, uint8_t *dest, size_t dest_len);
 
 #endif
\ No newline at end of file
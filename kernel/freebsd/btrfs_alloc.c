@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <vm/uma.h>
+#include "btrfs_alloc.h"
+#include "btrfs_mount.h"
+#include "btrfs_inode.h"
+
+static MALLOC_DEFINE(M_BTRFSARENA, "btrfs_arena", "btrfs per-mount arenas");
+
+uma_zone_t ba_inode_zone;
+uma_zone_t ba_root_zone;
+uma_zone_t ba_block_zone;
+
+void ba_init_zones(void) {
+	ba_inode_zone = uma_zcreate("btrfs_inode", sizeof(struct btrfs_inode), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
+	ba_root_zone = uma_zcreate("btrfs_root", sizeof(struct btrfs_root), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
+	ba_block_zone = uma_zcreate("btrfs_block", sizeof(struct bn_block), NULL, NULL, NULL, NULL,
+	    UMA_ALIGN_PTR, 0);
+}
+
+void ba_destroy_zones(void) {
+	uma_zdestroy(ba_block_zone);
+	uma_zdestroy(ba_root_zone);
+	uma_zdestroy(ba_inode_zone);
+}
+
+uma_zone_t ba_node_zone_create(uint32_t node_size) {
+	return(uma_zcreate("btrfs_node", node_size, NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0));
+}
+
+/*
+ * Bump allocator over a list of slabs. Nothing is freed individually; requests
+ * larger than a slab get a slab of their own.
+ */
+
+#define BA_SLAB_SIZE (64 * 1024)
+
+struct ba_slab {
+	SLIST_ENTRY(ba_slab) link;
+	uint8_t data[] __aligned(16);
+};
+
+void ba_arena_init(struct ba_arena *arena) {
+	mtx_init(&arena->ba_lock, "btrfsarena", NULL, MTX_DEF);
+	SLIST_INIT(&arena->ba_slabs);
+	arena->ba_used = 0;
+	arena->ba_size = 0;
+}
+
+// zeroed, 16 byte aligned, never fails
+void *ba_arena_alloc(struct ba_arena *arena, size_t size) {
+	struct ba_slab *slab;
+	size_t slab_size;
+	void *ptr;
+
+	size = roundup2(size, 16);
+	mtx_lock(&arena->ba_lock);
+	if(SLIST_EMPTY(&arena->ba_slabs) || arena->ba_size - arena->ba_used < size) {
+		slab_size = MAX(size, BA_SLAB_SIZE - sizeof(*slab));
+		mtx_unlock(&arena->ba_lock);
+		slab = malloc(sizeof(*slab) + slab_size, M_BTRFSARENA, M_WAITOK | M_ZERO);
+		mtx_lock(&arena->ba_lock);
+		if(slab_size > BA_SLAB_SIZE - sizeof(*slab)) {
+			// oversized, keep filling the current slab
+			if(SLIST_EMPTY(&arena->ba_slabs))
+				SLIST_INSERT_HEAD(&arena->ba_slabs, slab, link);
+			else
+				SLIST_INSERT_AFTER(SLIST_FIRST(&arena->ba_slabs), slab, link);
+			mtx_unlock(&arena->ba_lock);
+			return(slab->data);
+		}
+		SLIST_INSERT_HEAD(&arena->ba_slabs, slab, link);
+		arena->ba_used = 0;
+		arena->ba_size = slab_size;
+	}
+	ptr = SLIST_FIRST(&arena->ba_slabs)->data + arena->ba_used;
+	arena->ba_used += size;
+	mtx_unlock(&arena->ba_lock);
+	return(ptr);
+}
+
+void ba_arena_destroy(struct ba_arena *arena) {
+	struct ba_slab *slab;
+
+	while(!SLIST_EMPTY(&arena->ba_slabs)) {
+		slab = SLIST_FIRST(&arena->ba_slabs);
+		SLIST_REMOVE_HEAD(&arena->ba_slabs, link);
+		free(slab, M_BTRFSARENA);
+	}
+	mtx_destroy(&arena->ba_lock);
+}
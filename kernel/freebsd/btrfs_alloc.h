@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_ALLOC_H
+#define _BTRFS_ALLOC_H
+
+#include <sys/types.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+#include <vm/uma.h>
+
+// ba_ - Allocation
+//
+// Objects that come and go with vnodes or lookups live in UMA zones, so their
+// allocation is served from per-CPU caches. Objects that live exactly as long as
+// the mount (the chunk list and its snapshots) are carved out of a per-mount
+// arena and released in one go at unmount.
+
+extern uma_zone_t ba_inode_zone;                // struct btrfs_inode
+extern uma_zone_t ba_root_zone;                 // struct btrfs_root
+extern uma_zone_t ba_block_zone;                // struct bn_block, the tree block cache's entries
+
+void ba_init_zones(void);
+void ba_destroy_zones(void);
+
+// tree blocks are node_size, which is only known once the superblock is read
+uma_zone_t ba_node_zone_create(uint32_t node_size);
+
+struct ba_slab;
+
+struct ba_arena {
+    struct mtx ba_lock;
+    SLIST_HEAD(, ba_slab) ba_slabs;
+    size_t ba_used;                             // bytes handed out from the first slab
+    size_t ba_size;                             // usable bytes in the first slab
+};
+
+void ba_arena_init(struct ba_arena *arena);
+void *ba_arena_alloc(struct ba_arena *arena, size_t size);
+void ba_arena_destroy(struct ba_arena *arena);
+
+#endif // _BTRFS_ALLOC_H
@@ -0,0 +1,242 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/limits.h>
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sysctl.h>
+#include <vm/uma.h>
+#include "btrfs.h"
+#include "btrfs_tree.h"
+#include "btrfs_cache.h"
+
+static MALLOC_DEFINE(M_BTRFSCACHE, "btrfs_cache", "btrfs tree block cache");
+
+static uint64_t bn_cache_size = 64 * 1024 * 1024;
+SYSCTL_U64(_vfs_btrfs, OID_AUTO, tree_cache_size, CTLFLAG_RWTUN, &bn_cache_size, 0,
+    "Bytes of tree blocks each mount keeps in memory, taken at mount");
+
+// passes of the clock hand a hit is worth
+#define BN_LEAF_CHANCES 1
+#define BN_NODE_CHANCES 3
+
+// per shard, whatever the budget: a few paths' worth of blocks must fit
+#define BN_MIN_BLOCKS 16
+
+static uint32_t bn_hash(uint64_t bytenr) {
+	// tree blocks are at least 4K aligned, the low bits carry nothing
+	return((uint32_t)(((bytenr >> 12) * 0x9e3779b97f4a7c15ULL) >> 32));
+}
+
+static struct bn_shard *bn_shard(struct btrfsmount_internal *bmp, uint64_t bytenr) {
+	return(&bmp->pm_nodecache.bn_shards[bn_hash(bytenr) % BN_NSHARDS]);
+}
+
+static struct bn_bucket *bn_bucket(struct bn_shard *shard, uint64_t bytenr) {
+	return(&shard->ns_hash[(bn_hash(bytenr) / BN_NSHARDS) & shard->ns_mask]);
+}
+
+void bn_init(struct btrfsmount_internal *bmp) {
+	uint64_t blocks = bn_cache_size / bmp->pm_superblock.node_size / BN_NSHARDS;
+	struct bn_shard *shard;
+	u_long nbuckets;
+
+	blocks = MIN(MAX(blocks, BN_MIN_BLOCKS), UINT_MAX / 2);
+	for(nbuckets = 1; nbuckets < blocks; nbuckets <<= 1)
+		;
+	for(int i = 0; i < BN_NSHARDS; ++i) {
+		shard = &bmp->pm_nodecache.bn_shards[i];
+		mtx_init(&shard->ns_lock, "btrfsnode", NULL, MTX_DEF);
+		shard->ns_hash = mallocarray(nbuckets, sizeof(*shard->ns_hash), M_BTRFSCACHE, M_WAITOK);
+		for(u_long j = 0; j < nbuckets; ++j)
+			LIST_INIT(&shard->ns_hash[j]);
+		shard->ns_mask = nbuckets - 1;
+		TAILQ_INIT(&shard->ns_clock);
+		shard->ns_count = 0;
+		shard->ns_max = blocks;
+	}
+}
+
+static void bn_free_block(struct btrfsmount_internal *bmp, struct bn_block *block) {
+	bt_free_block(bmp, block->bn_data);
+	uma_zfree(ba_block_zone, block);
+}
+
+// every path has been released by now, only the table holds references
+void bn_destroy(struct btrfsmount_internal *bmp) {
+	struct bn_shard *shard;
+	struct bn_block *block;
+
+	for(int i = 0; i < BN_NSHARDS; ++i) {
+		shard = &bmp->pm_nodecache.bn_shards[i];
+		while((block = TAILQ_FIRST(&shard->ns_clock)) != NULL) {
+			TAILQ_REMOVE(&shard->ns_clock, block, bn_clock);
+			bn_free_block(bmp, block);
+		}
+		free(shard->ns_hash, M_BTRFSCACHE);
+		mtx_destroy(&shard->ns_lock);
+	}
+}
+
+static struct bn_block *bn_lookup(struct bn_shard *shard, uint64_t bytenr) {
+	struct bn_block *block;
+
+	LIST_FOREACH(block, bn_bucket(shard, bytenr), bn_hash) {
+		if(block->bn_bytenr == bytenr)
+			return(block);
+	}
+	return(NULL);
+}
+
+// takes the block out of the table and drops the table's reference
+static void bn_unlink(struct bn_shard *shard, struct bn_block *block) {
+	LIST_REMOVE(block, bn_hash);
+	TAILQ_REMOVE(&shard->ns_clock, block, bn_clock);
+	shard->ns_count--;
+	block->bn_refs--;
+}
+
+/*
+ * Runs the hand until the shard is back under budget. Blocks held by a path
+ * go round untouched, so when every block is held the shard stays over budget
+ * until some are released; the scan is bounded for that case.
+ */
+static void bn_evict(struct btrfsmount_internal *bmp, struct bn_shard *shard) {
+	struct bn_block *block;
+	u_int scan;
+
+	mtx_assert(&shard->ns_lock, MA_OWNED);
+	for(scan = shard->ns_count * (BN_NODE_CHANCES + 1); shard->ns_count > shard->ns_max && scan > 0; --scan) {
+		block = TAILQ_FIRST(&shard->ns_clock);
+		if(block->bn_refs > 1 || block->bn_chances > 0) {
+			if(block->bn_refs == 1)
+				block->bn_chances--;
+			TAILQ_REMOVE(&shard->ns_clock, block, bn_clock);
+			TAILQ_INSERT_TAIL(&shard->ns_clock, block, bn_clock);
+			continue;
+		}
+		bn_unlink(shard, block);
+		bn_free_block(bmp, block);
+		BS_INC(bmp, BTRFS_STAT_TREE_CACHE_EVICT);
+	}
+}
+
+int bn_get(struct btrfsmount_internal *bmp, uint64_t bytenr, int level, struct bn_block **blockp, int *blocks_read) {
+	struct bn_shard *shard = bn_shard(bmp, bytenr);
+	struct bn_block *block, *fresh = NULL;
+	uint8_t chances = level > 0 ? BN_NODE_CHANCES : BN_LEAF_CHANCES;
+	int error;
+
+	mtx_lock(&shard->ns_lock);
+	block = bn_lookup(shard, bytenr);
+	if(block == NULL) {
+		// allocations may sleep, look again once they are done
+		mtx_unlock(&shard->ns_lock);
+		fresh = uma_zalloc(ba_block_zone, M_WAITOK | M_ZERO);
+		fresh->bn_data = bt_alloc_block(bmp);
+		mtx_lock(&shard->ns_lock);
+		block = bn_lookup(shard, bytenr);
+	}
+
+	if(block != NULL) {
+		block->bn_refs++;
+		block->bn_chances = chances;
+		if(block->bn_state == BN_READING) {
+			// single flight: the thread that missed first does the read
+			BS_INC(bmp, BTRFS_STAT_TREE_CACHE_WAIT);
+			while(block->bn_state == BN_READING)
+				msleep(block, &shard->ns_lock, PRIBIO, "btrnode", 0);
+		} else
+			BS_INC(bmp, BTRFS_STAT_TREE_CACHE_HIT);
+		error = block->bn_error;
+		if(error == 0 && block->bn_level != level)
+			error = EIO;
+		mtx_unlock(&shard->ns_lock);
+		if(fresh != NULL)
+			bn_free_block(bmp, fresh);
+		if(error) {
+			bn_release(bmp, block);
+			return(error);
+		}
+		*blockp = block;
+		return(0);
+	}
+
+	// ours to read, held by us and by the table
+	block = fresh;
+	block->bn_bytenr = bytenr;
+	block->bn_level = level;
+	block->bn_state = BN_READING;
+	block->bn_chances = chances;
+	block->bn_refs = 2;
+	LIST_INSERT_HEAD(bn_bucket(shard, bytenr), block, bn_hash);
+	TAILQ_INSERT_TAIL(&shard->ns_clock, block, bn_clock);
+	shard->ns_count++;
+	bn_evict(bmp, shard);
+	mtx_unlock(&shard->ns_lock);
+
+	BS_INC(bmp, BTRFS_STAT_TREE_CACHE_MISS);
+	(*blocks_read)++;
+	error = bo_read_logical_into_buf(bmp, bytenr, bmp->pm_superblock.node_size, block->bn_data);
+	if(error == 0) {
+		error = bt_check_csum(bmp, block->bn_data);
+		if(error == 0)
+			error = bt_check_block(bmp, block->bn_data, level);
+		if(error)
+			uprintf("[BTRFS] Corrupt tree block at %lu\n", bytenr);
+	}
+
+	mtx_lock(&shard->ns_lock);
+	block->bn_state = BN_DONE;
+	block->bn_error = error;
+	// a failed read is not kept, the next lookup goes to the device again
+	if(error)
+		bn_unlink(shard, block);
+	wakeup(block);
+	mtx_unlock(&shard->ns_lock);
+	if(error) {
+		bn_release(bmp, block);
+		return(error);
+	}
+	*blockp = block;
+	return(0);
+}
+
+void bn_release(struct btrfsmount_internal *bmp, struct bn_block *block) {
+	struct bn_shard *shard = bn_shard(bmp, block->bn_bytenr);
+	u_int refs;
+
+	mtx_lock(&shard->ns_lock);
+	refs = --block->bn_refs;
+	mtx_unlock(&shard->ns_lock);
+	// only blocks already out of the table can reach zero
+	if(refs == 0)
+		bn_free_block(bmp, block);
+}
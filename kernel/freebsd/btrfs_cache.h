@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_CACHE_H
+#define _BTRFS_CACHE_H
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/queue.h>
+
+// bn_ - Tree block cache
+//
+// Verified tree blocks below the tree roots, keyed by logical address and
+// shared by every path on the mount. The table is split into shards with a
+// lock each, so searches on different blocks rarely meet. A block that is
+// being read stays in the table while the read is in flight and other threads
+// missing on it sleep on the entry instead of reading it again. Eviction is
+// CLOCK: every hit grants a block some passes of the hand, interior nodes more
+// than leaves, so the upper levels of busy trees stay resident. Blocks held by
+// a path are never evicted. Tree roots are not cached here; they live with
+// their struct btrfs_root for the whole mount.
+
+#define BN_NSHARDS 16
+
+#define BN_READING  0                           // in flight, sleep on the block
+#define BN_DONE     1                           // read finished, bn_error has the result
+
+struct bn_block {
+    LIST_ENTRY(bn_block) bn_hash;
+    TAILQ_ENTRY(bn_block) bn_clock;
+    uint64_t bn_bytenr;
+    uint8_t *bn_data;                           // node_size, from pm_nodezone
+    u_int bn_refs;                              // paths holding it, plus one while in the table
+    uint8_t bn_level;
+    uint8_t bn_state;                           // BN_READING or BN_DONE
+    uint8_t bn_chances;                         // passes of the clock hand left
+    int bn_error;                               // result of the read, once not BN_READING
+};
+
+LIST_HEAD(bn_bucket, bn_block);
+
+struct bn_shard {
+    struct mtx ns_lock;
+    struct bn_bucket *ns_hash;
+    u_long ns_mask;
+    TAILQ_HEAD(, bn_block) ns_clock;            // the hand is at the head
+    u_int ns_count;
+    u_int ns_max;                               // blocks before the hand starts evicting
+} __aligned(CACHE_LINE_SIZE);
+
+struct bn_cache {
+    struct bn_shard bn_shards[BN_NSHARDS];
+};
+
+struct btrfsmount_internal;
+
+// sized from vfs.btrfs.tree_cache_size once node_size is known
+void bn_init(struct btrfsmount_internal *bmp);
+void bn_destroy(struct btrfsmount_internal *bmp);
+
+/*
+ * The block at `bytenr`, which must be at `level`, read and verified on a
+ * miss. The caller holds a reference until bn_release(). `*blocks_read` is
+ * incremented when this call went to the device. Returns 0, EIO for a block
+ * that fails verification or an errno from the read.
+ */
+int bn_get(struct btrfsmount_internal *bmp, uint64_t bytenr, int level, struct bn_block **blockp, int *blocks_read);
+void bn_release(struct btrfsmount_internal *bmp, struct bn_block *block);
+
+#endif // _BTRFS_CACHE_H
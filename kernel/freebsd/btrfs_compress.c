@@ -0,0 +1,127 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/module.h>
+#include <sys/malloc.h>
+#include <contrib/zlib/zlib.h>
+#include "btrfs.h"
+
+/*
+ * Decompression of compressed extents. Callers usually want a window of the
+ * decoded extent (the part a buffer or page covers), so every decoder takes a
+ * number of leading bytes to throw away and writes the rest straight into the
+ * caller's buffer, without staging the whole extent.
+ */
+
+static MALLOC_DEFINE(M_BTRFSZ, "btrfs_zlib", "btrfs zlib decompression state");
+
+static void *bz_zalloc(void *nil, u_int items, u_int size) {
+	return(mallocarray(items, size, M_BTRFSZ, M_NOWAIT));
+}
+
+static void bz_zfree(void *nil, void *ptr) {
+	free(ptr, M_BTRFSZ);
+}
+
+// btrfs zlib extents are a single zlib stream
+static int bz_inflate(const uint8_t *src, size_t src_len, uint64_t skip, uint8_t *dest, size_t dest_len, size_t *produced) {
+	uint8_t *scratch = NULL;
+	size_t chunk;
+	z_stream zs;
+	int zerr = Z_OK, error = 0;
+
+	*produced = 0;
+	memset(&zs, 0, sizeof(zs));
+	zs.zalloc = bz_zalloc;
+	zs.zfree = bz_zfree;
+	if(inflateInit(&zs) != Z_OK)
+		return(EIO);
+
+	zs.next_in = (Bytef *)(uintptr_t)src;
+	zs.avail_in = src_len;
+
+	if(skip > 0)
+		scratch = malloc(PAGE_SIZE, M_BTRFSZ, M_WAITOK);
+	while(skip > 0) {
+		chunk = MIN(skip, PAGE_SIZE);
+		zs.next_out = scratch;
+		zs.avail_out = chunk;
+		zerr = inflate(&zs, Z_NO_FLUSH);
+		skip -= chunk - zs.avail_out;
+		if(zerr != Z_OK)
+			break;
+	}
+
+	// stream ended (or ran dry) before the window we want: it decodes to zeros
+	if(skip == 0 && zerr == Z_OK) {
+		zs.next_out = dest;
+		zs.avail_out = dest_len;
+		while(zs.avail_out > 0) {
+			zerr = inflate(&zs, Z_NO_FLUSH);
+			if(zerr != Z_OK)
+				break;
+		}
+		*produced = dest_len - zs.avail_out;
+	}
+	if(zerr != Z_OK && zerr != Z_STREAM_END && zerr != Z_BUF_ERROR)
+		error = EIO;
+
+	inflateEnd(&zs);
+	if(scratch != NULL)
+		free(scratch, M_BTRFSZ);
+	return(error);
+}
+
+/*
+ * Decode `src`, drop the first `skip` bytes of output and write the next
+ * `dest_len` bytes to `dest`. Output the stream does not cover is zero filled.
+ */
+int bz_decompress(uint8_t compression, const uint8_t *src, size_t src_len, uint64_t skip, uint8_t *dest, size_t dest_len) {
+	size_t produced = 0;
+	int error;
+
+	switch(compression) {
+		case BTRFS_COMPRESSION_ZLIB:
+			error = bz_inflate(src, src_len, skip, dest, dest_len, &produced);
+			break;
+		case BTRFS_COMPRESSION_LZO:
+		case BTRFS_COMPRESSION_ZSTD:
+			uprintf("[BTRFS] Compression type %u is not supported\n", compression);
+			return(EOPNOTSUPP);
+		default:
+			return(EIO);
+	}
+	if(error)
+		return(error);
+
+	if(produced < dest_len)
+		memset(dest + produced, 0, dest_len - produced);
+	return(0);
+}
+
+MODULE_DEPEND(btrfs, zlib, 1, 1, 1);
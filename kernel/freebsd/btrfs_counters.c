@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/mount.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include "btrfs_mount.h"
+#include "btrfs_counters.h"
+
+SYSCTL_NODE(_vfs, OID_AUTO, btrfs, CTLFLAG_RD | CTLFLAG_MPSAFE, 0, "btrfs filesystem");
+
+SDT_PROVIDER_DEFINE(btrfs);
+// logical address, physical address, size, latency, error
+SDT_PROBE_DEFINE5(btrfs, , bo, read, "uint64_t", "uint64_t", "uint32_t", "uint64_t", "int");
+// logical address, start of the covering chunk, physical address (both 0 when unmapped)
+SDT_PROBE_DEFINE3(btrfs, , bc, map, "uint64_t", "uint64_t", "uint64_t");
+// tree id, key, levels descended, blocks read from the device, latency, error
+SDT_PROBE_DEFINE6(btrfs, , bt, search, "uint64_t", "struct btrfs_key *", "int", "int", "uint64_t", "int");
+// block address, stored checksum, computed checksum, error
+SDT_PROBE_DEFINE4(btrfs, , bt, csum, "uint64_t", "uint32_t", "uint32_t", "int");
+// algorithm, compressed size, decompressed size, latency, error
+SDT_PROBE_DEFINE5(btrfs, , bz, decompress, "uint8_t", "size_t", "size_t", "uint64_t", "int");
+
+/*
+ * vfs.btrfs.<device>.<counter> for every counter, and
+ * vfs.btrfs.<device>.<histogram> as an array of BTRFS_HIST_BUCKETS buckets.
+ * The nodes belong to the mount's sysctl context and go away with it.
+ */
+void bs_init(struct btrfsmount_internal *bmp, const char *name) {
+	struct btrfs_stats *stats = &bmp->pm_stats;
+	struct sysctl_oid *oid;
+
+	for(int i = 0; i < BTRFS_NSTATS; ++i)
+		stats->bs_counters[i] = counter_u64_alloc(M_WAITOK);
+	for(int i = 0; i < BTRFS_NHISTS; ++i) {
+		for(int j = 0; j < BTRFS_HIST_BUCKETS; ++j)
+			stats->bs_hist[i][j] = counter_u64_alloc(M_WAITOK);
+	}
+
+	sysctl_ctx_init(&stats->bs_ctx);
+	oid = SYSCTL_ADD_NODE(&stats->bs_ctx, SYSCTL_STATIC_CHILDREN(_vfs_btrfs), OID_AUTO, name,
+	    CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, "btrfs mount statistics");
+	if(oid == NULL)
+		return;
+	for(int i = 0; i < BTRFS_NSTATS; ++i)
+		SYSCTL_ADD_COUNTER_U64(&stats->bs_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, btrfs_stat_names[i],
+		    CTLFLAG_RD, &stats->bs_counters[i], "");
+	for(int i = 0; i < BTRFS_NHISTS; ++i)
+		SYSCTL_ADD_COUNTER_U64_ARRAY(&stats->bs_ctx, SYSCTL_CHILDREN(oid), OID_AUTO, btrfs_hist_names[i],
+		    CTLFLAG_RD, stats->bs_hist[i], BTRFS_HIST_BUCKETS, "log2 latency histogram");
+}
+
+void bs_free(struct btrfsmount_internal *bmp) {
+	struct btrfs_stats *stats = &bmp->pm_stats;
+
+	sysctl_ctx_free(&stats->bs_ctx);
+	for(int i = 0; i < BTRFS_NSTATS; ++i)
+		counter_u64_free(stats->bs_counters[i]);
+	for(int i = 0; i < BTRFS_NHISTS; ++i) {
+		for(int j = 0; j < BTRFS_HIST_BUCKETS; ++j)
+			counter_u64_free(stats->bs_hist[i][j]);
+	}
+}
+
+// `start` comes from sbinuptime() when the operation began
+void bs_hist_record(struct btrfsmount_internal *bmp, enum btrfs_hist hist, sbintime_t start) {
+	uint64_t ns = sbttons(sbinuptime() - start);
+
+	counter_u64_add(bmp->pm_stats.bs_hist[hist][btrfs_hist_bucket(ns)], 1);
+}
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_COUNTERS_H
+#define _BTRFS_COUNTERS_H
+
+#include <sys/types.h>
+#include <sys/counter.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/sdt.h>
+#include "btrfs_stats.h"
+
+// bs_ - Per-mount statistics, exported under vfs.btrfs.<device>
+
+SYSCTL_DECL(_vfs_btrfs);
+
+// counter(9) is per-CPU, updating one never bounces a cache line between cores
+struct btrfs_stats {
+    counter_u64_t bs_counters[BTRFS_NSTATS];
+    counter_u64_t bs_hist[BTRFS_NHISTS][BTRFS_HIST_BUCKETS];
+    struct sysctl_ctx_list bs_ctx;
+};
+
+#define BS_ADD(bmp, stat, n) counter_u64_add((bmp)->pm_stats.bs_counters[(stat)], (n))
+#define BS_INC(bmp, stat) BS_ADD(bmp, stat, 1)
+
+struct btrfsmount_internal;
+
+// DTrace probes. Every probe is btrfs:::<name>, sizes are in bytes and times in
+// nanoseconds. Timing is only taken while some probe is enabled.
+SDT_PROVIDER_DECLARE(btrfs);
+SDT_PROBE_DECLARE(btrfs, , bo, read);
+SDT_PROBE_DECLARE(btrfs, , bc, map);
+SDT_PROBE_DECLARE(btrfs, , bt, search);
+SDT_PROBE_DECLARE(btrfs, , bt, csum);
+SDT_PROBE_DECLARE(btrfs, , bz, decompress);
+
+#define BS_PROBE_START() (SDT_PROBES_ENABLED() ? sbinuptime() : 0)
+#define BS_PROBE_NS(start) ((start) != 0 ? sbttons(sbinuptime() - (start)) : 0)
+
+void bs_init(struct btrfsmount_internal *bmp, const char *name);
+void bs_free(struct btrfsmount_internal *bmp);
+void bs_hist_record(struct btrfsmount_internal *bmp, enum btrfs_hist hist, sbintime_t start);
+
+#endif // _BTRFS_COUNTERS_H
@@ -0,0 +1,470 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/systm.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/malloc.h>
+#include <sys/vnode.h>
+#include <machine/atomic.h>
+#include "btrfs.h"
+#include "btrfs_tree.h"
+#include "btrfs_root.h"
+#include "btrfs_inode.h"
+
+/*
+ * The extent map is the inode's EXTENT_DATA items, read once into a sorted array.
+ * Reads and page-ins translate file offsets through it without going back to the
+ * fs tree, and it tells the strategy routine when a buffer can be handed to the
+ * disk as-is instead of being assembled in memory.
+ */
+
+#define BE_EXTENT_HEADER_SIZE offsetof(btrfs_extent_data, data)
+
+static void be_free_extents(struct be_extent_map *map) {
+	for(uint32_t i = 0; i < map->count; ++i) {
+		if(map->extents[i].inline_data != NULL)
+			free(map->extents[i].inline_data, M_BTRFSINODE);
+	}
+	if(map->extents != NULL)
+		free(map->extents, M_BTRFSINODE);
+	free(map, M_BTRFSINODE);
+}
+
+static int be_add_extent(struct be_extent_map *map, uint32_t *capacity, uint64_t file_offset, uint32_t item_size, const uint8_t *data) {
+	const uint8_t *ed2 = data + offsetof(btrfs_extent_data, data);
+	struct be_extent *extent, *grown;
+
+	if(item_size < BE_EXTENT_HEADER_SIZE)
+		return(EIO);
+	if(BTRFS_GET_U8(data, btrfs_extent_data, encryption) != BTRFS_ENCRYPTION_NONE ||
+	    BTRFS_GET_LE16(data, btrfs_extent_data, encoding) != BTRFS_ENCODING_NONE)
+		return(EOPNOTSUPP);
+
+	if(map->count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 8;
+		grown = mallocarray(*capacity, sizeof(*grown), M_BTRFSINODE, M_WAITOK | M_ZERO);
+		if(map->extents != NULL) {
+			memcpy(grown, map->extents, map->count * sizeof(*grown));
+			free(map->extents, M_BTRFSINODE);
+		}
+		map->extents = grown;
+	}
+
+	extent = &map->extents[map->count];
+	memset(extent, 0, sizeof(*extent));
+	extent->file_offset = file_offset;
+	extent->type = BTRFS_GET_U8(data, btrfs_extent_data, type);
+	extent->compression = BTRFS_GET_U8(data, btrfs_extent_data, compression);
+	extent->ram_bytes = BTRFS_GET_LE64(data, btrfs_extent_data, decoded_size);
+
+	if(extent->type == EXTENT_TYPE_INLINE) {
+		extent->num_bytes = extent->ram_bytes;
+		extent->inline_len = item_size - BE_EXTENT_HEADER_SIZE;
+		extent->inline_data = malloc(MAX(extent->inline_len, 1), M_BTRFSINODE, M_WAITOK);
+		memcpy(extent->inline_data, ed2, extent->inline_len);
+	} else {
+		if(item_size < BE_EXTENT_HEADER_SIZE + sizeof(btrfs_extent_data2))
+			return(EIO);
+		extent->disk_bytenr = BTRFS_GET_LE64(ed2, btrfs_extent_data2, address);
+		extent->disk_num_bytes = BTRFS_GET_LE64(ed2, btrfs_extent_data2, size);
+		extent->extent_offset = BTRFS_GET_LE64(ed2, btrfs_extent_data2, offset);
+		extent->num_bytes = BTRFS_GET_LE64(ed2, btrfs_extent_data2, num_bytes);
+	}
+	map->count++;
+	return(0);
+}
+
+static int be_load_map(struct btrfs_inode *bip, struct be_extent_map **mapp) {
+	struct btrfsmount_internal *bmp = bip->bi_bmp;
+	const uint8_t *item_key;
+	struct be_extent_map *map;
+	struct btrfs_key key;
+	struct bt_path path;
+	uint32_t capacity = 0;
+	uint8_t *root_node;
+	int error;
+
+	error = br_get_root_node(bmp, bip->bi_root, &root_node);
+	if(error)
+		return(error);
+
+	map = malloc(sizeof(*map), M_BTRFSINODE, M_WAITOK | M_ZERO);
+
+	key.obj_id = bip->bi_ino;
+	key.obj_type = TYPE_EXTENT_DATA;
+	key.offset = 0;
+	for(error = bt_search_slot(bmp, root_node, &key, &path); error == 0; error = bt_next_item(bmp, &path)) {
+		item_key = BTPATHKEY(&path);
+		if(btrfs_disk_key_objectid(item_key) != bip->bi_ino || btrfs_disk_key_type(item_key) != TYPE_EXTENT_DATA)
+			break;
+		error = be_add_extent(map, &capacity, btrfs_disk_key_offset(item_key), BTPATHSIZE(&path), BTPATHDATA(&path));
+		if(error)
+			break;
+	}
+	bt_path_release(&path);
+	if(error == ENOENT)
+		error = 0;
+	if(error) {
+		be_free_extents(map);
+		return(error);
+	}
+
+	*mapp = map;
+	return(0);
+}
+
+int be_get_map(struct btrfs_inode *bip, struct be_extent_map **mapp) {
+	struct be_extent_map *map;
+	int error;
+
+	map = (struct be_extent_map *)atomic_load_acq_ptr((uintptr_t *)&bip->bi_extents);
+	if(map != NULL) {
+		*mapp = map;
+		return(0);
+	}
+
+	error = be_load_map(bip, &map);
+	if(error)
+		return(error);
+
+	if(!atomic_cmpset_rel_ptr((uintptr_t *)&bip->bi_extents, (uintptr_t)NULL, (uintptr_t)map)) {
+		be_free_extents(map);
+		map = (struct be_extent_map *)atomic_load_acq_ptr((uintptr_t *)&bip->bi_extents);
+	}
+	*mapp = map;
+	return(0);
+}
+
+// the extent containing `offset`, or the first one after it, or NULL
+struct be_extent *be_lookup(struct be_extent_map *map, uint64_t offset) {
+	uint32_t lo = 0, hi = map->count, mid;
+
+	// first extent starting after offset
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(map->extents[mid].file_offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo > 0 && offset < map->extents[lo - 1].file_offset + map->extents[lo - 1].num_bytes)
+		return(&map->extents[lo - 1]);
+	return(lo < map->count ? &map->extents[lo] : NULL);
+}
+
+/*
+ * If [offset, offset + len) is backed by one uncompressed extent that sits in a
+ * single chunk, return the physical byte address of offset. The caller can then
+ * read straight from the device into its own pages.
+ */
+int be_map_physical(struct btrfs_inode *bip, struct be_extent_map *map, uint64_t offset, uint64_t len, uint64_t *physp) {
+	struct btrfsmount_internal *bmp = bip->bi_bmp;
+	struct b_chunk_list *chunk_entry;
+	struct be_extent *extent;
+	uint64_t logical;
+
+	extent = be_lookup(map, offset);
+	if(extent == NULL || extent->file_offset > offset)
+		return(ENOENT);
+	if(extent->type != EXTENT_TYPE_REGULAR || extent->compression != BTRFS_COMPRESSION_NONE || extent->disk_bytenr == 0)
+		return(ENOENT);
+	if(offset + len > extent->file_offset + extent->num_bytes)
+		return(ENOENT);
+
+	logical = extent->disk_bytenr + extent->extent_offset + (offset - extent->file_offset);
+	chunk_entry = bc_map_find_logical(bmp, logical);
+	if(chunk_entry == NULL || logical + len > chunk_entry->key.offset + chunk_entry->chunk_item.size)
+		return(ENOENT);
+
+	*physp = chunk_entry->chunk_stripe.offset + (logical - chunk_entry->key.offset);
+	return(0);
+}
+
+// decompress and account the time and bytes to the algorithm
+static int be_decompress(struct btrfsmount_internal *bmp, uint8_t compression, const uint8_t *src, size_t src_len,
+    uint64_t skip, uint8_t *dest, size_t dest_len) {
+	sbintime_t start;
+	uint64_t ns;
+	int error, stat;
+
+	if(compression > BTRFS_COMPRESSION_ZSTD)
+		return(EOPNOTSUPP);
+	stat = BTRFS_STAT_DECOMP(compression);
+	start = sbinuptime();
+	error = bz_decompress(compression, src, src_len, skip, dest, dest_len);
+	ns = sbttons(sbinuptime() - start);
+	BS_ADD(bmp, stat, src_len);
+	BS_ADD(bmp, stat + 1, dest_len);
+	BS_ADD(bmp, stat + 2, ns);
+	SDT_PROBE5(btrfs, , bz, decompress, compression, src_len, dest_len, ns, error);
+	return(error);
+}
+
+static int be_read_extent(struct btrfs_inode *bip, struct be_extent *extent, uint64_t offset, uint8_t *dest, uint64_t len) {
+	struct btrfsmount_internal *bmp = bip->bi_bmp;
+	uint64_t skip = offset - extent->file_offset;
+	uint8_t *compressed;
+	int error;
+
+	if(extent->type == EXTENT_TYPE_INLINE) {
+		if(extent->compression != BTRFS_COMPRESSION_NONE)
+			return(be_decompress(bmp, extent->compression, extent->inline_data, extent->inline_len, skip, dest, len));
+		if(skip < extent->inline_len) {
+			memcpy(dest, extent->inline_data + skip, MIN(len, extent->inline_len - skip));
+			if(len > extent->inline_len - skip)
+				memset(dest + (extent->inline_len - skip), 0, len - (extent->inline_len - skip));
+		} else {
+			memset(dest, 0, len);
+		}
+		return(0);
+	}
+
+	// preallocated space and explicit holes read as zeros
+	if(extent->type == EXTENT_TYPE_PREALLOC || extent->disk_bytenr == 0) {
+		memset(dest, 0, len);
+		return(0);
+	}
+
+	if(extent->compression == BTRFS_COMPRESSION_NONE)
+		return(bo_read_logical_into_buf(bmp, extent->disk_bytenr + extent->extent_offset + skip, len, dest));
+
+	// compressed extents are at most 128K on disk and decoded, anything bigger is corrupt
+	if(extent->disk_num_bytes > BTRFS_MAX_COMPRESSED || extent->ram_bytes > BTRFS_MAX_COMPRESSED)
+		return(EIO);
+	compressed = malloc(extent->disk_num_bytes, M_BTRFSINODE, M_WAITOK);
+	error = bo_read_logical_into_buf(bmp, extent->disk_bytenr, extent->disk_num_bytes, compressed);
+	if(error == 0)
+		error = be_decompress(bmp, extent->compression, compressed, extent->disk_num_bytes,
+		    extent->extent_offset + skip, dest, len);
+	free(compressed, M_BTRFSINODE);
+	return(error);
+}
+
+// fill dest with file bytes [offset, offset + len), extent by extent
+int be_read_range(struct btrfs_inode *bip, struct be_extent_map *map, uint64_t offset, uint8_t *dest, uint64_t len) {
+	struct be_extent *extent;
+	uint64_t pos = 0, cur, n;
+	int error;
+
+	while(pos < len) {
+		cur = offset + pos;
+		extent = be_lookup(map, cur);
+		if(extent == NULL || extent->file_offset > cur) {
+			// implicit hole up to the next extent
+			n = len - pos;
+			if(extent != NULL)
+				n = MIN(n, extent->file_offset - cur);
+			memset(dest + pos, 0, n);
+		} else {
+			n = MIN(len - pos, extent->file_offset + extent->num_bytes - cur);
+			error = be_read_extent(bip, extent, cur, dest + pos, n);
+			if(error)
+				return(error);
+		}
+		pos += n;
+	}
+	return(0);
+}
+
+/*
+ * FIEMAP. Extents come straight from the extent map; only the sharing check
+ * needs the extent tree. A batch is checked with one bt_search_many(), so
+ * extents next to each other on disk share the blocks leading to them.
+ */
+
+#define BE_STRIPED_PROFILES (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID10 | BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6)
+
+struct be_shared_batch {
+	uint8_t *extent_root;                                   // NULL until the first lookup
+	const struct be_extent *extents[BE_FIEMAP_BATCH];       // behind each entry of the batch
+	struct bt_many_key keys[BE_FIEMAP_BATCH];
+	EXTENT_ITEM items[BE_FIEMAP_BATCH];                     // by entry of the batch
+};
+
+static int be_key_cmp(const void *a, const void *b) {
+	return(bt_key_cmp(&((const struct bt_many_key *)a)->key, &((const struct bt_many_key *)b)->key));
+}
+
+/*
+ * An extent is shared when the extent tree counts more than one reference to
+ * it, or when it is older than the last snapshot of this subvolume: a snapshot
+ * shares the fs tree leaves, so their data refs are not counted again.
+ */
+static int be_fiemap_shared(struct btrfs_inode *bip, struct be_shared_batch *shared, struct btrfs_fiemap_extent *batch,
+    uint32_t n) {
+	struct btrfsmount_internal *bmp = bip->bi_bmp;
+	const struct be_extent *extent;
+	struct btrfs_root *root;
+	struct bt_many_key *key;
+	const EXTENT_ITEM *ei;
+	uint32_t count = 0;
+	int error;
+
+	for(uint32_t i = 0; i < n; ++i) {
+		extent = shared->extents[i];
+		if(extent->type == EXTENT_TYPE_INLINE)
+			continue;
+		key = &shared->keys[count++];
+		key->key.obj_id = extent->disk_bytenr;
+		key->key.obj_type = TYPE_EXTENT_ITEM;
+		key->key.offset = extent->disk_num_bytes;
+		key->dest = &shared->items[i];
+		key->dest_len = sizeof(shared->items[i]);
+	}
+	if(count == 0)
+		return(0);
+
+	if(shared->extent_root == NULL) {
+		error = br_get_root(bmp, BTRFS_ROOT_EXTENT, &root);
+		if(error == 0)
+			error = br_get_root_node(bmp, root, &shared->extent_root);
+		if(error)
+			return(error);
+	}
+	// file order is not disk order
+	qsort(shared->keys, count, sizeof(shared->keys[0]), be_key_cmp);
+	error = bt_search_many(bmp, shared->extent_root, shared->keys, count);
+	if(error)
+		return(error);
+
+	for(uint32_t k = 0; k < count; ++k) {
+		key = &shared->keys[k];
+		// every extent a file points at has an EXTENT_ITEM
+		if(key->error != 0 || key->size < sizeof(*ei))
+			return(EIO);
+		ei = key->dest;
+		if(BTRFS_GET_LE64(ei, EXTENT_ITEM, refcount) > 1 || BTRFS_GET_LE64(ei, EXTENT_ITEM, generation) <=
+		    BTRFS_GET_LE64(&bip->bi_root->root_item, struct btrfs_root_item, last_snapshot_generation))
+			batch[ei - shared->items].fe_flags |= BTRFS_FIEMAP_SHARED;
+	}
+	return(0);
+}
+
+static void be_fiemap_fill(struct btrfs_inode *bip, const struct be_extent *extent, struct btrfs_fiemap_extent *fe) {
+	struct b_chunk_list *chunk_entry;
+
+	memset(fe, 0, sizeof(*fe));
+	fe->fe_offset = extent->file_offset;
+	fe->fe_length = extent->num_bytes;
+	fe->fe_ram_bytes = extent->ram_bytes;
+	if(extent->compression != BTRFS_COMPRESSION_NONE)
+		fe->fe_flags |= BTRFS_FIEMAP_COMPRESSED;
+
+	if(extent->type == EXTENT_TYPE_INLINE) {
+		fe->fe_flags |= BTRFS_FIEMAP_INLINE;
+		fe->fe_disk_bytes = extent->inline_len;
+		return;
+	}
+	if(extent->type == EXTENT_TYPE_PREALLOC)
+		fe->fe_flags |= BTRFS_FIEMAP_PREALLOC;
+
+	// a compressed extent can only be read whole, so it is reported whole
+	if(extent->compression != BTRFS_COMPRESSION_NONE) {
+		fe->fe_logical = extent->disk_bytenr;
+		fe->fe_disk_bytes = extent->disk_num_bytes;
+	} else {
+		fe->fe_logical = extent->disk_bytenr + extent->extent_offset;
+		fe->fe_disk_bytes = extent->num_bytes;
+	}
+
+	chunk_entry = bc_map_find_logical(bip->bi_bmp, fe->fe_logical);
+	if(chunk_entry == NULL || (chunk_entry->chunk_item.type & BE_STRIPED_PROFILES) != 0) {
+		fe->fe_flags |= BTRFS_FIEMAP_UNMAPPED;
+	} else {
+		fe->fe_physical = chunk_entry->chunk_stripe.offset + (fe->fe_logical - chunk_entry->key.offset);
+		fe->fe_devid = chunk_entry->chunk_stripe.dev_id;
+	}
+}
+
+static bool be_is_hole(const struct be_extent *extent) {
+	return(extent->type != EXTENT_TYPE_INLINE && extent->disk_bytenr == 0);
+}
+
+/*
+ * Fills `batch` with up to fm_count (at most BE_FIEMAP_BATCH) extents
+ * overlapping [fm_start, fm_start + fm_length) and sets fm_count to the number
+ * filled. fm_next is where the range continues when the batch filled up before
+ * it ended, or the end of the range. Nothing is copied out: the caller holds
+ * the vnode lock, and the user buffer may be mapped from this very file.
+ */
+int be_fiemap(struct btrfs_inode *bip, struct be_extent_map *map, struct btrfs_fiemap *fm,
+    struct btrfs_fiemap_extent *batch) {
+	struct be_shared_batch *shared = NULL;
+	uint32_t i, last, room = MIN(fm->fm_count, BE_FIEMAP_BATCH), n = 0;
+	struct be_extent *extent;
+	uint64_t end, next;
+	int error = 0;
+
+	end = fm->fm_start + MIN(fm->fm_length, UINT64_MAX - fm->fm_start);
+	next = end;
+
+	// index one past the last extent with data, for BTRFS_FIEMAP_LAST
+	for(last = map->count; last > 0 && be_is_hole(&map->extents[last - 1]); --last)
+		;
+
+	extent = be_lookup(map, fm->fm_start);
+	i = extent != NULL ? (uint32_t)(extent - map->extents) : map->count;
+	if(room == 0 || i >= last) {
+		fm->fm_count = 0;
+		fm->fm_next = next;
+		return(0);
+	}
+
+	if(fm->fm_flags & BTRFS_FIEMAP_CHECK_SHARED)
+		shared = malloc(sizeof(*shared), M_BTRFSINODE, M_WAITOK | M_ZERO);
+	for(; i < last && map->extents[i].file_offset < end; ++i) {
+		extent = &map->extents[i];
+		if(be_is_hole(extent))
+			continue;
+		if(n == room) {
+			next = extent->file_offset;
+			break;
+		}
+		be_fiemap_fill(bip, extent, &batch[n]);
+		if(shared != NULL)
+			shared->extents[n] = extent;
+		if(i + 1 == last)
+			batch[n].fe_flags |= BTRFS_FIEMAP_LAST;
+		n++;
+	}
+	if(shared != NULL) {
+		error = be_fiemap_shared(bip, shared, batch, n);
+		free(shared, M_BTRFSINODE);
+	}
+	if(error)
+		return(error);
+
+	fm->fm_count = n;
+	fm->fm_next = next;
+	return(0);
+}
+
+void be_free_map(struct btrfs_inode *bip) {
+	if(bip->bi_extents != NULL)
+		be_free_extents(bip->bi_extents);
+	bip->bi_extents = NULL;
+}
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_INODE_H
+#define _BTRFS_INODE_H
+
+#include "btrfs_mount.h"
+#include "btrfs_ioctl.h"
+
+// bx_ - Extended attribute cache
+
+struct bx_entry {
+    char *name;                     // full on-disk name, e.g. "user.com.apple.FinderInfo"
+    uint8_t *data;
+    uint16_t name_len;
+    uint16_t data_len;
+};
+
+// Every XATTR_ITEM of an inode, loaded on the first probe. Since the mount is
+// read-only the set is complete and never changes, so a name missing from it is
+// a cached negative answer as well.
+struct bx_cache {
+    uint32_t count;
+    struct bx_entry *entries;
+};
+
+// be_ - Extent map
+
+// I/O size used for the vnode's buffers. Big enough that page-ins of large files
+// cluster into a few device reads, and no larger than a buffer cache buffer.
+#define BTRFS_BSIZE 65536
+
+// One EXTENT_DATA item. Ranges of the file not covered by any entry are holes.
+struct be_extent {
+    uint64_t file_offset;           // key offset
+    uint64_t num_bytes;             // bytes of the file this extent covers
+    uint64_t disk_bytenr;           // logical address of the on-disk extent, 0 for a hole
+    uint64_t disk_num_bytes;        // bytes on disk (compressed size)
+    uint64_t extent_offset;         // where file_offset falls inside the decoded extent
+    uint64_t ram_bytes;             // decoded size of the whole extent
+    uint8_t type;                   // EXTENT_TYPE_*
+    uint8_t compression;            // BTRFS_COMPRESSION_*
+    uint32_t inline_len;
+    uint8_t *inline_data;           // raw (possibly compressed) inline payload
+};
+
+struct be_extent_map {
+    uint32_t count;
+    struct be_extent *extents;      // sorted by file_offset
+};
+
+// in-core inode, hung off vnode->v_data
+struct btrfs_inode {
+    struct vnode *bi_vnode;
+    struct btrfsmount_internal *bi_bmp;
+    struct btrfs_root *bi_root;                 // tree this inode lives in
+    uint64_t bi_ino;                            // objectid within bi_root
+    btrfs_inode_item bi_inode;
+
+    struct bx_cache *bi_xattrs;                 // NULL until the first xattr probe
+    struct be_extent_map *bi_extents;           // NULL until the first read
+};
+
+#define VTOBI(vp) ((struct btrfs_inode *)(vp)->v_data)
+
+MALLOC_DECLARE(M_BTRFSINODE);
+extern struct vop_vector btrfs_vnodeops;
+
+int bx_get_cache(struct btrfs_inode *bip, struct bx_cache **cachep);
+struct bx_entry *bx_find(struct bx_cache *cache, const char *prefix, const char *name);
+void bx_free_cache(struct btrfs_inode *bip);
+
+int be_get_map(struct btrfs_inode *bip, struct be_extent_map **mapp);
+struct be_extent *be_lookup(struct be_extent_map *map, uint64_t offset);
+int be_map_physical(struct btrfs_inode *bip, struct be_extent_map *map, uint64_t offset, uint64_t len, uint64_t *physp);
+int be_read_range(struct btrfs_inode *bip, struct be_extent_map *map, uint64_t offset, uint8_t *dest, uint64_t len);
+// extents be_fiemap() fills per call, the ioctl copies out between calls
+#define BE_FIEMAP_BATCH 64
+int be_fiemap(struct btrfs_inode *bip, struct be_extent_map *map, struct btrfs_fiemap *fm,
+    struct btrfs_fiemap_extent *batch);
+void be_free_map(struct btrfs_inode *bip);
+
+#endif // _BTRFS_INODE_H
@@ -70,6 +70,7 @@
 #include <sys/proc.h>
 #include <sys/rwlock.h>
 #include <sys/stat.h>
+#include <sys/taskqueue.h>
 #include <sys/vnode.h>
 
 #include <geom/geom.h>
@@ -78,6 +79,8 @@
 #include "btrfs_mount.h"
 #include "btrfs.h"
 #include "btrfs_tree.h"
+#include "btrfs_root.h"
+#include "btrfs_inode.h"
 
 #ifdef LINUX_CROSS_BUILD
 // clang on debian breaks fstack-protector as of 14.0.6
@@ -86,8 +89,6 @@
 void *__stack_chk_guard = (void *)0xdeadbeef;
 #endif
 
-static const char btrfs_lock_msg[] = "btrfslk";
-
 static const char *btrfs_mount_opts[] = {
         "ro", "uid", "gid", "from", NULL
 };
@@ -106,9 +107,7 @@ static vfs_root_t btrfs_root;
 static vfs_statfs_t btrfs_statfs;
 static vfs_sync_t btrfs_sync;
 static vfs_unmount_t btrfs_unmount;
-
-//@todo: red-black trees
-//RB_HEAD(btrfs_chunk_root, btrfs_root) b_chunk_root;
+static vfs_vget_t btrfs_vget;
 
 static int update_mp(struct mount *mp, struct thread *td) {
         struct btrfsmount_internal *bmp = (struct btrfsmount_internal *)mp->mnt_data;
@@ -227,6 +226,153 @@ static int btrfs_mount(struct mount *mp) {
         return(0);
 }
 
+// add every CHUNK_ITEM of a chunk tree leaf to the chunk list
+static void btrfs_add_chunk_leaf(struct btrfsmount_internal *bmp, const uint8_t *leaf) {
+        uint32_t num_items = btrfs_header_nritems(leaf);
+        struct btrfs_key key;
+
+        for(uint32_t i = 0; i < num_items; ++i) {
+                const uint8_t *item_key = btrfs_item_key(leaf, i);
+                if(btrfs_disk_key_type(item_key) != TYPE_CHUNK_ITEM)
+                        continue;
+                // Stripes after the first are for RAID setups, which we don't support
+                if(btrfs_item_size(leaf, i) < btrfs_chunk_item_size(1))
+                        continue;
+                btrfs_disk_key_to_cpu(item_key, &key);
+                if(!bc_add_to_chunk_cache(bmp, &key, btrfs_item_data(leaf, i))) {
+                        uprintf("Overlap in chunk cache %lu %X\n", key.obj_id, key.obj_type);
+                }
+        }
+}
+
+// Walk the chunk tree below `node`. All children of a node are queued for
+// read-ahead before the first one is read, so the device works on the whole
+// level at once instead of one block per round trip. The chunk tree lives in
+// SYSTEM chunks, which sys_chunk_array already maps.
+static int btrfs_walk_chunk_node(struct btrfsmount_internal *bmp, const uint8_t *node) {
+        uint32_t num_items = btrfs_header_nritems(node);
+        uint8_t level = btrfs_header_level(node);
+        uint32_t node_size = bmp->pm_superblock.node_size;
+        uint64_t *addrs;
+        uint8_t *child;
+        int error = 0;
+
+        if(level == 0) {
+                btrfs_add_chunk_leaf(bmp, node);
+                return(0);
+        }
+
+        addrs = malloc(num_items * sizeof(*addrs), M_BTRFSMOUNT, M_WAITOK);
+        for(uint32_t i = 0; i < num_items; ++i)
+                addrs[i] = btrfs_node_blockptr(node, i);
+        bo_readahead_logical(bmp, addrs, num_items, node_size);
+
+        child = bt_alloc_block(bmp);
+        for(uint32_t i = 0; i < num_items && error == 0; ++i) {
+                error = bo_read_logical_into_buf(bmp, addrs[i], node_size, child);
+                if(error == 0)
+                        error = bt_check_csum(bmp, child);
+                if(error == 0)
+                        error = bt_check_block(bmp, child, level - 1);
+                if(error == 0)
+                        error = btrfs_walk_chunk_node(bmp, child);
+        }
+        bt_free_block(bmp, child);
+        free(addrs, M_BTRFSMOUNT);
+        return(error);
+}
+
+/*
+ * Everything past the superblock is loaded here, on a taskqueue thread, so that
+ * mounting many volumes at boot doesn't serialize on their chunk and root trees.
+ * Anything that needs the trees calls btrfs_wait_loaded() first.
+ */
+static int btrfs_load_trees(struct btrfsmount_internal *bmp) {
+        struct btrfs_root *fs_tree;
+        int error;
+
+        // - Read the chunk tree (sys_chunk_array only maps the chunk tree itself)
+        // - Read the root tree root (requires chunk tree for logical->physical mapping)
+        // - Read FS root to begin traversal
+        bmp->pm_fsinfo.chunk_root = bt_alloc_block(bmp);
+
+        error = bo_read_logical_into_buf(bmp, bmp->pm_superblock.chunk_tree_addr, bmp->pm_superblock.node_size,
+            bmp->pm_fsinfo.chunk_root);
+        if(error == 0)
+                error = bt_check_csum(bmp, bmp->pm_fsinfo.chunk_root);
+        if(error == 0)
+                error = bt_check_block(bmp, bmp->pm_fsinfo.chunk_root, -1);
+        if(error == 0)
+                error = btrfs_walk_chunk_node(bmp, bmp->pm_fsinfo.chunk_root);
+        if(error)
+                return(error);
+        bc_publish_chunk_map(bmp);
+
+        // if we cannot read the root tree, we cannot continue
+        bmp->pm_fsinfo.tree_root = bt_alloc_block(bmp);
+
+        error = bo_read_logical_into_buf(bmp, bmp->pm_superblock.root_tree_addr, bmp->pm_superblock.node_size,
+            bmp->pm_fsinfo.tree_root);
+        if(error == 0)
+                error = bt_check_csum(bmp, bmp->pm_fsinfo.tree_root);
+        if(error)
+                return(error);
+
+        // the top level subvolume is always needed, load it into the root cache now
+        error = br_get_root(bmp, BTRFS_ROOT_FSTREE, &fs_tree);
+        if(error == 0)
+                error = br_get_root_node(bmp, fs_tree, &bmp->pm_fsinfo.fs_root);
+        return(error);
+}
+
+static void btrfs_load_task(void *arg, int pending) {
+        struct btrfsmount_internal *bmp = arg;
+        int error;
+
+        error = btrfs_load_trees(bmp);
+        if(error)
+                printf("[BTRFS] %s: failed to load the chunk and root trees: %d\n", devtoname(bmp->pm_dev), error);
+
+        mtx_lock(&bmp->pm_loadlock);
+        bmp->pm_loaderror = error;
+        atomic_store_rel_int(&bmp->pm_loaded, 1);
+        wakeup(&bmp->pm_loaded);
+        mtx_unlock(&bmp->pm_loadlock);
+}
+
+// block until the background load has finished, returns its error
+int btrfs_wait_loaded(struct btrfsmount_internal *bmp) {
+        if(atomic_load_acq_int(&bmp->pm_loaded) == 0) {
+                mtx_lock(&bmp->pm_loadlock);
+                while(bmp->pm_loaded == 0)
+                        mtx_sleep(&bmp->pm_loaded, &bmp->pm_loadlock, PVFS, "btrfsld", 0);
+                mtx_unlock(&bmp->pm_loadlock);
+        }
+        return(bmp->pm_loaderror);
+}
+
+/*
+ * The primary superblock as read from the disk: the magic, a sys_chunk_array
+ * that fits, then the crc32c of everything after the checksum field. Other
+ * checksum types are trusted as-is, as they are for tree blocks.
+ */
+static int btrfs_check_superblock(const uint8_t *block) {
+        uint32_t crc;
+
+        if(BTRFS_GET_LE64(block, struct btrfs_superblock, magic) != BTRFS_MAGIC)
+                return(EINVAL);
+        if(BTRFS_GET_LE32(block, struct btrfs_superblock, sys_chunk_array_valid) > SYS_CHUNK_ARRAY_SIZE)
+                return(EINVAL);
+        if(BTRFS_GET_LE16(block, struct btrfs_superblock, csum_type) != CSUM_TYPE_CRC32C)
+                return(0);
+        crc = ~calculate_crc32c(~0U, block + BTRFS_CSUM_SIZE, BTRFS_SUPERBLOCK_SIZE - BTRFS_CSUM_SIZE);
+        if(crc != btrfs_get_le32(block)) {
+                uprintf("[BTRFS] Superblock checksum mismatch\n");
+                return(EINVAL);
+        }
+        return(0);
+}
+
 static int mount_btrfs_filesystem(struct vnode *odevvp, struct mount *mp) {
         struct btrfsmount_internal *bmp;
         struct buf *bp;
@@ -235,6 +381,7 @@ static int mount_btrfs_filesystem(struct vnode *odevvp, struct mount *mp) {
         struct btrfs_superblock *prim_sblock;
         struct b_chunk_list *tmp_chunk_entry;
         struct bufobj *buf_obj;
+        uint32_t array_size;
 
         int ronly, error;
         struct g_consumer *cp;
@@ -283,17 +430,22 @@ static int mount_btrfs_filesystem(struct vnode *odevvp, struct mount *mp) {
                 goto error_exit; // fun times
         bp->b_flags |= B_AGE;
         prim_sblock = (struct btrfs_superblock *)bp->b_data;
-        if(prim_sblock->magic != BTRFS_MAGIC) {
-                error = EINVAL;
+        error = btrfs_check_superblock(bp->b_data);
+        if(error)
                 goto error_exit;
-        }
 
         bmp = malloc(sizeof(*bmp), M_BTRFSMOUNT, M_WAITOK | M_ZERO);
         bmp->pm_mountp = mp;
         bmp->pm_cp = cp;
         bmp->pm_bo = buf_obj;
+        bmp->pm_devvp = devvp;
 
-        lockinit(&bmp->pm_btrfslock, 0, btrfs_lock_msg, 0, 0);
+        mtx_init(&bmp->pm_chunklock, "btrfschunk", NULL, MTX_DEF);
+        rm_init(&bmp->pm_rootlock, "btrfsroot");
+        ba_arena_init(&bmp->pm_arena);
+        mtx_init(&bmp->pm_loadlock, "btrfsload", NULL, MTX_DEF);
+        TASK_INIT(&bmp->pm_loadtask, 0, btrfs_load_task, bmp);
+        bs_init(bmp, devtoname(dev));
 
         // TASK_INIT for rw->ro
 
@@ -308,102 +460,87 @@ static int mount_btrfs_filesystem(struct vnode *odevvp, struct mount *mp) {
         // store superblock in the in-memory structure
         bmp->pm_superblock = *prim_sblock;
 
+        // tree blocks are a power of two between 4K and 64K
+        if(!powerof2(bmp->pm_superblock.node_size) || bmp->pm_superblock.node_size < 4096 ||
+            bmp->pm_superblock.node_size > 65536) {
+                error = EINVAL;
+                goto error_exit;
+        }
+        bmp->pm_nodezone = ba_node_zone_create(bmp->pm_superblock.node_size);
+        bn_init(bmp);
+
         bmp->pm_fsinfo.chunk_root = NULL;
         bmp->pm_fsinfo.tree_root = NULL;
         bmp->pm_fsinfo.fs_root = NULL;
         bmp->pm_fsinfo.extent_root = NULL;
+        br_init_roots(&bmp->pm_fsinfo);
 
         brelse(bp);
+        bp = NULL;
 
         LIST_INIT(&bmp->pm_backing_dev_bootstrap);
 
-        for(int i = 0; i < bmp->pm_superblock.sys_chunk_array_valid; i += (sizeof(struct btrfs_key) + sizeof(struct btrfs_chunk_item))) {
-                struct btrfs_key *fa_key = (struct btrfs_key *) &prim_sblock->sys_chunk_array[i];
-		struct btrfs_chunk_item *fa_chunk = (struct btrfs_chunk_item *) &prim_sblock->sys_chunk_array[i + sizeof(struct btrfs_key)];
-                struct btrfs_chunk_item_stripe *fa_stripe = (struct btrfs_chunk_item_stripe *) &prim_sblock->sys_chunk_array[i + sizeof(struct btrfs_key) + sizeof(struct btrfs_chunk_item)];
+        // sys_chunk_array is a packed run of (key, chunk item, stripes) entries,
+        // every one of which must fit in what is left of the valid part
+        array_size = BTRFS_GET_LE32(&bmp->pm_superblock, struct btrfs_superblock, sys_chunk_array_valid);
+        for(uint32_t i = 0; i < array_size;) {
+                const uint8_t *fa_key = &bmp->pm_superblock.sys_chunk_array[i];
+                const uint8_t *fa_chunk = fa_key + sizeof(struct btrfs_key);
+                uint16_t num_stripes;
+                struct btrfs_key key;
+
+                if(i + sizeof(struct btrfs_key) + btrfs_chunk_item_size(1) > array_size) {
+                        error = EINVAL;
+                        goto error_exit;
+                }
+                num_stripes = btrfs_chunk_num_stripes(fa_chunk);
                 // the chunk tree is essential. If we encounter an error, we'll
                 // simply exit in error.
-                if(fa_key->obj_type != TYPE_CHUNK_ITEM) {
+                if(btrfs_disk_key_type(fa_key) != TYPE_CHUNK_ITEM) {
                         error = EINVAL;
                         goto error_exit;
                 }
                 // every chunk has a stripe. absence of a stripe is corrupt data.
-                if(fa_chunk->num_stripes == 0) {
+                if(num_stripes == 0 || i + sizeof(struct btrfs_key) + btrfs_chunk_item_size(num_stripes) > array_size) {
                         error = EINVAL;
                         goto error_exit;
-                } else if(fa_chunk->num_stripes > 1) {
+                } else if(num_stripes > 1) {
                         // apparently the second stripe points to the next chunk_item
                         // btrfs documentation is somewhat.. lacking
-                        uprintf("[BTRFS] Found %d stripes, but we're only processing 1\n", fa_chunk->num_stripes);
+                        uprintf("[BTRFS] Found %d stripes, but we're only processing 1\n", num_stripes);
                 }
 
-                if(!bc_add_to_chunk_cache(*fa_key, *fa_chunk, *fa_stripe, &bmp->pm_backing_dev_bootstrap)) {
-                        uprintf("[BTRFS] Duplicate chunk item %lu not added to cache\n", fa_stripe->offset);
+                btrfs_disk_key_to_cpu(fa_key, &key);
+                if(!bc_add_to_chunk_cache(bmp, &key, fa_chunk)) {
+                        uprintf("[BTRFS] Duplicate chunk item %lu not added to cache\n", key.offset);
                 }
 
                 // we continue the traversal and skip the stripes appended at the end of each element
-                i += (sizeof(struct btrfs_chunk_item_stripe) * fa_chunk->num_stripes);
+                i += sizeof(struct btrfs_key) + btrfs_chunk_item_size(num_stripes);
         }
+        bc_publish_chunk_map(bmp);
 
-        tmp_chunk_entry = bc_find_logical_in_cache(bmp->pm_superblock.chunk_tree_addr, &bmp->pm_backing_dev_bootstrap);
+        tmp_chunk_entry = bc_map_find_logical(bmp, bmp->pm_superblock.chunk_tree_addr);
 
         // If we failed to bootstrap the chunk tree, we CANNOT continue
-        if(tmp_chunk_entry == NULL)
-                goto error_exit;
-
-        // - Read the root tree root (requires chunk tree for logical->physical mapping)
-        // - Read FS root to begin traversal
-        bmp->pm_fsinfo.chunk_root = malloc(tmp_chunk_entry->chunk_item.size, M_BTRFSMOUNT, M_WAITOK | M_ZERO);
-
-        error = bo_read_key_into_buf(devvp, tmp_chunk_entry->key, &bmp->pm_backing_dev_bootstrap, bmp->pm_fsinfo.chunk_root);
-        if(error)
+        if(tmp_chunk_entry == NULL) {
+                error = EINVAL;
                 goto error_exit;
-
-        struct btrfs_tree_header head = BTRFSHEADER(bmp->pm_fsinfo.chunk_root);
-        uint8_t *tst = BTRFSDATABUF(bmp->pm_fsinfo.chunk_root);
-        for(int i = 0; i < head.num_items; ++i) {
-                struct btrfs_leaf_node *to_dump_item = (struct btrfs_leaf_node *) (tst + (i * (sizeof(struct btrfs_leaf_node))));
-                switch(to_dump_item->key.obj_type) {
-                        case TYPE_CHUNK_ITEM: {
-                                struct btrfs_chunk_item *tmp_chnk = (struct btrfs_chunk_item *)(tst + to_dump_item->offset);
-                                for(int j = 0; j < tmp_chnk->num_stripes; ++j) {
-                                        // We're skipping all chunks past the first.
-                                        // Stripes after the first are for RAID setups, which we don't support
-                                        if(j > 0)
-                                                continue;
-                                        struct btrfs_chunk_item_stripe *tmp_stripe = (struct btrfs_chunk_item_stripe *)(tst + to_dump_item->offset + sizeof(struct btrfs_chunk_item));
-                                        if(!bc_add_to_chunk_cache(to_dump_item->key, *tmp_chnk, *tmp_stripe, &bmp->pm_backing_dev_bootstrap)) {
-                                                uprintf("Overlap in chunk cache %lu %X\n", to_dump_item->key.obj_id, to_dump_item->key.obj_type);
-                                        }
-                                }
-                                break;
-                        }
-                        default:
-                                break;
-                }
         }
 
-        tmp_chunk_entry = bc_find_logical_in_cache(bmp->pm_superblock.root_tree_addr, &bmp->pm_backing_dev_bootstrap);
-        // if we cannot read the root tree, we cannot continue
-        if(tmp_chunk_entry == NULL)
-                goto error_exit;
-
-        bmp->pm_fsinfo.tree_root = malloc(tmp_chunk_entry->chunk_item.size, M_BTRFSMOUNT, M_WAITOK | M_ZERO);
-
-        error = bo_read_key_into_buf(devvp, tmp_chunk_entry->key, &bmp->pm_backing_dev_bootstrap, bmp->pm_fsinfo.tree_root);
-        if(error)
-                goto error_exit;
-
-        head = BTRFSHEADER(bmp->pm_fsinfo.tree_root);
-        uprintf("TREE ROOT addr %lu num items %u level %d\n", head.address, head.num_items, head.level);
-
         // assign our internal structure to mp
-        bmp->pm_devvp = devvp;
         bmp->pm_odevvp = odevvp;
         bmp->pm_dev = dev;
 
         mp->mnt_data = bmp;
-
+        mp->mnt_stat.f_iosize = BTRFS_BSIZE;
+        // nothing below the vnode lock changes after mount, let lookups run in parallel
+        MNT_ILOCK(mp);
+        mp->mnt_kern_flag |= MNTK_LOOKUP_SHARED | MNTK_EXTENDED_SHARED;
+        MNT_IUNLOCK(mp);
+
+        // the superblock checks out, the rest is read in the background
+        taskqueue_enqueue(taskqueue_thread, &bmp->pm_loadtask);
         return(0);
 
 error_exit:
@@ -415,8 +552,17 @@ error_exit:
                 g_topology_unlock();
         }
         if(bmp != NULL) {
-                lockdestroy(&bmp->pm_btrfslock);
-                bc_free_cache_list(&bmp->pm_backing_dev_bootstrap);
+                br_free_roots(bmp);
+                ba_arena_destroy(&bmp->pm_arena);
+                if(bmp->pm_nodezone != NULL) {
+                        bn_destroy(bmp);
+                        uma_zdestroy(bmp->pm_nodezone);
+                }
+                rm_destroy(&bmp->pm_rootlock);
+                mtx_destroy(&bmp->pm_chunklock);
+                bs_free(bmp);
+                mtx_destroy(&bmp->pm_loadlock);
+                free(bmp, M_BTRFSMOUNT);
                 mp->mnt_data = NULL;
         }
         BO_LOCK(&odevvp->v_bufobj);
@@ -437,6 +583,14 @@ static int btrfs_unmount(struct mount *mp, int mntflags) {
         error = 0;
         bmp = VFSTOBTRFS(mp);
 
+        // every vnode's v_data points into memory freed below, get rid of them first
+        error = vflush(mp, 0, (mntflags & MNT_FORCE) ? FORCECLOSE : 0, curthread);
+        if(error)
+                return(error);
+
+        // the load task uses the device, let it finish first
+        taskqueue_drain(taskqueue_thread, &bmp->pm_loadtask);
+
         vn_lock(bmp->pm_devvp, LK_EXCLUSIVE | LK_RETRY);
         g_topology_lock();
         g_vfs_close(bmp->pm_cp);
@@ -449,13 +603,22 @@ static int btrfs_unmount(struct mount *mp, int mntflags) {
         vrele(bmp->pm_odevvp);
         dev_rel(bmp->pm_dev);
 
-        bc_free_cache_list(&bmp->pm_backing_dev_bootstrap);
+        // fs_root belongs to its entry in the root cache
+        br_free_roots(bmp);
         if(bmp->pm_fsinfo.chunk_root != NULL)
-                free(bmp->pm_fsinfo.chunk_root, M_BTRFSMOUNT);
+                bt_free_block(bmp, bmp->pm_fsinfo.chunk_root);
         if(bmp->pm_fsinfo.tree_root != NULL)
-                free(bmp->pm_fsinfo.tree_root, M_BTRFSMOUNT);
-
-        lockdestroy(&bmp->pm_btrfslock);
+                bt_free_block(bmp, bmp->pm_fsinfo.tree_root);
+        // the chunk list and maps go with the arena, the zone is empty once the
+        // cached tree blocks are gone
+        ba_arena_destroy(&bmp->pm_arena);
+        bn_destroy(bmp);
+        uma_zdestroy(bmp->pm_nodezone);
+
+        rm_destroy(&bmp->pm_rootlock);
+        mtx_destroy(&bmp->pm_chunklock);
+        bs_free(bmp);
+        mtx_destroy(&bmp->pm_loadlock);
         free(bmp, M_BTRFSMOUNT);
         mp->mnt_data = NULL;
         return(error);
@@ -475,10 +638,89 @@ static int btrfs_statfs(struct mount *mp, struct statfs *sbp) {
         return(0);
 }
 
+// inode numbers are objectids in the top level fs tree for now
+static int btrfs_vget(struct mount *mp, ino_t ino, int flags, struct vnode **vpp) {
+        struct btrfsmount_internal *bmp = VFSTOBTRFS(mp);
+        struct btrfs_inode *bip;
+        struct btrfs_key key;
+        struct vnode *vp;
+        uint8_t *root_node;
+        int error;
+
+        error = vfs_hash_get(mp, ino, flags, curthread, vpp, NULL, NULL);
+        if(error || *vpp != NULL)
+                return(error);
+
+        error = btrfs_wait_loaded(bmp);
+        if(error) {
+                *vpp = NULL;
+                return(error);
+        }
+
+        bip = uma_zalloc(ba_inode_zone, M_WAITOK | M_ZERO);
+        error = getnewvnode("btrfs", mp, &btrfs_vnodeops, &vp);
+        if(error) {
+                uma_zfree(ba_inode_zone, bip);
+                *vpp = NULL;
+                return(error);
+        }
+
+        bip->bi_vnode = vp;
+        bip->bi_bmp = bmp;
+        bip->bi_ino = ino;
+        vp->v_data = bip;
+
+        lockmgr(vp->v_vnlock, LK_EXCLUSIVE, NULL);
+        VN_LOCK_ASHARE(vp);
+        // on failure insmntque() reclaims vp, which frees bip
+        error = insmntque(vp, mp);
+        if(error) {
+                *vpp = NULL;
+                return(error);
+        }
+        error = vfs_hash_insert(vp, ino, flags, curthread, vpp, NULL, NULL);
+        if(error || *vpp != NULL)
+                return(error);
+
+        key.obj_id = ino;
+        key.obj_type = TYPE_INODE_ITEM;
+        key.offset = 0;
+        error = br_get_root(bmp, BTRFS_ROOT_FSTREE, &bip->bi_root);
+        if(error == 0)
+                error = br_get_root_node(bmp, bip->bi_root, &root_node);
+        if(error == 0)
+                error = bt_search_by_key(bmp, key, root_node, &bip->bi_inode, sizeof(bip->bi_inode));
+        if(error) {
+                // take it out of the vfs hash, a later vget must not find it half built
+                vgone(vp);
+                vput(vp);
+                *vpp = NULL;
+                return(error);
+        }
+
+        vp->v_type = IFTOVT(bip->bi_inode.st_mode);
+        if(ino == SUBVOL_ROOT_INODE)
+                vp->v_vflag |= VV_ROOT;
+        vn_set_state(vp, VSTATE_CONSTRUCTED);
+
+        *vpp = vp;
+        return(0);
+}
+
 static int btrfs_fhtovp(struct mount *mp, struct fid *fhp, int flags, struct vnode **vpp) {
         return(0);
 }
 
+static int btrfs_init(struct vfsconf *vfsp) {
+        ba_init_zones();
+        return(0);
+}
+
+static int btrfs_uninit(struct vfsconf *vfsp) {
+        ba_destroy_zones();
+        return(0);
+}
+
 static struct vfsops btrfs_vfsops = {
 	.vfs_fhtovp =		btrfs_fhtovp,
 	.vfs_mount =		btrfs_mount,
@@ -486,6 +728,9 @@ static struct vfsops btrfs_vfsops = {
 	.vfs_root =		btrfs_root,
 	.vfs_statfs =		btrfs_statfs,
 	.vfs_unmount =		btrfs_unmount,
+	.vfs_vget =		btrfs_vget,
+	.vfs_init =		btrfs_init,
+	.vfs_uninit =		btrfs_uninit,
 };
 
 VFS_SET(btrfs_vfsops, btrfs, VFCF_READONLY );
\ No newline at end of file
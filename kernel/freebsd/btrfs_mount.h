@@ -29,10 +29,15 @@ DAMAGE.
 
 #include <sys/types.h>
 #include <sys/lock.h>
-#include <sys/lockmgr.h>
+#include <sys/mutex.h>
+#include <sys/rmlock.h>
+#include <sys/_task.h>
 #include <sys/tree.h>
 #include <sys/queue.h>
 #include "btrfs_filesystem.h"
+#include "btrfs_counters.h"
+#include "btrfs_alloc.h"
+#include "btrfs_cache.h"
 
 // BTRFS in Linux is represented in a red-black tree
 // @todo: use generic RB trees rather than lists for key/chunk_item pairs in sys_chunk_array
@@ -45,6 +50,12 @@ struct b_chunk_list {
     LIST_ENTRY(b_chunk_list) entries;
 };
 
+// Immutable, sorted snapshot of the chunk list. See bc_publish_chunk_map().
+struct bc_chunk_map {
+    uint32_t count;
+    struct b_chunk_list *entries[];
+};
+
 // Linux kernel has a helpful struct (btrfs/fs.h) that holds pointers to all the roots
 // we will encounter. Seems like a good idea to me.
 struct btrfs_fs_info {
@@ -52,16 +63,33 @@ struct btrfs_fs_info {
     uint8_t *chunk_root;
     uint8_t *fs_root;
     uint8_t *extent_root;
+
+    // every subvolume/snapshot root we have loaded, keyed by root objectid
+    RB_HEAD(btrfs_root_tree, btrfs_root) roots;
+    uint64_t num_roots;
 };
 
 // RB root item
-//@todo: implement btrfs_root struct methods to hold RB roots
+// One of these exists per loaded tree (subvolume, snapshot or internal tree). They
+// are never evicted: the filesystem is read-only, so a root item cannot change
+// under us and the entries live until unmount.
 struct btrfs_root {
-//    RB_ENTRY(btrfs_root) rb_node;
+    RB_ENTRY(btrfs_root) rb_node;
 
     struct btrfs_root_item root_item;
     struct btrfs_key root_key;
     struct btrfs_fs_info *fs_info;
+
+    uint8_t *node;                  // root block of this tree, read on first use
+
+    // where this root is linked into its parent, from ROOT_BACKREF and checked
+    // against the parent's ROOT_REF. parent_id is 0 for the top level fs tree,
+    // internal trees and subvolumes whose link is gone.
+    uint64_t parent_id;
+    uint64_t parent_dirid;
+    uint64_t parent_index;
+    uint16_t name_len;
+    char *name;
 };
 
 struct btrfsmount_internal {
@@ -83,7 +111,28 @@ struct btrfsmount_internal {
 
     LIST_HEAD(btrfs_sys_chunks, b_chunk_list) pm_backing_dev_bootstrap;
 
-    struct lock pm_btrfslock;                   // protects allocations
+    // The mount is read-only, so nearly everything is written once and read many
+    // times. Readers never take a mount-wide lock:
+    //  - the chunk map is an immutable snapshot loaded with an acquire
+    //  - the root cache sits behind a read-mostly lock
+    //  - per-inode caches are built once and published with a compare-and-set
+    //  - tree blocks are shared through a cache with a lock per shard
+    //  - vnodes are found through vfs_hash, which does its own locking
+    struct bc_chunk_map *pm_chunk_map;
+    struct mtx pm_chunklock;                    // serializes chunk map publication
+    struct rmlock pm_rootlock;                  // protects pm_fsinfo.roots
+
+    // chunk and root trees are loaded after mount returns, see btrfs_wait_loaded()
+    struct task pm_loadtask;
+    struct mtx pm_loadlock;
+    int pm_loaded;                              // set once the load task is done
+    int pm_loaderror;                           // its result, valid once pm_loaded is set
+
+    struct btrfs_stats pm_stats;
+
+    uma_zone_t pm_nodezone;                     // node_size tree block buffers
+    struct bn_cache pm_nodecache;               // verified tree blocks below the roots
+    struct ba_arena pm_arena;                   // chunk list entries and chunk map snapshots
 };
 
 struct btrfs_args {
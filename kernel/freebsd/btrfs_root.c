@@ -0,0 +1,255 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/systm.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/rmlock.h>
+#include <machine/atomic.h>
+#include "btrfs.h"
+#include "btrfs_tree.h"
+#include "btrfs_root.h"
+
+/*
+ * Subvolumes and snapshots are separate trees, each described by a ROOT_ITEM in
+ * the root tree. A parent links to a child with ROOT_REF (parent, ROOT_REF, child)
+ * and the child points back with ROOT_BACKREF (child, ROOT_BACKREF, parent).
+ * We read the ROOT_ITEM and both refs once and keep them in an RB tree keyed
+ * by root objectid, so walking in and out of subvolumes never touches the root
+ * tree again.
+ */
+
+RB_GENERATE(btrfs_root_tree, btrfs_root, rb_node, br_root_cmp);
+
+int br_root_cmp(struct btrfs_root *a, struct btrfs_root *b) {
+	if(a->root_key.obj_id == b->root_key.obj_id)
+		return(0);
+	return(a->root_key.obj_id < b->root_key.obj_id ? -1 : 1);
+}
+
+void br_init_roots(struct btrfs_fs_info *fs_info) {
+	RB_INIT(&fs_info->roots);
+	fs_info->num_roots = 0;
+}
+
+static void br_free_root(struct btrfsmount_internal *bmp, struct btrfs_root *root) {
+	if(root->node != NULL)
+		bt_free_block(bmp, root->node);
+	if(root->name != NULL)
+		free(root->name, M_BTRFSOPS);
+	uma_zfree(ba_root_zone, root);
+}
+
+static struct btrfs_root *br_find_cached(struct btrfs_fs_info *fs_info, uint64_t root_id) {
+	struct btrfs_root find;
+
+	find.root_key.obj_id = root_id;
+	return(RB_FIND(btrfs_root_tree, &fs_info->roots, &find));
+}
+
+/*
+ * The parent's side of the link, (parent, ROOT_REF, child), has to say the same
+ * as the child's backref. A link missing there is not followed: the child is
+ * kept, just not attached anywhere.
+ */
+static int br_check_ref(struct btrfsmount_internal *bmp, struct btrfs_root *root) {
+	const uint8_t *item_key;
+	struct btrfs_key key;
+	struct bt_path path;
+	const uint8_t *ref;
+	bool linked = false;
+	int error;
+
+	key.obj_id = root->parent_id;
+	key.obj_type = TYPE_ROOT_REF;
+	key.offset = root->root_key.obj_id;
+	error = bt_search_slot(bmp, bmp->pm_fsinfo.tree_root, &key, &path);
+	if(error == 0) {
+		item_key = BTPATHKEY(&path);
+		if(btrfs_disk_key_objectid(item_key) == key.obj_id && btrfs_disk_key_type(item_key) == TYPE_ROOT_REF &&
+		    btrfs_disk_key_offset(item_key) == key.offset && BTPATHSIZE(&path) >= offsetof(ROOT_REF, name)) {
+			ref = BTPATHDATA(&path);
+			linked = BTRFS_GET_LE64(ref, ROOT_REF, dir) == root->parent_dirid &&
+			    BTRFS_GET_LE64(ref, ROOT_REF, index) == root->parent_index;
+		}
+	}
+	bt_path_release(&path);
+	if(error && error != ENOENT)
+		return(error);
+
+	if(!linked) {
+		root->parent_id = 0;
+		root->parent_dirid = 0;
+		root->parent_index = 0;
+	}
+	return(0);
+}
+
+// read ROOT_ITEM and ROOT_BACKREF for root_id out of the root tree, then check the link against ROOT_REF
+static int br_load_root(struct btrfsmount_internal *bmp, uint64_t root_id, struct btrfs_root **rootp) {
+	struct btrfs_root *root;
+	const uint8_t *item_key;
+	uint32_t item_size;
+	struct btrfs_key key;
+	struct bt_path path;
+	const uint8_t *ref;
+	int error;
+
+	root = uma_zalloc(ba_root_zone, M_WAITOK | M_ZERO);
+	root->fs_info = &bmp->pm_fsinfo;
+
+	// snapshots carry their creation transid in the key offset, so search from 0
+	key.obj_id = root_id;
+	key.obj_type = TYPE_ROOT_ITEM;
+	key.offset = 0;
+	error = bt_search_slot(bmp, bmp->pm_fsinfo.tree_root, &key, &path);
+	if(error == 0) {
+		item_key = BTPATHKEY(&path);
+		if(btrfs_disk_key_objectid(item_key) != root_id || btrfs_disk_key_type(item_key) != TYPE_ROOT_ITEM) {
+			error = ENOENT;
+		} else {
+			btrfs_disk_key_to_cpu(item_key, &root->root_key);
+			// older kernels wrote a shorter root item, everything past it stays zeroed
+			memcpy(&root->root_item, BTPATHDATA(&path), MIN(BTPATHSIZE(&path), sizeof(root->root_item)));
+		}
+	}
+	bt_path_release(&path);
+	if(error)
+		goto load_fail;
+
+	key.obj_type = TYPE_ROOT_BACKREF;
+	error = bt_search_slot(bmp, bmp->pm_fsinfo.tree_root, &key, &path);
+	if(error == 0) {
+		item_key = BTPATHKEY(&path);
+		item_size = BTPATHSIZE(&path);
+		if(btrfs_disk_key_objectid(item_key) == root_id && btrfs_disk_key_type(item_key) == TYPE_ROOT_BACKREF &&
+		    item_size >= offsetof(ROOT_REF, name)) {
+			ref = BTPATHDATA(&path);
+			root->parent_id = btrfs_disk_key_offset(item_key);
+			root->parent_dirid = BTRFS_GET_LE64(ref, ROOT_REF, dir);
+			root->parent_index = BTRFS_GET_LE64(ref, ROOT_REF, index);
+			root->name_len = MIN(BTRFS_GET_LE16(ref, ROOT_REF, n), item_size - offsetof(ROOT_REF, name));
+			root->name = malloc(root->name_len + 1, M_BTRFSOPS, M_WAITOK | M_ZERO);
+			memcpy(root->name, BTRFS_FIELD(ref, ROOT_REF, name), root->name_len);
+		}
+	}
+	bt_path_release(&path);
+	// the top level fs tree and the internal trees have no backref
+	if(error == ENOENT)
+		error = 0;
+	if(error)
+		goto load_fail;
+
+	if(root->parent_id != 0) {
+		error = br_check_ref(bmp, root);
+		if(error)
+			goto load_fail;
+	}
+
+	*rootp = root;
+	return(0);
+
+load_fail:
+	br_free_root(bmp, root);
+	return(error);
+}
+
+int br_get_root(struct btrfsmount_internal *bmp, uint64_t root_id, struct btrfs_root **rootp) {
+	struct btrfs_fs_info *fs_info = &bmp->pm_fsinfo;
+	struct btrfs_root *root, *existing;
+	struct rm_priotracker tracker;
+	int error;
+
+	rm_rlock(&bmp->pm_rootlock, &tracker);
+	root = br_find_cached(fs_info, root_id);
+	rm_runlock(&bmp->pm_rootlock, &tracker);
+	if(root != NULL) {
+		*rootp = root;
+		return(0);
+	}
+
+	// do the reads unlocked, whoever inserts first wins
+	error = br_load_root(bmp, root_id, &root);
+	if(error)
+		return(error);
+
+	rm_wlock(&bmp->pm_rootlock);
+	existing = RB_INSERT(btrfs_root_tree, &fs_info->roots, root);
+	if(existing == NULL)
+		fs_info->num_roots++;
+	rm_wunlock(&bmp->pm_rootlock);
+
+	if(existing != NULL) {
+		br_free_root(bmp, root);
+		root = existing;
+	}
+	*rootp = root;
+	return(0);
+}
+
+int br_get_root_node(struct btrfsmount_internal *bmp, struct btrfs_root *root, uint8_t **nodep) {
+	uint32_t node_size = bmp->pm_superblock.node_size;
+	uint8_t *node;
+	int error;
+
+	node = (uint8_t *)atomic_load_acq_ptr((uintptr_t *)&root->node);
+	if(node != NULL) {
+		*nodep = node;
+		return(0);
+	}
+
+	node = bt_alloc_block(bmp);
+	error = bo_read_logical_into_buf(bmp, BTRFS_GET_LE64(&root->root_item, struct btrfs_root_item, block_number),
+	    node_size, node);
+	if(error == 0)
+		error = bt_check_csum(bmp, node);
+	if(error) {
+		bt_free_block(bmp, node);
+		return(error);
+	}
+
+	// first reader to finish publishes its copy, the others drop theirs
+	if(atomic_cmpset_rel_ptr((uintptr_t *)&root->node, (uintptr_t)NULL, (uintptr_t)node)) {
+		*nodep = node;
+		return(0);
+	}
+	bt_free_block(bmp, node);
+	*nodep = (uint8_t *)atomic_load_acq_ptr((uintptr_t *)&root->node);
+	return(0);
+}
+
+void br_free_roots(struct btrfsmount_internal *bmp) {
+	struct btrfs_fs_info *fs_info = &bmp->pm_fsinfo;
+	struct btrfs_root *root, *tmp;
+
+	RB_FOREACH_SAFE(root, btrfs_root_tree, &fs_info->roots, tmp) {
+		RB_REMOVE(btrfs_root_tree, &fs_info->roots, root);
+		br_free_root(bmp, root);
+	}
+	fs_info->num_roots = 0;
+}
@@ -0,0 +1,42 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_ROOT_H
+#define _BTRFS_ROOT_H
+
+#include "btrfs_mount.h"
+
+// br_ - Subvolume/snapshot root cache
+
+int br_root_cmp(struct btrfs_root *a, struct btrfs_root *b);
+RB_PROTOTYPE(btrfs_root_tree, btrfs_root, rb_node, br_root_cmp);
+
+void br_init_roots(struct btrfs_fs_info *fs_info);
+int br_get_root(struct btrfsmount_internal *bmp, uint64_t root_id, struct btrfs_root **rootp);
+int br_get_root_node(struct btrfsmount_internal *bmp, struct btrfs_root *root, uint8_t **nodep);
+void br_free_roots(struct btrfsmount_internal *bmp);
+
+#endif // _BTRFS_ROOT_H
@@ -29,18 +29,243 @@ DAMAGE.
 #include <sys/param.h>
 #include <sys/malloc.h>
 #include <sys/buf.h>
+#include <sys/time.h>
+#include "btrfs.h"
 #include "btrfs_tree.h"
 
-int bt_search_by_key(struct btrfs_key in, struct vnode *devvp, struct btrfs_sys_chunks *cache_head, uint8_t *tree_root, void *dest) {
-  struct btrfs_tree_header t_header = BTRFSHEADER(tree_root);
-  if(t_header.level == 1) {
-    uprintf("node\n");
-  } else {
-    uprintf("leaf\n");
+// node_size buffers for tree blocks, from the mount's zone
+uint8_t *bt_alloc_block(struct btrfsmount_internal *bmp) {
+  return(uma_zalloc(bmp->pm_nodezone, M_WAITOK));
+}
+
+void bt_free_block(struct btrfsmount_internal *bmp, uint8_t *block) {
+  uma_zfree(bmp->pm_nodezone, block);
+}
+
+// tree blocks start with a checksum of the rest of the block
+int bt_check_csum(struct btrfsmount_internal *bmp, uint8_t *block) {
+  uint32_t node_size = bmp->pm_superblock.node_size;
+  uint32_t crc, stored;
+  int error = 0;
+
+  // only crc32c is verified, the other hashes are trusted as-is
+  if(bmp->pm_superblock.csum_type != CSUM_TYPE_CRC32C)
+    return(0);
+  crc = ~calculate_crc32c(~0U, block + BTRFS_CSUM_SIZE, node_size - BTRFS_CSUM_SIZE);
+  memcpy(&stored, block, sizeof(stored));
+  if(stored != crc) {
+    BS_INC(bmp, BTRFS_STAT_CSUM_FAIL);
+    error = EIO;
+  }
+  SDT_PROBE4(btrfs, , bt, csum, btrfs_header_bytenr(block), stored, crc, error);
+  return(error);
+}
+
+// sanity check a block before we trust num_items to index into it
+int bt_check_block(struct btrfsmount_internal *bmp, uint8_t *block, int expect_level) {
+  uint32_t data_size = bmp->pm_superblock.node_size - sizeof(struct btrfs_tree_header);
+  uint32_t num_items = btrfs_header_nritems(block);
+  uint8_t level = btrfs_header_level(block);
+  size_t entry_size;
+
+  if(expect_level >= 0 && level != expect_level)
+    return(EIO);
+  if(level >= BTRFS_MAX_LEVEL)
+    return(EIO);
+  entry_size = level ? sizeof(struct btrfs_internal_node) : sizeof(struct btrfs_leaf_node);
+  if((uint64_t)num_items * entry_size > data_size)
+    return(EIO);
+  if(level == 0) {
+    for(uint32_t i = 0; i < num_items; ++i) {
+      if((uint64_t)btrfs_item_offset(block, i) + btrfs_item_size(block, i) > data_size)
+        return(EIO);
+    }
+  }
+  return(0);
+}
+
+// point path->nodes[level - 1] at the child referenced by slot `slot` of path->nodes[level]
+static int bt_read_child(struct btrfsmount_internal *bmp, struct bt_path *path, int level, uint32_t slot) {
+  uint64_t address = btrfs_node_blockptr(path->nodes[level], slot);
+  struct bn_block *block;
+  int error;
+
+  if(path->blocks[level - 1] != NULL)
+    bn_release(bmp, path->blocks[level - 1]);
+  path->blocks[level - 1] = NULL;
+  path->nodes[level - 1] = NULL;
+
+  error = bn_get(bmp, address, level - 1, &block, &path->blocks_read);
+  if(error)
+    return(error);
+  path->blocks[level - 1] = block;
+  path->nodes[level - 1] = block->bn_data;
+  path->slots[level - 1] = 0;
+  return(0);
+}
+
+static int bt_do_search(struct btrfsmount_internal *bmp, uint8_t *tree_root, const struct btrfs_key *key, struct bt_path *path) {
+  uint32_t slot, num_items;
+  int level, error;
+
+  memset(path, 0, sizeof(*path));
+  path->bmp = bmp;
+  error = bt_check_block(bmp, tree_root, -1);
+  if(error)
+    return(error);
+
+  level = btrfs_header_level(tree_root);
+  path->root_level = level;
+  path->nodes[level] = tree_root;
+
+  for(;;) {
+    num_items = btrfs_header_nritems(path->nodes[level]);
+    if(num_items == 0)
+      return(ENOENT);
+
+    if(level == 0) {
+      path->slots[0] = bt_leaf_slot(path->nodes[0], 0, key);
+      if(path->slots[0] < num_items)
+        return(0);
+      // everything in this leaf is smaller, the answer is the first item of the next leaf
+      path->slots[0] = num_items - 1;
+      return(bt_next_item(bmp, path));
+    }
+
+    slot = bt_node_slot(path->nodes[level], 0, key);
+    path->slots[level] = slot;
+
+    error = bt_read_child(bmp, path, level, slot);
+    if(error)
+      return(error);
+    level--;
+  }
+}
+
+/*
+ * Position `path` at the first item whose key is >= `key`.
+ * Returns 0 on success, ENOENT when no such item exists in the tree,
+ * or an errno from the underlying read.
+ */
+int bt_search_slot(struct btrfsmount_internal *bmp, uint8_t *tree_root, const struct btrfs_key *key, struct bt_path *path) {
+  sbintime_t start = sbinuptime();
+  int error;
+
+  error = bt_do_search(bmp, tree_root, key, path);
+  bs_hist_record(bmp, BTRFS_HIST_LOOKUP, start);
+  SDT_PROBE6(btrfs, , bt, search, btrfs_header_owner(tree_root), key,
+      path->root_level, path->blocks_read, sbttons(sbinuptime() - start), error);
+  return(error);
+}
+
+/*
+ * Advance `path` to the next item in key order, climbing to the parent
+ * nodes when the current leaf is exhausted. Returns ENOENT past the last item.
+ */
+int bt_next_item(struct btrfsmount_internal *bmp, struct bt_path *path) {
+  int level, error;
+
+  if(path->slots[0] + 1 < btrfs_header_nritems(path->nodes[0])) {
+    path->slots[0]++;
+    return(0);
+  }
+
+  for(level = 1; level <= path->root_level; ++level) {
+    if(path->slots[level] + 1 < btrfs_header_nritems(path->nodes[level]))
+      break;
+  }
+  if(level > path->root_level)
+    return(ENOENT);
+
+  path->slots[level]++;
+  for(; level > 0; --level) {
+    error = bt_read_child(bmp, path, level, path->slots[level]);
+    if(error)
+      return(error);
+  }
+  if(btrfs_header_nritems(path->nodes[0]) == 0)
+    return(ENOENT);
+  return(0);
+}
+
+void bt_path_release(struct bt_path *path) {
+  // the root block is owned by whoever handed it to bt_search_slot()
+  for(int i = 0; i < path->root_level; ++i) {
+    if(path->blocks[i] != NULL)
+      bn_release(path->bmp, path->blocks[i]);
+    path->blocks[i] = NULL;
+    path->nodes[i] = NULL;
+  }
+}
+
+/*
+ * Exact match lookup. Copies at most `dest_len` bytes of the item into `dest`
+ * and returns 0, or ENOENT if the key is not present.
+ */
+int bt_search_by_key(struct btrfsmount_internal *bmp, struct btrfs_key in, uint8_t *tree_root, void *dest, uint32_t dest_len) {
+  struct bt_many_key one = { .key = in, .dest = dest, .dest_len = dest_len };
+  int error;
+
+  error = bt_search_many(bmp, tree_root, &one, 1);
+  return(error ? error : one.error);
+}
+
+// hand every key of the batch to the child of `node` whose range holds it, one child at a time
+static int bt_many_visit(struct btrfsmount_internal *bmp, const uint8_t *node, int level, struct bt_many_key *keys,
+    int count, int *blocks_read) {
+  uint32_t num_items = btrfs_header_nritems(node), slot = 0;
+  struct bn_block *child;
+  int i, j, error;
+
+  if(num_items == 0)
+    return(0);
+
+  if(level == 0) {
+    bt_many_leaf(node, keys, count);
+    return(0);
+  }
+
+  for(i = 0; i < count; i = j) {
+    slot = bt_node_slot(node, slot, &keys[i].key);
+    // the keys below the next pointer's key all live under this one
+    for(j = i + 1; j < count; ++j) {
+      if(slot + 1 < num_items && btrfs_comp_disk_key(btrfs_node_key(node, slot + 1), &keys[j].key) <= 0)
+        break;
+    }
+    error = bn_get(bmp, btrfs_node_blockptr(node, slot), level - 1, &child, blocks_read);
+    if(error)
+      return(error);
+    error = bt_many_visit(bmp, child->bn_data, level - 1, keys + i, j - i, blocks_read);
+    bn_release(bmp, child);
+    if(error)
+      return(error);
   }
   return(0);
 }
 
+/*
+ * Exact match lookup of `count` keys sorted in ascending order, in one descent:
+ * the batch is split at every internal node, so each block any of the keys
+ * needs is visited once rather than once per key. Fills in size and error of
+ * every key and copies found items to their dest. Returns 0, EINVAL for an
+ * unsorted batch, or an errno from the underlying read.
+ */
+int bt_search_many(struct btrfsmount_internal *bmp, uint8_t *tree_root, struct bt_many_key *keys, int count) {
+  sbintime_t start = sbinuptime();
+  int blocks_read = 0, error;
+
+  error = bt_many_prepare(keys, count);
+  if(error)
+    return(error);
+  error = bt_check_block(bmp, tree_root, -1);
+  if(error == 0 && count > 0)
+    error = bt_many_visit(bmp, tree_root, btrfs_header_level(tree_root), keys, count, &blocks_read);
+  bs_hist_record(bmp, BTRFS_HIST_LOOKUP, start);
+  SDT_PROBE6(btrfs, , bt, search, btrfs_header_owner(tree_root), count > 0 ? &keys[0].key : NULL,
+      btrfs_header_level(tree_root), blocks_read, sbttons(sbinuptime() - start), error);
+  return(error);
+}
+
 int bt_walk_leaves(struct btrfs_sys_chunks *head) {
   
   return(0);
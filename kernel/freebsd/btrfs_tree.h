@@ -28,11 +28,39 @@ DAMAGE.
 #define _BTRFS_TREE_H
 
 #include "btrfs_mount.h"
+#include "btrfs_accessors.h"
+#include "btrfs_search.h"
 
-#define BTRFSHEADER(x) *((struct btrfs_tree_header *) x)
-#define BTRFSDATABUF(x) (x + sizeof(struct btrfs_tree_header))
+// btrfs limits tree height to 8 levels (0 being the leaves)
+#define BTRFS_MAX_LEVEL 8
 
-int bt_search_by_key(struct btrfs_key in, struct vnode *devvp, struct btrfs_sys_chunks *cache_head, uint8_t *tree_root, void *dest);
+// A path records the blocks visited from the root down to a leaf, and the slot
+// taken at each level. nodes[0] is always the leaf once a search succeeds.
+// The root block belongs to the caller; every block below it is a reference
+// into the tree block cache held by the path (see btrfs_cache.h).
+struct bt_path {
+    struct btrfsmount_internal *bmp;
+    uint8_t *nodes[BTRFS_MAX_LEVEL];
+    struct bn_block *blocks[BTRFS_MAX_LEVEL];   // the cache entries behind nodes[]
+    uint32_t slots[BTRFS_MAX_LEVEL];
+    int root_level;
+    int blocks_read;                // blocks this path had to fetch from the device
+};
+
+// the item a path points at, read in place from the leaf (see btrfs_accessors.h)
+#define BTPATHKEY(p) btrfs_item_key((p)->nodes[0], (p)->slots[0])
+#define BTPATHSIZE(p) btrfs_item_size((p)->nodes[0], (p)->slots[0])
+#define BTPATHDATA(p) btrfs_item_data((p)->nodes[0], (p)->slots[0])
+
+uint8_t *bt_alloc_block(struct btrfsmount_internal *bmp);
+void bt_free_block(struct btrfsmount_internal *bmp, uint8_t *block);
+int bt_check_csum(struct btrfsmount_internal *bmp, uint8_t *block);
+int bt_check_block(struct btrfsmount_internal *bmp, uint8_t *block, int expect_level);
+int bt_search_slot(struct btrfsmount_internal *bmp, uint8_t *tree_root, const struct btrfs_key *key, struct bt_path *path);
+int bt_next_item(struct btrfsmount_internal *bmp, struct bt_path *path);
+void bt_path_release(struct bt_path *path);
+int bt_search_by_key(struct btrfsmount_internal *bmp, struct btrfs_key in, uint8_t *tree_root, void *dest, uint32_t dest_len);
+int bt_search_many(struct btrfsmount_internal *bmp, uint8_t *tree_root, struct bt_many_key *keys, int count);
 int bt_walk_leaves(struct btrfs_sys_chunks *head);
 
 #endif //_BTRFS_TREE_H
\ No newline at end of file
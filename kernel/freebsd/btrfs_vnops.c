@@ -0,0 +1,321 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mount.h>
+#include <sys/malloc.h>
+#include <sys/vnode.h>
+#include <sys/uio.h>
+#include <sys/extattr.h>
+#include <sys/buf.h>
+#include <sys/bio.h>
+#include <vm/vm.h>
+#include <vm/vm_extern.h>
+#include <vm/vnode_pager.h>
+#include "btrfs.h"
+#include "btrfs_inode.h"
+
+MALLOC_DEFINE(M_BTRFSINODE, "btrfs_inode", "btrfs in-core inodes");
+
+static vop_getextattr_t btrfs_getextattr;
+static vop_listextattr_t btrfs_listextattr;
+static vop_reclaim_t btrfs_reclaim;
+static vop_open_t btrfs_open;
+static vop_bmap_t btrfs_bmap;
+static vop_strategy_t btrfs_strategy;
+static vop_getpages_t btrfs_getpages;
+static vop_ioctl_t btrfs_ioctl;
+
+// btrfs keeps the namespace as part of the name, the way Linux hands it over
+static const char *btrfs_xattr_prefix(int attrnamespace) {
+	switch(attrnamespace) {
+		case EXTATTR_NAMESPACE_USER:
+			return("user.");
+		case EXTATTR_NAMESPACE_SYSTEM:
+			return("system.");
+		default:
+			return(NULL);
+	}
+}
+
+static int btrfs_getextattr(struct vop_getextattr_args *ap) {
+	struct btrfs_inode *bip = VTOBI(ap->a_vp);
+	struct bx_cache *cache;
+	struct bx_entry *entry;
+	const char *prefix;
+	int error;
+
+	prefix = btrfs_xattr_prefix(ap->a_attrnamespace);
+	if(prefix == NULL)
+		return(EOPNOTSUPP);
+
+	error = extattr_check_cred(ap->a_vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VREAD);
+	if(error)
+		return(error);
+
+	error = bx_get_cache(bip, &cache);
+	if(error)
+		return(error);
+
+	entry = bx_find(cache, prefix, ap->a_name);
+	if(entry == NULL)
+		return(ENOATTR);
+
+	if(ap->a_size != NULL)
+		*ap->a_size = entry->data_len;
+	if(ap->a_uio != NULL && ap->a_uio->uio_offset < entry->data_len)
+		error = uiomove(entry->data + ap->a_uio->uio_offset, entry->data_len - ap->a_uio->uio_offset, ap->a_uio);
+	return(error);
+}
+
+// names go out as <length byte><name>, without the namespace prefix
+static int btrfs_listextattr(struct vop_listextattr_args *ap) {
+	struct btrfs_inode *bip = VTOBI(ap->a_vp);
+	struct bx_cache *cache;
+	struct bx_entry *entry;
+	const char *prefix;
+	size_t prefix_len;
+	uint8_t name_len;
+	int error;
+
+	prefix = btrfs_xattr_prefix(ap->a_attrnamespace);
+	if(prefix == NULL)
+		return(EOPNOTSUPP);
+	prefix_len = strlen(prefix);
+
+	error = extattr_check_cred(ap->a_vp, ap->a_attrnamespace, ap->a_cred, ap->a_td, VREAD);
+	if(error)
+		return(error);
+
+	error = bx_get_cache(bip, &cache);
+	if(error)
+		return(error);
+
+	if(ap->a_size != NULL)
+		*ap->a_size = 0;
+	for(uint32_t i = 0; i < cache->count; ++i) {
+		entry = &cache->entries[i];
+		if(entry->name_len <= prefix_len || entry->name_len - prefix_len > UINT8_MAX ||
+		    memcmp(entry->name, prefix, prefix_len) != 0)
+			continue;
+
+		name_len = entry->name_len - prefix_len;
+		if(ap->a_size != NULL)
+			*ap->a_size += name_len + 1;
+		if(ap->a_uio != NULL) {
+			error = uiomove(&name_len, sizeof(name_len), ap->a_uio);
+			if(error == 0)
+				error = uiomove(entry->name + prefix_len, name_len, ap->a_uio);
+			if(error)
+				return(error);
+		}
+	}
+	return(0);
+}
+
+static int btrfs_open(struct vop_open_args *ap) {
+	struct vnode *vp = ap->a_vp;
+
+	if(vp->v_type == VREG || vp->v_type == VDIR)
+		vnode_create_vobject(vp, VTOBI(vp)->bi_inode.st_size, ap->a_td);
+	return(0);
+}
+
+/*
+ * Logical blocks of a vnode are BTRFS_BSIZE bytes. A block maps to a device
+ * block only when it lies inside one uncompressed extent, anything else is
+ * assembled by btrfs_strategy() and reported as unmapped (-1).
+ */
+static int btrfs_bmap(struct vop_bmap_args *ap) {
+	struct btrfs_inode *bip = VTOBI(ap->a_vp);
+	struct be_extent_map *map;
+	uint64_t phys;
+	int error;
+
+	if(ap->a_bop != NULL)
+		*ap->a_bop = bip->bi_bmp->pm_bo;
+	if(ap->a_runp != NULL)
+		*ap->a_runp = 0;
+	if(ap->a_runb != NULL)
+		*ap->a_runb = 0;
+	if(ap->a_bnp == NULL)
+		return(0);
+
+	error = be_get_map(bip, &map);
+	if(error)
+		return(error);
+	if(be_map_physical(bip, map, (uint64_t)ap->a_bn * BTRFS_BSIZE, BTRFS_BSIZE, &phys) == 0)
+		*ap->a_bnp = phys / DEV_BSIZE;
+	else
+		*ap->a_bnp = -1;
+	return(0);
+}
+
+/*
+ * Buffers that sit inside one uncompressed extent are retargeted at the device
+ * and read directly into their pages. Everything else (holes, inline data,
+ * compressed or fragmented ranges) is filled here, with compressed extents
+ * decoded straight into the buffer.
+ */
+static int btrfs_strategy(struct vop_strategy_args *ap) {
+	struct buf *bp = ap->a_bp;
+	struct btrfs_inode *bip = VTOBI(ap->a_vp);
+	struct be_extent_map *map;
+	uint64_t offset, phys;
+	int error;
+
+	if(bp->b_iocmd != BIO_READ) {
+		bp->b_error = EROFS;
+		bp->b_ioflags |= BIO_ERROR;
+		bufdone(bp);
+		return(0);
+	}
+
+	offset = (uint64_t)bp->b_lblkno * BTRFS_BSIZE;
+	error = be_get_map(bip, &map);
+	if(error == 0 && be_map_physical(bip, map, offset, bp->b_bcount, &phys) == 0) {
+		bp->b_blkno = phys / DEV_BSIZE;
+		bp->b_iooffset = phys;
+		BO_STRATEGY(bip->bi_bmp->pm_bo, bp);
+		return(0);
+	}
+
+	if(error == 0)
+		error = be_read_range(bip, map, offset, bp->b_data, bp->b_bcount);
+	if(error) {
+		bp->b_error = error;
+		bp->b_ioflags |= BIO_ERROR;
+	}
+	bp->b_resid = 0;
+	bufdone(bp);
+	return(0);
+}
+
+static daddr_t btrfs_gbp_getblkno(struct vnode *vp, vm_ooffset_t off) {
+	return(off / BTRFS_BSIZE);
+}
+
+static int btrfs_gbp_getblksz(struct vnode *vp, daddr_t lbn, long *sz) {
+	*sz = BTRFS_BSIZE;
+	return(0);
+}
+
+// mmap() and sendfile() page-ins, clustered in BTRFS_BSIZE buffers backed by the pages
+static int btrfs_getpages(struct vop_getpages_args *ap) {
+	sbintime_t start = sbinuptime();
+	int error;
+
+	error = vfs_bio_getpages(ap->a_vp, ap->a_m, ap->a_count, ap->a_rbehind, ap->a_rahead,
+	    btrfs_gbp_getblkno, btrfs_gbp_getblksz);
+	bs_hist_record(VTOBI(ap->a_vp)->bi_bmp, BTRFS_HIST_READ, start);
+	return(error);
+}
+
+/*
+ * Batches are filled under the vnode lock and copied out without it, since a
+ * fault on a user buffer mapped from this file would take the lock again.
+ */
+static int btrfs_ioctl_fiemap(struct vnode *vp, struct btrfs_fiemap *fm) {
+	char *uaddr = (char *)(uintptr_t)fm->fm_extents;
+	struct btrfs_fiemap_extent *batch;
+	struct be_extent_map *map;
+	struct btrfs_fiemap part = *fm;
+	uint64_t end = fm->fm_start + MIN(fm->fm_length, UINT64_MAX - fm->fm_start);
+	uint32_t filled = 0;
+	int error;
+
+	batch = mallocarray(BE_FIEMAP_BATCH, sizeof(*batch), M_BTRFSINODE, M_WAITOK);
+	for(;;) {
+		part.fm_count = fm->fm_count - filled;
+		vn_lock(vp, LK_SHARED | LK_RETRY);
+		if(VN_IS_DOOMED(vp))
+			error = EBADF;
+		else {
+			error = be_get_map(VTOBI(vp), &map);
+			if(error == 0)
+				error = be_fiemap(VTOBI(vp), map, &part, batch);
+		}
+		VOP_UNLOCK(vp);
+		if(error == 0 && part.fm_count > 0)
+			error = copyout(batch, uaddr + (size_t)filled * sizeof(*batch), part.fm_count * sizeof(*batch));
+		if(error)
+			break;
+		filled += part.fm_count;
+		// the range is done, or the caller's buffer is full
+		if(part.fm_next == end || filled == fm->fm_count)
+			break;
+		part.fm_start = part.fm_next;
+		part.fm_length = end - part.fm_next;
+	}
+	free(batch, M_BTRFSINODE);
+	if(error)
+		return(error);
+	fm->fm_count = filled;
+	fm->fm_next = part.fm_next;
+	return(0);
+}
+
+// BTRFS_IOC_*, see btrfs_ioctl.h. The argument has already been copied in.
+static int btrfs_ioctl(struct vop_ioctl_args *ap) {
+	struct vnode *vp = ap->a_vp;
+
+	switch(ap->a_command) {
+		case BTRFS_IOC_FIEMAP:
+			if(vp->v_type != VREG)
+				return(EINVAL);
+			return(btrfs_ioctl_fiemap(vp, (struct btrfs_fiemap *)ap->a_data));
+		default:
+			return(ENOTTY);
+	}
+}
+
+static int btrfs_reclaim(struct vop_reclaim_args *ap) {
+	struct vnode *vp = ap->a_vp;
+	struct btrfs_inode *bip = VTOBI(vp);
+
+	vfs_hash_remove(vp);
+	if(bip != NULL) {
+		bx_free_cache(bip);
+		be_free_map(bip);
+		uma_zfree(ba_inode_zone, bip);
+	}
+	vp->v_data = NULL;
+	return(0);
+}
+
+struct vop_vector btrfs_vnodeops = {
+	.vop_default =		&default_vnodeops,
+	.vop_getextattr =	btrfs_getextattr,
+	.vop_listextattr =	btrfs_listextattr,
+	.vop_reclaim =		btrfs_reclaim,
+	.vop_open =		btrfs_open,
+	.vop_bmap =		btrfs_bmap,
+	.vop_strategy =		btrfs_strategy,
+	.vop_getpages =		btrfs_getpages,
+	.vop_ioctl =		btrfs_ioctl,
+};
+VFS_VOP_VECTOR_REGISTER(btrfs_vnodeops);
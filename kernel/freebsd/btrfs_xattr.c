@@ -0,0 +1,186 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <sys/systm.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/malloc.h>
+#include <sys/vnode.h>
+#include <machine/atomic.h>
+#include "btrfs.h"
+#include "btrfs_tree.h"
+#include "btrfs_root.h"
+#include "btrfs_inode.h"
+
+/*
+ * Extended attributes are stored as XATTR_ITEMs keyed (inode, XATTR_ITEM, name hash),
+ * each holding one or more btrfs_dir_item headers followed by the name and value.
+ * Finder and Spotlight probe a handful of com.apple.* names on every file, and most
+ * files have none of them. Instead of a tree search per probe we scan the inode's
+ * XATTR_ITEM range once and answer every later probe, hit or miss, from memory.
+ */
+
+// shared by every inode without xattrs, never freed
+static struct bx_cache bx_empty_cache;
+
+static void bx_free_entries(struct bx_cache *cache) {
+	for(uint32_t i = 0; i < cache->count; ++i) {
+		free(cache->entries[i].name, M_BTRFSINODE);
+		if(cache->entries[i].data != NULL)
+			free(cache->entries[i].data, M_BTRFSINODE);
+	}
+	if(cache->entries != NULL)
+		free(cache->entries, M_BTRFSINODE);
+	free(cache, M_BTRFSINODE);
+}
+
+static void bx_add_entry(struct bx_cache *cache, uint32_t *capacity, const struct btrfs_dir_item *di) {
+	struct bx_entry *entry, *grown;
+	uint8_t *name = (uint8_t *)(di + 1);
+
+	if(cache->count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 4;
+		grown = mallocarray(*capacity, sizeof(*grown), M_BTRFSINODE, M_WAITOK | M_ZERO);
+		if(cache->entries != NULL) {
+			memcpy(grown, cache->entries, cache->count * sizeof(*grown));
+			free(cache->entries, M_BTRFSINODE);
+		}
+		cache->entries = grown;
+	}
+
+	entry = &cache->entries[cache->count++];
+	entry->name_len = di->name_length;
+	entry->data_len = di->extended_attribute_len;
+	entry->name = malloc(entry->name_len + 1, M_BTRFSINODE, M_WAITOK | M_ZERO);
+	memcpy(entry->name, name, entry->name_len);
+	if(entry->data_len != 0) {
+		entry->data = malloc(entry->data_len, M_BTRFSINODE, M_WAITOK);
+		memcpy(entry->data, name + entry->name_len, entry->data_len);
+	}
+}
+
+// range scan (ino, XATTR_ITEM, 0) .. (ino, XATTR_ITEM, UINT64_MAX)
+static int bx_load_cache(struct btrfs_inode *bip, struct bx_cache **cachep) {
+	struct btrfsmount_internal *bmp = bip->bi_bmp;
+	const uint8_t *item_key;
+	uint32_t item_size;
+	const struct btrfs_dir_item *di;
+	struct bx_cache *cache;
+	struct btrfs_key key;
+	struct bt_path path;
+	uint32_t capacity = 0, pos;
+	uint8_t *root_node;
+	int error;
+
+	error = br_get_root_node(bmp, bip->bi_root, &root_node);
+	if(error)
+		return(error);
+
+	cache = malloc(sizeof(*cache), M_BTRFSINODE, M_WAITOK | M_ZERO);
+
+	key.obj_id = bip->bi_ino;
+	key.obj_type = TYPE_XATTR_ITEM;
+	key.offset = 0;
+	for(error = bt_search_slot(bmp, root_node, &key, &path); error == 0; error = bt_next_item(bmp, &path)) {
+		item_key = BTPATHKEY(&path);
+		if(btrfs_disk_key_objectid(item_key) != bip->bi_ino || btrfs_disk_key_type(item_key) != TYPE_XATTR_ITEM)
+			break;
+		item_size = BTPATHSIZE(&path);
+
+		// several names can share a hash, walk every dir_item packed in the item
+		for(pos = 0; pos + sizeof(*di) <= item_size;) {
+			di = (const struct btrfs_dir_item *)(BTPATHDATA(&path) + pos);
+			if(pos + sizeof(*di) + di->name_length + di->extended_attribute_len > item_size) {
+				error = EIO;
+				break;
+			}
+			bx_add_entry(cache, &capacity, di);
+			pos += sizeof(*di) + di->name_length + di->extended_attribute_len;
+		}
+		if(error)
+			break;
+	}
+	bt_path_release(&path);
+	if(error == ENOENT)
+		error = 0;
+	if(error) {
+		bx_free_entries(cache);
+		return(error);
+	}
+
+	if(cache->count == 0) {
+		bx_free_entries(cache);
+		cache = &bx_empty_cache;
+	}
+	*cachep = cache;
+	return(0);
+}
+
+int bx_get_cache(struct btrfs_inode *bip, struct bx_cache **cachep) {
+	struct bx_cache *cache;
+	int error;
+
+	cache = (struct bx_cache *)atomic_load_acq_ptr((uintptr_t *)&bip->bi_xattrs);
+	if(cache != NULL) {
+		*cachep = cache;
+		return(0);
+	}
+
+	error = bx_load_cache(bip, &cache);
+	if(error)
+		return(error);
+
+	// two threads may load the same inode under a shared vnode lock, keep the first
+	if(!atomic_cmpset_rel_ptr((uintptr_t *)&bip->bi_xattrs, (uintptr_t)NULL, (uintptr_t)cache)) {
+		if(cache != &bx_empty_cache)
+			bx_free_entries(cache);
+		cache = (struct bx_cache *)atomic_load_acq_ptr((uintptr_t *)&bip->bi_xattrs);
+	}
+	*cachep = cache;
+	return(0);
+}
+
+// look up prefix + name, e.g. ("user.", "com.apple.FinderInfo")
+struct bx_entry *bx_find(struct bx_cache *cache, const char *prefix, const char *name) {
+	size_t prefix_len = strlen(prefix), name_len = strlen(name);
+	struct bx_entry *entry;
+
+	for(uint32_t i = 0; i < cache->count; ++i) {
+		entry = &cache->entries[i];
+		if(entry->name_len != prefix_len + name_len)
+			continue;
+		if(memcmp(entry->name, prefix, prefix_len) == 0 &&
+		    memcmp(entry->name + prefix_len, name, name_len) == 0)
+			return(entry);
+	}
+	return(NULL);
+}
+
+void bx_free_cache(struct btrfs_inode *bip) {
+	if(bip->bi_xattrs != NULL && bip->bi_xattrs != &bx_empty_cache)
+		bx_free_entries(bip->bi_xattrs);
+	bip->bi_xattrs = NULL;
+}
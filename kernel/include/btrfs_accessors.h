@@ -0,0 +1,212 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_ACCESSORS_H
+#define _BTRFS_ACCESSORS_H
+
+#include "btrfs_filesystem.h"
+
+#if defined(__FreeBSD__)
+#include <sys/endian.h>
+#elif defined(__APPLE__)
+#include <libkern/OSByteOrder.h>
+#define le16toh(x) OSSwapLittleToHostInt16(x)
+#define le32toh(x) OSSwapLittleToHostInt32(x)
+#define le64toh(x) OSSwapLittleToHostInt64(x)
+#else
+#include <endian.h>
+#endif
+
+/*
+ * Typed accessors for on-disk structures, read in place from a block buffer.
+ *
+ * Everything on disk is little-endian and the structures in btrfs_filesystem.h
+ * are packed, so a field can sit at any alignment. Each accessor loads exactly
+ * the field it names with an unaligned-safe copy of that field's width and
+ * swaps it on big-endian hosts, instead of copying a whole header or item out
+ * to look at one member. Pointers into a block are passed as `const uint8_t *`.
+ */
+
+#define BTRFS_FIELD(p, type, member) ((const uint8_t *)(p) + __builtin_offsetof(type, member))
+
+static __inline uint8_t btrfs_get_u8(const uint8_t *p) {
+    return(*p);
+}
+
+static __inline uint16_t btrfs_get_le16(const uint8_t *p) {
+    uint16_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return(le16toh(v));
+}
+
+static __inline uint32_t btrfs_get_le32(const uint8_t *p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return(le32toh(v));
+}
+
+static __inline uint64_t btrfs_get_le64(const uint8_t *p) {
+    uint64_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return(le64toh(v));
+}
+
+// any other member of a packed on-disk structure
+#define BTRFS_GET_LE16(p, type, member) btrfs_get_le16(BTRFS_FIELD(p, type, member))
+#define BTRFS_GET_LE32(p, type, member) btrfs_get_le32(BTRFS_FIELD(p, type, member))
+#define BTRFS_GET_LE64(p, type, member) btrfs_get_le64(BTRFS_FIELD(p, type, member))
+#define BTRFS_GET_U8(p, type, member) btrfs_get_u8(BTRFS_FIELD(p, type, member))
+
+// struct btrfs_key as stored on disk (little-endian, unaligned)
+
+static __inline uint64_t btrfs_disk_key_objectid(const uint8_t *k) {
+    return(btrfs_get_le64(BTRFS_FIELD(k, struct btrfs_key, obj_id)));
+}
+
+static __inline uint8_t btrfs_disk_key_type(const uint8_t *k) {
+    return(btrfs_get_u8(BTRFS_FIELD(k, struct btrfs_key, obj_type)));
+}
+
+static __inline uint64_t btrfs_disk_key_offset(const uint8_t *k) {
+    return(btrfs_get_le64(BTRFS_FIELD(k, struct btrfs_key, offset)));
+}
+
+static __inline void btrfs_disk_key_to_cpu(const uint8_t *k, struct btrfs_key *out) {
+    out->obj_id = btrfs_disk_key_objectid(k);
+    out->obj_type = btrfs_disk_key_type(k);
+    out->offset = btrfs_disk_key_offset(k);
+}
+
+// compare an on-disk key against a host key, stopping at the first field that differs
+static __inline int btrfs_comp_disk_key(const uint8_t *k, const struct btrfs_key *key) {
+    uint64_t id = btrfs_disk_key_objectid(k), off;
+    uint8_t type;
+
+    if(id != key->obj_id)
+        return(id < key->obj_id ? -1 : 1);
+    type = btrfs_disk_key_type(k);
+    if(type != key->obj_type)
+        return(type < key->obj_type ? -1 : 1);
+    off = btrfs_disk_key_offset(k);
+    if(off != key->offset)
+        return(off < key->offset ? -1 : 1);
+    return(0);
+}
+
+// struct btrfs_tree_header at the start of every tree block
+
+static __inline uint64_t btrfs_header_bytenr(const uint8_t *b) {
+    return(btrfs_get_le64(BTRFS_FIELD(b, struct btrfs_tree_header, address)));
+}
+
+static __inline uint64_t btrfs_header_generation(const uint8_t *b) {
+    return(btrfs_get_le64(BTRFS_FIELD(b, struct btrfs_tree_header, generation)));
+}
+
+static __inline uint64_t btrfs_header_owner(const uint8_t *b) {
+    return(btrfs_get_le64(BTRFS_FIELD(b, struct btrfs_tree_header, tree_id)));
+}
+
+static __inline uint32_t btrfs_header_nritems(const uint8_t *b) {
+    return(btrfs_get_le32(BTRFS_FIELD(b, struct btrfs_tree_header, num_items)));
+}
+
+static __inline uint8_t btrfs_header_level(const uint8_t *b) {
+    return(btrfs_get_u8(BTRFS_FIELD(b, struct btrfs_tree_header, level)));
+}
+
+// leaf items (struct btrfs_leaf_node), slot is the item index in the leaf
+
+static __inline const uint8_t *btrfs_item_nr(const uint8_t *leaf, uint32_t slot) {
+    return(leaf + sizeof(struct btrfs_tree_header) + (size_t)slot * sizeof(struct btrfs_leaf_node));
+}
+
+static __inline const uint8_t *btrfs_item_key(const uint8_t *leaf, uint32_t slot) {
+    return(BTRFS_FIELD(btrfs_item_nr(leaf, slot), struct btrfs_leaf_node, key));
+}
+
+// item data offsets are relative to the end of the header
+static __inline uint32_t btrfs_item_offset(const uint8_t *leaf, uint32_t slot) {
+    return(btrfs_get_le32(BTRFS_FIELD(btrfs_item_nr(leaf, slot), struct btrfs_leaf_node, offset)));
+}
+
+static __inline uint32_t btrfs_item_size(const uint8_t *leaf, uint32_t slot) {
+    return(btrfs_get_le32(BTRFS_FIELD(btrfs_item_nr(leaf, slot), struct btrfs_leaf_node, size)));
+}
+
+static __inline const uint8_t *btrfs_item_data(const uint8_t *leaf, uint32_t slot) {
+    return(leaf + sizeof(struct btrfs_tree_header) + btrfs_item_offset(leaf, slot));
+}
+
+// internal node pointers (struct btrfs_internal_node)
+
+static __inline const uint8_t *btrfs_node_nr(const uint8_t *node, uint32_t slot) {
+    return(node + sizeof(struct btrfs_tree_header) + (size_t)slot * sizeof(struct btrfs_internal_node));
+}
+
+static __inline const uint8_t *btrfs_node_key(const uint8_t *node, uint32_t slot) {
+    return(BTRFS_FIELD(btrfs_node_nr(node, slot), struct btrfs_internal_node, key));
+}
+
+static __inline uint64_t btrfs_node_blockptr(const uint8_t *node, uint32_t slot) {
+    return(btrfs_get_le64(BTRFS_FIELD(btrfs_node_nr(node, slot), struct btrfs_internal_node, address)));
+}
+
+static __inline uint64_t btrfs_node_ptr_generation(const uint8_t *node, uint32_t slot) {
+    return(btrfs_get_le64(BTRFS_FIELD(btrfs_node_nr(node, slot), struct btrfs_internal_node, generation)));
+}
+
+// CHUNK_ITEM payload, followed by num_stripes stripes
+
+static __inline uint64_t btrfs_chunk_length(const uint8_t *c) {
+    return(btrfs_get_le64(BTRFS_FIELD(c, struct btrfs_chunk_item, size)));
+}
+
+static __inline uint64_t btrfs_chunk_type(const uint8_t *c) {
+    return(btrfs_get_le64(BTRFS_FIELD(c, struct btrfs_chunk_item, type)));
+}
+
+static __inline uint16_t btrfs_chunk_num_stripes(const uint8_t *c) {
+    return(btrfs_get_le16(BTRFS_FIELD(c, struct btrfs_chunk_item, num_stripes)));
+}
+
+static __inline size_t btrfs_chunk_item_size(uint16_t num_stripes) {
+    return(sizeof(struct btrfs_chunk_item) + (size_t)num_stripes * sizeof(struct btrfs_chunk_item_stripe));
+}
+
+static __inline const uint8_t *btrfs_chunk_stripe(const uint8_t *c, uint16_t n) {
+    return(c + sizeof(struct btrfs_chunk_item) + (size_t)n * sizeof(struct btrfs_chunk_item_stripe));
+}
+
+static __inline uint64_t btrfs_stripe_devid(const uint8_t *s) {
+    return(btrfs_get_le64(BTRFS_FIELD(s, struct btrfs_chunk_item_stripe, dev_id)));
+}
+
+static __inline uint64_t btrfs_stripe_offset(const uint8_t *s) {
+    return(btrfs_get_le64(BTRFS_FIELD(s, struct btrfs_chunk_item_stripe, offset)));
+}
+
+#endif // _BTRFS_ACCESSORS_H
@@ -17,7 +17,7 @@
 #include <sys/types.h>
 #ifdef __APPLE__
 #include <libkern/libkern.h>
-#elif __FreeBSD__
+#elif defined(__FreeBSD__) && defined(_KERNEL)
 #include <sys/libkern.h>
 #endif
 
@@ -31,6 +31,7 @@
 #define FSUR_IO_SUCCESS         (-3)
 #define FSUR_IO_FAIL            (-4)
 #define FSUR_IO_UNCLEAN         (-5)
+#define FSUR_INVAL              (-6)
 #else
 #include <sys/loadable_fs.h>
 #endif
@@ -74,6 +75,10 @@ static const uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0
 #define TYPE_DEV_EXTENT        0xCC
 #define TYPE_DEV_ITEM          0xD8
 #define TYPE_CHUNK_ITEM        0xE4
+#define TYPE_QGROUP_STATUS     0xF0
+#define TYPE_QGROUP_INFO       0xF2
+#define TYPE_QGROUP_LIMIT      0xF4
+#define TYPE_QGROUP_RELATION   0xF6
 #define TYPE_TEMP_ITEM         0xF8
 #define TYPE_DEV_STATS         0xF9
 #define TYPE_SUBVOL_UUID       0xFB
@@ -86,6 +91,7 @@ static const uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0
 #define BTRFS_ROOT_FSTREE       5
 #define BTRFS_ROOT_TREEDIR      6
 #define BTRFS_ROOT_CHECKSUM     7
+#define BTRFS_ROOT_QUOTA        8
 #define BTRFS_ROOT_UUID         9
 #define BTRFS_ROOT_FREE_SPACE   0xa
 #define BTRFS_ROOT_DATA_RELOC   0xFFFFFFFFFFFFFFF7
@@ -95,6 +101,8 @@ static const uint64_t superblock_addrs[] = { 0x10000, 0x4000000, 0x4000000000, 0
 #define BTRFS_COMPRESSION_LZO   2
 #define BTRFS_COMPRESSION_ZSTD  3
 
+#define BTRFS_MAX_COMPRESSED    (128 * 1024)
+
 #define BTRFS_ENCRYPTION_NONE   0
 
 #define BTRFS_ENCODING_NONE     0
@@ -929,6 +937,67 @@ typedef struct {
 	uint32_t flags;
 } FREE_SPACE_INFO;
 
+#define BTRFS_QGROUP_STATUS_FLAG_ON           0x1
+#define BTRFS_QGROUP_STATUS_FLAG_RESCAN       0x2
+#define BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT 0x4
+#define BTRFS_QGROUP_STATUS_FLAG_SIMPLE_MODE  0x8
+
+#define BTRFS_QGROUP_LIMIT_MAX_RFER         0x1
+#define BTRFS_QGROUP_LIMIT_MAX_EXCL         0x2
+
+#define BTRFS_QGROUP_LEVEL_SHIFT            48
+
+/*!
+ @struct QGROUP_STATUS
+ @abstract State of quota accounting, one per filesystem in the quota tree.
+ @field version
+ @field generation Transaction the accounting was last brought up to date in.
+ @field flags BTRFS_QGROUP_STATUS_FLAG_*
+ @field rescan Progress of a running rescan, the next objectid to account.
+ @discussion This struct is keyed on (0, QGROUP_STATUS, 0).
+ */
+typedef struct {
+	uint64_t version;
+	uint64_t generation;
+	uint64_t flags;
+	uint64_t rescan;
+} QGROUP_STATUS;
+
+/*!
+ @struct QGROUP_INFO
+ @abstract Space accounted to one qgroup.
+ @field generation
+ @field rfer Bytes referenced by the qgroup.
+ @field rfer_cmpr Referenced bytes as stored on disk.
+ @field excl Bytes referenced only by the qgroup.
+ @field excl_cmpr Exclusive bytes as stored on disk.
+ @discussion This struct is keyed on (0, QGROUP_INFO, level << 48 | subvolume id).
+ */
+typedef struct {
+	uint64_t generation;
+	uint64_t rfer;
+	uint64_t rfer_cmpr;
+	uint64_t excl;
+	uint64_t excl_cmpr;
+} QGROUP_INFO;
+
+/*!
+ @struct QGROUP_LIMIT
+ @field flags BTRFS_QGROUP_LIMIT_*, which of the limits are set
+ @field max_rfer
+ @field max_excl
+ @field rsv_rfer
+ @field rsv_excl
+ @discussion This struct is keyed on (0, QGROUP_LIMIT, qgroup id).
+ */
+typedef struct {
+	uint64_t flags;
+	uint64_t max_rfer;
+	uint64_t max_excl;
+	uint64_t rsv_rfer;
+	uint64_t rsv_excl;
+} QGROUP_LIMIT;
+
 #define BTRFS_DEV_STAT_WRITE_ERRORS          0
 #define BTRFS_DEV_STAT_READ_ERRORS           1
 #define BTRFS_DEV_STAT_FLUSH_ERRORS          2
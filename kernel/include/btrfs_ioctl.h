@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_IOCTL_H
+#define _BTRFS_IOCTL_H
+
+#include <sys/types.h>
+#ifdef _KERNEL
+#include <sys/ioccom.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+#endif
+
+/*
+ * ioctls on files of a mounted btrfs, shared by the kernel module and the
+ * userspace tools. Structures have a fixed layout on every ABI; user pointers
+ * travel as 64-bit integers.
+ */
+
+// One extent of a file. Holes are not reported.
+struct btrfs_fiemap_extent {
+    uint64_t fe_offset;                         // file offset
+    uint64_t fe_length;                         // file bytes covered
+    uint64_t fe_logical;                        // btrfs logical address of the data, 0 when inline
+    uint64_t fe_physical;                       // device offset of the data, 0 when unmapped
+    uint64_t fe_devid;
+    uint64_t fe_disk_bytes;                     // bytes on disk, compressed size if compressed
+    uint64_t fe_ram_bytes;                      // decoded size of the whole extent
+    uint32_t fe_flags;                          // BTRFS_FIEMAP_*
+    uint32_t fe_reserved;
+};
+
+#define BTRFS_FIEMAP_LAST       0x0001          // no extent follows this one
+#define BTRFS_FIEMAP_INLINE     0x0002          // stored in the fs tree, no logical or physical address
+#define BTRFS_FIEMAP_PREALLOC   0x0004          // allocated but unwritten, reads as zeros
+#define BTRFS_FIEMAP_COMPRESSED 0x0008          // physical and disk_bytes are those of the whole compressed extent
+#define BTRFS_FIEMAP_SHARED     0x0010          // other files or snapshots may use the same data
+#define BTRFS_FIEMAP_UNMAPPED   0x0020          // striped or parity profile, no single device offset
+
+// request flags
+#define BTRFS_FIEMAP_CHECK_SHARED 0x0001        // look each extent up in the extent tree to set SHARED
+
+struct btrfs_fiemap {
+    uint64_t fm_start;                          // in: first file offset of interest
+    uint64_t fm_length;                         // in: bytes of interest from there
+    uint64_t fm_extents;                        // in: user address of fm_count entries
+    uint32_t fm_flags;                          // in: BTRFS_FIEMAP_CHECK_*
+    uint32_t fm_count;                          // in: room at fm_extents, out: entries written
+    uint64_t fm_next;                           // out: where the next call should start
+};
+
+/*
+ * Fills up to fm_count extents overlapping [fm_start, fm_start + fm_length) from
+ * the inode's in-memory extent map in one call. When the buffer fills before
+ * the range ends, fm_next is where to continue; otherwise the last extent
+ * written carries BTRFS_FIEMAP_LAST if it is the file's last.
+ */
+#define BTRFS_IOC_FIEMAP _IOWR('B', 1, struct btrfs_fiemap)
+
+#endif // _BTRFS_IOCTL_H
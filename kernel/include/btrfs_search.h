@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_SEARCH_H
+#define _BTRFS_SEARCH_H
+
+#include "btrfs_accessors.h"
+
+#if defined(__FreeBSD__) && defined(_KERNEL)
+#include <sys/errno.h>
+#include <sys/systm.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+// Searches within one tree block. They only look at the block in memory, so
+// the tree code does the descent and the reads and these stay pure.
+
+// One key of a bt_search_many() batch. Only exact matches are reported.
+struct bt_many_key {
+    struct btrfs_key key;           // the batch is sorted by it
+    void *dest;                     // receives up to dest_len bytes of the item, may be NULL
+    uint32_t dest_len;
+    uint32_t size;                  // out: full size of the item
+    int error;                      // out: 0, or ENOENT when the tree has no such key
+};
+
+static __inline int bt_key_cmp(const struct btrfs_key *a, const struct btrfs_key *b) {
+    if(a->obj_id != b->obj_id)
+        return(a->obj_id < b->obj_id ? -1 : 1);
+    if(a->obj_type != b->obj_type)
+        return(a->obj_type < b->obj_type ? -1 : 1);
+    if(a->offset != b->offset)
+        return(a->offset < b->offset ? -1 : 1);
+    return(0);
+}
+
+// first slot of a leaf at or after `lo` with key >= `key`, nritems if there is none
+static __inline uint32_t bt_leaf_slot(const uint8_t *leaf, uint32_t lo, const struct btrfs_key *key) {
+    uint32_t hi = btrfs_header_nritems(leaf), mid;
+
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(btrfs_comp_disk_key(btrfs_item_key(leaf, mid), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return(lo);
+}
+
+// last slot of an internal node at or after `lo` with key <= `key`, or `lo` if every key is larger
+static __inline uint32_t bt_node_slot(const uint8_t *node, uint32_t lo, const struct btrfs_key *key) {
+    uint32_t hi = btrfs_header_nritems(node), mid;
+
+    while(hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if(btrfs_comp_disk_key(btrfs_node_key(node, mid), key) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return(lo);
+}
+
+// marks every key of a batch not found; EINVAL if the batch is not sorted
+static __inline int bt_many_prepare(struct bt_many_key *keys, int count) {
+    for(int i = 0; i < count; ++i) {
+        if(i > 0 && bt_key_cmp(&keys[i - 1].key, &keys[i].key) > 0)
+            return(EINVAL);
+        keys[i].size = 0;
+        keys[i].error = ENOENT;
+    }
+    return(0);
+}
+
+// the keys of a batch found in `leaf`, which must have passed bt_check_block()
+static __inline void bt_many_leaf(const uint8_t *leaf, struct bt_many_key *keys, int count) {
+    uint32_t num_items = btrfs_header_nritems(leaf), slot = 0;
+
+    for(int i = 0; i < count; ++i) {
+        slot = bt_leaf_slot(leaf, slot, &keys[i].key);
+        if(slot == num_items)
+            break;
+        if(btrfs_comp_disk_key(btrfs_item_key(leaf, slot), &keys[i].key) != 0)
+            continue;
+        keys[i].size = btrfs_item_size(leaf, slot);
+        keys[i].error = 0;
+        if(keys[i].dest != NULL)
+            memcpy(keys[i].dest, btrfs_item_data(leaf, slot), keys[i].size < keys[i].dest_len ?
+                keys[i].size : keys[i].dest_len);
+    }
+}
+
+#endif // _BTRFS_SEARCH_H
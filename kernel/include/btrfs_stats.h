@@ -0,0 +1,116 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_STATS_H
+#define _BTRFS_STATS_H
+
+#include <sys/types.h>
+#ifndef _KERNEL
+#include <stdint.h>
+#endif
+
+/*
+ * Counter and histogram identifiers shared by the kernel module and the
+ * userspace tools, so both report the same names. Storage is up to the user:
+ * the kernel keeps per-CPU counter(9)s, the tools keep relaxed atomics in
+ * struct btrfs_volume.
+ */
+
+enum btrfs_stat {
+    BTRFS_STAT_TREE_CACHE_HIT,      // tree block found in the block cache (not roots)
+    BTRFS_STAT_TREE_CACHE_MISS,     // tree block the block cache read from the device
+    BTRFS_STAT_TREE_CACHE_WAIT,     // miss on a block another thread was already reading
+    BTRFS_STAT_TREE_CACHE_EVICT,    // tree block dropped to stay within the cache budget
+    BTRFS_STAT_BREAD,               // device reads issued
+    BTRFS_STAT_BREAD_BYTES,
+    BTRFS_STAT_CHUNK_LOOKUP,        // logical -> physical translations
+    BTRFS_STAT_CHUNK_MISS,          // translations with no chunk covering the address
+    BTRFS_STAT_CSUM_FAIL,           // tree blocks failing checksum verification
+
+    // decompression, one in/out/ns triplet per algorithm in BTRFS_COMPRESSION_* order
+    BTRFS_STAT_ZLIB_IN,
+    BTRFS_STAT_ZLIB_OUT,
+    BTRFS_STAT_ZLIB_NS,
+    BTRFS_STAT_LZO_IN,
+    BTRFS_STAT_LZO_OUT,
+    BTRFS_STAT_LZO_NS,
+    BTRFS_STAT_ZSTD_IN,
+    BTRFS_STAT_ZSTD_OUT,
+    BTRFS_STAT_ZSTD_NS,
+
+    BTRFS_NSTATS
+};
+
+// first decompression counter for a BTRFS_COMPRESSION_* value (1 = zlib, 2 = lzo, 3 = zstd)
+#define BTRFS_STAT_DECOMP(compression) (BTRFS_STAT_ZLIB_IN + 3 * ((compression) - 1))
+
+static const char *const btrfs_stat_names[BTRFS_NSTATS] = {
+    [BTRFS_STAT_TREE_CACHE_HIT] = "tree_cache_hit",
+    [BTRFS_STAT_TREE_CACHE_MISS] = "tree_cache_miss",
+    [BTRFS_STAT_TREE_CACHE_WAIT] = "tree_cache_wait",
+    [BTRFS_STAT_TREE_CACHE_EVICT] = "tree_cache_evict",
+    [BTRFS_STAT_BREAD] = "bread",
+    [BTRFS_STAT_BREAD_BYTES] = "bread_bytes",
+    [BTRFS_STAT_CHUNK_LOOKUP] = "chunk_lookup",
+    [BTRFS_STAT_CHUNK_MISS] = "chunk_miss",
+    [BTRFS_STAT_CSUM_FAIL] = "csum_fail",
+    [BTRFS_STAT_ZLIB_IN] = "zlib_in_bytes",
+    [BTRFS_STAT_ZLIB_OUT] = "zlib_out_bytes",
+    [BTRFS_STAT_ZLIB_NS] = "zlib_ns",
+    [BTRFS_STAT_LZO_IN] = "lzo_in_bytes",
+    [BTRFS_STAT_LZO_OUT] = "lzo_out_bytes",
+    [BTRFS_STAT_LZO_NS] = "lzo_ns",
+    [BTRFS_STAT_ZSTD_IN] = "zstd_in_bytes",
+    [BTRFS_STAT_ZSTD_OUT] = "zstd_out_bytes",
+    [BTRFS_STAT_ZSTD_NS] = "zstd_ns",
+};
+
+// Latency histograms. Bucket 0 counts 0ns, bucket i counts [2^(i-1), 2^i) ns and
+// the last bucket takes everything slower.
+enum btrfs_hist {
+    BTRFS_HIST_LOOKUP,              // tree searches
+    BTRFS_HIST_READ,                // file data reads
+    BTRFS_NHISTS
+};
+
+#define BTRFS_HIST_BUCKETS 40
+
+static const char *const btrfs_hist_names[BTRFS_NHISTS] = {
+    [BTRFS_HIST_LOOKUP] = "lookup_ns",
+    [BTRFS_HIST_READ] = "read_ns",
+};
+
+static __inline int btrfs_hist_bucket(uint64_t ns) {
+    int bucket = 0;
+
+    while(ns != 0 && bucket < BTRFS_HIST_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return(bucket);
+}
+
+#endif // _BTRFS_STATS_H
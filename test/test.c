@@ -24,9 +24,409 @@ OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
 DAMAGE. 
 */
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "btrfs_super.h"
+#include "btrfs_space.h"
+#include "btrfs_search.h"
+#include "crc32.h"
 
-int main(int argc, char *argv[]) {
-    return 0;
+// the send stream framing is internal to the sender and the receiver
+#include "btrfs_send.c"
+#include "btrfs_receive.c"
+
+// Table-driven checks of the parsers that see untrusted on-disk and stream
+// data. Each test walks its table and reports the rows that disagree.
+
+static int failures;
+
+#define EXPECT(cond, ...) do {                                                  \
+    if(!(cond)) {                                                               \
+        fprintf(stderr, "%s:%d: ", __func__, __LINE__);                         \
+        fprintf(stderr, __VA_ARGS__);                                           \
+        fputc('\n', stderr);                                                    \
+        failures++;                                                             \
+    }                                                                           \
+} while(0)
+
+static const struct {
+    const char *str;
+    int error;
+    uint8_t uuid[BTRFS_UUID_SIZE];
+    const char *formatted;                      // NULL when it formats back to str
+} uuid_cases[] = {
+    { "00000000-0000-0000-0000-000000000000", 0, { 0 }, NULL },
+    { "0123abcd-ef45-6789-89ab-cdef01234567", 0,
+      { 0x01, 0x23, 0xab, 0xcd, 0xef, 0x45, 0x67, 0x89, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23, 0x45, 0x67 }, NULL },
+    { "FFFFFFFF-FFFF-FFFF-FFFF-FFFFFFFFFFFF", 0,
+      { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },
+      "ffffffff-ffff-ffff-ffff-ffffffffffff" },
+    { "", EINVAL, { 0 }, NULL },
+    { "0123abcd-ef45-6789-89ab-cdef0123456", EINVAL, { 0 }, NULL },          // short
+    { "0123abcd-ef45-6789-89ab-cdef012345670", EINVAL, { 0 }, NULL },        // long
+    { "0123abcdef45-6789-89ab-cdef012345670", EINVAL, { 0 }, NULL },         // dash moved
+    { "0123abcd-ef45-6789-89ab-cdef0123456g", EINVAL, { 0 }, NULL },         // not hex
+    { "0123abcd-ef45-6789-89ab-cdef0123 567", EINVAL, { 0 }, NULL },
+    { "0123abcd_ef45_6789_89ab_cdef01234567", EINVAL, { 0 }, NULL },
+    { "0123abcdef456789-89abcdef0123456789", EINVAL, { 0 }, NULL },
+};
+
+static void test_uuid(void) {
+    char buf[BTRFS_UUID_STRLEN];
+    btrfs_uuid uuid;
+    int error;
+
+    for(size_t i = 0; i < sizeof(uuid_cases) / sizeof(uuid_cases[0]); ++i) {
+        error = btrfs_uuid_parse(uuid_cases[i].str, &uuid);
+        EXPECT(error == uuid_cases[i].error, "parse \"%s\": %d", uuid_cases[i].str, error);
+        if(error || uuid_cases[i].error)
+            continue;
+        EXPECT(memcmp(uuid.uuid, uuid_cases[i].uuid, BTRFS_UUID_SIZE) == 0, "parse \"%s\": wrong bytes",
+            uuid_cases[i].str);
+        btrfs_uuid_format(&uuid, buf);
+        EXPECT(strcmp(buf, uuid_cases[i].formatted ? uuid_cases[i].formatted : uuid_cases[i].str) == 0,
+            "format \"%s\": \"%s\"", uuid_cases[i].str, buf);
+    }
+}
+
+#define W(...) { __VA_ARGS__ }, sizeof((uint64_t[]){ __VA_ARGS__ }) / sizeof(uint64_t)
+
+static const struct {
+    uint64_t w[4];
+    size_t n;
+    uint64_t bits;
+    uint64_t runs;
+} bitmap_cases[] = {
+    { { 0 }, 0, 0, 0 },
+    { W(0), 0, 0 },
+    { W(1), 1, 1 },
+    { W(UINT64_MAX), 64, 1 },
+    { W(0xaaaaaaaaaaaaaaaaULL), 32, 32 },
+    { W(0x5555555555555555ULL), 32, 32 },
+    { W(0xf0, 0, 0xf), 8, 2 },
+    { W(1ULL << 63, 1), 2, 1 },                 // a run across the word boundary
+    { W(1ULL << 63, 2), 2, 2 },
+    { W(0x8000000000000001ULL, 0x8000000000000001ULL), 4, 3 },
+    { W(UINT64_MAX, UINT64_MAX, UINT64_MAX), 192, 1 },
+    { W(UINT64_MAX, 0, UINT64_MAX, 0), 128, 2 },
+    { W(0, 0, 0, 1ULL << 63), 1, 1 },
+};
+
+// bit by bit, as the free space tree defines it
+static uint64_t bitmap_naive(const uint64_t *w, size_t n, uint64_t *runs) {
+    uint64_t bits = 0;
+    int prev = 0, bit;
+
+    *runs = 0;
+    for(size_t i = 0; i < n * 64; ++i) {
+        bit = (w[i / 64] >> (i % 64)) & 1;
+        bits += bit;
+        *runs += bit && !prev;
+        prev = bit;
+    }
+    return(bits);
+}
+
+static void test_bitmap(void) {
+    btrfs_space_count_fn *count = btrfs_space_counter();
+    uint64_t w[40], x = 0x9e3779b97f4a7c15ULL, bits, runs, want_runs;
+
+    for(size_t i = 0; i < sizeof(bitmap_cases) / sizeof(bitmap_cases[0]); ++i) {
+        bits = count(bitmap_cases[i].w, bitmap_cases[i].n, &runs);
+        EXPECT(bits == bitmap_cases[i].bits && runs == bitmap_cases[i].runs,
+            "case %zu: %ju bits, %ju runs", i, (uintmax_t)bits, (uintmax_t)runs);
+    }
+    // long enough for the vector loops, with both sparse and dense words
+    for(size_t i = 0; i < 40; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        w[i] = i % 3 == 0 ? x & (x >> 5) & (x >> 11) : i % 3 == 1 ? x : x | (x << 3);
+    }
+    for(size_t n = 0; n <= 40; ++n) {
+        bits = count(w, n, &runs);
+        EXPECT(bits == bitmap_naive(w, n, &want_runs) && runs == want_runs, "%zu random words", n);
+    }
+}
+
+static const struct {
+    const char *data;
+    size_t len;
+    uint32_t crc;                               // seeded with ~0 and inverted, as usually quoted
+} crc32c_cases[] = {
+    { "", 0, 0 },
+    { "123456789", 9, 0xe3069283 },
+    { "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 32, 0x8a9136aa },
+    { "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff"
+      "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 32, 0x62a8ab43 },
+    { "\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+      "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f", 32, 0x46dd794e },
+};
+
+static void test_crc32c(void) {
+    const unsigned char *p;
+    uint32_t crc;
+
+    for(size_t i = 0; i < sizeof(crc32c_cases) / sizeof(crc32c_cases[0]); ++i) {
+        p = (const unsigned char *)crc32c_cases[i].data;
+        crc = ~calculate_crc32c(~0U, p, crc32c_cases[i].len);
+        EXPECT(crc == crc32c_cases[i].crc, "case %zu: %08x", i, crc);
+        // the sender continues a command's crc over its data buffer
+        for(size_t split = 0; split <= crc32c_cases[i].len; ++split) {
+            crc = ~calculate_crc32c(calculate_crc32c(~0U, p, split), p + split, crc32c_cases[i].len - split);
+            EXPECT(crc == crc32c_cases[i].crc, "case %zu split at %zu: %08x", i, split, crc);
+        }
+    }
+}
+
+enum { ATTR_PATH, ATTR_U64, ATTR_TIME, ATTR_DATA };
+
+struct send_case_attr {
+    int kind;
+    uint16_t type;
+    const char *str;                            // ATTR_PATH and ATTR_DATA
+    uint64_t v;                                 // ATTR_U64, seconds of ATTR_TIME
+    uint32_t nsec;
+};
+
+// lengths and crcs as a btrfs receive of the same commands computes them
+static const struct {
+    uint16_t cmd;
+    struct send_case_attr attr[3];
+    int nattr;
+    uint32_t len;
+    uint32_t csum;
+} send_cases[] = {
+    { BTRFS_SEND_CMD_MKFILE, { { ATTR_PATH, BTRFS_SEND_TLV_PATH, "a", 0, 0 } }, 1, 5, 0x1bda968c },
+    { BTRFS_SEND_CMD_WRITE, {
+        { ATTR_PATH, BTRFS_SEND_TLV_PATH, "f", 0, 0 },
+        { ATTR_U64, BTRFS_SEND_TLV_OFFSET, NULL, 4096, 0 },
+        { ATTR_DATA, BTRFS_SEND_TLV_DATA, "hello", 0, 0 } }, 3, 26, 0xd1ce23f3 },
+    { BTRFS_SEND_CMD_UTIMES, {
+        { ATTR_PATH, BTRFS_SEND_TLV_PATH, "d/e", 0, 0 },
+        { ATTR_TIME, BTRFS_SEND_TLV_MTIME, NULL, 1700000000, 5 } }, 2, 23, 0xc9c1886a },
+    { BTRFS_SEND_CMD_TRUNCATE, {
+        { ATTR_PATH, BTRFS_SEND_TLV_PATH, "", 0, 0 },
+        { ATTR_U64, BTRFS_SEND_TLV_SIZE, NULL, 0, 0 } }, 2, 16, 0x81225d22 },
+    { BTRFS_SEND_CMD_END, { { 0 } }, 0, 0, 0x9dc96c50 },
+};
+
+// what the receiver's parser does with a command read from the stream
+static void send_parse(struct recv_cmd *cmd, const uint8_t *buf, size_t len) {
+    memcpy(cmd->buf, buf, len);
+    cmd->len = BTRFS_GET_LE32(cmd->buf, btrfs_send_command, length);
+    cmd->cmd = BTRFS_GET_LE16(cmd->buf, btrfs_send_command, cmd);
+    cmd->csum = BTRFS_GET_LE32(cmd->buf, btrfs_send_command, csum);
+    memset(cmd->buf + __builtin_offsetof(btrfs_send_command, csum), 0, sizeof(uint32_t));
+}
+
+static void send_refresh_csum(uint8_t *buf, size_t len) {
+    memset(buf + __builtin_offsetof(btrfs_send_command, csum), 0, sizeof(uint32_t));
+    send_le32(buf + __builtin_offsetof(btrfs_send_command, csum), calculate_crc32c(0, buf, len));
+}
+
+static void test_send_framing(void) {
+    struct send_stream s = { 0 };
+    struct recv_cmd *cmd = malloc(sizeof(*cmd));
+    const struct send_case_attr *a;
+    struct timespec ts;
+    uint8_t buf[256], bad[256];
+    FILE *f = tmpfile();
+    ssize_t n;
+    uint64_t v;
+
+    s.meta = malloc(SEND_META_SIZE);
+    if(cmd == NULL || f == NULL || s.meta == NULL) {
+        EXPECT(0, "out of memory");
+        return;
+    }
+    s.fd = fileno(f);
+
+    for(size_t i = 0; i < sizeof(send_cases) / sizeof(send_cases[0]); ++i) {
+        send_begin(&s, send_cases[i].cmd);
+        for(int j = 0; j < send_cases[i].nattr; ++j) {
+            a = &send_cases[i].attr[j];
+            ts = (struct timespec){ .tv_sec = a->v, .tv_nsec = a->nsec };
+            if(a->kind == ATTR_PATH)
+                send_put_path(&s, a->type, a->str);
+            else if(a->kind == ATTR_U64)
+                send_put_u64(&s, a->type, a->v);
+            else if(a->kind == ATTR_TIME)
+                send_put_time(&s, a->type, &ts);
+            else
+                send_put_data(&s, a->type, (const uint8_t *)a->str, strlen(a->str));
+        }
+        EXPECT(send_end(&s) == 0 && send_flush(&s) == 0, "case %zu: %d", i, s.error);
+        n = pread(s.fd, buf, sizeof(buf), 0);
+        EXPECT(n == (ssize_t)(SEND_HEADER_SIZE + send_cases[i].len), "case %zu: %zd bytes", i, n);
+        if(n != (ssize_t)(SEND_HEADER_SIZE + send_cases[i].len))
+            continue;
+        EXPECT(BTRFS_GET_LE32(buf, btrfs_send_command, csum) == send_cases[i].csum, "case %zu: crc %08x", i,
+            BTRFS_GET_LE32(buf, btrfs_send_command, csum));
+
+        send_parse(cmd, buf, n);
+        EXPECT(cmd->cmd == send_cases[i].cmd && cmd->len == send_cases[i].len && recv_check(cmd) == 0,
+            "case %zu: does not parse back", i);
+        for(int j = 0; j < send_cases[i].nattr; ++j) {
+            a = &send_cases[i].attr[j];
+            if(a->kind == ATTR_PATH || a->kind == ATTR_DATA)
+                EXPECT(cmd->attr_len[a->type] == strlen(a->str) && memcmp(cmd->attr[a->type], a->str,
+                    strlen(a->str)) == 0, "case %zu: attribute %u", i, a->type);
+            else if(a->kind == ATTR_U64)
+                EXPECT(recv_u64(cmd, a->type, &v) == 0 && v == a->v, "case %zu: attribute %u", i, a->type);
+            else
+                EXPECT(recv_time(cmd, a->type, &ts) == 0 && (uint64_t)ts.tv_sec == a->v &&
+                    (uint32_t)ts.tv_nsec == a->nsec, "case %zu: attribute %u", i, a->type);
+        }
+
+        // damage the command: the receiver must refuse it, not read past it
+        if(send_cases[i].len > 0) {
+            memcpy(bad, buf, n);
+            bad[n - 1] ^= 1;
+            send_parse(cmd, bad, n);
+            EXPECT(recv_check(cmd) == EBADMSG, "case %zu: corrupt byte accepted", i);
+
+            memcpy(bad, buf, n);
+            send_le16(bad + SEND_HEADER_SIZE + __builtin_offsetof(btrfs_send_tlv, length), send_cases[i].len);
+            send_refresh_csum(bad, n);
+            send_parse(cmd, bad, n);
+            EXPECT(recv_check(cmd) == EBADMSG, "case %zu: attribute past the command accepted", i);
+
+            memcpy(bad, buf, n);
+            send_le32(bad + __builtin_offsetof(btrfs_send_command, length), SEND_TLV_SIZE - 1);
+            send_refresh_csum(bad, SEND_HEADER_SIZE + SEND_TLV_SIZE - 1);
+            send_parse(cmd, bad, SEND_HEADER_SIZE + SEND_TLV_SIZE - 1);
+            EXPECT(recv_check(cmd) == EBADMSG, "case %zu: partial attribute header accepted", i);
+        }
+        if(ftruncate(s.fd, 0) != 0 || lseek(s.fd, 0, SEEK_SET) != 0)
+            EXPECT(0, "truncating: %s", strerror(errno));
+    }
+
+    // nothing larger than a v1 receiver takes goes out
+    send_begin(&s, BTRFS_SEND_CMD_MKFILE);
+    send_put(&s, BTRFS_SEND_TLV_PATH, s.meta, BTRFS_SEND_BUF_SIZE - SEND_HEADER_SIZE - SEND_TLV_SIZE + 1);
+    EXPECT(send_end(&s) == ENAMETOOLONG, "oversized attribute: %d", s.error);
+    s.error = 0;
+    send_flush(&s);
+    send_begin(&s, BTRFS_SEND_CMD_WRITE);
+    send_put_data(&s, BTRFS_SEND_TLV_DATA, s.meta, BTRFS_SEND_BUF_SIZE);
+    EXPECT(send_end(&s) == EINVAL, "oversized data: %d", s.error);
+
+    fclose(f);
+    free(s.meta);
+    free(cmd);
+}
+
+#define LEAF_SIZE 4096
+
+static const struct {
+    struct btrfs_key key;
+    const char *data;
+} leaf_items[] = {
+    { { 256, 1, 0 }, "inode 256" },
+    { { 256, 12, 256 }, "ref" },
+    { { 256, 84, 100 }, "dir item" },
+    { { 257, 1, 0 }, "inode 257" },
+    { { 257, 108, 0 }, "extent at 0" },
+    { { 257, 108, 4096 }, "extent at 4096" },
+    { { 300, 132, 0 }, "" },
+};
+
+#define NITEMS (sizeof(leaf_items) / sizeof(leaf_items[0]))
+#define MISSING (-1)
+
+static const struct {
+    struct btrfs_key keys[5];
+    int count;
+    int error;                                  // of bt_many_prepare()
+    int item[5];                                // leaf_items index each key must find, or MISSING
+    uint32_t dest_len;
+} many_cases[] = {
+    { { { 256, 1, 0 }, { 256, 12, 256 }, { 256, 84, 100 }, { 257, 1, 0 }, { 257, 108, 0 } }, 5, 0,
+      { 0, 1, 2, 3, 4 }, 64 },
+    { { { 257, 108, 4096 }, { 300, 132, 0 } }, 2, 0, { 5, 6 }, 64 },
+    { { { 1, 1, 0 }, { 256, 12, 255 }, { 257, 108, 4096 }, { 300, 132, 1 }, { 999, 0, 0 } }, 5, 0,
+      { MISSING, MISSING, 5, MISSING, MISSING }, 64 },
+    { { { 256, 2, 0 }, { 256, 84, 99 }, { 256, 84, 101 }, { 257, 0, UINT64_MAX } }, 4, 0,
+      { MISSING, MISSING, MISSING, MISSING }, 64 },
+    { { { 257, 1, 0 }, { 257, 1, 0 } }, 2, 0, { 3, 3 }, 64 },       // the same key twice
+    { { { 256, 84, 100 }, { 257, 108, 4096 } }, 2, 0, { 2, 5 }, 4 }, // dest shorter than the items
+    { { { 0 } }, 0, 0, { 0 }, 64 },
+    { { { 257, 1, 0 }, { 256, 1, 0 } }, 2, EINVAL, { 0 }, 64 },
+    { { { 256, 12, 256 }, { 256, 1, 0 }, { 257, 1, 0 } }, 3, EINVAL, { 0 }, 64 },
+};
+
+// items from the front, their data packed from the back, as btrfs lays out a leaf
+static void leaf_build(uint8_t *leaf, size_t nitems) {
+    struct btrfs_tree_header h = { .num_items = htole32(nitems), .level = 0 };
+    struct btrfs_leaf_node item;
+    uint32_t end = LEAF_SIZE - sizeof(h), len;
+
+    memset(leaf, 0, LEAF_SIZE);
+    memcpy(leaf, &h, sizeof(h));
+    for(size_t i = 0; i < nitems; ++i) {
+        len = strlen(leaf_items[i].data);
+        end -= len;
+        item.key.obj_id = htole64(leaf_items[i].key.obj_id);
+        item.key.obj_type = leaf_items[i].key.obj_type;
+        item.key.offset = htole64(leaf_items[i].key.offset);
+        item.offset = htole32(end);
+        item.size = htole32(len);
+        memcpy((uint8_t *)btrfs_item_nr(leaf, i), &item, sizeof(item));
+        memcpy(leaf + sizeof(h) + end, leaf_items[i].data, len);
+    }
+}
+
+static void test_search_many(void) {
+    static uint8_t leaf[LEAF_SIZE];
+    char dest[5][64];
+    struct bt_many_key keys[5];
+    const char *want;
+    uint32_t len;
+    int error;
+
+    for(int empty = 0; empty <= 1; ++empty) {
+        leaf_build(leaf, empty ? 0 : NITEMS);
+        for(size_t i = 0; i < sizeof(many_cases) / sizeof(many_cases[0]); ++i) {
+            memset(dest, 0xa5, sizeof(dest));
+            for(int j = 0; j < many_cases[i].count; ++j) {
+                keys[j] = (struct bt_many_key){ .key = many_cases[i].keys[j], .dest = dest[j],
+                    .dest_len = many_cases[i].dest_len, .size = 12345, .error = -1 };
+            }
+            error = bt_many_prepare(keys, many_cases[i].count);
+            EXPECT(error == many_cases[i].error, "case %zu: %d", i, error);
+            if(error)
+                continue;
+            bt_many_leaf(leaf, keys, many_cases[i].count);
+            for(int j = 0; j < many_cases[i].count; ++j) {
+                if(empty || many_cases[i].item[j] == MISSING) {
+                    EXPECT(keys[j].error == ENOENT && keys[j].size == 0 && (uint8_t)dest[j][0] == 0xa5,
+                        "case %zu%s: key %d found", i, empty ? " (empty leaf)" : "", j);
+                    continue;
+                }
+                want = leaf_items[many_cases[i].item[j]].data;
+                len = strlen(want) < many_cases[i].dest_len ? strlen(want) : many_cases[i].dest_len;
+                EXPECT(keys[j].error == 0 && keys[j].size == strlen(want), "case %zu: key %d: %d, %u bytes", i, j,
+                    keys[j].error, keys[j].size);
+                EXPECT(memcmp(dest[j], want, len) == 0 && (uint8_t)dest[j][len] == 0xa5,
+                    "case %zu: key %d: wrong data", i, j);
+            }
+        }
+    }
+}
+
+int main(int argc __attribute__((unused)), char *argv[] __attribute__((unused))) {
+    test_uuid();
+    test_bitmap();
+    test_crc32c();
+    test_send_framing();
+    test_search_many();
+    if(failures) {
+        fprintf(stderr, "%d failures\n", failures);
+        return(1);
+    }
+    return(0);
 }
@@ -27,12 +27,15 @@ DAMAGE.
 #include <stddef.h>
 #include <stdbool.h>
 
+#ifdef __APPLE__
 #include <sys/disk.h>
 #include <sys/loadable_fs.h>
+#endif
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/wait.h>
 
 #include <errno.h>
 #include <stdio.h>
@@ -42,20 +45,78 @@ DAMAGE.
 #include <unistd.h>
 
 #include "btrfs_filesystem.h"
+#include "btrfs_super.h"
+#include "btrfs_probe.h"
+#include "btrfs_dump.h"
+#include "btrfs_scrub.h"
+#include "btrfs_send.h"
+#include "btrfs_receive.h"
+#include "btrfs_space.h"
+#include "btrfs_backref.h"
+#include "btrfs_fiemap.h"
+#include "btrfs_extract.h"
+#include "btrfs_diff.h"
+#include "btrfs_qgroup.h"
+
+#ifndef __APPLE__
+#define FSUC_PROBE 'p'
+#define FSUC_MOUNT 'm'
+#define FSUC_UNMOUNT 'u'
+#define DEVICE_REMOVABLE "removable"
+#define DEVICE_FIXED "fixed"
+#define DEVICE_READONLY "readonly"
+#define DEVICE_WRITABLE "writable"
+#endif
 
 #ifndef FSUC_GETUUID
 #define FSUC_GETUUID 'k'
 #endif
 
+// engine commands, these take any device path. sys/loadable_fs.h reserves
+// p P i r m u s k a d M n for the FSUC_ actions, stay clear of those.
+#define BTRFS_UC_BATCH_PROBE 'B'
+#define BTRFS_UC_INSPECT 'T'
+#define BTRFS_UC_SCRUB 'V'
+#define BTRFS_UC_SEND 'S'
+#define BTRFS_UC_RECEIVE 'R'
+#define BTRFS_UC_SPACE 'F'
+#define BTRFS_UC_LOGICAL 'l'
+#define BTRFS_UC_EXTENTS 'e'
+#define BTRFS_UC_EXTRACT 'x'
+#define BTRFS_UC_DIFF 'D'
+#define BTRFS_UC_QGROUP 'Q'
+
 static void usage(const char *progname) __attribute__((noreturn));
 static void usage(const char *progname)
 {
     fprintf(stderr, "usage: %s action_arg device_arg [mount_point_arg] [Flags]\n", progname);
+    fprintf(stderr, "       %s -%c device ...\n", progname, BTRFS_UC_BATCH_PROBE);
+    fprintf(stderr, "       %s -%c [-q] [-j threads] tree device ...\n", progname, BTRFS_UC_INSPECT);
+    fprintf(stderr, "       %s -%c [-j threads-per-device] device ...\n", progname, BTRFS_UC_SCRUB);
+    fprintf(stderr, "       %s -%c [-C] [-f file] [-n name] subvolume device ...\n", progname, BTRFS_UC_SEND);
+    fprintf(stderr, "       %s -%c [-s] [-f file] directory\n", progname, BTRFS_UC_RECEIVE);
+    fprintf(stderr, "       %s -%c [-q] device ...\n", progname, BTRFS_UC_SPACE);
+    fprintf(stderr, "       %s -%c [-f file] device ...\n", progname, BTRFS_UC_LOGICAL);
+    fprintf(stderr, "       %s -%c [-s] file ...\n", progname, BTRFS_UC_EXTENTS);
+    fprintf(stderr, "       %s -%c [-j threads] [-v subvolume ...] [-p path] directory device ...\n", progname, BTRFS_UC_EXTRACT);
+    fprintf(stderr, "       %s -%c [-q] [-g generation | -P | old-subvolume] subvolume device ...\n", progname, BTRFS_UC_DIFF);
+    fprintf(stderr, "       %s -%c [-w] [-j threads] device ...\n", progname, BTRFS_UC_QGROUP);
     fprintf(stderr, "action_arg:\n");
     fprintf(stderr, "       -%c (Get UUID Key)\n", FSUC_GETUUID);
     fprintf(stderr, "       -%c (Mount)\n", FSUC_MOUNT);
     fprintf(stderr, "       -%c (Probe)\n", FSUC_PROBE);
     fprintf(stderr, "       -%c (Unmount)\n", FSUC_UNMOUNT);
+    fprintf(stderr, "       -%c (Probe every device given, grouped by filesystem)\n", BTRFS_UC_BATCH_PROBE);
+    fprintf(stderr, "       -%c (Dump a tree, or with -q only time reading it)\n", BTRFS_UC_INSPECT);
+    fprintf(stderr, "       -%c (Verify every copy of all metadata and data checksums, read-only)\n", BTRFS_UC_SCRUB);
+    fprintf(stderr, "       -%c (Send a subvolume as a btrfs-stream, shared extents as clones)\n", BTRFS_UC_SEND);
+    fprintf(stderr, "       -%c (Apply a btrfs-stream to a directory on any filesystem)\n", BTRFS_UC_RECEIVE);
+    fprintf(stderr, "       -%c (Free space and fragmentation per block group from the free space tree)\n", BTRFS_UC_SPACE);
+    fprintf(stderr, "       -%c (Map logical addresses to the files and trees using them)\n", BTRFS_UC_LOGICAL);
+    fprintf(stderr, "       -%c (List a file's extents with device addresses and sharing, on a mounted btrfs)\n", BTRFS_UC_EXTENTS);
+    fprintf(stderr, "       -%c (Copy a subvolume or subtree out to a directory on any filesystem)\n", BTRFS_UC_EXTRACT);
+    fprintf(stderr, "       -%c (List inodes and extents changed between two snapshots, or since a generation)\n", BTRFS_UC_DIFF);
+    fprintf(stderr, "       -%c (Disk usage per subvolume from the quota tree, or an inode walk without quotas)\n", BTRFS_UC_QGROUP);
     fprintf(stderr, "device_arg:\n");
     fprintf(stderr, "       device we are acting upon (for example, 'disk0s2')\n");
     fprintf(stderr, "mount_point_arg:\n");
@@ -73,32 +134,29 @@ static void usage(const char *progname)
     exit(FSUR_INVAL);
 }
 
-static int get_volume_superblock_record(char *rdev, superblock *sbrec) {
+static int get_volume_superblock_record(char *rdev, struct btrfs_superblock *sbrec) {
 
-	superblock *sb;
-	int f, opresult = FSUR_UNRECOGNIZED;
-	void *buf;
+	int f, opresult;
 
 	f = open(rdev, O_RDONLY);
 	if (f == -1) return FSUR_IO_FAIL;
 
-	buf = malloc(BTRFS_SUPERBLOCK_SIZE);
-	if(!buf) {opresult = -ENOMEM;}
-	else {
-		// Read superblock record and check that the magic works
-		if(pread(f, buf, BTRFS_SUPERBLOCK_SIZE, 0x10000) != BTRFS_SUPERBLOCK_SIZE) {opresult = FSUR_IO_FAIL;}
-		else {
-			sb = (superblock *)buf;
-			if(sb->magic == BTRFS_MAGIC) {
-				/// @todo: calculate crc32
-				memcpy(sbrec, sb, sizeof(*sb));
-				opresult = FSUR_RECOGNIZED;
-			}
-			else {opresult = FSUR_UNRECOGNIZED;}
-		}
+	// Read superblock record and check the magic and checksum; a checksum type
+	// we cannot verify is still a btrfs volume
+	switch(btrfs_super_read(f, superblock_addrs[0], sbrec)) {
+	case 0:
+	case ENOTSUP:
+		opresult = FSUR_RECOGNIZED;
+		break;
+	case EINVAL:
+	case EBADMSG:
+		opresult = FSUR_UNRECOGNIZED;
+		break;
+	default:
+		opresult = FSUR_IO_FAIL;
+		break;
 	}
 
-	if(buf) free(buf);
 	(void) close(f);
 	return opresult;
 }
@@ -118,26 +176,18 @@ static int get_volume_superblock_record(char *rdev, superblock *sbrec) {
  */
 
 static int do_getuuid(char *rdev) {
-	superblock *sb;
+	struct btrfs_superblock *sb;
 	int err = FSUR_INVAL;
 
 	sb = malloc(BTRFS_SUPERBLOCK_SIZE);
 	if(sb) {
 		err = get_volume_superblock_record(rdev, sb);
 		if(err == FSUR_RECOGNIZED) {
-			char uuid[37];
-
-			/// @todo: clean this up
-			if(snprintf(uuid, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-					 sb->uuid.uuid[0], sb->uuid.uuid[1], sb->uuid.uuid[2], sb->uuid.uuid[3],
-					 sb->uuid.uuid[4], sb->uuid.uuid[5], sb->uuid.uuid[6], sb->uuid.uuid[7],
-					 sb->uuid.uuid[8], sb->uuid.uuid[9],  sb->uuid.uuid[10], sb->uuid.uuid[11],
-					 sb->uuid.uuid[12], sb->uuid.uuid[13], sb->uuid.uuid[14], sb->uuid.uuid[15]) != 36)
-				err = FSUR_IO_FAIL;
-			else {
-				(void)write(STDOUT_FILENO, uuid, 36);
-				err = FSUR_IO_SUCCESS;
-			}
+			char uuid[BTRFS_UUID_STRLEN];
+
+			btrfs_uuid_format(&sb->uuid, uuid);
+			(void)write(STDOUT_FILENO, uuid, 36);
+			err = FSUR_IO_SUCCESS;
 		}
 		else fprintf(stderr, "Failure: %d\n", err);
 		free(sb);
@@ -161,7 +211,7 @@ static int do_probe(char *rdev, const bool removable __attribute__((unused)),
 {
 //	UUID="9d5bce63-3a73-4fb3-b8bd-9d00a6d9c30a" UUID_SUB="9cb965da-c2df-44ca-9917-47b96cc786a2" TYPE="btrfs" PARTUUID="ff67145c-01"
 	int err = FSUR_IO_FAIL;
-	superblock *sb;
+	struct btrfs_superblock *sb;
 	
 	sb = malloc(BTRFS_SUPERBLOCK_SIZE);
 	if(sb) {
@@ -180,7 +230,7 @@ static int do_probe(char *rdev, const bool removable __attribute__((unused)),
 static int do_exec(const char *progname, char *const args[])
 {
 	pid_t pid;
-	union wait status;
+	int status;
 	int err;
 
 	pid = fork();
@@ -199,7 +249,7 @@ static int do_exec(const char *progname, char *const args[])
 		exit(err);
 	}
 	/* In parent process, wait for exernal command to finish. */
-	if (wait4(pid, (int*)&status, 0, NULL) != pid) {
+	if (wait4(pid, &status, 0, NULL) != pid) {
 		fprintf(stderr, "%s: BUG executing %s command.\n", progname,
 				args[0]);
 		return FSUR_INVAL;
@@ -225,12 +275,14 @@ static int do_mount(const char *progname, char *dev, char *mp,
 		const bool removable __attribute__((unused)),
 		const bool readonly, const bool nosuid, const bool nodev)
 {
+#ifdef __APPLE__
 	/// @todo: currently on /S/L/E, unused, change for debug later
 	char *const kextargs[] = { "/sbin/kextload",
 			"/Users/yehia/macos_btrfs/macos-btrfs.kext", NULL };
+	struct vfsconf vfc;
+#endif
 	char *mountargs[] = { "/sbin/mount", "-w", "-o",
 			"suid", "-o", "dev", "-t", "btrfs", dev, mp, NULL };
-	struct vfsconf vfc;
 
 	if (!mp || !strlen(mp))
 		return FSUR_INVAL;
@@ -240,12 +292,14 @@ static int do_mount(const char *progname, char *dev, char *mp,
 		mountargs[3] = "nosuid";
 	if (nodev)
 		mountargs[5] = "nodev";
+#ifdef __APPLE__
 	/*
 	 * If the kext is not loaded, load it now.  Ignore any errors as the
 	 * mount will fail appropriately if the kext is not loaded.
 	 */
 	if (getvfsbyname("btrfs", &vfc))
 		(void)do_exec(progname, kextargs);
+#endif
 	return do_exec(progname, mountargs);
 }
 
@@ -280,6 +334,28 @@ int main(int argc, char **argv) {
 	if (argc < 2 || argv[0][0] != '-')
 		usage(progname);
 	opt = argv[0][1];
+	if (opt == BTRFS_UC_BATCH_PROBE)
+		return btrfs_probe_batch(argv + 1, argc - 1);
+	if (opt == BTRFS_UC_INSPECT)
+		return btrfs_dump_main(argc, argv);
+	if (opt == BTRFS_UC_SCRUB)
+		return btrfs_scrub_main(argc, argv);
+	if (opt == BTRFS_UC_SEND)
+		return btrfs_send_main(argc, argv);
+	if (opt == BTRFS_UC_RECEIVE)
+		return btrfs_receive_main(argc, argv);
+	if (opt == BTRFS_UC_SPACE)
+		return btrfs_space_main(argc, argv);
+	if (opt == BTRFS_UC_LOGICAL)
+		return btrfs_logical_main(argc, argv);
+	if (opt == BTRFS_UC_EXTENTS)
+		return btrfs_fiemap_main(argc, argv);
+	if (opt == BTRFS_UC_EXTRACT)
+		return btrfs_extract_main(argc, argv);
+	if (opt == BTRFS_UC_DIFF)
+		return btrfs_diff_main(argc, argv);
+	if (opt == BTRFS_UC_QGROUP)
+		return btrfs_qgroup_main(argc, argv);
 	dev = argv[1];
 	argc -= 2;
 	argv += 2;
@@ -340,7 +416,8 @@ int main(int argc, char **argv) {
 				exit(FSUR_INVAL);
 		}
 		/* fs_probe() bellow will handle fdesc file path */
-		strlcpy(rawdev, dev, MAXPATHLEN);
+		if (snprintf(rawdev, sizeof(rawdev), "%s", dev) >= (int)sizeof(rawdev))
+			exit(FSUR_INVAL);
 	} else {
 		exit(FSUR_INVAL);
 	}
@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "btrfs_arena.h"
+
+#define BTRFS_ARENA_SLAB_SIZE (64 * 1024)
+
+struct btrfs_arena_slab {
+	struct btrfs_arena_slab *next;
+	_Alignas(16) uint8_t data[];
+};
+
+void btrfs_arena_init(struct btrfs_arena *arena) {
+	pthread_mutex_init(&arena->lock, NULL);
+	arena->slabs = NULL;
+	arena->used = 0;
+	arena->size = 0;
+}
+
+void *btrfs_arena_alloc(struct btrfs_arena *arena, size_t size) {
+	struct btrfs_arena_slab *slab;
+	size_t slab_size;
+	void *ptr;
+
+	size = (size + 15) & ~(size_t)15;
+	pthread_mutex_lock(&arena->lock);
+	if(arena->slabs == NULL || arena->size - arena->used < size) {
+		slab_size = size > BTRFS_ARENA_SLAB_SIZE - sizeof(*slab) ? size : BTRFS_ARENA_SLAB_SIZE - sizeof(*slab);
+		slab = calloc(1, sizeof(*slab) + slab_size);
+		if(slab == NULL) {
+			pthread_mutex_unlock(&arena->lock);
+			return(NULL);
+		}
+		if(slab_size > BTRFS_ARENA_SLAB_SIZE - sizeof(*slab) && arena->slabs != NULL) {
+			// oversized, keep filling the current slab
+			slab->next = arena->slabs->next;
+			arena->slabs->next = slab;
+			pthread_mutex_unlock(&arena->lock);
+			return(slab->data);
+		}
+		slab->next = arena->slabs;
+		arena->slabs = slab;
+		arena->used = 0;
+		arena->size = slab_size;
+	}
+	ptr = arena->slabs->data + arena->used;
+	arena->used += size;
+	pthread_mutex_unlock(&arena->lock);
+	return(ptr);
+}
+
+void btrfs_arena_destroy(struct btrfs_arena *arena) {
+	struct btrfs_arena_slab *slab;
+
+	while((slab = arena->slabs) != NULL) {
+		arena->slabs = slab->next;
+		free(slab);
+	}
+	pthread_mutex_destroy(&arena->lock);
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_ARENA_H
+#define _BTRFS_ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Userspace counterpart of the kernel's per-mount arena (kernel/freebsd/btrfs_alloc.h).
+// Chunk entries, tree blocks kept for the whole run and similar objects are carved
+// out of large slabs and released together by btrfs_arena_destroy().
+
+struct btrfs_arena_slab;
+
+struct btrfs_arena {
+    pthread_mutex_t lock;
+    struct btrfs_arena_slab *slabs;             // current slab first
+    size_t used;                                // bytes handed out from the current slab
+    size_t size;                                // usable bytes in the current slab
+};
+
+void btrfs_arena_init(struct btrfs_arena *arena);
+// zeroed, 16 byte aligned, NULL when out of memory
+void *btrfs_arena_alloc(struct btrfs_arena *arena, size_t size);
+void btrfs_arena_destroy(struct btrfs_arena *arena);
+
+#endif // _BTRFS_ARENA_H
@@ -0,0 +1,598 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_volume.h"
+#include "btrfs_fs.h"
+#include "btrfs_backref.h"
+
+#define BACKREF_FILE_HEADER_SIZE __builtin_offsetof(btrfs_extent_data, data)
+// simple quota owner, an inline item that is not a reference
+#define BACKREF_EXTENT_OWNER_REF 0xAC
+#define BACKREF_PATH_MAX 4096
+
+struct backref {
+	uint8_t type;                           // TYPE_*_REF
+	uint64_t root;                          // tree block and data refs
+	uint64_t parent;                        // shared refs
+	uint64_t ino, offset;                   // data refs
+	uint32_t count;
+};
+
+struct backref_root {
+	uint64_t id;
+	int error;
+	struct btrfs_subvol sv;
+};
+
+struct backref_name {
+	uint64_t root, ino;
+	char *path;                             // NULL when it could not be found
+	bool used;
+};
+
+struct backref_ctx {
+	struct btrfs_volume *vol;
+	int (*fn)(void *arg, const struct btrfs_logical_ref *ref);
+	void *arg;
+
+	// extent tree cursor, only moves forward
+	struct btrfs_path path;
+	bool positioned;
+
+	// extent under the cursor and its decoded references
+	uint64_t ext_start, ext_len;
+	bool ext_meta;
+	uint8_t ext_level;
+	struct backref *refs;
+	size_t nrefs, refs_cap;
+
+	struct backref_root *roots;
+	size_t nroots;
+	struct backref_name *names;             // (root, inode) -> path, open addressing
+	size_t nnames, names_cap;
+	uint8_t *node;                          // parent blocks of shared refs
+	char pathbuf[BACKREF_PATH_MAX];
+};
+
+static struct btrfs_subvol *backref_subvol(struct backref_ctx *ctx, uint64_t id) {
+	struct backref_root *roots;
+
+	for(size_t i = 0; i < ctx->nroots; ++i) {
+		if(ctx->roots[i].id == id)
+			return(ctx->roots[i].error ? NULL : &ctx->roots[i].sv);
+	}
+	roots = realloc(ctx->roots, (ctx->nroots + 1) * sizeof(*roots));
+	if(roots == NULL)
+		return(NULL);
+	ctx->roots = roots;
+	roots[ctx->nroots].id = id;
+	roots[ctx->nroots].error = btrfs_subvol_open(ctx->vol, id, &roots[ctx->nroots].sv);
+	return(roots[ctx->nroots++].error ? NULL : &roots[ctx->nroots - 1].sv);
+}
+
+static size_t backref_name_hash(uint64_t root, uint64_t ino) {
+	return((size_t)((root * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL)));
+}
+
+// inodes usually repeat, every bad sector of a file asks for the same path
+static const char *backref_path(struct backref_ctx *ctx, uint64_t root, uint64_t ino) {
+	struct btrfs_subvol *sv;
+	struct backref_name *names, *n;
+	size_t cap, i;
+
+	if(ctx->nnames * 2 >= ctx->names_cap) {
+		cap = ctx->names_cap ? ctx->names_cap * 2 : 256;
+		names = calloc(cap, sizeof(*names));
+		if(names == NULL)
+			return(NULL);
+		for(size_t j = 0; j < ctx->names_cap; ++j) {
+			if(!ctx->names[j].used)
+				continue;
+			for(i = backref_name_hash(ctx->names[j].root, ctx->names[j].ino) & (cap - 1); names[i].used;
+			    i = (i + 1) & (cap - 1))
+				;
+			names[i] = ctx->names[j];
+		}
+		free(ctx->names);
+		ctx->names = names;
+		ctx->names_cap = cap;
+	}
+	for(i = backref_name_hash(root, ino) & (ctx->names_cap - 1); ctx->names[i].used; i = (i + 1) & (ctx->names_cap - 1)) {
+		if(ctx->names[i].root == root && ctx->names[i].ino == ino)
+			return(ctx->names[i].path);
+	}
+	n = &ctx->names[i];
+	n->used = true;
+	n->root = root;
+	n->ino = ino;
+	sv = backref_subvol(ctx, root);
+	if(sv != NULL && btrfs_inode_path(sv, ino, ctx->pathbuf, sizeof(ctx->pathbuf)) == 0)
+		n->path = strdup(ctx->pathbuf);
+	ctx->nnames++;
+	return(n->path);
+}
+
+/*
+ * Positioning. The cursor is left on the last item whose key is <= (logical,
+ * 0xff, ~0) and then stepped back to the extent item before it. Addresses come
+ * in ascending order, so while the next one still sorts inside the leaf the
+ * cursor holds, it is found there without another search from the root.
+ */
+static int backref_seek(struct backref_ctx *ctx, uint64_t logical) {
+	struct btrfs_key key = { logical, 0xff, UINT64_MAX };
+	const uint8_t *leaf = ctx->path.nodes[0];
+	uint32_t n = leaf != NULL ? btrfs_header_nritems(leaf) : 0, lo, hi, mid;
+	uint8_t type;
+	int error;
+
+	if(ctx->positioned && n > 0 && btrfs_comp_disk_key(btrfs_item_key(leaf, 0), &key) <= 0 &&
+	    btrfs_comp_disk_key(btrfs_item_key(leaf, n - 1), &key) > 0) {
+		lo = 0;
+		hi = n;
+		while(lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if(btrfs_comp_disk_key(btrfs_item_key(leaf, mid), &key) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		ctx->path.slots[0] = lo - 1;
+	} else {
+		btrfs_path_release(&ctx->path);
+		ctx->positioned = false;
+		error = btrfs_search(ctx->vol, ctx->vol->extent_root.bytenr, ctx->vol->extent_root.level, &key,
+		    &ctx->path);
+		if(error && error != ENOENT)
+			return(error);
+		ctx->positioned = true;
+		error = btrfs_prev_item(ctx->vol, &ctx->path);
+		if(error)
+			return(error);
+	}
+	// past the keyed references of the extent and any block group item
+	for(;;) {
+		type = btrfs_disk_key_type(btrfs_path_key(&ctx->path));
+		if(type == TYPE_EXTENT_ITEM || type == TYPE_METADATA_ITEM)
+			return(0);
+		error = btrfs_prev_item(ctx->vol, &ctx->path);
+		if(error)
+			return(error);
+	}
+}
+
+static int backref_add(struct backref_ctx *ctx, const struct backref *ref) {
+	struct backref *refs;
+
+	if(ctx->nrefs == ctx->refs_cap) {
+		ctx->refs_cap = ctx->refs_cap ? ctx->refs_cap * 2 : 16;
+		refs = realloc(ctx->refs, ctx->refs_cap * sizeof(*refs));
+		if(refs == NULL)
+			return(ENOMEM);
+		ctx->refs = refs;
+	}
+	ctx->refs[ctx->nrefs++] = *ref;
+	return(0);
+}
+
+static int backref_data_ref(const uint8_t *p, struct backref *ref) {
+	ref->root = BTRFS_GET_LE64(p, EXTENT_DATA_REF, root);
+	ref->ino = BTRFS_GET_LE64(p, EXTENT_DATA_REF, objid);
+	ref->offset = BTRFS_GET_LE64(p, EXTENT_DATA_REF, offset);
+	ref->count = BTRFS_GET_LE32(p, EXTENT_DATA_REF, count);
+	return(0);
+}
+
+// the extent item under the cursor: its inline references, then the keyed ones after it
+static int backref_collect(struct backref_ctx *ctx) {
+	const uint8_t *k = btrfs_path_key(&ctx->path), *p = btrfs_path_data(&ctx->path), *end;
+	struct backref ref;
+	uint64_t flags;
+	int error = 0;
+
+	ctx->nrefs = 0;
+	ctx->ext_start = btrfs_disk_key_objectid(k);
+	end = p + btrfs_path_size(&ctx->path);
+	if(btrfs_path_size(&ctx->path) < sizeof(EXTENT_ITEM))
+		return(EIO);
+	flags = BTRFS_GET_LE64(p, EXTENT_ITEM, flags);
+	ctx->ext_meta = (flags & EXTENT_ITEM_TREE_BLOCK) != 0;
+	p += sizeof(EXTENT_ITEM);
+	if(btrfs_disk_key_type(k) == TYPE_METADATA_ITEM) {
+		ctx->ext_len = ctx->vol->node_size;
+		ctx->ext_level = btrfs_disk_key_offset(k);
+	} else {
+		ctx->ext_len = btrfs_disk_key_offset(k);
+		if(ctx->ext_meta) {
+			if(end - p < (ptrdiff_t)sizeof(EXTENT_ITEM2))
+				return(EIO);
+			ctx->ext_level = BTRFS_GET_U8(p, EXTENT_ITEM2, level);
+			p += sizeof(EXTENT_ITEM2);
+		}
+	}
+
+	while(error == 0 && p < end) {
+		memset(&ref, 0, sizeof(ref));
+		ref.type = *p++;
+		switch(ref.type) {
+		case TYPE_TREE_BLOCK_REF:
+		case TYPE_SHARED_BLOCK_REF:
+		case BACKREF_EXTENT_OWNER_REF:
+			if(end - p < 8)
+				return(EIO);
+			ref.root = ref.parent = btrfs_get_le64(p);
+			p += 8;
+			break;
+		case TYPE_EXTENT_DATA_REF:
+			if(end - p < (ptrdiff_t)sizeof(EXTENT_DATA_REF))
+				return(EIO);
+			backref_data_ref(p, &ref);
+			p += sizeof(EXTENT_DATA_REF);
+			break;
+		case TYPE_SHARED_DATA_REF:
+			if(end - p < (ptrdiff_t)sizeof(SHARED_DATA_REF))
+				return(EIO);
+			ref.parent = BTRFS_GET_LE64(p, SHARED_DATA_REF, offset);
+			ref.count = BTRFS_GET_LE32(p, SHARED_DATA_REF, count);
+			p += sizeof(SHARED_DATA_REF);
+			break;
+		default:
+			return(EIO);
+		}
+		if(ref.type != BACKREF_EXTENT_OWNER_REF)
+			error = backref_add(ctx, &ref);
+	}
+
+	// keyed references sort right after their extent item
+	while(error == 0 && (error = btrfs_next_item(ctx->vol, &ctx->path)) == 0) {
+		k = btrfs_path_key(&ctx->path);
+		p = btrfs_path_data(&ctx->path);
+		if(btrfs_disk_key_objectid(k) != ctx->ext_start || btrfs_disk_key_type(k) > TYPE_SHARED_DATA_REF)
+			break;
+		memset(&ref, 0, sizeof(ref));
+		ref.type = btrfs_disk_key_type(k);
+		switch(ref.type) {
+		case TYPE_TREE_BLOCK_REF:
+		case TYPE_SHARED_BLOCK_REF:
+			ref.root = ref.parent = btrfs_disk_key_offset(k);
+			break;
+		case TYPE_EXTENT_DATA_REF:
+			if(btrfs_path_size(&ctx->path) < sizeof(EXTENT_DATA_REF))
+				return(EIO);
+			backref_data_ref(p, &ref);
+			break;
+		case TYPE_SHARED_DATA_REF:
+			if(btrfs_path_size(&ctx->path) < sizeof(uint32_t))
+				return(EIO);
+			ref.parent = btrfs_disk_key_offset(k);
+			ref.count = btrfs_get_le32(p);
+			break;
+		default:
+			continue;
+		}
+		error = backref_add(ctx, &ref);
+	}
+	return(error == ENOENT ? 0 : error);
+}
+
+/*
+ * A file extent item that points at the current extent. Only the part of the
+ * extent it references is checked against `logical`; compressed extents are
+ * decoded as a whole, so any address in one affects every byte it covers.
+ */
+static int backref_file_extent(struct backref_ctx *ctx, struct btrfs_logical_ref *out, const uint8_t *key,
+    const uint8_t *data, uint32_t size, bool *match, bool *covers) {
+	const uint8_t *d2 = data + BACKREF_FILE_HEADER_SIZE;
+	uint64_t extent_offset, num_bytes, lo, sector = ctx->vol->sector_size;
+
+	*match = *covers = false;
+	if(btrfs_disk_key_type(key) != TYPE_EXTENT_DATA || size < BACKREF_FILE_HEADER_SIZE + sizeof(btrfs_extent_data2) ||
+	    BTRFS_GET_U8(data, btrfs_extent_data, type) == EXTENT_TYPE_INLINE ||
+	    BTRFS_GET_LE64(d2, btrfs_extent_data2, address) != ctx->ext_start)
+		return(0);
+	*match = true;
+	extent_offset = BTRFS_GET_LE64(d2, btrfs_extent_data2, offset);
+	num_bytes = BTRFS_GET_LE64(d2, btrfs_extent_data2, num_bytes);
+	out->inode = btrfs_disk_key_objectid(key);
+	if(BTRFS_GET_U8(data, btrfs_extent_data, compression) != 0) {
+		out->offset = btrfs_disk_key_offset(key);
+		out->length = num_bytes;
+	} else {
+		lo = ctx->ext_start + extent_offset;
+		if(out->logical < lo || out->logical - lo >= num_bytes)
+			return(0);
+		out->offset = btrfs_disk_key_offset(key) + (out->logical - lo);
+		out->length = sector - out->logical % sector;
+		if(out->length > num_bytes - (out->logical - lo))
+			out->length = num_bytes - (out->logical - lo);
+	}
+	*covers = true;
+	return(0);
+}
+
+static int backref_emit_file(struct backref_ctx *ctx, struct btrfs_logical_ref *out, uint64_t root) {
+	out->root = root;
+	out->path = backref_path(ctx, root, out->inode);
+	return(ctx->fn(ctx->arg, out));
+}
+
+static int backref_data(struct backref_ctx *ctx, uint64_t logical, const struct backref *ref, size_t *emitted) {
+	struct btrfs_logical_ref out = { .logical = logical, .extent = ctx->ext_start };
+	struct btrfs_key key = { ref->ino, TYPE_EXTENT_DATA, ref->offset };
+	struct btrfs_subvol *sv;
+	struct btrfs_path path;
+	const uint8_t *k;
+	uint32_t found = 0;
+	bool match, covers;
+	int error;
+
+	sv = backref_subvol(ctx, ref->root);
+	if(sv == NULL) {
+		// a deleted subvolume not cleaned up yet, still name what we know
+		out.root = ref->root;
+		out.inode = ref->ino;
+		out.offset = ref->offset;
+		++*emitted;
+		return(ctx->fn(ctx->arg, &out));
+	}
+	// the ref's offset is the file offset of the extent's start, no item before it can point here
+	for(error = btrfs_search(ctx->vol, sv->root.bytenr, sv->root.level, &key, &path); error == 0 && found < ref->count;
+	    error = btrfs_next_item(ctx->vol, &path)) {
+		k = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(k) != ref->ino || btrfs_disk_key_type(k) != TYPE_EXTENT_DATA)
+			break;
+		backref_file_extent(ctx, &out, k, btrfs_path_data(&path), btrfs_path_size(&path), &match, &covers);
+		found += match;
+		if(covers) {
+			++*emitted;
+			error = backref_emit_file(ctx, &out, ref->root);
+			if(error)
+				break;
+		}
+	}
+	btrfs_path_release(&path);
+	return(error == ENOENT ? 0 : error);
+}
+
+static int backref_shared(struct backref_ctx *ctx, uint64_t logical, const struct backref *ref, size_t *emitted) {
+	struct btrfs_logical_ref out = { .logical = logical, .extent = ctx->ext_start, .shared = true };
+	uint32_t n;
+	bool match, covers;
+	int error;
+
+	error = btrfs_read_node(ctx->vol, ref->parent, ref->type == TYPE_SHARED_DATA_REF ? 0 : -1, 0, ctx->node);
+	if(error)
+		return(error);
+	out.root = btrfs_header_owner(ctx->node);
+	if(ref->type == TYPE_SHARED_BLOCK_REF) {
+		out.metadata = true;
+		out.offset = ctx->ext_level;
+		out.length = ctx->vol->node_size;
+		++*emitted;
+		return(ctx->fn(ctx->arg, &out));
+	}
+	n = btrfs_header_nritems(ctx->node);
+	for(uint32_t slot = 0; slot < n; ++slot) {
+		backref_file_extent(ctx, &out, btrfs_item_key(ctx->node, slot), btrfs_item_data(ctx->node, slot),
+		    btrfs_item_size(ctx->node, slot), &match, &covers);
+		if(covers) {
+			++*emitted;
+			error = backref_emit_file(ctx, &out, out.root);
+			if(error)
+				return(error);
+		}
+	}
+	return(0);
+}
+
+static int backref_resolve_one(struct backref_ctx *ctx, uint64_t logical) {
+	struct btrfs_logical_ref out = { .logical = logical };
+	size_t emitted = 0;
+	int error;
+
+	// the extent already decoded still holds it
+	if(!(ctx->nrefs != 0 && logical >= ctx->ext_start && logical - ctx->ext_start < ctx->ext_len)) {
+		ctx->nrefs = 0;
+		ctx->ext_len = 0;
+		error = backref_seek(ctx, logical);
+		if(error == 0) {
+			const uint8_t *k = btrfs_path_key(&ctx->path);
+			uint64_t start = btrfs_disk_key_objectid(k);
+			uint64_t len = btrfs_disk_key_type(k) == TYPE_METADATA_ITEM ? ctx->vol->node_size :
+			    btrfs_disk_key_offset(k);
+
+			if(logical - start < len)
+				error = backref_collect(ctx);
+			else
+				error = ENOENT;
+		}
+		if(error == ENOENT)
+			return(ctx->fn(ctx->arg, &out));
+		if(error) {
+			ctx->positioned = false;
+			return(error);
+		}
+	}
+
+	out.extent = ctx->ext_start;
+	for(size_t i = 0; i < ctx->nrefs; ++i) {
+		const struct backref *ref = &ctx->refs[i];
+
+		switch(ref->type) {
+		case TYPE_TREE_BLOCK_REF:
+			out.root = ref->root;
+			out.metadata = true;
+			out.offset = ctx->ext_level;
+			out.length = ctx->vol->node_size;
+			++emitted;
+			error = ctx->fn(ctx->arg, &out);
+			break;
+		case TYPE_EXTENT_DATA_REF:
+			error = backref_data(ctx, logical, ref, &emitted);
+			break;
+		default:
+			error = backref_shared(ctx, logical, ref, &emitted);
+			break;
+		}
+		if(error)
+			return(error);
+	}
+	// allocated, but no file uses this part of the extent any more
+	if(emitted == 0) {
+		out.root = 0;
+		return(ctx->fn(ctx->arg, &out));
+	}
+	return(0);
+}
+
+static int backref_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+int btrfs_logical_resolve(struct btrfs_volume *vol, const uint64_t *logicals, size_t count,
+    int (*fn)(void *arg, const struct btrfs_logical_ref *ref), void *arg) {
+	struct backref_ctx ctx = { .vol = vol, .fn = fn, .arg = arg };
+	uint64_t *sorted;
+	int error = 0;
+
+	if(vol->extent_root.bytenr == 0)
+		return(ENOENT);
+	sorted = malloc(count * sizeof(*sorted) + 1);
+	ctx.node = malloc(vol->node_size);
+	if(sorted == NULL || ctx.node == NULL) {
+		free(sorted);
+		free(ctx.node);
+		return(ENOMEM);
+	}
+	memcpy(sorted, logicals, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), backref_cmp);
+	for(size_t i = 0; error == 0 && i < count; ++i) {
+		if(i == 0 || sorted[i] != sorted[i - 1])
+			error = backref_resolve_one(&ctx, sorted[i]);
+	}
+
+	btrfs_path_release(&ctx.path);
+	for(size_t i = 0; i < ctx.names_cap; ++i)
+		free(ctx.names[i].path);
+	free(ctx.names);
+	free(ctx.roots);
+	free(ctx.refs);
+	free(ctx.node);
+	free(sorted);
+	return(error);
+}
+
+void btrfs_logical_ref_print(const struct btrfs_logical_ref *ref) {
+	if(ref->extent == 0)
+		printf("%" PRIu64 ": not allocated\n", ref->logical);
+	else if(ref->root == 0)
+		printf("%" PRIu64 ": extent %" PRIu64 ", not referenced by any file\n", ref->logical, ref->extent);
+	else if(ref->metadata)
+		printf("%" PRIu64 ": tree %" PRIu64 " level %" PRIu64 " block %" PRIu64 "%s\n", ref->logical, ref->root,
+		    ref->offset, ref->extent, ref->shared ? " (shared)" : "");
+	else
+		printf("%" PRIu64 ": root %" PRIu64 " inode %" PRIu64 " offset %" PRIu64 " length %" PRIu64 " path %s%s\n",
+		    ref->logical, ref->root, ref->inode, ref->offset, ref->length, ref->path ? ref->path : "?",
+		    ref->shared ? " (shared)" : "");
+}
+
+static int backref_print(void *arg, const struct btrfs_logical_ref *ref) {
+	(void)arg;
+	btrfs_logical_ref_print(ref);
+	return(0);
+}
+
+int btrfs_logical_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	const char *file = NULL;
+	uint64_t *logicals = NULL, *grown;
+	size_t count = 0, cap = 0;
+	char line[128], *end;
+	FILE *in = stdin;
+	int ch, error = 0;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "f:")) != -1) {
+		switch(ch) {
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: btrfs.util -l [-f file] device ...\n");
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1) {
+		fprintf(stderr, "usage: btrfs.util -l [-f file] device ...\n");
+		return(FSUR_INVAL);
+	}
+	if(file != NULL && (in = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return(FSUR_IO_FAIL);
+	}
+	while(error == 0 && fgets(line, sizeof(line), in) != NULL) {
+		if(line[strspn(line, " \t\n")] == '\0')
+			continue;
+		if(count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			grown = realloc(logicals, cap * sizeof(*logicals));
+			if(grown == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			logicals = grown;
+		}
+		errno = 0;
+		logicals[count++] = strtoull(line, &end, 0);
+		if(errno != 0 || end == line || end[strspn(end, " \t\n")] != '\0') {
+			fprintf(stderr, "not a logical address: %s", line);
+			error = EINVAL;
+		}
+	}
+	if(file != NULL)
+		fclose(in);
+	if(error == 0 && btrfs_volume_open(&vol, argv, argc) == 0) {
+		error = btrfs_logical_resolve(&vol, logicals, count, backref_print, NULL);
+		if(error)
+			fprintf(stderr, "resolving addresses: %s\n", strerror(error));
+		btrfs_volume_close(&vol);
+	} else if(error == 0)
+		error = EIO;
+	free(logicals);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_BACKREF_H
+#define _BTRFS_BACKREF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "btrfs_volume.h"
+
+/*
+ * Logical address -> owners, through the back references in the extent tree.
+ * A data extent names the (root, inode, offset) of every file extent item that
+ * points at it, or the leaf holding them once the subvolume has been
+ * snapshotted; a tree block names the tree it belongs to.
+ */
+struct btrfs_logical_ref {
+    uint64_t logical;
+    uint64_t extent;                            // start of the extent holding it, 0 when unallocated
+    uint64_t root;                              // tree the reference is in
+    uint64_t inode;                             // 0 for tree blocks
+    uint64_t offset;                            // first file offset affected; tree level for tree blocks
+    uint64_t length;                            // file bytes affected, the whole extent when compressed
+    bool metadata;
+    bool shared;                                // from a shared ref, `root` is the owner of the leaf
+    const char *path;                           // below the subvolume root, NULL when it can't be found
+};
+
+/*
+ * Resolves a batch of logical addresses. They are sorted and walked through
+ * the extent tree in one ascending pass, staying in the current leaf while the
+ * next address is still inside it, and every extent's references are decoded
+ * once for all addresses that fall in it. fn is called for each reference in
+ * address order (once with `extent` 0 for an unallocated address) and a nonzero
+ * return stops the walk and is returned. Returns 0 or an errno.
+ */
+int btrfs_logical_resolve(struct btrfs_volume *vol, const uint64_t *logicals, size_t count,
+    int (*fn)(void *arg, const struct btrfs_logical_ref *ref), void *arg);
+
+// prints one reference the way btrfs.util reports it
+void btrfs_logical_ref_print(const struct btrfs_logical_ref *ref);
+
+// btrfs.util -l [-f file] device ...
+//
+// Resolves the logical addresses, one per line, in `file` or on stdin.
+int btrfs_logical_main(int argc, char *argv[]);
+
+#endif // _BTRFS_BACKREF_H
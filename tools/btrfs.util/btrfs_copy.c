@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#if defined(__linux__)
+#define _GNU_SOURCE                             // copy_file_range
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#elif defined(__FreeBSD__)
+#include <sys/param.h>
+#endif
+#include "btrfs_copy.h"
+
+#define COPY_BUF_SIZE (1024 * 1024)
+
+static int copy_through_buffer(int src, uint64_t src_off, int dst, uint64_t dst_off, uint64_t len) {
+	uint8_t *buf;
+	ssize_t n;
+	int error = 0;
+
+	buf = malloc(COPY_BUF_SIZE);
+	if(buf == NULL)
+		return(ENOMEM);
+	while(len > 0) {
+		n = pread(src, buf, len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE, src_off);
+		if(n <= 0) {
+			error = n == 0 ? EIO : errno;
+			break;
+		}
+		if(pwrite(dst, buf, n, dst_off) != n) {
+			error = errno ? errno : EIO;
+			break;
+		}
+		src_off += n;
+		dst_off += n;
+		len -= n;
+	}
+	free(buf);
+	return(error);
+}
+
+int btrfs_copy_range(int src, uint64_t src_off, int dst, uint64_t dst_off, uint64_t len, uint64_t *reflinked) {
+#if defined(FICLONERANGE)
+	struct file_clone_range range = { .src_fd = src, .src_offset = src_off, .src_length = len,
+	    .dest_offset = dst_off };
+
+	if(ioctl(dst, FICLONERANGE, &range) == 0) {
+		*reflinked += len;
+		return(0);
+	}
+#else
+	(void)reflinked;
+#endif
+#if defined(__linux__) || (defined(__FreeBSD__) && __FreeBSD_version >= 1300037)
+	while(len > 0) {
+		off_t in = src_off, out = dst_off;
+		ssize_t n = copy_file_range(src, &in, dst, &out, len, 0);
+
+		if(n <= 0)
+			break;
+		src_off += n;
+		dst_off += n;
+		len -= n;
+	}
+#endif
+	if(len > 0)
+		return(copy_through_buffer(src, src_off, dst, dst_off, len));
+	return(0);
+}
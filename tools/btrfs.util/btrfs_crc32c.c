@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "crc32.h"
+
+/*
+ * Userspace calculate_crc32c(), with the same contract as the kernel's libkern
+ * version: no pre/post inversion, callers pass ~0 and invert the result.
+ *
+ * The portable path is slicing-by-8 (eight bytes per step through eight tables),
+ * the x86 path uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_tab[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t v;
+
+	while(len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while(len >= 8) {
+		__builtin_memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		v = __builtin_bswap64(v);
+#endif
+		v ^= crc;
+		crc = crc32c_tab[7][v & 0xff] ^ crc32c_tab[6][(v >> 8) & 0xff] ^
+		    crc32c_tab[5][(v >> 16) & 0xff] ^ crc32c_tab[4][(v >> 24) & 0xff] ^
+		    crc32c_tab[3][(v >> 32) & 0xff] ^ crc32c_tab[2][(v >> 40) & 0xff] ^
+		    crc32c_tab[1][(v >> 48) & 0xff] ^ crc32c_tab[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0)
+		crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return(crc);
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t crc64, v;
+
+	while(len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		len--;
+	}
+	crc64 = crc;
+	while(len >= 8) {
+		__builtin_memcpy(&v, p, sizeof(v));
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while(len-- > 0)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return(crc);
+}
+#endif
+
+static void crc32c_init(void) {
+	uint32_t crc;
+
+	for(int i = 0; i < 256; ++i) {
+		crc = i;
+		for(int j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_tab[0][i] = crc;
+	}
+	for(int i = 0; i < 256; ++i) {
+		crc = crc32c_tab[0][i];
+		for(int t = 1; t < 8; ++t) {
+			crc = crc32c_tab[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_tab[t][i] = crc;
+		}
+	}
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+	if(__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t calculate_crc32c(uint32_t crc32c, const unsigned char *buffer, unsigned int length) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return(crc32c_impl(crc32c, buffer, length));
+}
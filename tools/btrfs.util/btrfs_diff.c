@@ -0,0 +1,449 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_volume.h"
+#include "btrfs_fs.h"
+#include "btrfs_diff.h"
+
+/*
+ * A cursor stands on one pointer or item of a tree, at `level`, with the nodes
+ * above it in the path. It can step over what it stands on, including the
+ * whole subtree of a pointer, or descend into that subtree.
+ */
+struct diff_cursor {
+	struct btrfs_volume *vol;
+	struct btrfs_path path;
+	int level;
+	bool end;
+	struct btrfs_diff_stats *stats;
+};
+
+static int diff_cursor_init(struct diff_cursor *c, struct btrfs_volume *vol, const struct btrfs_tree_root *root,
+    struct btrfs_diff_stats *stats) {
+	int error;
+
+	memset(c, 0, sizeof(*c));
+	c->vol = vol;
+	c->stats = stats;
+	if(root->level >= BTRFS_MAX_LEVEL)
+		return(EIO);
+	c->path.root_level = root->level;
+	c->path.nodes[root->level] = malloc(vol->node_size);
+	if(c->path.nodes[root->level] == NULL)
+		return(ENOMEM);
+	error = btrfs_read_node(vol, root->bytenr, root->level, 0, c->path.nodes[root->level]);
+	if(error)
+		return(error);
+	stats->nodes_read++;
+	c->level = root->level;
+	if(btrfs_header_nritems(c->path.nodes[c->level]) == 0) {
+		// only an empty tree has an empty block, and that is a leaf
+		if(c->level > 0)
+			return(EIO);
+		c->end = true;
+	}
+	return(0);
+}
+
+static const uint8_t *diff_cursor_key(const struct diff_cursor *c) {
+	const uint8_t *node = c->path.nodes[c->level];
+	uint32_t slot = c->path.slots[c->level];
+
+	return(c->level > 0 ? btrfs_node_key(node, slot) : btrfs_item_key(node, slot));
+}
+
+// past what the cursor stands on, climbing out of finished nodes
+static void diff_cursor_next(struct diff_cursor *c) {
+	while(++c->path.slots[c->level] >= btrfs_header_nritems(c->path.nodes[c->level])) {
+		if(c->level == c->path.root_level) {
+			c->end = true;
+			return;
+		}
+		c->level++;
+	}
+}
+
+// onto the first entry of the block under the current pointer
+static int diff_cursor_down(struct diff_cursor *c) {
+	const uint8_t *parent = c->path.nodes[c->level];
+	uint32_t slot = c->path.slots[c->level];
+	int level = c->level - 1, error;
+
+	if(c->path.nodes[level] == NULL) {
+		c->path.nodes[level] = malloc(c->vol->node_size);
+		if(c->path.nodes[level] == NULL)
+			return(ENOMEM);
+	}
+	error = btrfs_read_node(c->vol, btrfs_node_blockptr(parent, slot), level, btrfs_node_ptr_generation(parent, slot),
+	    c->path.nodes[level]);
+	if(error)
+		return(error);
+	c->stats->nodes_read++;
+	if(btrfs_header_nritems(c->path.nodes[level]) == 0)
+		return(EIO);
+	c->level = level;
+	c->path.slots[level] = 0;
+	return(0);
+}
+
+static int diff_emit(int change, const struct diff_cursor *old, const struct diff_cursor *new,
+    int (*fn)(void *arg, const struct btrfs_diff_item *item), void *arg) {
+	struct btrfs_diff_item item = { .change = change };
+
+	if(old != NULL) {
+		item.old_data = btrfs_item_data(old->path.nodes[0], old->path.slots[0]);
+		item.old_size = btrfs_item_size(old->path.nodes[0], old->path.slots[0]);
+	}
+	if(new != NULL) {
+		item.new_data = btrfs_item_data(new->path.nodes[0], new->path.slots[0]);
+		item.new_size = btrfs_item_size(new->path.nodes[0], new->path.slots[0]);
+	}
+	btrfs_disk_key_to_cpu(diff_cursor_key(new != NULL ? new : old), &item.key);
+	return(fn(arg, &item));
+}
+
+int btrfs_tree_diff(struct btrfs_volume *vol, const struct btrfs_tree_root *old_root,
+    const struct btrfs_tree_root *new_root, int (*fn)(void *arg, const struct btrfs_diff_item *item), void *arg,
+    struct btrfs_diff_stats *stats) {
+	struct diff_cursor old, new;
+	struct btrfs_key key;
+	const uint8_t *o, *n;
+	int cmp, error;
+
+	error = diff_cursor_init(&old, vol, old_root, stats);
+	if(error == 0)
+		error = diff_cursor_init(&new, vol, new_root, stats);
+	else
+		memset(&new, 0, sizeof(new));
+
+	while(error == 0 && !(old.end && new.end)) {
+		// what is left of one tree once the other is done
+		if(old.end || new.end) {
+			struct diff_cursor *c = old.end ? &new : &old;
+
+			if(c->level > 0) {
+				error = diff_cursor_down(c);
+			} else {
+				error = diff_emit(old.end ? BTRFS_DIFF_ADDED : BTRFS_DIFF_DELETED, old.end ? NULL : &old,
+				    old.end ? &new : NULL, fn, arg);
+				diff_cursor_next(c);
+			}
+			continue;
+		}
+
+		// keys are only comparable between entries at the same level
+		if(old.level > new.level) {
+			error = diff_cursor_down(&old);
+			continue;
+		}
+		if(new.level > old.level) {
+			error = diff_cursor_down(&new);
+			continue;
+		}
+		btrfs_disk_key_to_cpu(diff_cursor_key(&new), &key);
+		cmp = btrfs_comp_disk_key(diff_cursor_key(&old), &key);
+
+		if(old.level > 0) {
+			o = old.path.nodes[old.level];
+			n = new.path.nodes[new.level];
+			if(cmp == 0 && btrfs_node_blockptr(o, old.path.slots[old.level]) ==
+			    btrfs_node_blockptr(n, new.path.slots[new.level]) &&
+			    btrfs_node_ptr_generation(o, old.path.slots[old.level]) ==
+			    btrfs_node_ptr_generation(n, new.path.slots[new.level])) {
+				// the same block in both, and so everything below it
+				stats->subtrees_skipped++;
+				diff_cursor_next(&old);
+				diff_cursor_next(&new);
+			} else {
+				error = diff_cursor_down(&old);
+				if(error == 0)
+					error = diff_cursor_down(&new);
+			}
+			continue;
+		}
+
+		if(cmp < 0) {
+			error = diff_emit(BTRFS_DIFF_DELETED, &old, NULL, fn, arg);
+			diff_cursor_next(&old);
+		} else if(cmp > 0) {
+			error = diff_emit(BTRFS_DIFF_ADDED, NULL, &new, fn, arg);
+			diff_cursor_next(&new);
+		} else {
+			o = old.path.nodes[0];
+			n = new.path.nodes[0];
+			if(btrfs_item_size(o, old.path.slots[0]) != btrfs_item_size(n, new.path.slots[0]) ||
+			    memcmp(btrfs_item_data(o, old.path.slots[0]), btrfs_item_data(n, new.path.slots[0]),
+			    btrfs_item_size(o, old.path.slots[0])) != 0)
+				error = diff_emit(BTRFS_DIFF_MODIFIED, &old, &new, fn, arg);
+			diff_cursor_next(&old);
+			diff_cursor_next(&new);
+		}
+	}
+	btrfs_path_release(&old.path);
+	btrfs_path_release(&new.path);
+	return(error);
+}
+
+int btrfs_tree_newer(struct btrfs_volume *vol, const struct btrfs_tree_root *root, uint64_t generation,
+    int (*fn)(void *arg, const struct btrfs_diff_item *item), void *arg, struct btrfs_diff_stats *stats) {
+	struct diff_cursor c;
+	const uint8_t *node;
+	int error;
+
+	error = diff_cursor_init(&c, vol, root, stats);
+	if(error == 0 && btrfs_header_generation(c.path.nodes[c.level]) <= generation) {
+		stats->subtrees_skipped++;
+		c.end = true;
+	}
+	while(error == 0 && !c.end) {
+		node = c.path.nodes[c.level];
+		if(c.level == 0) {
+			error = diff_emit(BTRFS_DIFF_NEWER, NULL, &c, fn, arg);
+			diff_cursor_next(&c);
+		} else if(btrfs_node_ptr_generation(node, c.path.slots[c.level]) > generation) {
+			error = diff_cursor_down(&c);
+		} else {
+			stats->subtrees_skipped++;
+			diff_cursor_next(&c);
+		}
+	}
+	btrfs_path_release(&c.path);
+	return(error);
+}
+
+/*
+ * The listing. Items come in key order, so all changes to one inode arrive
+ * together and its INODE_ITEM, when it changed, first. The inode is printed
+ * with the first change seen, then its file extents; extents of deleted
+ * inodes are left out.
+ */
+
+struct diff_ctx {
+	struct btrfs_subvol old, new;
+	uint64_t generation;                    // -g, otherwise 0
+	bool quiet;
+	uint64_t ino;                           // last inode printed
+	int ino_change;
+	char path[PATH_MAX];
+	uint64_t inodes[4], extents[4];         // by BTRFS_DIFF_ADDED, _DELETED and _MODIFIED
+};
+
+static const char diff_marks[] = " +-~";
+
+static void diff_print_extent(int mark, const struct btrfs_file_extent *ext) {
+	printf("%c   extent %" PRIu64 " len %" PRIu64, mark, ext->file_offset, ext->num_bytes);
+	if(ext->type == EXTENT_TYPE_INLINE)
+		printf(" inline");
+	else if(ext->disk_bytenr == 0)
+		printf(" hole");
+	else
+		printf(" disk %" PRIu64 " offset %" PRIu64 "%s", ext->disk_bytenr, ext->extent_offset,
+		    ext->type == EXTENT_TYPE_PREALLOC ? " prealloc" : "");
+	if(ext->compression != BTRFS_COMPRESSION_NONE)
+		printf(" compressed");
+	printf(" gen %" PRIu64 "\n", ext->generation);
+}
+
+static int diff_item(void *arg, const struct btrfs_diff_item *item) {
+	struct diff_ctx *ctx = arg;
+	struct btrfs_file_extent ext;
+	uint64_t ino = item->key.obj_id;
+	int change = item->change, error;
+
+	// orphans, free inode cache and the like
+	if(ino < BTRFS_FIRST_FREE_OBJECTID || ino > BTRFS_LAST_FREE_OBJECTID)
+		return(0);
+	if(change == BTRFS_DIFF_NEWER) {
+		// a leaf is newer when any item in it changed, the items say which
+		if(item->key.obj_type == TYPE_INODE_ITEM) {
+			if(item->new_size < sizeof(btrfs_inode_item) ||
+			    BTRFS_GET_LE64(item->new_data, btrfs_inode_item, transid) <= ctx->generation)
+				return(0);
+			change = BTRFS_GET_LE64(item->new_data, btrfs_inode_item, generation) > ctx->generation ?
+			    BTRFS_DIFF_ADDED : BTRFS_DIFF_MODIFIED;
+		} else if(item->key.obj_type == TYPE_EXTENT_DATA) {
+			if(item->new_size < sizeof(btrfs_extent_data) ||
+			    BTRFS_GET_LE64(item->new_data, btrfs_extent_data, generation) <= ctx->generation)
+				return(0);
+			change = BTRFS_DIFF_ADDED;
+		} else {
+			return(0);
+		}
+	}
+
+	if(ino != ctx->ino) {
+		ctx->ino = ino;
+		ctx->ino_change = item->key.obj_type == TYPE_INODE_ITEM ? change : BTRFS_DIFF_MODIFIED;
+		ctx->inodes[ctx->ino_change]++;
+		if(!ctx->quiet) {
+			error = btrfs_inode_path(ctx->ino_change == BTRFS_DIFF_DELETED ? &ctx->old : &ctx->new, ino, ctx->path,
+			    sizeof(ctx->path));
+			if(error)
+				snprintf(ctx->path, sizeof(ctx->path), "(%s)", strerror(error));
+			printf("%c inode %" PRIu64 " %s\n", diff_marks[ctx->ino_change], ino, ctx->path);
+		}
+	}
+	if(item->key.obj_type != TYPE_EXTENT_DATA || ctx->ino_change == BTRFS_DIFF_DELETED)
+		return(0);
+
+	ctx->extents[change]++;
+	if(ctx->quiet)
+		return(0);
+	if(item->old_data != NULL) {
+		error = btrfs_extent_decode(item->key.offset, item->old_data, item->old_size, &ext);
+		if(error)
+			return(error);
+		diff_print_extent('-', &ext);
+	}
+	if(item->new_data != NULL) {
+		error = btrfs_extent_decode(item->key.offset, item->new_data, item->new_size, &ext);
+		if(error)
+			return(error);
+		diff_print_extent(diff_marks[change == BTRFS_DIFF_MODIFIED ? BTRFS_DIFF_ADDED : change], &ext);
+	}
+	return(0);
+}
+
+static void diff_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -D [-q] [-g generation | -P | old-subvolume] subvolume device ...\n");
+}
+
+static int diff_open(struct btrfs_volume *vol, const char *name, struct btrfs_subvol *sv) {
+	uint64_t id;
+	int error;
+
+	error = btrfs_subvol_resolve(vol, name, &id);
+	if(error == 0)
+		error = btrfs_subvol_open(vol, id, sv);
+	if(error)
+		fprintf(stderr, "subvolume %s: %s\n", name, strerror(error));
+	return(error);
+}
+
+// the subvolume `sv` was snapshotted from, through the UUID tree
+static int diff_open_parent(struct btrfs_volume *vol, const char *name, const struct btrfs_subvol *sv,
+    struct btrfs_subvol *parent) {
+	static const uint8_t none[BTRFS_UUID_SIZE];
+	uint64_t id;
+	size_t count;
+	int error;
+
+	if(memcmp(sv->parent_uuid, none, BTRFS_UUID_SIZE) == 0) {
+		fprintf(stderr, "subvolume %s is not a snapshot\n", name);
+		return(ENOENT);
+	}
+	error = btrfs_subvol_by_uuid(vol, sv->parent_uuid, TYPE_SUBVOL_UUID, &id, 1, &count);
+	if(error == 0)
+		error = btrfs_subvol_open(vol, id, parent);
+	if(error)
+		fprintf(stderr, "parent of subvolume %s: %s\n", name, strerror(error));
+	return(error);
+}
+
+int btrfs_diff_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct diff_ctx ctx = { 0 };
+	struct btrfs_diff_stats stats = { 0 };
+	struct timespec start, stop;
+	bool newer = false, parent = false;
+	char *end;
+	int ch, nids, error;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "g:Pq")) != -1) {
+		switch(ch) {
+		case 'g':
+			ctx.generation = strtoull(optarg, &end, 0);
+			if(*end != '\0') {
+				diff_usage();
+				return(FSUR_INVAL);
+			}
+			newer = true;
+			break;
+		case 'P':
+			parent = true;
+			break;
+		case 'q':
+			ctx.quiet = true;
+			break;
+		default:
+			diff_usage();
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	nids = newer || parent ? 1 : 2;
+	if((newer && parent) || argc < nids + 1) {
+		diff_usage();
+		return(FSUR_INVAL);
+	}
+	if(btrfs_volume_open(&vol, argv + nids, argc - nids) != 0)
+		return(FSUR_IO_FAIL);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	error = diff_open(&vol, argv[nids - 1], &ctx.new);
+	if(error == 0 && parent)
+		error = diff_open_parent(&vol, argv[0], &ctx.new, &ctx.old);
+	else if(error == 0 && !newer)
+		error = diff_open(&vol, argv[0], &ctx.old);
+	if(error == 0) {
+		if(newer)
+			error = btrfs_tree_newer(&vol, &ctx.new.root, ctx.generation, diff_item, &ctx, &stats);
+		else
+			error = btrfs_tree_diff(&vol, &ctx.old.root, &ctx.new.root, diff_item, &ctx, &stats);
+		if(error)
+			fprintf(stderr, "diff failed: %s\n", strerror(error));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	if(error == 0) {
+		if(newer)
+			printf("%" PRIu64 " inodes created, %" PRIu64 " changed, %" PRIu64 " extents written after "
+			    "generation %" PRIu64 "\n", ctx.inodes[BTRFS_DIFF_ADDED], ctx.inodes[BTRFS_DIFF_MODIFIED],
+			    ctx.extents[BTRFS_DIFF_ADDED], ctx.generation);
+		else
+			printf("inodes: %" PRIu64 " added, %" PRIu64 " modified, %" PRIu64 " deleted; extents: %" PRIu64
+			    " added, %" PRIu64 " modified, %" PRIu64 " deleted\n", ctx.inodes[BTRFS_DIFF_ADDED],
+			    ctx.inodes[BTRFS_DIFF_MODIFIED], ctx.inodes[BTRFS_DIFF_DELETED], ctx.extents[BTRFS_DIFF_ADDED],
+			    ctx.extents[BTRFS_DIFF_MODIFIED], ctx.extents[BTRFS_DIFF_DELETED]);
+		fprintf(stderr, "%" PRIu64 " tree blocks read, %" PRIu64 " subtrees skipped, %.3fs\n", stats.nodes_read,
+		    stats.subtrees_skipped, stop.tv_sec - start.tv_sec + (stop.tv_nsec - start.tv_nsec) / 1e9);
+	}
+	btrfs_volume_close(&vol);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,86 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_DIFF_H
+#define _BTRFS_DIFF_H
+
+#include <stdint.h>
+#include "btrfs_volume.h"
+
+/*
+ * Changes between two versions of a tree. A snapshot and its source, or two
+ * snapshots of one subvolume, share every block neither has rewritten since
+ * they split, and a rewritten block has a newer generation than the ones it
+ * replaced. Both walks below use that to stay out of unchanged subtrees, so
+ * their cost follows the size of the change rather than of the tree.
+ */
+
+#define BTRFS_DIFF_ADDED    1                   // only in the new tree
+#define BTRFS_DIFF_DELETED  2                   // only in the old tree
+#define BTRFS_DIFF_MODIFIED 3                   // in both with different contents
+#define BTRFS_DIFF_NEWER    4                   // in a block written after the cutoff generation
+
+struct btrfs_diff_item {
+    int change;                                 // BTRFS_DIFF_*
+    struct btrfs_key key;
+    const uint8_t *old_data, *new_data;         // NULL on the side the item is missing from
+    uint32_t old_size, new_size;
+};
+
+struct btrfs_diff_stats {
+    uint64_t nodes_read;
+    uint64_t subtrees_skipped;                  // pointers not followed, shared or too old
+};
+
+/*
+ * Walks both trees in key order, side by side. Pointers with the same key to
+ * the same block at the same generation are stepped over without reading
+ * them; otherwise the side with the higher level descends until both stand on
+ * items, which are compared. fn is called for every item that differs, in key
+ * order, and a nonzero return stops the walk and is returned. Returns 0 or an
+ * errno.
+ */
+int btrfs_tree_diff(struct btrfs_volume *vol, const struct btrfs_tree_root *old_root,
+    const struct btrfs_tree_root *new_root, int (*fn)(void *arg, const struct btrfs_diff_item *item), void *arg,
+    struct btrfs_diff_stats *stats);
+
+/*
+ * Calls fn with BTRFS_DIFF_NEWER for every item of a leaf newer than
+ * `generation`, following only pointers whose generation is newer too. Items
+ * that were merely moved into such a leaf are included; their own generation
+ * fields tell them apart.
+ */
+int btrfs_tree_newer(struct btrfs_volume *vol, const struct btrfs_tree_root *root, uint64_t generation,
+    int (*fn)(void *arg, const struct btrfs_diff_item *item), void *arg, struct btrfs_diff_stats *stats);
+
+// btrfs.util -D [-g generation | -P | old-subvolume] subvolume device ...
+//
+// Lists the inodes and file extents added, modified or deleted between two
+// snapshots, given by id or uuid, or written in a subvolume after a
+// generation. -P compares a snapshot with the subvolume it was taken from.
+int btrfs_diff_main(int argc, char *argv[]);
+
+#endif // _BTRFS_DIFF_H
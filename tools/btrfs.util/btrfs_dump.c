@@ -0,0 +1,614 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "btrfs_volume.h"
+#include "btrfs_super.h"
+#include "btrfs_pool.h"
+#include "btrfs_dump.h"
+
+#define DUMP_INLINE_REF_SIZE 9                  // u8 type, u64 offset
+
+static const struct {
+	const char *name;
+	uint64_t id;
+} dump_trees[] = {
+	{ "root", BTRFS_ROOT_ROOT },
+	{ "extent", BTRFS_ROOT_EXTENT },
+	{ "chunk", BTRFS_ROOT_CHUNK },
+	{ "dev", BTRFS_ROOT_DEVTREE },
+	{ "fs", BTRFS_ROOT_FSTREE },
+	{ "csum", BTRFS_ROOT_CHECKSUM },
+	{ "quota", BTRFS_ROOT_QUOTA },
+	{ "uuid", BTRFS_ROOT_UUID },
+	{ "free-space", BTRFS_ROOT_FREE_SPACE },
+};
+
+static const char *const dump_type_names[256] = {
+	[TYPE_INODE_ITEM] = "INODE_ITEM",
+	[TYPE_INODE_REF] = "INODE_REF",
+	[TYPE_INODE_EXTREF] = "INODE_EXTREF",
+	[TYPE_XATTR_ITEM] = "XATTR_ITEM",
+	[TYPE_ORPHAN_INODE] = "ORPHAN_ITEM",
+	[TYPE_DIR_ITEM] = "DIR_ITEM",
+	[TYPE_DIR_INDEX] = "DIR_INDEX",
+	[TYPE_EXTENT_DATA] = "EXTENT_DATA",
+	[TYPE_EXTENT_CSUM] = "EXTENT_CSUM",
+	[TYPE_ROOT_ITEM] = "ROOT_ITEM",
+	[TYPE_ROOT_BACKREF] = "ROOT_BACKREF",
+	[TYPE_ROOT_REF] = "ROOT_REF",
+	[TYPE_EXTENT_ITEM] = "EXTENT_ITEM",
+	[TYPE_METADATA_ITEM] = "METADATA_ITEM",
+	[TYPE_TREE_BLOCK_REF] = "TREE_BLOCK_REF",
+	[TYPE_EXTENT_DATA_REF] = "EXTENT_DATA_REF",
+	[TYPE_EXTENT_REF_V0] = "EXTENT_REF_V0",
+	[TYPE_SHARED_BLOCK_REF] = "SHARED_BLOCK_REF",
+	[TYPE_SHARED_DATA_REF] = "SHARED_DATA_REF",
+	[TYPE_BLOCK_GROUP_ITEM] = "BLOCK_GROUP_ITEM",
+	[TYPE_FREE_SPACE_INFO] = "FREE_SPACE_INFO",
+	[TYPE_FREE_SPACE_EXTENT] = "FREE_SPACE_EXTENT",
+	[TYPE_FREE_SPACE_BITMAP] = "FREE_SPACE_BITMAP",
+	[TYPE_DEV_EXTENT] = "DEV_EXTENT",
+	[TYPE_DEV_ITEM] = "DEV_ITEM",
+	[TYPE_CHUNK_ITEM] = "CHUNK_ITEM",
+	[TYPE_QGROUP_STATUS] = "QGROUP_STATUS",
+	[TYPE_QGROUP_INFO] = "QGROUP_INFO",
+	[TYPE_QGROUP_LIMIT] = "QGROUP_LIMIT",
+	[TYPE_QGROUP_RELATION] = "QGROUP_RELATION",
+	[TYPE_TEMP_ITEM] = "TEMPORARY_ITEM",
+	[TYPE_DEV_STATS] = "PERSISTENT_ITEM",
+	[TYPE_SUBVOL_UUID] = "UUID_KEY_SUBVOL",
+	[TYPE_SUBVOL_REC_UUID] = "UUID_KEY_RECEIVED_SUBVOL",
+};
+
+uint64_t btrfs_tree_id(const char *name) {
+	char *end;
+	uint64_t id;
+
+	for(size_t i = 0; i < sizeof(dump_trees) / sizeof(dump_trees[0]); ++i) {
+		if(strcmp(name, dump_trees[i].name) == 0)
+			return(dump_trees[i].id);
+	}
+	id = strtoull(name, &end, 0);
+	return(*end == '\0' ? id : 0);
+}
+
+// per-worker output, printed in one piece once a block is formatted
+struct dump_buf {
+	char *data;
+	size_t len, cap;
+};
+
+static void __attribute__((format(printf, 2, 3))) dump_printf(struct dump_buf *buf, const char *fmt, ...) {
+	va_list ap;
+	size_t avail;
+	char *grown;
+	int n;
+
+	for(;;) {
+		avail = buf->cap - buf->len;
+		va_start(ap, fmt);
+		n = vsnprintf(buf->data + buf->len, avail, fmt, ap);
+		va_end(ap);
+		if(n < 0)
+			return;
+		if((size_t)n < avail) {
+			buf->len += n;
+			return;
+		}
+		grown = realloc(buf->data, buf->cap * 2 + n);
+		if(grown == NULL)
+			return;
+		buf->data = grown;
+		buf->cap = buf->cap * 2 + n;
+	}
+}
+
+struct dump_ctx {
+	struct btrfs_volume *vol;
+	bool quiet;
+	uint8_t **nodes;                        // one block buffer per worker
+	struct dump_buf *bufs;
+	atomic_uint_fast64_t nodes_read, leaves_read, items, errors;
+};
+
+struct dump_task {
+	struct dump_ctx *ctx;
+	uint64_t bytenr;
+	uint64_t generation;
+	int level;
+};
+
+static void dump_key(struct dump_buf *buf, const uint8_t *key) {
+	const char *type = dump_type_names[btrfs_disk_key_type(key)];
+
+	if(type != NULL)
+		dump_printf(buf, "(%" PRIu64 " %s %" PRIu64 ")", btrfs_disk_key_objectid(key), type, btrfs_disk_key_offset(key));
+	else
+		dump_printf(buf, "(%" PRIu64 " UNKNOWN.%u %" PRIu64 ")", btrfs_disk_key_objectid(key),
+		    btrfs_disk_key_type(key), btrfs_disk_key_offset(key));
+}
+
+static void dump_name(struct dump_buf *buf, const uint8_t *name, size_t len) {
+	dump_printf(buf, "%.*s", (int)len, (const char *)name);
+}
+
+static void dump_uuid(struct dump_buf *buf, const uint8_t *uuid) {
+	char str[BTRFS_UUID_STRLEN];
+
+	btrfs_uuid_format((const btrfs_uuid *)uuid, str);
+	dump_printf(buf, "%s", str);
+}
+
+static void dump_inode_item(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	if(size < sizeof(btrfs_inode_item))
+		return;
+	dump_printf(buf, "\t\tgeneration %" PRIu64 " transid %" PRIu64 " size %" PRIu64 " nbytes %" PRIu64 "\n",
+	    BTRFS_GET_LE64(p, btrfs_inode_item, generation), BTRFS_GET_LE64(p, btrfs_inode_item, transid),
+	    BTRFS_GET_LE64(p, btrfs_inode_item, st_size), BTRFS_GET_LE64(p, btrfs_inode_item, st_blocks));
+	dump_printf(buf, "\t\tnlink %u uid %u gid %u mode %o rdev %" PRIu64 " flags 0x%" PRIx64 "\n",
+	    BTRFS_GET_LE32(p, btrfs_inode_item, st_nlink), BTRFS_GET_LE32(p, btrfs_inode_item, st_uid),
+	    BTRFS_GET_LE32(p, btrfs_inode_item, st_gid), BTRFS_GET_LE32(p, btrfs_inode_item, st_mode),
+	    BTRFS_GET_LE64(p, btrfs_inode_item, st_rdev), BTRFS_GET_LE64(p, btrfs_inode_item, flags));
+}
+
+static void dump_inode_ref(struct dump_buf *buf, const uint8_t *p, uint32_t size, bool extref) {
+	size_t head = extref ? sizeof(btrfs_inode_extref) : sizeof(btrfs_inode_ref);
+	uint16_t len;
+
+	for(uint32_t off = 0; off + head <= size; off += head + len) {
+		const uint8_t *ref = p + off;
+
+		if(extref) {
+			len = BTRFS_GET_LE16(ref, btrfs_inode_extref, name_len);
+			dump_printf(buf, "\t\tdir %" PRIu64 " index %" PRIu64 " name ",
+			    BTRFS_GET_LE64(ref, btrfs_inode_extref, dir), BTRFS_GET_LE64(ref, btrfs_inode_extref, index));
+		} else {
+			len = BTRFS_GET_LE16(ref, btrfs_inode_ref, name_len);
+			dump_printf(buf, "\t\tindex %" PRIu64 " name ", BTRFS_GET_LE64(ref, btrfs_inode_ref, index));
+		}
+		if(off + head + len > size)
+			break;
+		dump_name(buf, ref + head, len);
+		dump_printf(buf, "\n");
+	}
+}
+
+// DIR_ITEM, DIR_INDEX and XATTR_ITEM all hold a run of dir items
+static void dump_dir_item(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	uint16_t name_len, data_len;
+
+	for(uint32_t off = 0; off + sizeof(struct btrfs_dir_item) <= size;
+	    off += sizeof(struct btrfs_dir_item) + name_len + data_len) {
+		const uint8_t *di = p + off;
+
+		name_len = BTRFS_GET_LE16(di, struct btrfs_dir_item, name_length);
+		data_len = BTRFS_GET_LE16(di, struct btrfs_dir_item, extended_attribute_len);
+		if(off + sizeof(struct btrfs_dir_item) + name_len + data_len > size)
+			break;
+		dump_printf(buf, "\t\tlocation ");
+		dump_key(buf, BTRFS_FIELD(di, struct btrfs_dir_item, key));
+		dump_printf(buf, " type %u transid %" PRIu64 " data_len %u name ",
+		    BTRFS_GET_U8(di, struct btrfs_dir_item, type), BTRFS_GET_LE64(di, struct btrfs_dir_item, transid),
+		    data_len);
+		dump_name(buf, di + sizeof(struct btrfs_dir_item), name_len);
+		dump_printf(buf, "\n");
+	}
+}
+
+static void dump_file_extent(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	size_t head = __builtin_offsetof(btrfs_extent_data, data);
+	const uint8_t *ext = p + head;
+	uint8_t type;
+
+	if(size < head)
+		return;
+	type = BTRFS_GET_U8(p, btrfs_extent_data, type);
+	dump_printf(buf, "\t\tgeneration %" PRIu64 " type %u compression %u ram_bytes %" PRIu64 "\n",
+	    BTRFS_GET_LE64(p, btrfs_extent_data, generation), type, BTRFS_GET_U8(p, btrfs_extent_data, compression),
+	    BTRFS_GET_LE64(p, btrfs_extent_data, decoded_size));
+	if(type == EXTENT_TYPE_INLINE) {
+		dump_printf(buf, "\t\tinline data size %zu\n", size - head);
+	} else if(size >= head + sizeof(btrfs_extent_data2)) {
+		dump_printf(buf, "\t\tdisk bytenr %" PRIu64 " disk num bytes %" PRIu64 " offset %" PRIu64
+		    " num bytes %" PRIu64 "\n",
+		    BTRFS_GET_LE64(ext, btrfs_extent_data2, address), BTRFS_GET_LE64(ext, btrfs_extent_data2, size),
+		    BTRFS_GET_LE64(ext, btrfs_extent_data2, offset), BTRFS_GET_LE64(ext, btrfs_extent_data2, num_bytes));
+	}
+}
+
+static void dump_root_item(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	if(size < __builtin_offsetof(struct btrfs_root_item, generation2))
+		return;
+	dump_printf(buf, "\t\tbytenr %" PRIu64 " level %u generation %" PRIu64 " root_dirid %" PRIu64
+	    " refs %u flags 0x%" PRIx64 "\n",
+	    BTRFS_GET_LE64(p, struct btrfs_root_item, block_number), BTRFS_GET_U8(p, struct btrfs_root_item, root_level),
+	    BTRFS_GET_LE64(p, struct btrfs_root_item, generation), BTRFS_GET_LE64(p, struct btrfs_root_item, objid),
+	    BTRFS_GET_LE32(p, struct btrfs_root_item, num_references), BTRFS_GET_LE64(p, struct btrfs_root_item, flags));
+	if(size >= __builtin_offsetof(struct btrfs_root_item, ctime)) {
+		dump_printf(buf, "\t\tuuid ");
+		dump_uuid(buf, BTRFS_FIELD(p, struct btrfs_root_item, uuid));
+		dump_printf(buf, " parent ");
+		dump_uuid(buf, BTRFS_FIELD(p, struct btrfs_root_item, parent_uuid));
+		dump_printf(buf, " ctransid %" PRIu64 " otransid %" PRIu64 "\n",
+		    BTRFS_GET_LE64(p, struct btrfs_root_item, ctransid), BTRFS_GET_LE64(p, struct btrfs_root_item, otransid));
+	}
+}
+
+static void dump_root_ref(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	size_t head = __builtin_offsetof(ROOT_REF, name);
+	uint16_t len;
+
+	if(size < head)
+		return;
+	len = BTRFS_GET_LE16(p, ROOT_REF, n);
+	dump_printf(buf, "\t\tdir %" PRIu64 " index %" PRIu64 " name ", BTRFS_GET_LE64(p, ROOT_REF, dir),
+	    BTRFS_GET_LE64(p, ROOT_REF, index));
+	dump_name(buf, p + head, len <= size - head ? len : size - head);
+	dump_printf(buf, "\n");
+}
+
+static void dump_data_ref(struct dump_buf *buf, const uint8_t *ref) {
+	dump_printf(buf, "root %" PRIu64 " objectid %" PRIu64 " offset %" PRIu64 " count %u",
+	    BTRFS_GET_LE64(ref, EXTENT_DATA_REF, root), BTRFS_GET_LE64(ref, EXTENT_DATA_REF, objid),
+	    BTRFS_GET_LE64(ref, EXTENT_DATA_REF, offset), BTRFS_GET_LE32(ref, EXTENT_DATA_REF, count));
+}
+
+static void dump_extent_item(struct dump_buf *buf, const uint8_t *key, const uint8_t *p, uint32_t size) {
+	uint64_t flags;
+	uint32_t off = sizeof(EXTENT_ITEM);
+
+	if(size < sizeof(EXTENT_ITEM)) {
+		if(size == sizeof(EXTENT_ITEM_V0))
+			dump_printf(buf, "\t\trefs %u (v0)\n", BTRFS_GET_LE32(p, EXTENT_ITEM_V0, refcount));
+		return;
+	}
+	flags = BTRFS_GET_LE64(p, EXTENT_ITEM, flags);
+	dump_printf(buf, "\t\trefs %" PRIu64 " gen %" PRIu64 " flags %s%s\n", BTRFS_GET_LE64(p, EXTENT_ITEM, refcount),
+	    BTRFS_GET_LE64(p, EXTENT_ITEM, generation), flags & EXTENT_ITEM_DATA ? "DATA" : "",
+	    flags & EXTENT_ITEM_TREE_BLOCK ? "TREE_BLOCK" : "");
+	// non-skinny tree block items carry the first key and level of the block
+	if((flags & EXTENT_ITEM_TREE_BLOCK) && btrfs_disk_key_type(key) == TYPE_EXTENT_ITEM) {
+		if(off + sizeof(EXTENT_ITEM2) > size)
+			return;
+		dump_printf(buf, "\t\ttree block key ");
+		dump_key(buf, p + off);
+		dump_printf(buf, " level %u\n", BTRFS_GET_U8(p + off, EXTENT_ITEM2, level));
+		off += sizeof(EXTENT_ITEM2);
+	}
+	while(off + DUMP_INLINE_REF_SIZE <= size) {
+		uint8_t type = p[off];
+		const uint8_t *ref = p + off + 1;
+
+		switch(type) {
+		case TYPE_TREE_BLOCK_REF:
+			dump_printf(buf, "\t\ttree block backref root %" PRIu64 "\n", btrfs_get_le64(ref));
+			off += DUMP_INLINE_REF_SIZE;
+			break;
+		case TYPE_SHARED_BLOCK_REF:
+			dump_printf(buf, "\t\tshared block backref parent %" PRIu64 "\n", btrfs_get_le64(ref));
+			off += DUMP_INLINE_REF_SIZE;
+			break;
+		case TYPE_SHARED_DATA_REF:
+			if(off + 1 + sizeof(SHARED_DATA_REF) > size)
+				return;
+			dump_printf(buf, "\t\tshared data backref parent %" PRIu64 " count %u\n",
+			    BTRFS_GET_LE64(ref, SHARED_DATA_REF, offset), BTRFS_GET_LE32(ref, SHARED_DATA_REF, count));
+			off += 1 + sizeof(SHARED_DATA_REF);
+			break;
+		case TYPE_EXTENT_DATA_REF:
+			if(off + 1 + sizeof(EXTENT_DATA_REF) > size)
+				return;
+			dump_printf(buf, "\t\textent data backref ");
+			dump_data_ref(buf, ref);
+			dump_printf(buf, "\n");
+			off += 1 + sizeof(EXTENT_DATA_REF);
+			break;
+		default:
+			dump_printf(buf, "\t\tunknown inline ref type %u\n", type);
+			return;
+		}
+	}
+}
+
+static void dump_chunk_item(struct dump_buf *buf, const uint8_t *p, uint32_t size) {
+	uint16_t num_stripes;
+
+	if(size < btrfs_chunk_item_size(1))
+		return;
+	num_stripes = btrfs_chunk_num_stripes(p);
+	dump_printf(buf, "\t\tlength %" PRIu64 " owner %" PRIu64 " stripe_len %" PRIu64 " type 0x%" PRIx64
+	    " num_stripes %u sub_stripes %u\n",
+	    btrfs_chunk_length(p), BTRFS_GET_LE64(p, struct btrfs_chunk_item, root_id),
+	    BTRFS_GET_LE64(p, struct btrfs_chunk_item, stripe_length), btrfs_chunk_type(p), num_stripes,
+	    BTRFS_GET_LE16(p, struct btrfs_chunk_item, sub_stripes));
+	for(uint16_t i = 0; i < num_stripes && btrfs_chunk_item_size(i + 1) <= size; ++i) {
+		const uint8_t *stripe = btrfs_chunk_stripe(p, i);
+
+		dump_printf(buf, "\t\t\tstripe %u devid %" PRIu64 " offset %" PRIu64 "\n", i, btrfs_stripe_devid(stripe),
+		    btrfs_stripe_offset(stripe));
+	}
+}
+
+static void dump_item(struct dump_ctx *ctx, struct dump_buf *buf, const uint8_t *leaf, uint32_t slot) {
+	const uint8_t *key = btrfs_item_key(leaf, slot), *p = btrfs_item_data(leaf, slot);
+	uint32_t size = btrfs_item_size(leaf, slot);
+
+	dump_printf(buf, "\titem %u key ", slot);
+	dump_key(buf, key);
+	dump_printf(buf, " itemoff %u itemsize %u\n", btrfs_item_offset(leaf, slot), size);
+
+	switch(btrfs_disk_key_type(key)) {
+	case TYPE_INODE_ITEM:
+		dump_inode_item(buf, p, size);
+		break;
+	case TYPE_INODE_REF:
+		dump_inode_ref(buf, p, size, false);
+		break;
+	case TYPE_INODE_EXTREF:
+		dump_inode_ref(buf, p, size, true);
+		break;
+	case TYPE_DIR_ITEM:
+	case TYPE_DIR_INDEX:
+	case TYPE_XATTR_ITEM:
+		dump_dir_item(buf, p, size);
+		break;
+	case TYPE_EXTENT_DATA:
+		dump_file_extent(buf, p, size);
+		break;
+	case TYPE_EXTENT_CSUM:
+		dump_printf(buf, "\t\tcsums %u covering %" PRIu64 " bytes\n", size / 4,
+		    (uint64_t)(size / 4) * ctx->vol->sector_size);
+		break;
+	case TYPE_ROOT_ITEM:
+		dump_root_item(buf, p, size);
+		break;
+	case TYPE_ROOT_REF:
+	case TYPE_ROOT_BACKREF:
+		dump_root_ref(buf, p, size);
+		break;
+	case TYPE_EXTENT_ITEM:
+	case TYPE_METADATA_ITEM:
+		dump_extent_item(buf, key, p, size);
+		break;
+	case TYPE_EXTENT_DATA_REF:
+		if(size >= sizeof(EXTENT_DATA_REF)) {
+			dump_printf(buf, "\t\t");
+			dump_data_ref(buf, p);
+			dump_printf(buf, "\n");
+		}
+		break;
+	case TYPE_SHARED_DATA_REF:
+		if(size >= sizeof(uint32_t))
+			dump_printf(buf, "\t\tcount %u\n", btrfs_get_le32(p));
+		break;
+	case TYPE_BLOCK_GROUP_ITEM:
+		if(size >= sizeof(BLOCK_GROUP_ITEM))
+			dump_printf(buf, "\t\tused %" PRIu64 " chunk_objectid %" PRIu64 " flags 0x%" PRIx64 "\n",
+			    BTRFS_GET_LE64(p, BLOCK_GROUP_ITEM, used), BTRFS_GET_LE64(p, BLOCK_GROUP_ITEM, chunk_tree),
+			    BTRFS_GET_LE64(p, BLOCK_GROUP_ITEM, flags));
+		break;
+	case TYPE_FREE_SPACE_INFO:
+		if(size >= sizeof(FREE_SPACE_INFO))
+			dump_printf(buf, "\t\textent count %u flags %u\n", BTRFS_GET_LE32(p, FREE_SPACE_INFO, count),
+			    BTRFS_GET_LE32(p, FREE_SPACE_INFO, flags));
+		break;
+	case TYPE_DEV_EXTENT:
+		if(size >= sizeof(DEV_EXTENT))
+			dump_printf(buf, "\t\tchunk tree %" PRIu64 " chunk objectid %" PRIu64 " chunk offset %" PRIu64
+			    " length %" PRIu64 "\n",
+			    BTRFS_GET_LE64(p, DEV_EXTENT, chunktree), BTRFS_GET_LE64(p, DEV_EXTENT, objid),
+			    BTRFS_GET_LE64(p, DEV_EXTENT, address), BTRFS_GET_LE64(p, DEV_EXTENT, length));
+		break;
+	case TYPE_DEV_ITEM:
+		if(size >= sizeof(struct btrfs_dev_item)) {
+			dump_printf(buf, "\t\tdevid %" PRIu64 " total_bytes %" PRIu64 " bytes_used %" PRIu64 " uuid ",
+			    BTRFS_GET_LE64(p, struct btrfs_dev_item, dev_id), BTRFS_GET_LE64(p, struct btrfs_dev_item, num_bytes),
+			    BTRFS_GET_LE64(p, struct btrfs_dev_item, bytes_used));
+			dump_uuid(buf, BTRFS_FIELD(p, struct btrfs_dev_item, device_uuid));
+			dump_printf(buf, "\n");
+		}
+		break;
+	case TYPE_CHUNK_ITEM:
+		dump_chunk_item(buf, p, size);
+		break;
+	case TYPE_SUBVOL_UUID:
+	case TYPE_SUBVOL_REC_UUID:
+		for(uint32_t off = 0; off + sizeof(uint64_t) <= size; off += sizeof(uint64_t))
+			dump_printf(buf, "\t\tsubvol_id %" PRIu64 "\n", btrfs_get_le64(p + off));
+		break;
+	}
+}
+
+static void dump_block(struct btrfs_pool *pool, void *arg) {
+	struct dump_task *task = arg;
+	struct dump_ctx *ctx = task->ctx;
+	unsigned self = btrfs_pool_self();
+	uint8_t *node = ctx->nodes[self];
+	struct dump_buf *buf = &ctx->bufs[self];
+	struct dump_task *child;
+	uint32_t num_items;
+	int level, error;
+
+	error = btrfs_read_node(ctx->vol, task->bytenr, task->level, task->generation, node);
+	if(error) {
+		fprintf(stderr, "block %" PRIu64 ": %s\n", task->bytenr, strerror(error));
+		atomic_fetch_add(&ctx->errors, 1);
+		free(task);
+		return;
+	}
+	level = btrfs_header_level(node);
+	num_items = btrfs_header_nritems(node);
+
+	// hand the children out before formatting, so idle workers can start on them
+	for(uint32_t i = 0; level > 0 && i < num_items; ++i) {
+		child = malloc(sizeof(*child));
+		if(child == NULL) {
+			atomic_fetch_add(&ctx->errors, 1);
+			break;
+		}
+		*child = (struct dump_task){ ctx, btrfs_node_blockptr(node, i), btrfs_node_ptr_generation(node, i), level - 1 };
+		if(btrfs_pool_submit(pool, dump_block, child) != 0) {
+			free(child);
+			atomic_fetch_add(&ctx->errors, 1);
+			break;
+		}
+	}
+	if(level > 0)
+		atomic_fetch_add(&ctx->nodes_read, 1);
+	else {
+		atomic_fetch_add(&ctx->leaves_read, 1);
+		atomic_fetch_add(&ctx->items, num_items);
+	}
+	free(task);
+	if(ctx->quiet)
+		return;
+
+	buf->len = 0;
+	dump_printf(buf, "%s %" PRIu64 " level %d items %u generation %" PRIu64 " owner %" PRIu64 "\n",
+	    level ? "node" : "leaf", btrfs_header_bytenr(node), level, num_items, btrfs_header_generation(node),
+	    btrfs_header_owner(node));
+	for(uint32_t i = 0; i < num_items; ++i) {
+		if(level > 0) {
+			dump_printf(buf, "\tkey ");
+			dump_key(buf, btrfs_node_key(node, i));
+			dump_printf(buf, " block %" PRIu64 " gen %" PRIu64 "\n", btrfs_node_blockptr(node, i),
+			    btrfs_node_ptr_generation(node, i));
+		} else
+			dump_item(ctx, buf, node, i);
+	}
+	flockfile(stdout);
+	fwrite(buf->data, 1, buf->len, stdout);
+	funlockfile(stdout);
+}
+
+static double dump_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void dump_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -T [-q] [-j threads] tree device ...\n");
+	fprintf(stderr, "       tree is root, extent, chunk, dev, fs, csum, quota, uuid, free-space or a tree id\n");
+}
+
+int btrfs_dump_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct btrfs_pool *pool;
+	struct dump_ctx ctx = { 0 };
+	struct dump_task *task;
+	unsigned nthreads = 0;
+	uint64_t tree_id, bytenr, bytes;
+	uint8_t level;
+	double start, elapsed;
+	int ch, error;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "qj:")) != -1) {
+		switch(ch) {
+		case 'q':
+			ctx.quiet = true;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			dump_usage();
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 2 || (tree_id = btrfs_tree_id(argv[0])) == 0) {
+		dump_usage();
+		return(FSUR_INVAL);
+	}
+
+	if(btrfs_volume_open(&vol, argv + 1, argc - 1) != 0)
+		return(FSUR_IO_FAIL);
+	error = btrfs_find_root(&vol, tree_id, &bytenr, &level);
+	if(error) {
+		fprintf(stderr, "tree %" PRIu64 ": %s\n", tree_id, strerror(error));
+		btrfs_volume_close(&vol);
+		return(FSUR_IO_FAIL);
+	}
+	pool = btrfs_pool_create(nthreads);
+	if(pool == NULL) {
+		btrfs_volume_close(&vol);
+		return(FSUR_IO_FAIL);
+	}
+	nthreads = btrfs_pool_nthreads(pool);
+	ctx.vol = &vol;
+	ctx.nodes = calloc(nthreads, sizeof(*ctx.nodes));
+	ctx.bufs = calloc(nthreads, sizeof(*ctx.bufs));
+	task = malloc(sizeof(*task));
+	error = ctx.nodes == NULL || ctx.bufs == NULL || task == NULL;
+	for(unsigned i = 0; i < nthreads && !error; ++i) {
+		ctx.nodes[i] = malloc(vol.node_size);
+		ctx.bufs[i].cap = 64 * 1024;
+		ctx.bufs[i].data = malloc(ctx.bufs[i].cap);
+		error = ctx.nodes[i] == NULL || ctx.bufs[i].data == NULL;
+	}
+
+	start = dump_now();
+	if(!error) {
+		*task = (struct dump_task){ &ctx, bytenr, 0, level };
+		error = btrfs_pool_submit(pool, dump_block, task);
+	}
+	if(error)
+		free(task);
+	else
+		btrfs_pool_wait(pool);
+	elapsed = dump_now() - start;
+	btrfs_pool_destroy(pool);
+	fflush(stdout);
+
+	bytes = atomic_load(&vol.stats[BTRFS_STAT_BREAD_BYTES]);
+	fprintf(stderr, "%" PRIu64 " nodes, %" PRIu64 " leaves, %" PRIu64 " items, %" PRIu64 " errors\n",
+	    (uint64_t)atomic_load(&ctx.nodes_read), (uint64_t)atomic_load(&ctx.leaves_read),
+	    (uint64_t)atomic_load(&ctx.items), (uint64_t)atomic_load(&ctx.errors));
+	fprintf(stderr, "%" PRIu64 " bytes read in %.3fs, %.1f MiB/s on %u threads\n", bytes, elapsed,
+	    elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0.0, nthreads);
+
+	for(unsigned i = 0; ctx.nodes != NULL && i < nthreads; ++i)
+		free(ctx.nodes[i]);
+	for(unsigned i = 0; ctx.bufs != NULL && i < nthreads; ++i)
+		free(ctx.bufs[i].data);
+	free(ctx.nodes);
+	free(ctx.bufs);
+	btrfs_volume_close(&vol);
+	return(error || atomic_load(&ctx.errors) ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,1093 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#endif
+#include "btrfs_filesystem.h"
+#include "btrfs_compress.h"
+#include "btrfs_copy.h"
+#include "btrfs_fs.h"
+#include "btrfs_hash.h"
+#include "btrfs_pool.h"
+#include "btrfs_volume.h"
+#include "btrfs_extract.h"
+#include "crc32.h"
+
+/*
+ * Four stages. The metadata walk recreates the directory tree and cuts every
+ * file's extents into jobs, which are then sorted by the device and physical
+ * address of their first copy. One reader per device reads its jobs in that
+ * order, workers check the data checksums (going to the other copies for bad
+ * sectors) and decompress, and the calling thread writes the bytes in place.
+ * Buffers cycle through a free queue, so at most nbufs jobs are in flight and
+ * a slow destination holds the readers back instead of growing memory. Holes
+ * and preallocated ranges are never written and stay sparse in the copy.
+ *
+ * Every disk extent is read once. Its first reference is materialized from
+ * the device; later ones, in the same or another subvolume, are recorded as
+ * clones of that file range and done on the destination after the data pass,
+ * by reflink where the destination supports it.
+ */
+
+#define EXTRACT_CHUNK (1024 * 1024)             // file bytes per job from an uncompressed extent
+#define EXTRACT_MAX_DECODED (128 * 1024)        // largest compressed extent, on disk and decoded
+#define EXTRACT_BUFS_PER_THREAD 4
+#define EXTRACT_NFDS 256                        // files the writer keeps open
+
+// everything created other than the extra names of hard links, for the final chown/chmod/utimes
+struct extract_inode {
+	const char *path;                           // relative to the destination, "" for its root
+	struct btrfs_inode_attr attr;
+};
+
+// one name of a regular file; they are created once the walk is done, in inode order
+struct extract_name {
+	uint64_t ino;
+	size_t seq;                                 // walk order, the first name is the one created
+	const char *path;
+};
+
+struct extract_buf {
+	uint8_t *raw;                               // as read, EXTRACT_CHUNK plus two sectors
+	uint8_t *data;                              // decoded, EXTRACT_MAX_DECODED
+	uint32_t *csums;
+	uint8_t *present;
+};
+
+struct extract_job {
+	uint32_t inode;                             // index into ctx->inodes
+	uint16_t dev;                               // device of the first copy, ndevs when unknown
+	uint8_t compression;
+	bool read_ok;                               // the first copy read without an I/O error
+	uint64_t physical;
+	uint64_t offset;                            // file offset of the first byte
+	uint64_t len;                               // file bytes
+	uint64_t read_start;                        // sector aligned logical range to read
+	uint32_t read_len;
+	uint32_t skip;                              // bytes of the (decoded) read before the file's
+	struct extract_buf *buf;
+	const uint8_t *out;                         // len bytes to write, once decoded
+	int error;
+};
+
+// where the bytes of a disk extent were first placed
+struct extract_src {
+	uint32_t inode;
+	uint64_t file_offset;
+	uint64_t extent_offset;                     // of file_offset in the decoded extent
+	uint64_t len;
+};
+
+// a file range filled from another file once all data is written
+struct extract_clone {
+	uint32_t inode, src;
+	uint64_t offset, src_offset, len;
+};
+
+struct extract_ctx {
+	struct btrfs_volume *vol;
+	struct btrfs_subvol sv;
+	int dest;                                   // destination directory
+	struct btrfs_arena arena;                   // paths
+	char pathbuf[PATH_MAX];
+	uint8_t *scratch;                           // EXTRACT_MAX_DECODED, for symlinks and inline extents
+	
+	struct extract_inode *inodes;
+	size_t ninodes, inodes_cap;
+	struct extract_name *names;
+	size_t nnames, names_cap;
+	struct extract_job *jobs;
+	size_t njobs, jobs_cap;
+	struct btrfs_hash extents;                  // disk bytenr -> struct extract_src
+	struct extract_clone *clones;
+	size_t nclones, clones_cap;
+	
+	// the file whose extents are being listed
+	uint32_t cur;
+	int cur_fd;
+	
+	struct btrfs_queue free, work, write;
+	atomic_uint readers, workers;               // still running; the last one closes the next queue
+	_Atomic uint64_t repaired;                  // jobs that needed another copy
+	struct { uint32_t inode; int fd; } fds[EXTRACT_NFDS];
+	
+	uint64_t files, dirs, links, others, subvols, inline_bytes, data_bytes, clone_bytes, reflinked, errors;
+};
+
+struct extract_reader {
+	struct extract_ctx *ctx;
+	size_t first, last;                         // jobs of one device
+	pthread_t thread;
+};
+
+static const char *extract_save_path(struct extract_ctx *ctx, const char *path) {
+	size_t len = strlen(path) + 1;
+	char *copy = btrfs_arena_alloc(&ctx->arena, len);
+
+	if(copy != NULL)
+		memcpy(copy, path, len);
+	return(copy);
+}
+
+static int extract_add_inode(struct extract_ctx *ctx, const char *path, const struct btrfs_inode_attr *attr) {
+	struct extract_inode *grown;
+
+	if(ctx->ninodes == ctx->inodes_cap) {
+		grown = realloc(ctx->inodes, (ctx->inodes_cap ? ctx->inodes_cap * 2 : 1024) * sizeof(*grown));
+		if(grown == NULL)
+			return(ENOMEM);
+		ctx->inodes = grown;
+		ctx->inodes_cap = ctx->inodes_cap ? ctx->inodes_cap * 2 : 1024;
+	}
+	if(ctx->ninodes == UINT32_MAX)
+		return(EFBIG);
+	ctx->inodes[ctx->ninodes].path = path;
+	ctx->inodes[ctx->ninodes].attr = *attr;
+	ctx->ninodes++;
+	return(0);
+}
+
+static int extract_symlink_target(void *arg, const struct btrfs_file_extent *ext) {
+	struct extract_ctx *ctx = arg;
+	const struct btrfs_inode_attr *attr = &ctx->inodes[ctx->cur].attr;
+
+	if(ext->file_offset != 0 || ext->type != EXTENT_TYPE_INLINE || attr->size >= PATH_MAX)
+		return(EIO);
+	return(btrfs_extent_read(ctx->vol, ext, 0, ctx->scratch, attr->size));
+}
+
+// btrfs keeps the kernel's internal device number, 12 bits of major and 20 of minor
+static dev_t extract_rdev(uint64_t rdev) {
+	return(makedev(rdev >> 20, rdev & 0xfffff));
+}
+
+static int extract_create(struct extract_ctx *ctx, const char *path, const struct btrfs_inode_attr *attr) {
+	int error;
+
+	switch(attr->mode & S_IFMT) {
+	case S_IFDIR:
+		ctx->dirs++;
+		return(mkdirat(ctx->dest, path, 0700) == 0 ? 0 : errno);
+	case S_IFLNK:
+		if(attr->size >= PATH_MAX)
+			return(EIO);
+		memset(ctx->scratch, 0, attr->size + 1);
+		error = btrfs_extent_iterate(&ctx->sv, attr->ino, extract_symlink_target, ctx);
+		if(error)
+			return(error);
+		ctx->others++;
+		return(symlinkat((const char *)ctx->scratch, ctx->dest, path) == 0 ? 0 : errno);
+	case S_IFIFO:
+		ctx->others++;
+		return(mkfifoat(ctx->dest, path, 0600) == 0 ? 0 : errno);
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFSOCK:
+		ctx->others++;
+		return(mknodat(ctx->dest, path, (attr->mode & S_IFMT) | 0600, extract_rdev(attr->rdev)) == 0 ? 0 : errno);
+	default:
+		fprintf(stderr, "%s: unknown file type %o\n", path, attr->mode & S_IFMT);
+		return(EIO);
+	}
+}
+
+/*
+ * One entry that could not be extracted: reported and counted, and the walk
+ * goes on with the next. Running out of memory ends it.
+ */
+static int extract_failed(struct extract_ctx *ctx, const char *path, int error) {
+	fprintf(stderr, "%s: %s\n", path, strerror(error));
+	if(error == ENOMEM)
+		return(error);
+	ctx->errors++;
+	return(0);
+}
+
+/*
+ * Names from the image become paths under the destination, so each must be a
+ * single component: "..", a "/" or an earlier symlink followed by a later
+ * name could otherwise reach outside it.
+ */
+static bool extract_name_ok(const char *name, size_t len) {
+	if(len == 0 || memchr(name, '/', len) != NULL || memchr(name, '\0', len) != NULL)
+		return(false);
+	return(!(len == 1 && name[0] == '.') && !(len == 2 && name[0] == '.' && name[1] == '.'));
+}
+
+static int extract_dirent(void *arg, const struct btrfs_dirent *ent) {
+	struct extract_ctx *ctx = arg;
+	const char *parent = ctx->inodes[ctx->cur].path, *saved;
+	struct btrfs_inode_attr attr;
+	struct extract_name *grown;
+	size_t plen = strlen(parent);
+	char *path = ctx->pathbuf;
+	uint32_t parent_index;
+	int error;
+
+	if(!extract_name_ok(ent->name, ent->name_len)) {
+		fprintf(stderr, "%s%s%.*s: invalid name in directory\n", parent, plen > 0 ? "/" : "", (int)ent->name_len,
+		    ent->name);
+		ctx->errors++;
+		return(0);
+	}
+	if(plen + 1 + ent->name_len >= sizeof(ctx->pathbuf)) {
+		fprintf(stderr, "%s/%.*s: %s\n", parent, (int)ent->name_len, ent->name, strerror(ENAMETOOLONG));
+		ctx->errors++;
+		return(0);
+	}
+	memcpy(path, parent, plen);
+	if(plen > 0)
+		path[plen++] = '/';
+	memcpy(path + plen, ent->name, ent->name_len);
+	path[plen + ent->name_len] = '\0';
+	saved = extract_save_path(ctx, path);
+	if(saved == NULL)
+		return(ENOMEM);
+
+	// a nested subvolume is a tree of its own, leave an empty directory where it is mounted
+	if(ent->key_type != TYPE_INODE_ITEM) {
+		ctx->subvols++;
+		fprintf(stderr, "%s: subvolume %" PRIu64 " not extracted\n", path, ent->ino);
+		if(mkdirat(ctx->dest, path, 0755) != 0)
+			return(extract_failed(ctx, path, errno));
+		return(0);
+	}
+
+	if(ent->type == BTRFS_FT_REG_FILE) {
+		if(ctx->nnames == ctx->names_cap) {
+			grown = realloc(ctx->names, (ctx->names_cap ? ctx->names_cap * 2 : 1024) * sizeof(*grown));
+			if(grown == NULL)
+				return(ENOMEM);
+			ctx->names = grown;
+			ctx->names_cap = ctx->names_cap ? ctx->names_cap * 2 : 1024;
+		}
+		ctx->names[ctx->nnames] = (struct extract_name){ ent->ino, ctx->nnames, saved };
+		ctx->nnames++;
+		return(0);
+	}
+
+	error = btrfs_inode_get(&ctx->sv, ent->ino, &attr);
+	if(error == 0)
+		error = extract_add_inode(ctx, saved, &attr);
+	if(error)
+		return(extract_failed(ctx, path, error));
+
+	// extract_create() reads the symlink target through ctx->cur
+	parent_index = ctx->cur;
+	ctx->cur = ctx->ninodes - 1;
+	error = extract_create(ctx, path, &attr);
+	ctx->cur = parent_index;
+	if(error == 0)
+		return(0);
+	// not there, so neither walked nor given its owner and times later
+	ctx->ninodes--;
+	// unprivileged extraction cannot make device nodes, like it cannot chown
+	if(error == EPERM && !S_ISDIR(attr.mode) && !S_ISLNK(attr.mode)) {
+		fprintf(stderr, "%s: %s, skipped\n", path, strerror(error));
+		return(0);
+	}
+	return(extract_failed(ctx, path, error));
+}
+
+// directories in the order they were found from `first`, so the inode list grows while it is walked
+static int extract_walk(struct extract_ctx *ctx, size_t first) {
+	int error = 0;
+
+	for(size_t i = first; error == 0 && i < ctx->ninodes; ++i) {
+		if(!S_ISDIR(ctx->inodes[i].attr.mode))
+			continue;
+		ctx->cur = i;
+		error = btrfs_dir_iterate(&ctx->sv, ctx->inodes[i].attr.ino, extract_dirent, ctx);
+		// a directory that cannot be read loses its entries, not the rest of the tree
+		if(error && error != ENOMEM)
+			error = extract_failed(ctx, ctx->inodes[i].path[0] ? ctx->inodes[i].path : ".", error);
+	}
+	return(error);
+}
+
+static int extract_add_job(struct extract_ctx *ctx, const struct extract_job *job) {
+	struct extract_job *grown;
+
+	if(ctx->njobs == ctx->jobs_cap) {
+		grown = realloc(ctx->jobs, (ctx->jobs_cap ? ctx->jobs_cap * 2 : 4096) * sizeof(*grown));
+		if(grown == NULL)
+			return(ENOMEM);
+		ctx->jobs = grown;
+		ctx->jobs_cap = ctx->jobs_cap ? ctx->jobs_cap * 2 : 4096;
+	}
+	ctx->jobs[ctx->njobs++] = *job;
+	return(0);
+}
+
+static void extract_place(struct extract_ctx *ctx, struct extract_job *job) {
+	struct btrfs_device *dev;
+	uint64_t contiguous;
+
+	job->dev = ctx->vol->ndevs;
+	job->physical = job->read_start;
+	if(btrfs_map_logical(ctx->vol, job->read_start, 0, &dev, &job->physical, &contiguous) == 0)
+		job->dev = dev - ctx->vol->devs;
+}
+
+// jobs reading bytes [from, len) of the file range an extent covers
+static int extract_read(struct extract_ctx *ctx, const struct btrfs_file_extent *ext, uint64_t from, uint64_t len) {
+	uint64_t sector_mask = ctx->vol->sector_size - 1, start, end, n;
+	struct extract_job job;
+	int error;
+
+	memset(&job, 0, sizeof(job));
+	job.inode = ctx->cur;
+	job.compression = ext->compression;
+	if(ext->compression != BTRFS_COMPRESSION_NONE) {
+		// checksummed, and so read, whole
+		if(len > EXTRACT_MAX_DECODED || ext->disk_num_bytes > EXTRACT_MAX_DECODED ||
+		    ext->extent_offset + len > ext->ram_bytes)
+			return(EIO);
+		job.offset = ext->file_offset + from;
+		job.len = len - from;
+		job.read_start = ext->disk_bytenr;
+		job.read_len = ext->disk_num_bytes;
+		job.skip = ext->extent_offset + from;
+		extract_place(ctx, &job);
+		return(extract_add_job(ctx, &job));
+	}
+
+	for(uint64_t done = from; done < len; done += n) {
+		n = len - done < EXTRACT_CHUNK ? len - done : EXTRACT_CHUNK;
+		start = ext->disk_bytenr + ext->extent_offset + done;
+		end = (start + n + sector_mask) & ~sector_mask;
+		job.offset = ext->file_offset + done;
+		job.len = n;
+		job.read_start = start & ~sector_mask;
+		job.read_len = end - job.read_start;
+		job.skip = start & sector_mask;
+		extract_place(ctx, &job);
+		error = extract_add_job(ctx, &job);
+		if(error)
+			return(error);
+	}
+	return(0);
+}
+
+/*
+ * Clones the head of [offset, offset + len) from where the extent's bytes were
+ * first placed, as far as that range reaches. *cloned is the length taken.
+ */
+static int extract_add_clone(struct extract_ctx *ctx, const struct extract_src *src,
+    const struct btrfs_file_extent *ext, uint64_t offset, uint64_t len, uint64_t *cloned) {
+	struct extract_clone *grown;
+	uint64_t n, src_offset;
+
+	*cloned = 0;
+	if(ext->extent_offset < src->extent_offset || ext->extent_offset >= src->extent_offset + src->len)
+		return(0);
+	n = src->extent_offset + src->len - ext->extent_offset;
+	if(n > len)
+		n = len;
+	src_offset = src->file_offset + (ext->extent_offset - src->extent_offset);
+	// ranges of one file may not overlap
+	if(src->inode == ctx->cur && src_offset < offset + n && offset < src_offset + n)
+		return(0);
+
+	if(ctx->nclones == ctx->clones_cap) {
+		grown = realloc(ctx->clones, (ctx->clones_cap ? ctx->clones_cap * 2 : 1024) * sizeof(*grown));
+		if(grown == NULL)
+			return(ENOMEM);
+		ctx->clones = grown;
+		ctx->clones_cap = ctx->clones_cap ? ctx->clones_cap * 2 : 1024;
+	}
+	ctx->clones[ctx->nclones++] = (struct extract_clone){ ctx->cur, src->inode, offset, src_offset, n };
+	*cloned = n;
+	return(0);
+}
+
+static int extract_extent(void *arg, const struct btrfs_file_extent *ext) {
+	struct extract_ctx *ctx = arg;
+	uint64_t size = ctx->inodes[ctx->cur].attr.size;
+	uint64_t offset = ext->file_offset, len = ext->num_bytes, cloned = 0;
+	struct extract_src *src;
+	ssize_t written;
+	int error;
+
+	if(offset >= size)
+		return(0);
+	if(len > size - offset)
+		len = size - offset;
+	// holes and preallocated ranges stay sparse
+	if(ext->type == EXTENT_TYPE_PREALLOC || (ext->type == EXTENT_TYPE_REGULAR && ext->disk_bytenr == 0))
+		return(0);
+
+	// inline data lives in the leaf the walk already has, write it now
+	if(ext->type == EXTENT_TYPE_INLINE) {
+		if(len > EXTRACT_MAX_DECODED)
+			return(EIO);
+		error = btrfs_extent_read(ctx->vol, ext, 0, ctx->scratch, len);
+		if(error)
+			return(error);
+		written = pwrite(ctx->cur_fd, ctx->scratch, len, offset);
+		if(written < 0)
+			return(errno);
+		if((uint64_t)written != len)
+			return(EIO);
+		ctx->inline_bytes += len;
+		return(0);
+	}
+
+	// a disk extent already placed in some file is copied from there after the data pass
+	src = btrfs_hash_get(&ctx->extents, ext->disk_bytenr);
+	if(src != NULL) {
+		error = extract_add_clone(ctx, src, ext, offset, len, &cloned);
+		if(error || cloned == len)
+			return(error);
+	}
+	error = extract_read(ctx, ext, cloned, len);
+	if(error || src != NULL)
+		return(error);
+
+	src = btrfs_arena_alloc(&ctx->arena, sizeof(*src));
+	if(src == NULL)
+		return(ENOMEM);
+	*src = (struct extract_src){ ctx->cur, offset, ext->extent_offset, len };
+	return(btrfs_hash_put(&ctx->extents, ext->disk_bytenr, src));
+}
+
+static int extract_name_cmp(const void *a, const void *b) {
+	const struct extract_name *x = a, *y = b;
+
+	if(x->ino != y->ino)
+		return(x->ino < y->ino ? -1 : 1);
+	return(x->seq < y->seq ? -1 : x->seq > y->seq);
+}
+
+/*
+ * Regular files, in inode order so their extent items are read in fs tree
+ * order. Each is created at its full size, so whatever is not written later
+ * is a hole, and further names of the same inode become hard links. A file
+ * that fails is reported and counted and the others are still extracted.
+ */
+static int extract_files(struct extract_ctx *ctx) {
+	const struct extract_name *name;
+	struct btrfs_inode_attr attr;
+	int error = 0;
+
+	qsort(ctx->names, ctx->nnames, sizeof(*ctx->names), extract_name_cmp);
+	for(size_t i = 0; error == 0 && i < ctx->nnames; ++i) {
+		name = &ctx->names[i];
+		if(i > 0 && name->ino == ctx->names[i - 1].ino) {
+			ctx->links++;
+			for(size_t first = i; ; --first) {
+				if(first == 0 || ctx->names[first - 1].ino != name->ino) {
+					if(linkat(ctx->dest, ctx->names[first].path, ctx->dest, name->path, 0) != 0)
+						error = extract_failed(ctx, name->path, errno);
+					break;
+				}
+			}
+			continue;
+		}
+
+		error = btrfs_inode_get(&ctx->sv, name->ino, &attr);
+		if(error == 0)
+			error = extract_add_inode(ctx, name->path, &attr);
+		if(error) {
+			error = extract_failed(ctx, name->path, error);
+			continue;
+		}
+		ctx->cur = ctx->ninodes - 1;
+		ctx->cur_fd = openat(ctx->dest, name->path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+		if(ctx->cur_fd < 0) {
+			// nothing of it was queued yet, forget it
+			ctx->ninodes--;
+			error = extract_failed(ctx, name->path, errno);
+			continue;
+		}
+		ctx->files++;
+		if(ftruncate(ctx->cur_fd, attr.size) != 0)
+			error = errno;
+		if(error == 0)
+			error = btrfs_extent_iterate(&ctx->sv, name->ino, extract_extent, ctx);
+		if(close(ctx->cur_fd) != 0 && error == 0)
+			error = errno;
+		ctx->cur_fd = -1;
+		if(error)
+			error = extract_failed(ctx, name->path, error);
+	}
+	return(error);
+}
+
+static int extract_job_cmp(const void *a, const void *b) {
+	const struct extract_job *x = a, *y = b;
+
+	if(x->dev != y->dev)
+		return(x->dev < y->dev ? -1 : 1);
+	return(x->physical < y->physical ? -1 : x->physical > y->physical);
+}
+
+static void *extract_reader(void *arg) {
+	struct extract_reader *r = arg;
+	struct extract_ctx *ctx = r->ctx;
+	struct extract_job *job;
+
+	for(size_t i = r->first; i < r->last; ++i) {
+		job = &ctx->jobs[i];
+		job->buf = btrfs_queue_pop(&ctx->free);
+		if(job->buf == NULL)
+			break;
+		job->read_ok = btrfs_read_logical(ctx->vol, job->read_start, job->buf->raw, job->read_len, 0) == 0;
+		btrfs_queue_push(&ctx->work, job);
+	}
+	if(atomic_fetch_sub(&ctx->readers, 1) == 1)
+		btrfs_queue_close(&ctx->work);
+	return(NULL);
+}
+
+// checks the copy read against the csum tree and replaces bad sectors from the others, then decodes
+static int extract_decode(struct extract_ctx *ctx, struct extract_job *job) {
+	struct btrfs_volume *vol = ctx->vol;
+	struct extract_buf *buf = job->buf;
+	size_t nsectors = job->read_len / vol->sector_size;
+	bool good = job->read_ok;
+	int error;
+
+	if(good) {
+		error = btrfs_csum_lookup(vol, job->read_start, job->read_len, buf->csums, buf->present);
+		if(error)
+			return(error);
+		for(size_t i = 0; good && i < nsectors; ++i) {
+			if((buf->present[i / 8] & (1 << (i % 8))) &&
+			    ~calculate_crc32c(~0U, buf->raw + i * vol->sector_size, vol->sector_size) != buf->csums[i])
+				good = false;
+		}
+	}
+	if(!good) {
+		atomic_fetch_add_explicit(&ctx->repaired, 1, memory_order_relaxed);
+		error = btrfs_read_data(vol, job->read_start, buf->raw, job->read_len);
+		if(error)
+			return(error);
+	}
+
+	if(job->compression == BTRFS_COMPRESSION_NONE) {
+		job->out = buf->raw + job->skip;
+		return(0);
+	}
+	job->out = buf->data;
+	return(btrfs_decompress(job->compression, buf->raw, job->read_len, job->skip, buf->data, job->len));
+}
+
+static void *extract_worker(void *arg) {
+	struct extract_ctx *ctx = arg;
+	struct extract_job *job;
+
+	while((job = btrfs_queue_pop(&ctx->work)) != NULL) {
+		job->error = extract_decode(ctx, job);
+		btrfs_queue_push(&ctx->write, job);
+	}
+	if(atomic_fetch_sub(&ctx->workers, 1) == 1)
+		btrfs_queue_close(&ctx->write);
+	return(NULL);
+}
+
+// the file's descriptor from the writer's cache, read-write for the clones
+static int extract_open(struct extract_ctx *ctx, uint32_t inode, int *fd) {
+	size_t slot = inode % EXTRACT_NFDS;
+
+	if(ctx->fds[slot].fd < 0 || ctx->fds[slot].inode != inode) {
+		if(ctx->fds[slot].fd >= 0)
+			close(ctx->fds[slot].fd);
+		ctx->fds[slot].fd = openat(ctx->dest, ctx->inodes[inode].path, O_RDWR | O_NOFOLLOW);
+		if(ctx->fds[slot].fd < 0)
+			return(errno);
+		ctx->fds[slot].inode = inode;
+	}
+	*fd = ctx->fds[slot].fd;
+	return(0);
+}
+
+static int extract_write(struct extract_ctx *ctx, const struct extract_job *job) {
+	const uint8_t *data = job->out;
+	uint64_t offset = job->offset, len = job->len;
+	ssize_t n;
+	int fd, error;
+
+	error = extract_open(ctx, job->inode, &fd);
+	if(error)
+		return(error);
+	while(len > 0) {
+		n = pwrite(fd, data, len, offset);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return(errno);
+		}
+		data += n;
+		offset += n;
+		len -= n;
+	}
+	return(0);
+}
+
+// writes a decoded job out and gives its buffer back to the readers
+static void extract_complete(struct extract_ctx *ctx, struct extract_job *job) {
+	if(job->error == 0)
+		job->error = extract_write(ctx, job);
+	if(job->error) {
+		fprintf(stderr, "%s: bytes %" PRIu64 "-%" PRIu64 " (logical %" PRIu64 "): %s\n",
+		    ctx->inodes[job->inode].path, job->offset, job->offset + job->len - 1, job->read_start,
+		    strerror(job->error));
+		ctx->errors++;
+	} else
+		ctx->data_bytes += job->len;
+	btrfs_queue_push(&ctx->free, job->buf);
+	job->buf = NULL;
+}
+
+/*
+ * Runs the read, decode and write stages over the sorted jobs with `nworkers`
+ * decoders. Data errors are reported per file range and counted, the rest of
+ * the files are still extracted.
+ */
+static int extract_data(struct extract_ctx *ctx, unsigned nworkers) {
+	struct btrfs_volume *vol = ctx->vol;
+	struct extract_reader *readers;
+	struct extract_buf *bufs;
+	struct extract_job *job;
+	pthread_t *workers;
+	size_t nbufs, nreaders = 0, max_sectors;
+	unsigned started = 0;
+	int error = 0;
+
+	qsort(ctx->jobs, ctx->njobs, sizeof(*ctx->jobs), extract_job_cmp);
+
+	readers = calloc(vol->ndevs + 1, sizeof(*readers));
+	workers = calloc(nworkers, sizeof(*workers));
+	nbufs = (size_t)(nworkers + vol->ndevs + 1) * EXTRACT_BUFS_PER_THREAD;
+	bufs = calloc(nbufs, sizeof(*bufs));
+	max_sectors = (EXTRACT_CHUNK + 2 * vol->sector_size) / vol->sector_size;
+	if(readers == NULL || workers == NULL || bufs == NULL)
+		error = ENOMEM;
+	for(size_t i = 0; error == 0 && i < nbufs; ++i) {
+		bufs[i].raw = malloc(EXTRACT_CHUNK + 2 * vol->sector_size);
+		bufs[i].data = malloc(EXTRACT_MAX_DECODED);
+		bufs[i].csums = malloc(max_sectors * sizeof(uint32_t) + (max_sectors + 7) / 8);
+		if(bufs[i].raw == NULL || bufs[i].data == NULL || bufs[i].csums == NULL)
+			error = ENOMEM;
+		else
+			bufs[i].present = (uint8_t *)(bufs[i].csums + max_sectors);
+	}
+	if(error == 0 && (btrfs_queue_init(&ctx->free, nbufs) != 0 || btrfs_queue_init(&ctx->work, nbufs) != 0 ||
+	    btrfs_queue_init(&ctx->write, nbufs) != 0))
+		error = ENOMEM;
+	if(error)
+		goto out;
+	for(size_t i = 0; i < nbufs; ++i)
+		btrfs_queue_push(&ctx->free, &bufs[i]);
+
+	// one reader for each device's run of jobs
+	for(size_t i = 0; i < ctx->njobs; ) {
+		readers[nreaders] = (struct extract_reader){ .ctx = ctx, .first = i, .last = i };
+		while(readers[nreaders].last < ctx->njobs && ctx->jobs[readers[nreaders].last].dev == ctx->jobs[i].dev)
+			readers[nreaders].last++;
+		i = readers[nreaders++].last;
+	}
+	atomic_store(&ctx->readers, nreaders);
+	atomic_store(&ctx->workers, nworkers);
+	if(nreaders == 0)
+		btrfs_queue_close(&ctx->work);
+	for(size_t i = 0; i < nreaders; ++i) {
+		if(pthread_create(&readers[i].thread, NULL, extract_reader, &readers[i]) != 0) {
+			// its jobs are never read and show up as missing below
+			readers[i].first = readers[i].last;
+			error = EAGAIN;
+			if(atomic_fetch_sub(&ctx->readers, 1) == 1)
+				btrfs_queue_close(&ctx->work);
+		}
+	}
+	for(; started < nworkers; ++started) {
+		if(pthread_create(&workers[started], NULL, extract_worker, ctx) != 0)
+			break;
+	}
+	if(started == 0) {
+		// no decoder could be started, take each job through decode and write here
+		while((job = btrfs_queue_pop(&ctx->work)) != NULL) {
+			job->error = extract_decode(ctx, job);
+			extract_complete(ctx, job);
+		}
+	} else {
+		// the workers that did start may all be done already
+		if(started < nworkers && atomic_fetch_sub(&ctx->workers, nworkers - started) == nworkers - started)
+			btrfs_queue_close(&ctx->write);
+		while((job = btrfs_queue_pop(&ctx->write)) != NULL)
+			extract_complete(ctx, job);
+	}
+
+	for(size_t i = 0; i < nreaders; ++i) {
+		if(readers[i].first < readers[i].last)
+			pthread_join(readers[i].thread, NULL);
+	}
+	for(unsigned i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+out:
+	if(bufs != NULL) {
+		for(size_t i = 0; i < nbufs; ++i) {
+			free(bufs[i].raw);
+			free(bufs[i].data);
+			free(bufs[i].csums);
+		}
+	}
+	btrfs_queue_destroy(&ctx->free);
+	btrfs_queue_destroy(&ctx->work);
+	btrfs_queue_destroy(&ctx->write);
+	free(bufs);
+	free(workers);
+	free(readers);
+	return(error);
+}
+
+/*
+ * Fills the ranges whose disk extent was already materialized from the file
+ * that holds it, in the order they were found, then closes the writer's files.
+ */
+static int extract_clones(struct extract_ctx *ctx) {
+	const struct extract_clone *clone;
+	int src, dst, error = 0;
+	bool own;
+
+	for(size_t i = 0; i < ctx->nclones; ++i) {
+		clone = &ctx->clones[i];
+		// both in one cache slot, keep the source there and open the target aside
+		own = clone->inode != clone->src && clone->inode % EXTRACT_NFDS == clone->src % EXTRACT_NFDS;
+		dst = -1;
+		error = 0;
+		if(own) {
+			dst = openat(ctx->dest, ctx->inodes[clone->inode].path, O_RDWR | O_NOFOLLOW);
+			if(dst < 0)
+				error = errno;
+		} else
+			error = extract_open(ctx, clone->inode, &dst);
+		if(error == 0)
+			error = extract_open(ctx, clone->src, &src);
+		if(error == 0)
+			error = btrfs_copy_range(src, clone->src_offset, dst, clone->offset, clone->len, &ctx->reflinked);
+		if(own && dst >= 0 && close(dst) != 0 && error == 0)
+			error = errno;
+		if(error) {
+			fprintf(stderr, "%s: bytes %" PRIu64 "-%" PRIu64 " (from %s): %s\n", ctx->inodes[clone->inode].path,
+			    clone->offset, clone->offset + clone->len - 1, ctx->inodes[clone->src].path, strerror(error));
+			ctx->errors++;
+		} else
+			ctx->clone_bytes += clone->len;
+	}
+
+	error = 0;
+	for(size_t i = 0; i < EXTRACT_NFDS; ++i) {
+		if(ctx->fds[i].fd >= 0 && close(ctx->fds[i].fd) != 0 && error == 0)
+			error = errno;
+		ctx->fds[i].fd = -1;
+	}
+	return(error);
+}
+
+// owner, mode and times once nothing more is written, children before their directories
+static int extract_finish(struct extract_ctx *ctx) {
+	const struct extract_inode *inode;
+	struct timespec times[2];
+	int error = 0;
+
+	for(size_t i = ctx->ninodes; i-- > 0;) {
+		inode = &ctx->inodes[i];
+		// the destination directory keeps its own
+		if(inode->path[0] == '\0')
+			continue;
+		// unprivileged extraction keeps its own ownership
+		if(fchownat(ctx->dest, inode->path, inode->attr.uid, inode->attr.gid, AT_SYMLINK_NOFOLLOW) != 0 &&
+		    errno != EPERM)
+			error = errno;
+		if(error == 0 && !S_ISLNK(inode->attr.mode) && fchmodat(ctx->dest, inode->path, inode->attr.mode & 07777, 0) != 0)
+			error = errno;
+		times[0] = inode->attr.atime;
+		times[1] = inode->attr.mtime;
+		if(error == 0 && utimensat(ctx->dest, inode->path, times, AT_SYMLINK_NOFOLLOW) != 0)
+			error = errno;
+		if(error) {
+			fprintf(stderr, "%s: %s\n", inode->path, strerror(error));
+			ctx->errors++;
+			error = 0;
+		}
+	}
+	return(0);
+}
+
+struct extract_lookup_arg {
+	const char *name;
+	uint64_t ino;
+};
+
+static int extract_lookup_name(void *arg, const struct btrfs_dirent *ent) {
+	struct extract_lookup_arg *lookup = arg;
+
+	if(ent->key_type != TYPE_INODE_ITEM || strlen(lookup->name) != ent->name_len ||
+	    memcmp(lookup->name, ent->name, ent->name_len) != 0)
+		return(0);
+	lookup->ino = ent->ino;
+	return(1);
+}
+
+// inode of `path` below the subvolume root, following only directories of this subvolume
+static int extract_lookup(struct btrfs_subvol *sv, const char *path, uint64_t *ino) {
+	struct extract_lookup_arg lookup;
+	char component[BTRFS_NAME_MAX + 1];
+	const char *p = path;
+	size_t len;
+	int error;
+
+	*ino = BTRFS_FIRST_FREE_OBJECTID;
+	while(*p != '\0') {
+		len = strcspn(p, "/");
+		if(len > BTRFS_NAME_MAX)
+			return(ENAMETOOLONG);
+		if(len > 0 && !(len == 1 && p[0] == '.')) {
+			memcpy(component, p, len);
+			component[len] = '\0';
+			lookup.name = component;
+			error = btrfs_dir_iterate(sv, *ino, extract_lookup_name, &lookup);
+			if(error == 0)
+				return(ENOENT);
+			if(error != 1)
+				return(error);
+			*ino = lookup.ino;
+		}
+		p += len + (p[len] == '/');
+	}
+	return(0);
+}
+
+/*
+ * Walks the subtree at `path` in subvolume `id` and queues its data. With
+ * `own_dir` it goes to a new directory named after the subvolume instead of
+ * the destination itself; the jobs of all subvolumes share one data pass.
+ */
+static int extract_subvol(struct extract_ctx *ctx, uint64_t id, const char *path, bool own_dir) {
+	struct btrfs_inode_attr attr;
+	const char *root = "";
+	char name[BTRFS_NAME_MAX + 1];
+	size_t first = ctx->ninodes;
+	uint64_t ino;
+	int error;
+
+	error = btrfs_subvol_open(ctx->vol, id, &ctx->sv);
+	if(error) {
+		fprintf(stderr, "subvolume %" PRIu64 ": %s\n", id, strerror(error));
+		return(error);
+	}
+	error = extract_lookup(&ctx->sv, path, &ino);
+	if(error == 0)
+		error = btrfs_inode_get(&ctx->sv, ino, &attr);
+	if(error == 0 && !S_ISDIR(attr.mode))
+		error = ENOTDIR;
+	if(error) {
+		fprintf(stderr, "subvolume %" PRIu64 ": %s: %s\n", id, path, strerror(error));
+		return(error);
+	}
+
+	if(own_dir) {
+		if(btrfs_subvol_name(ctx->vol, id, name, sizeof(name)) != 0)
+			snprintf(name, sizeof(name), "subvol%" PRIu64, id);
+		else if(!extract_name_ok(name, strlen(name))) {
+			fprintf(stderr, "subvolume %" PRIu64 ": invalid name \"%s\"\n", id, name);
+			ctx->errors++;
+			snprintf(name, sizeof(name), "subvol%" PRIu64, id);
+		}
+		root = extract_save_path(ctx, name);
+		if(root == NULL)
+			return(ENOMEM);
+		if(mkdirat(ctx->dest, root, 0700) != 0) {
+			error = errno;
+			fprintf(stderr, "%s: %s\n", root, strerror(error));
+			return(error);
+		}
+		ctx->dirs++;
+	}
+	// without one, the subtree's root is the destination directory itself
+	error = extract_add_inode(ctx, root, &attr);
+	if(error == 0)
+		error = extract_walk(ctx, first);
+	if(error == 0)
+		error = extract_files(ctx);
+	ctx->nnames = 0;
+	return(error);
+}
+
+static double extract_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void extract_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -x [-j threads] [-v subvolume ...] [-p path] directory device ...\n");
+}
+
+int btrfs_extract_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct extract_ctx ctx = { .dest = -1, .cur_fd = -1 };
+	const char *subtree = "";
+	const char **names;
+	uint64_t *ids;
+	size_t nids = 0;
+	unsigned nworkers = btrfs_ncpu();
+	double start, walked, elapsed;
+	char *end;
+	int ch, error;
+
+	ids = calloc(argc, sizeof(*ids));
+	names = calloc(argc, sizeof(*names));
+	if(ids == NULL || names == NULL) {
+		free(ids);
+		free(names);
+		return(FSUR_IO_FAIL);
+	}
+	optind = 1;
+	while((ch = getopt(argc, argv, "j:v:p:")) != -1) {
+		switch(ch) {
+		case 'j':
+			nworkers = strtoul(optarg, &end, 0);
+			if(*end != '\0' || nworkers == 0 || nworkers > 1024) {
+				extract_usage();
+				free(ids);
+				free(names);
+				return(FSUR_INVAL);
+			}
+			break;
+		case 'v':
+			// an id or a uuid, which needs the volume to resolve
+			names[nids++] = optarg;
+			break;
+		case 'p':
+			subtree = optarg;
+			break;
+		default:
+			extract_usage();
+			free(ids);
+			free(names);
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 2) {
+		extract_usage();
+		free(ids);
+		free(names);
+		return(FSUR_INVAL);
+	}
+	ctx.dest = open(argv[0], O_RDONLY | O_DIRECTORY);
+	if(ctx.dest < 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		free(ids);
+		free(names);
+		return(FSUR_IO_FAIL);
+	}
+	if(btrfs_volume_open(&vol, argv + 1, argc - 1) != 0) {
+		close(ctx.dest);
+		free(ids);
+		free(names);
+		return(FSUR_IO_FAIL);
+	}
+	ctx.vol = &vol;
+	error = 0;
+	for(size_t i = 0; error == 0 && i < nids; ++i) {
+		error = btrfs_subvol_resolve(&vol, names[i], &ids[i]);
+		if(error)
+			fprintf(stderr, "subvolume %s: %s\n", names[i], strerror(error));
+	}
+	if(nids == 0)
+		ids[nids++] = BTRFS_ROOT_FSTREE;
+
+	btrfs_arena_init(&ctx.arena);
+	for(size_t i = 0; i < EXTRACT_NFDS; ++i)
+		ctx.fds[i].fd = -1;
+	ctx.scratch = malloc(EXTRACT_MAX_DECODED > PATH_MAX ? EXTRACT_MAX_DECODED : PATH_MAX);
+	start = extract_now();
+	walked = start;
+	if(error == 0 && ctx.scratch == NULL)
+		error = ENOMEM;
+	for(size_t i = 0; error == 0 && i < nids; ++i)
+		error = extract_subvol(&ctx, ids[i], subtree, nids > 1);
+	if(error == 0) {
+		walked = extract_now();
+		error = extract_data(&ctx, nworkers);
+	}
+	if(error == 0)
+		error = extract_clones(&ctx);
+	if(error == 0)
+		error = extract_finish(&ctx);
+	elapsed = extract_now() - start;
+	if(error)
+		fprintf(stderr, "extract failed: %s\n", strerror(error));
+
+	fprintf(stderr, "%" PRIu64 " files, %" PRIu64 " directories, %" PRIu64 " hard links, %" PRIu64 " other, "
+	    "%" PRIu64 " nested subvolumes skipped\n", ctx.files, ctx.dirs, ctx.links, ctx.others, ctx.subvols);
+	fprintf(stderr, "%" PRIu64 " data bytes in %zu reads (%" PRIu64 " from another copy), %" PRIu64 " inline bytes, "
+	    "metadata %.3fs, total %.3fs, %.1f MiB/s\n", ctx.data_bytes, ctx.njobs, atomic_load(&ctx.repaired),
+	    ctx.inline_bytes, walked - start, elapsed, elapsed > 0 ? ctx.data_bytes / elapsed / (1024 * 1024) : 0.0);
+	if(ctx.nclones)
+		fprintf(stderr, "%" PRIu64 " bytes in %zu ranges cloned from extents already extracted (%" PRIu64 " reflinked)\n",
+		    ctx.clone_bytes, ctx.nclones, ctx.reflinked);
+	if(ctx.errors)
+		fprintf(stderr, "%" PRIu64 " errors\n", ctx.errors);
+
+	for(size_t i = 0; i < EXTRACT_NFDS; ++i) {
+		if(ctx.fds[i].fd >= 0)
+			close(ctx.fds[i].fd);
+	}
+	free(ctx.scratch);
+	free(ctx.inodes);
+	free(ctx.names);
+	free(ctx.jobs);
+	free(ctx.clones);
+	free(ids);
+	free(names);
+	btrfs_hash_free(&ctx.extents);
+	btrfs_arena_destroy(&ctx.arena);
+	btrfs_volume_close(&vol);
+	close(ctx.dest);
+	return(error || ctx.errors ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,144 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_ioctl.h"
+#include "btrfs_fiemap.h"
+
+// one call covers this many extents, most files need no second one
+#define FIEMAP_BATCH 512
+
+static void fiemap_print_flags(uint32_t flags) {
+	static const struct {
+		uint32_t flag;
+		const char *name;
+	} names[] = {
+		{ BTRFS_FIEMAP_INLINE, "inline" },
+		{ BTRFS_FIEMAP_PREALLOC, "prealloc" },
+		{ BTRFS_FIEMAP_COMPRESSED, "compressed" },
+		{ BTRFS_FIEMAP_SHARED, "shared" },
+		{ BTRFS_FIEMAP_UNMAPPED, "unmapped" },
+		{ BTRFS_FIEMAP_LAST, "last" },
+	};
+	const char *sep = "";
+
+	for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if(flags & names[i].flag) {
+			printf("%s%s", sep, names[i].name);
+			sep = ",";
+		}
+	}
+	printf("\n");
+}
+
+static int fiemap_file(const char *file, uint32_t flags, struct btrfs_fiemap_extent *extents) {
+	struct btrfs_fiemap fm;
+	uint64_t total = 0;
+	int fd, error = 0;
+
+	if((fd = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return(errno);
+	}
+
+	fm.fm_start = 0;
+	for(;;) {
+		fm.fm_length = UINT64_MAX - fm.fm_start;
+		fm.fm_extents = (uint64_t)(uintptr_t)extents;
+		fm.fm_flags = flags;
+		fm.fm_count = FIEMAP_BATCH;
+		fm.fm_next = 0;
+		if(ioctl(fd, BTRFS_IOC_FIEMAP, &fm) < 0) {
+			error = errno;
+			fprintf(stderr, "%s: %s\n", file, error == ENOTTY ? "not on a mounted btrfs" : strerror(error));
+			break;
+		}
+		if(fm.fm_start == 0) {
+			printf("%s:\n", file);
+			printf("%18s %12s %18s %18s %6s %12s %12s  %s\n", "offset", "length", "logical", "physical", "devid",
+			    "disk bytes", "ram bytes", "flags");
+		}
+		for(uint32_t i = 0; i < fm.fm_count; ++i) {
+			const struct btrfs_fiemap_extent *fe = &extents[i];
+
+			printf("%18" PRIu64 " %12" PRIu64 " %18" PRIu64 " %18" PRIu64 " %6" PRIu64 " %12" PRIu64 " %12" PRIu64 "  ",
+			    fe->fe_offset, fe->fe_length, fe->fe_logical, fe->fe_physical, fe->fe_devid, fe->fe_disk_bytes,
+			    fe->fe_ram_bytes);
+			fiemap_print_flags(fe->fe_flags);
+		}
+		total += fm.fm_count;
+		// a short batch means the range is exhausted
+		if(fm.fm_count < FIEMAP_BATCH || (extents[fm.fm_count - 1].fe_flags & BTRFS_FIEMAP_LAST) ||
+		    fm.fm_next <= fm.fm_start)
+			break;
+		fm.fm_start = fm.fm_next;
+	}
+	if(error == 0)
+		printf("%" PRIu64 " extents\n", total);
+	close(fd);
+	return(error);
+}
+
+int btrfs_fiemap_main(int argc, char *argv[]) {
+	struct btrfs_fiemap_extent *extents;
+	uint32_t flags = 0;
+	int ch, error = 0;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "s")) != -1) {
+		switch(ch) {
+		case 's':
+			flags |= BTRFS_FIEMAP_CHECK_SHARED;
+			break;
+		default:
+			fprintf(stderr, "usage: btrfs.util -e [-s] file ...\n");
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1) {
+		fprintf(stderr, "usage: btrfs.util -e [-s] file ...\n");
+		return(FSUR_INVAL);
+	}
+
+	extents = calloc(FIEMAP_BATCH, sizeof(*extents));
+	if(extents == NULL)
+		return(FSUR_IO_FAIL);
+	for(int i = 0; i < argc; ++i) {
+		if(fiemap_file(argv[i], flags, extents) != 0)
+			error = EIO;
+	}
+	free(extents);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
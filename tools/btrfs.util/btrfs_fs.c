@@ -0,0 +1,525 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "btrfs_fs.h"
+#include "btrfs_super.h"
+#include "btrfs_compress.h"
+
+#define FS_EXTENT_HEADER_SIZE __builtin_offsetof(btrfs_extent_data, data)
+// deeper than any real tree, only a corrupt loop of INODE_REFs gets there
+#define FS_PATH_DEPTH_MAX 4096
+
+int btrfs_subvol_open(struct btrfs_volume *vol, uint64_t id, struct btrfs_subvol *sv) {
+	struct btrfs_key key = { .obj_id = id, .obj_type = TYPE_ROOT_ITEM, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *item;
+	uint32_t size;
+	int error;
+
+	memset(sv, 0, sizeof(*sv));
+	sv->vol = vol;
+	sv->id = id;
+	error = btrfs_search(vol, vol->sb.root_tree_addr, vol->sb.root_level, &key, &path);
+	if(error == 0) {
+		item = btrfs_path_key(&path);
+		size = btrfs_path_size(&path);
+		if(btrfs_disk_key_objectid(item) != id || btrfs_disk_key_type(item) != TYPE_ROOT_ITEM ||
+		    size < __builtin_offsetof(struct btrfs_root_item, generation2))
+			error = ENOENT;
+	}
+	if(error == 0) {
+		item = btrfs_path_data(&path);
+		sv->root.bytenr = BTRFS_GET_LE64(item, struct btrfs_root_item, block_number);
+		sv->root.level = BTRFS_GET_U8(item, struct btrfs_root_item, root_level);
+		sv->generation = BTRFS_GET_LE64(item, struct btrfs_root_item, generation);
+		// roots written by old kernels end before the uuids
+		if(size >= __builtin_offsetof(struct btrfs_root_item, otransid)) {
+			memcpy(sv->uuid, BTRFS_FIELD(item, struct btrfs_root_item, uuid), BTRFS_UUID_SIZE);
+			memcpy(sv->parent_uuid, BTRFS_FIELD(item, struct btrfs_root_item, parent_uuid), BTRFS_UUID_SIZE);
+			memcpy(sv->received_uuid, BTRFS_FIELD(item, struct btrfs_root_item, received_uuid), BTRFS_UUID_SIZE);
+			sv->ctransid = BTRFS_GET_LE64(item, struct btrfs_root_item, ctransid);
+		} else
+			sv->ctransid = sv->generation;
+	}
+	btrfs_path_release(&path);
+	return(error);
+}
+
+// the root item still carries the uuid the UUID tree filed it under
+static bool fs_uuid_matches(struct btrfs_volume *vol, uint64_t id, const uint8_t *uuid, uint8_t type) {
+	struct btrfs_subvol sv;
+
+	if(btrfs_subvol_open(vol, id, &sv) != 0)
+		return(false);
+	return(memcmp(type == TYPE_SUBVOL_UUID ? sv.uuid : sv.received_uuid, uuid, BTRFS_UUID_SIZE) == 0);
+}
+
+struct fs_uuid_scan {
+	struct btrfs_volume *vol;
+	const uint8_t *uuid;
+	uint8_t type;
+	uint64_t *ids;
+	size_t max, count;
+};
+
+static int fs_uuid_scan_one(void *arg, uint64_t id) {
+	struct fs_uuid_scan *scan = arg;
+
+	if(fs_uuid_matches(scan->vol, id, scan->uuid, scan->type)) {
+		if(scan->count < scan->max)
+			scan->ids[scan->count] = id;
+		scan->count++;
+	}
+	return(0);
+}
+
+int btrfs_subvol_by_uuid(struct btrfs_volume *vol, const uint8_t *uuid, uint8_t type, uint64_t *ids, size_t max,
+    size_t *count) {
+	struct btrfs_key key = { .obj_id = btrfs_get_le64(uuid), .obj_type = type,
+	    .offset = btrfs_get_le64(uuid + sizeof(uint64_t)) };
+	struct fs_uuid_scan scan = { vol, uuid, type, ids, max, 0 };
+	struct btrfs_path path;
+	const uint8_t *item, *data;
+	uint64_t bytenr, id;
+	uint8_t level;
+	int error;
+
+	*count = 0;
+	error = btrfs_find_root(vol, BTRFS_ROOT_UUID, &bytenr, &level);
+	if(error == ENOENT) {
+		error = btrfs_subvol_iterate(vol, fs_uuid_scan_one, &scan);
+		*count = scan.count;
+		return(error == 0 && scan.count == 0 ? ENOENT : error);
+	}
+	if(error)
+		return(error);
+
+	error = btrfs_search(vol, bytenr, level, &key, &path);
+	if(error == 0) {
+		item = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(item) != key.obj_id || btrfs_disk_key_type(item) != type ||
+		    btrfs_disk_key_offset(item) != key.offset)
+			error = ENOENT;
+	}
+	if(error == 0) {
+		// received subvolumes can share a uuid, so the item is a list
+		data = btrfs_path_data(&path);
+		for(uint32_t off = 0; off + sizeof(uint64_t) <= btrfs_path_size(&path); off += sizeof(uint64_t)) {
+			id = btrfs_get_le64(data + off);
+			if(!fs_uuid_matches(vol, id, uuid, type))
+				continue;
+			if(*count < max)
+				ids[*count] = id;
+			(*count)++;
+		}
+	}
+	btrfs_path_release(&path);
+	if(error == ENOENT)
+		error = 0;
+	// mkfs does not file the top level subvolume, which snapshots are often
+	// taken of
+	if(error == 0 && *count == 0 && type == TYPE_SUBVOL_UUID &&
+	    fs_uuid_matches(vol, BTRFS_ROOT_FSTREE, uuid, type)) {
+		if(max > 0)
+			ids[0] = BTRFS_ROOT_FSTREE;
+		*count = 1;
+	}
+	return(error == 0 && *count == 0 ? ENOENT : error);
+}
+
+int btrfs_subvol_resolve(struct btrfs_volume *vol, const char *arg, uint64_t *id) {
+	btrfs_uuid uuid;
+	size_t count;
+	char *end;
+
+	if(btrfs_uuid_parse(arg, &uuid) == 0)
+		return(btrfs_subvol_by_uuid(vol, uuid.uuid, TYPE_SUBVOL_UUID, id, 1, &count));
+	*id = strtoull(arg, &end, 0);
+	return(*id == 0 || *end != '\0' ? EINVAL : 0);
+}
+
+int btrfs_subvol_iterate(struct btrfs_volume *vol, int (*fn)(void *arg, uint64_t id), void *arg) {
+	struct btrfs_key key = { .obj_id = BTRFS_ROOT_FSTREE, .obj_type = TYPE_ROOT_ITEM, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *item;
+	uint64_t id, last = 0;
+	int error;
+
+	error = btrfs_search(vol, vol->sb.root_tree_addr, vol->sb.root_level, &key, &path);
+	for(; error == 0; error = btrfs_next_item(vol, &path)) {
+		item = btrfs_path_key(&path);
+		id = btrfs_disk_key_objectid(item);
+		if(id > BTRFS_LAST_FREE_OBJECTID)
+			break;
+		// the trees between the top level and the first subvolume are internal ones
+		if(btrfs_disk_key_type(item) != TYPE_ROOT_ITEM || id == last ||
+		    (id != BTRFS_ROOT_FSTREE && id < BTRFS_FIRST_FREE_OBJECTID))
+			continue;
+		last = id;
+		error = fn(arg, id);
+		if(error)
+			break;
+	}
+	btrfs_path_release(&path);
+	return(error == ENOENT ? 0 : error);
+}
+
+int btrfs_subvol_name(struct btrfs_volume *vol, uint64_t id, char *name, size_t size) {
+	struct btrfs_key key = { .obj_id = id, .obj_type = TYPE_ROOT_BACKREF, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *item;
+	uint16_t len;
+	int error;
+
+	error = btrfs_search(vol, vol->sb.root_tree_addr, vol->sb.root_level, &key, &path);
+	if(error == 0) {
+		item = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(item) != id || btrfs_disk_key_type(item) != TYPE_ROOT_BACKREF ||
+		    btrfs_path_size(&path) < __builtin_offsetof(ROOT_REF, name))
+			error = ENOENT;
+	}
+	if(error == 0) {
+		item = btrfs_path_data(&path);
+		len = BTRFS_GET_LE16(item, ROOT_REF, n);
+		if(len >= size || __builtin_offsetof(ROOT_REF, name) + len > btrfs_path_size(&path))
+			error = ENAMETOOLONG;
+		else {
+			memcpy(name, item + __builtin_offsetof(ROOT_REF, name), len);
+			name[len] = '\0';
+		}
+	}
+	btrfs_path_release(&path);
+	return(error);
+}
+
+static void fs_timespec(const uint8_t *p, struct timespec *ts) {
+	ts->tv_sec = (time_t)BTRFS_GET_LE64(p, btrfs_timespec, seconds);
+	ts->tv_nsec = BTRFS_GET_LE32(p, btrfs_timespec, nanoseconds);
+}
+
+int btrfs_inode_get(struct btrfs_subvol *sv, uint64_t ino, struct btrfs_inode_attr *attr) {
+	struct btrfs_key key = { .obj_id = ino, .obj_type = TYPE_INODE_ITEM, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *p;
+	int error;
+
+	error = btrfs_search(sv->vol, sv->root.bytenr, sv->root.level, &key, &path);
+	if(error == 0) {
+		p = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(p) != ino || btrfs_disk_key_type(p) != TYPE_INODE_ITEM)
+			error = ENOENT;
+		else if(btrfs_path_size(&path) < sizeof(btrfs_inode_item))
+			error = EIO;
+	}
+	if(error == 0) {
+		p = btrfs_path_data(&path);
+		attr->ino = ino;
+		attr->generation = BTRFS_GET_LE64(p, btrfs_inode_item, generation);
+		attr->transid = BTRFS_GET_LE64(p, btrfs_inode_item, transid);
+		attr->size = BTRFS_GET_LE64(p, btrfs_inode_item, st_size);
+		attr->nbytes = BTRFS_GET_LE64(p, btrfs_inode_item, st_blocks);
+		attr->nlink = BTRFS_GET_LE32(p, btrfs_inode_item, st_nlink);
+		attr->uid = BTRFS_GET_LE32(p, btrfs_inode_item, st_uid);
+		attr->gid = BTRFS_GET_LE32(p, btrfs_inode_item, st_gid);
+		attr->mode = BTRFS_GET_LE32(p, btrfs_inode_item, st_mode);
+		attr->rdev = BTRFS_GET_LE64(p, btrfs_inode_item, st_rdev);
+		attr->flags = BTRFS_GET_LE64(p, btrfs_inode_item, flags);
+		fs_timespec(BTRFS_FIELD(p, btrfs_inode_item, atime), &attr->atime);
+		fs_timespec(BTRFS_FIELD(p, btrfs_inode_item, ctime), &attr->ctime);
+		fs_timespec(BTRFS_FIELD(p, btrfs_inode_item, mtime), &attr->mtime);
+		fs_timespec(BTRFS_FIELD(p, btrfs_inode_item, otime), &attr->otime);
+	}
+	btrfs_path_release(&path);
+	return(error);
+}
+
+int btrfs_inode_parent(struct btrfs_subvol *sv, uint64_t ino, uint64_t *parent, char *name, size_t size) {
+	struct btrfs_key key = { .obj_id = ino, .obj_type = TYPE_INODE_REF, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *k, *p;
+	uint32_t item_size;
+	uint16_t len = 0;
+	int error;
+
+	error = btrfs_search(sv->vol, sv->root.bytenr, sv->root.level, &key, &path);
+	if(error == 0) {
+		k = btrfs_path_key(&path);
+		p = btrfs_path_data(&path);
+		item_size = btrfs_path_size(&path);
+		if(btrfs_disk_key_objectid(k) != ino)
+			error = ENOENT;
+		else if(btrfs_disk_key_type(k) == TYPE_INODE_REF) {
+			len = item_size >= sizeof(btrfs_inode_ref) ? BTRFS_GET_LE16(p, btrfs_inode_ref, name_len) : 0;
+			if(len == 0 || sizeof(btrfs_inode_ref) + len > item_size)
+				error = EIO;
+			*parent = btrfs_disk_key_offset(k);
+			p += sizeof(btrfs_inode_ref);
+		} else if(btrfs_disk_key_type(k) == TYPE_INODE_EXTREF) {
+			len = item_size >= sizeof(btrfs_inode_extref) ? BTRFS_GET_LE16(p, btrfs_inode_extref, name_len) : 0;
+			if(len == 0 || sizeof(btrfs_inode_extref) + len > item_size)
+				error = EIO;
+			*parent = BTRFS_GET_LE64(p, btrfs_inode_extref, dir);
+			p += sizeof(btrfs_inode_extref);
+		} else
+			error = ENOENT;
+	}
+	if(error == 0 && len >= size)
+		error = ENAMETOOLONG;
+	if(error == 0) {
+		memcpy(name, p, len);
+		name[len] = '\0';
+	}
+	btrfs_path_release(&path);
+	return(error);
+}
+
+int btrfs_inode_path(struct btrfs_subvol *sv, uint64_t ino, char *path, size_t size) {
+	char name[BTRFS_NAME_MAX + 1];
+	size_t pos = size - 1, len;
+	uint64_t parent;
+	int depth, error;
+
+	if(size == 0)
+		return(ENAMETOOLONG);
+	// built from the end of the buffer backwards, then moved to the front
+	path[pos] = '\0';
+	for(depth = 0; ino != BTRFS_FIRST_FREE_OBJECTID; ++depth) {
+		if(depth == FS_PATH_DEPTH_MAX)
+			return(ELOOP);
+		error = btrfs_inode_parent(sv, ino, &parent, name, sizeof(name));
+		if(error)
+			return(error);
+		len = strlen(name);
+		if(len + (pos < size - 1) > pos)
+			return(ENAMETOOLONG);
+		if(pos < size - 1)
+			path[--pos] = '/';
+		pos -= len;
+		memcpy(path + pos, name, len);
+		ino = parent;
+	}
+	memmove(path, path + pos, size - pos);
+	return(0);
+}
+
+// every item of one type belonging to `ino`, in key order
+typedef int (*fs_item_fn)(void *arg, const uint8_t *key, const uint8_t *data, uint32_t size);
+
+static int fs_iterate(struct btrfs_subvol *sv, uint64_t ino, uint8_t type, fs_item_fn fn, void *arg) {
+	struct btrfs_key key = { .obj_id = ino, .obj_type = type, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *k;
+	int error;
+
+	for(error = btrfs_search(sv->vol, sv->root.bytenr, sv->root.level, &key, &path); error == 0;
+	    error = btrfs_next_item(sv->vol, &path)) {
+		k = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(k) != ino || btrfs_disk_key_type(k) != type)
+			break;
+		error = fn(arg, k, btrfs_path_data(&path), btrfs_path_size(&path));
+		if(error)
+			break;
+	}
+	btrfs_path_release(&path);
+	return(error == ENOENT ? 0 : error);
+}
+
+struct fs_dir_ctx {
+	int (*fn)(void *arg, const struct btrfs_dirent *ent);
+	void *arg;
+};
+
+static int fs_dir_item(void *arg, const uint8_t *key, const uint8_t *data, uint32_t size) {
+	struct fs_dir_ctx *ctx = arg;
+	struct btrfs_dirent ent;
+	const uint8_t *location;
+
+	// a DIR_INDEX holds exactly one entry
+	if(size < sizeof(struct btrfs_dir_item))
+		return(EIO);
+	location = BTRFS_FIELD(data, struct btrfs_dir_item, key);
+	ent.dir = btrfs_disk_key_objectid(key);
+	ent.index = btrfs_disk_key_offset(key);
+	ent.ino = btrfs_disk_key_objectid(location);
+	ent.key_type = btrfs_disk_key_type(location);
+	ent.type = BTRFS_GET_U8(data, struct btrfs_dir_item, type);
+	ent.name_len = BTRFS_GET_LE16(data, struct btrfs_dir_item, name_length);
+	ent.name = (const char *)data + sizeof(struct btrfs_dir_item);
+	if(sizeof(struct btrfs_dir_item) + ent.name_len > size)
+		return(EIO);
+	return(ctx->fn(ctx->arg, &ent));
+}
+
+int btrfs_dir_iterate(struct btrfs_subvol *sv, uint64_t dir, int (*fn)(void *arg, const struct btrfs_dirent *ent),
+    void *arg) {
+	struct fs_dir_ctx ctx = { fn, arg };
+
+	return(fs_iterate(sv, dir, TYPE_DIR_INDEX, fs_dir_item, &ctx));
+}
+
+struct fs_xattr_ctx {
+	int (*fn)(void *arg, const struct btrfs_xattr *xattr);
+	void *arg;
+};
+
+// names colliding on the hash share one item
+static int fs_xattr_item(void *arg, const uint8_t *key, const uint8_t *data, uint32_t size) {
+	struct fs_xattr_ctx *ctx = arg;
+	struct btrfs_xattr xattr;
+	const uint8_t *di;
+	int error;
+
+	(void)key;
+	for(uint32_t off = 0; off + sizeof(struct btrfs_dir_item) <= size;
+	    off += sizeof(struct btrfs_dir_item) + xattr.name_len + xattr.value_len) {
+		di = data + off;
+		xattr.name_len = BTRFS_GET_LE16(di, struct btrfs_dir_item, name_length);
+		xattr.value_len = BTRFS_GET_LE16(di, struct btrfs_dir_item, extended_attribute_len);
+		if(off + sizeof(struct btrfs_dir_item) + xattr.name_len + xattr.value_len > size)
+			return(EIO);
+		xattr.name = (const char *)di + sizeof(struct btrfs_dir_item);
+		xattr.value = di + sizeof(struct btrfs_dir_item) + xattr.name_len;
+		error = ctx->fn(ctx->arg, &xattr);
+		if(error)
+			return(error);
+	}
+	return(0);
+}
+
+int btrfs_xattr_iterate(struct btrfs_subvol *sv, uint64_t ino, int (*fn)(void *arg, const struct btrfs_xattr *xattr),
+    void *arg) {
+	struct fs_xattr_ctx ctx = { fn, arg };
+
+	return(fs_iterate(sv, ino, TYPE_XATTR_ITEM, fs_xattr_item, &ctx));
+}
+
+struct fs_extent_ctx {
+	int (*fn)(void *arg, const struct btrfs_file_extent *ext);
+	void *arg;
+};
+
+int btrfs_extent_decode(uint64_t file_offset, const uint8_t *data, uint32_t size, struct btrfs_file_extent *ext) {
+	const uint8_t *ed2 = data + FS_EXTENT_HEADER_SIZE;
+
+	if(size < FS_EXTENT_HEADER_SIZE)
+		return(EIO);
+	if(BTRFS_GET_U8(data, btrfs_extent_data, encryption) != BTRFS_ENCRYPTION_NONE ||
+	    BTRFS_GET_LE16(data, btrfs_extent_data, encoding) != BTRFS_ENCODING_NONE)
+		return(EOPNOTSUPP);
+	memset(ext, 0, sizeof(*ext));
+	ext->file_offset = file_offset;
+	ext->generation = BTRFS_GET_LE64(data, btrfs_extent_data, generation);
+	ext->type = BTRFS_GET_U8(data, btrfs_extent_data, type);
+	ext->compression = BTRFS_GET_U8(data, btrfs_extent_data, compression);
+	ext->ram_bytes = BTRFS_GET_LE64(data, btrfs_extent_data, decoded_size);
+	if(ext->type == EXTENT_TYPE_INLINE) {
+		ext->num_bytes = ext->ram_bytes;
+		ext->inline_data = ed2;
+		ext->inline_len = size - FS_EXTENT_HEADER_SIZE;
+	} else {
+		if(size < FS_EXTENT_HEADER_SIZE + sizeof(btrfs_extent_data2))
+			return(EIO);
+		ext->disk_bytenr = BTRFS_GET_LE64(ed2, btrfs_extent_data2, address);
+		ext->disk_num_bytes = BTRFS_GET_LE64(ed2, btrfs_extent_data2, size);
+		ext->extent_offset = BTRFS_GET_LE64(ed2, btrfs_extent_data2, offset);
+		ext->num_bytes = BTRFS_GET_LE64(ed2, btrfs_extent_data2, num_bytes);
+	}
+	return(0);
+}
+
+static int fs_extent_item(void *arg, const uint8_t *key, const uint8_t *data, uint32_t size) {
+	struct fs_extent_ctx *ctx = arg;
+	struct btrfs_file_extent ext;
+	int error;
+
+	error = btrfs_extent_decode(btrfs_disk_key_offset(key), data, size, &ext);
+	if(error)
+		return(error);
+	return(ctx->fn(ctx->arg, &ext));
+}
+
+int btrfs_extent_iterate(struct btrfs_subvol *sv, uint64_t ino,
+    int (*fn)(void *arg, const struct btrfs_file_extent *ext), void *arg) {
+	struct fs_extent_ctx ctx = { fn, arg };
+
+	return(fs_iterate(sv, ino, TYPE_EXTENT_DATA, fs_extent_item, &ctx));
+}
+
+int btrfs_extent_read(struct btrfs_volume *vol, const struct btrfs_file_extent *ext, uint64_t offset, uint8_t *buf,
+    size_t len) {
+	uint64_t start, end, sector_mask = vol->sector_size - 1;
+	uint8_t *tmp;
+	int error;
+
+	if(ext->type == EXTENT_TYPE_INLINE) {
+		if(ext->compression != BTRFS_COMPRESSION_NONE)
+			return(btrfs_decompress(ext->compression, ext->inline_data, ext->inline_len, offset, buf, len));
+		if(offset < ext->inline_len) {
+			size_t n = ext->inline_len - offset < len ? ext->inline_len - offset : len;
+
+			memcpy(buf, ext->inline_data + offset, n);
+			memset(buf + n, 0, len - n);
+		} else
+			memset(buf, 0, len);
+		return(0);
+	}
+	if(ext->type == EXTENT_TYPE_PREALLOC || ext->disk_bytenr == 0) {
+		memset(buf, 0, len);
+		return(0);
+	}
+
+	// compressed extents are checksummed, and so read, whole
+	if(ext->compression != BTRFS_COMPRESSION_NONE) {
+		tmp = malloc(ext->disk_num_bytes);
+		if(tmp == NULL)
+			return(ENOMEM);
+		error = btrfs_read_data(vol, ext->disk_bytenr, tmp, ext->disk_num_bytes);
+		if(error == 0)
+			error = btrfs_decompress(ext->compression, tmp, ext->disk_num_bytes, ext->extent_offset + offset, buf,
+			    len);
+		free(tmp);
+		return(error);
+	}
+
+	start = ext->disk_bytenr + ext->extent_offset + offset;
+	end = start + len;
+	if((start & sector_mask) == 0 && (end & sector_mask) == 0)
+		return(btrfs_read_data(vol, start, buf, len));
+	start &= ~sector_mask;
+	end = (end + sector_mask) & ~sector_mask;
+	tmp = malloc(end - start);
+	if(tmp == NULL)
+		return(ENOMEM);
+	error = btrfs_read_data(vol, start, tmp, end - start);
+	if(error == 0)
+		memcpy(buf, tmp + ((ext->disk_bytenr + ext->extent_offset + offset) & sector_mask), len);
+	free(tmp);
+	return(error);
+}
@@ -0,0 +1,168 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_FS_H
+#define _BTRFS_FS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "btrfs_volume.h"
+
+/*
+ * Files in one subvolume (fs tree) of an open volume: inodes, directory
+ * entries, xattrs and file extents, decoded to host order. The iterators call
+ * `fn` once per item in key order and stop at the first nonzero return, which
+ * they pass back; pointers handed to `fn` are only valid during the call.
+ */
+
+#define BTRFS_FIRST_FREE_OBJECTID 256           // root directory of every subvolume
+#define BTRFS_NAME_MAX 255
+
+// directory entry types (btrfs_dir_item.type)
+#define BTRFS_FT_UNKNOWN  0
+#define BTRFS_FT_REG_FILE 1
+#define BTRFS_FT_DIR      2
+#define BTRFS_FT_CHRDEV   3
+#define BTRFS_FT_BLKDEV   4
+#define BTRFS_FT_FIFO     5
+#define BTRFS_FT_SOCK     6
+#define BTRFS_FT_SYMLINK  7
+#define BTRFS_FT_XATTR    8
+
+struct btrfs_subvol {
+    struct btrfs_volume *vol;
+    uint64_t id;
+    struct btrfs_tree_root root;
+    uint8_t uuid[BTRFS_UUID_SIZE];
+    uint8_t parent_uuid[BTRFS_UUID_SIZE];       // of the subvolume this is a snapshot of
+    uint8_t received_uuid[BTRFS_UUID_SIZE];     // of the one sent, when created by receive
+    uint64_t generation;
+    uint64_t ctransid;
+};
+
+// Looks `id` up in the root tree. Returns 0, ENOENT or another errno.
+int btrfs_subvol_open(struct btrfs_volume *vol, uint64_t id, struct btrfs_subvol *sv);
+
+/*
+ * Subvolumes whose uuid (TYPE_SUBVOL_UUID) or received uuid
+ * (TYPE_SUBVOL_REC_UUID) is `uuid`, through the UUID tree, where the key is
+ * the two halves of the uuid. Stale entries are checked against the root item
+ * and dropped. Filesystems created before the UUID tree existed fall back to
+ * reading every root item. Up to `max` ids go to `ids` and *count is how many
+ * matched. Returns 0, ENOENT when none did, or another errno.
+ */
+int btrfs_subvol_by_uuid(struct btrfs_volume *vol, const uint8_t *uuid, uint8_t type, uint64_t *ids, size_t max,
+    size_t *count);
+
+// Subvolume named on a command line by id or by uuid. Returns 0, EINVAL when
+// `arg` is neither, ENOENT or another errno.
+int btrfs_subvol_resolve(struct btrfs_volume *vol, const char *arg, uint64_t *id);
+
+// Calls fn with the id of every subvolume, the top level one first, in id
+// order. A nonzero return stops the walk and is returned.
+int btrfs_subvol_iterate(struct btrfs_volume *vol, int (*fn)(void *arg, uint64_t id), void *arg);
+
+// Name of subvolume `id` in its parent directory, from its ROOT_BACKREF.
+// Returns 0, ENOENT for the top level or ENAMETOOLONG.
+int btrfs_subvol_name(struct btrfs_volume *vol, uint64_t id, char *name, size_t size);
+
+struct btrfs_inode_attr {
+    uint64_t ino;
+    uint64_t generation;
+    uint64_t transid;
+    uint64_t size;
+    uint64_t nbytes;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t mode;
+    uint64_t rdev;
+    uint64_t flags;
+    struct timespec atime, ctime, mtime, otime;
+};
+
+int btrfs_inode_get(struct btrfs_subvol *sv, uint64_t ino, struct btrfs_inode_attr *attr);
+
+// One name of `ino`: the directory holding it and its name there, from its
+// first INODE_REF or INODE_EXTREF. Returns 0, ENOENT, ENAMETOOLONG or another errno.
+int btrfs_inode_parent(struct btrfs_subvol *sv, uint64_t ino, uint64_t *parent, char *name, size_t size);
+
+// Path of `ino` below the subvolume's root directory, following the first name
+// at each level; "" for the root directory itself.
+int btrfs_inode_path(struct btrfs_subvol *sv, uint64_t ino, char *path, size_t size);
+
+struct btrfs_dirent {
+    uint64_t dir;
+    uint64_t index;                             // DIR_INDEX sequence, creation order
+    uint64_t ino;
+    uint8_t key_type;                           // TYPE_INODE_ITEM, or TYPE_ROOT_ITEM for a subvolume
+    uint8_t type;                               // BTRFS_FT_*
+    uint16_t name_len;
+    const char *name;                           // not terminated
+};
+
+int btrfs_dir_iterate(struct btrfs_subvol *sv, uint64_t dir, int (*fn)(void *arg, const struct btrfs_dirent *ent),
+    void *arg);
+
+struct btrfs_xattr {
+    uint16_t name_len;
+    uint16_t value_len;
+    const char *name;
+    const uint8_t *value;
+};
+
+int btrfs_xattr_iterate(struct btrfs_subvol *sv, uint64_t ino, int (*fn)(void *arg, const struct btrfs_xattr *xattr),
+    void *arg);
+
+struct btrfs_file_extent {
+    uint64_t file_offset;
+    uint64_t generation;
+    uint8_t type;                               // EXTENT_TYPE_*
+    uint8_t compression;
+    uint64_t ram_bytes;                         // decoded size of the whole extent
+    uint64_t num_bytes;                         // bytes of the file it covers
+    // regular and prealloc extents, disk_bytenr 0 is a hole
+    uint64_t disk_bytenr;
+    uint64_t disk_num_bytes;
+    uint64_t extent_offset;                     // where the file's bytes start in the decoded extent
+    // inline extents
+    const uint8_t *inline_data;
+    uint32_t inline_len;
+};
+
+int btrfs_extent_iterate(struct btrfs_subvol *sv, uint64_t ino,
+    int (*fn)(void *arg, const struct btrfs_file_extent *ext), void *arg);
+
+// Decodes the EXTENT_DATA item at `file_offset`, as btrfs_extent_iterate()
+// does. Returns 0, EIO for a short item or EOPNOTSUPP for an encrypted one.
+int btrfs_extent_decode(uint64_t file_offset, const uint8_t *data, uint32_t size, struct btrfs_file_extent *ext);
+
+// Decoded bytes [offset, offset + len) of the file range an extent covers, with
+// checksums verified. Holes and prealloc read as zeros. Returns 0 or an errno.
+int btrfs_extent_read(struct btrfs_volume *vol, const struct btrfs_file_extent *ext, uint64_t offset, uint8_t *buf,
+    size_t len);
+
+#endif // _BTRFS_FS_H
@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include "btrfs_hash.h"
+
+static size_t hash_slot(const struct btrfs_hash *hash, uint64_t key) {
+	size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20;
+
+	for(i &= hash->size - 1; hash->keys[i] != 0 && hash->keys[i] != key; i = (i + 1) & (hash->size - 1))
+		;
+	return(i);
+}
+
+void *btrfs_hash_get(const struct btrfs_hash *hash, uint64_t key) {
+	size_t i;
+
+	if(hash->size == 0)
+		return(NULL);
+	i = hash_slot(hash, key);
+	return(hash->keys[i] == key ? hash->values[i] : NULL);
+}
+
+int btrfs_hash_put(struct btrfs_hash *hash, uint64_t key, void *value) {
+	struct btrfs_hash grown;
+	size_t i;
+
+	if((hash->count + 1) * 2 > hash->size) {
+		grown.size = hash->size ? hash->size * 2 : 1024;
+		grown.count = 0;
+		grown.keys = calloc(grown.size, sizeof(*grown.keys));
+		grown.values = calloc(grown.size, sizeof(*grown.values));
+		if(grown.keys == NULL || grown.values == NULL) {
+			free(grown.keys);
+			free(grown.values);
+			return(ENOMEM);
+		}
+		for(i = 0; i < hash->size; ++i) {
+			if(hash->keys[i] != 0)
+				btrfs_hash_put(&grown, hash->keys[i], hash->values[i]);
+		}
+		free(hash->keys);
+		free(hash->values);
+		*hash = grown;
+	}
+	i = hash_slot(hash, key);
+	if(hash->keys[i] == 0)
+		hash->count++;
+	hash->keys[i] = key;
+	hash->values[i] = value;
+	return(0);
+}
+
+void btrfs_hash_free(struct btrfs_hash *hash) {
+	free(hash->keys);
+	free(hash->values);
+	hash->keys = NULL;
+	hash->values = NULL;
+	hash->count = hash->size = 0;
+}
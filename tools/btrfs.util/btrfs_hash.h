@@ -0,0 +1,49 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_HASH_H
+#define _BTRFS_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * u64 -> pointer map with open addressing, for inode numbers, disk bytenrs and
+ * the like. Key 0 can't be stored. Zero-initialized is empty.
+ */
+struct btrfs_hash {
+    uint64_t *keys;                             // 0 marks a free slot
+    void **values;
+    size_t count, size;
+};
+
+// NULL when `key` is not in the map
+void *btrfs_hash_get(const struct btrfs_hash *hash, uint64_t key);
+// adds or replaces; returns 0 or ENOMEM
+int btrfs_hash_put(struct btrfs_hash *hash, uint64_t key, void *value);
+void btrfs_hash_free(struct btrfs_hash *hash);
+
+#endif // _BTRFS_HASH_H
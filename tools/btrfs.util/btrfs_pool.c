@@ -0,0 +1,371 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "btrfs_pool.h"
+
+unsigned btrfs_ncpu(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return(n > 0 ? (unsigned)n : 1);
+}
+
+struct parallel_for {
+	btrfs_pool_fn *fn;
+	void *arg;
+	size_t count;
+	atomic_size_t next;
+};
+
+static void *parallel_for_worker(void *arg) {
+	struct parallel_for *pf = arg;
+	size_t i;
+
+	while((i = atomic_fetch_add_explicit(&pf->next, 1, memory_order_relaxed)) < pf->count)
+		pf->fn(pf->arg, i);
+	return(NULL);
+}
+
+int btrfs_parallel_for(unsigned nthreads, size_t count, btrfs_pool_fn *fn, void *arg) {
+	struct parallel_for pf = { .fn = fn, .arg = arg, .count = count };
+	pthread_t *threads;
+	unsigned started;
+
+	atomic_init(&pf.next, 0);
+	if(nthreads > count)
+		nthreads = count;
+	if(nthreads <= 1) {
+		parallel_for_worker(&pf);
+		return(0);
+	}
+	threads = calloc(nthreads, sizeof(*threads));
+	if(threads == NULL)
+		return(ENOMEM);
+	// the calling thread is one of the workers
+	for(started = 0; started < nthreads - 1; ++started) {
+		if(pthread_create(&threads[started], NULL, parallel_for_worker, &pf) != 0)
+			break;
+	}
+	parallel_for_worker(&pf);
+	for(unsigned i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	return(0);
+}
+
+struct pool_task {
+	btrfs_task_fn *fn;
+	void *arg;
+};
+
+// a ring of tasks, the owner works at `bottom` and thieves at `top`
+struct pool_deque {
+	pthread_mutex_t lock;
+	struct pool_task *tasks;
+	size_t mask;
+	size_t top, bottom;
+} __attribute__((aligned(64)));
+
+struct btrfs_pool {
+	unsigned nthreads;                      // workers running
+	unsigned ndeques;                       // workers asked for
+	pthread_t *threads;
+	struct pool_deque *deques;
+	atomic_size_t queued;                   // tasks sitting in a deque
+	atomic_size_t pending;                  // tasks submitted and not finished
+	atomic_uint nidle;
+	atomic_uint next_external;
+	bool shutdown;
+	pthread_mutex_t lock;                   // protects the sleeps below
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+};
+
+static _Thread_local struct btrfs_pool *pool_current;
+static _Thread_local unsigned pool_index;
+
+static int deque_push(struct pool_deque *dq, btrfs_task_fn *fn, void *arg) {
+	struct pool_task *grown;
+	size_t size;
+
+	pthread_mutex_lock(&dq->lock);
+	size = dq->mask + 1;
+	if(dq->bottom - dq->top == size) {
+		grown = malloc(2 * size * sizeof(*grown));
+		if(grown == NULL) {
+			pthread_mutex_unlock(&dq->lock);
+			return(ENOMEM);
+		}
+		for(size_t i = dq->top; i != dq->bottom; ++i)
+			grown[i & (2 * size - 1)] = dq->tasks[i & dq->mask];
+		free(dq->tasks);
+		dq->tasks = grown;
+		dq->mask = 2 * size - 1;
+	}
+	dq->tasks[dq->bottom++ & dq->mask] = (struct pool_task){ fn, arg };
+	pthread_mutex_unlock(&dq->lock);
+	return(0);
+}
+
+static bool deque_take(struct pool_deque *dq, bool steal, struct pool_task *task) {
+	bool found = false;
+
+	pthread_mutex_lock(&dq->lock);
+	if(dq->bottom != dq->top) {
+		*task = steal ? dq->tasks[dq->top++ & dq->mask] : dq->tasks[--dq->bottom & dq->mask];
+		found = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return(found);
+}
+
+static bool pool_find_task(struct btrfs_pool *pool, unsigned self, struct pool_task *task) {
+	if(deque_take(&pool->deques[self], false, task))
+		return(true);
+	for(unsigned i = 1; i < pool->nthreads; ++i) {
+		if(deque_take(&pool->deques[(self + i) % pool->nthreads], true, task))
+			return(true);
+	}
+	return(false);
+}
+
+static void *pool_worker(void *arg) {
+	struct btrfs_pool *pool = arg;
+	struct pool_task task;
+	unsigned self = pool_index;
+
+	for(;;) {
+		if(pool_find_task(pool, self, &task)) {
+			atomic_fetch_sub(&pool->queued, 1);
+			task.fn(pool, task.arg);
+			if(atomic_fetch_sub(&pool->pending, 1) == 1) {
+				pthread_mutex_lock(&pool->lock);
+				pthread_cond_broadcast(&pool->done_cond);
+				pthread_mutex_unlock(&pool->lock);
+			}
+			continue;
+		}
+		// nothing to run anywhere, sleep until a submit
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->nidle, 1);
+		while(atomic_load(&pool->queued) == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		atomic_fetch_sub(&pool->nidle, 1);
+		if(pool->shutdown && atomic_load(&pool->queued) == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			return(NULL);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+struct worker_start {
+	struct btrfs_pool *pool;
+	unsigned index;
+};
+
+static void *pool_worker_start(void *arg) {
+	struct worker_start start = *(struct worker_start *)arg;
+
+	free(arg);
+	pool_current = start.pool;
+	pool_index = start.index;
+	return(pool_worker(start.pool));
+}
+
+struct btrfs_pool *btrfs_pool_create(unsigned nthreads) {
+	struct btrfs_pool *pool;
+	struct worker_start *start;
+
+	if(nthreads == 0)
+		nthreads = btrfs_ncpu();
+	pool = calloc(1, sizeof(*pool));
+	if(pool == NULL)
+		return(NULL);
+	pool->threads = calloc(nthreads, sizeof(*pool->threads));
+	if(posix_memalign((void **)&pool->deques, 64, nthreads * sizeof(*pool->deques)) != 0)
+		pool->deques = NULL;
+	if(pool->threads == NULL || pool->deques == NULL) {
+		free(pool->threads);
+		free(pool->deques);
+		free(pool);
+		return(NULL);
+	}
+	pool->ndeques = nthreads;
+	for(unsigned i = 0; i < nthreads; ++i) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+		pool->deques[i].mask = 63;
+		pool->deques[i].tasks = malloc(64 * sizeof(struct pool_task));
+		pool->deques[i].top = pool->deques[i].bottom = 0;
+	}
+	atomic_init(&pool->queued, 0);
+	atomic_init(&pool->pending, 0);
+	atomic_init(&pool->nidle, 0);
+	atomic_init(&pool->next_external, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for(unsigned i = 0; i < nthreads; ++i) {
+		start = malloc(sizeof(*start));
+		if(start == NULL || pool->deques[i].tasks == NULL)
+			break;
+		*start = (struct worker_start){ pool, i };
+		if(pthread_create(&pool->threads[i], NULL, pool_worker_start, start) != 0) {
+			free(start);
+			break;
+		}
+		pool->nthreads++;
+	}
+	if(pool->nthreads == 0) {
+		btrfs_pool_destroy(pool);
+		return(NULL);
+	}
+	return(pool);
+}
+
+int btrfs_pool_submit(struct btrfs_pool *pool, btrfs_task_fn *fn, void *arg) {
+	unsigned target;
+	int error;
+
+	if(pool_current == pool)
+		target = pool_index;
+	else
+		target = atomic_fetch_add(&pool->next_external, 1) % pool->nthreads;
+	atomic_fetch_add(&pool->pending, 1);
+	error = deque_push(&pool->deques[target], fn, arg);
+	if(error) {
+		atomic_fetch_sub(&pool->pending, 1);
+		return(error);
+	}
+	atomic_fetch_add(&pool->queued, 1);
+	// pairs with the queued check a worker makes after raising nidle
+	if(atomic_load(&pool->nidle) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return(0);
+}
+
+void btrfs_pool_wait(struct btrfs_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while(atomic_load(&pool->pending) != 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void btrfs_pool_destroy(struct btrfs_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(unsigned i = 0; i < pool->nthreads; ++i)
+		pthread_join(pool->threads[i], NULL);
+	for(unsigned i = 0; i < pool->ndeques; ++i) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+unsigned btrfs_pool_nthreads(const struct btrfs_pool *pool) {
+	return(pool->nthreads);
+}
+
+unsigned btrfs_pool_self(void) {
+	return(pool_index);
+}
+
+int btrfs_queue_init(struct btrfs_queue *q, size_t cap) {
+	q->items = calloc(cap, sizeof(*q->items));
+	if(q->items == NULL)
+		return(ENOMEM);
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->not_empty, NULL);
+	pthread_cond_init(&q->not_full, NULL);
+	q->cap = cap;
+	q->head = 0;
+	q->count = 0;
+	q->closed = false;
+	return(0);
+}
+
+bool btrfs_queue_push(struct btrfs_queue *q, void *item) {
+	pthread_mutex_lock(&q->lock);
+	while(q->count == q->cap && !q->closed)
+		pthread_cond_wait(&q->not_full, &q->lock);
+	if(q->closed) {
+		pthread_mutex_unlock(&q->lock);
+		return(false);
+	}
+	q->items[(q->head + q->count) % q->cap] = item;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->lock);
+	return(true);
+}
+
+void *btrfs_queue_pop(struct btrfs_queue *q) {
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	while(q->count == 0 && !q->closed)
+		pthread_cond_wait(&q->not_empty, &q->lock);
+	if(q->count > 0) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return(item);
+}
+
+void btrfs_queue_close(struct btrfs_queue *q) {
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->not_empty);
+	pthread_cond_broadcast(&q->not_full);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void btrfs_queue_destroy(struct btrfs_queue *q) {
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_cond_destroy(&q->not_full);
+	free(q->items);
+}
@@ -0,0 +1,92 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_POOL_H
+#define _BTRFS_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Worker threads for the userspace engine
+
+typedef void btrfs_pool_fn(void *arg, size_t index);
+
+// number of online CPUs, at least 1
+unsigned btrfs_ncpu(void);
+
+// Calls fn(arg, i) for every i in [0, count) from up to `nthreads` threads and
+// returns once all calls are done. Indices are handed out one at a time, so a
+// slow item never holds up the others. If some threads fail to start the rest
+// finish the work. Returns 0, or ENOMEM when nothing could be run.
+int btrfs_parallel_for(unsigned nthreads, size_t count, btrfs_pool_fn *fn, void *arg);
+
+/*
+ * Work-stealing pool for recursive work such as tree walks. Each worker keeps
+ * its own deque: tasks it submits go on the bottom and it takes from the bottom,
+ * so a walk runs depth first and its memory stays bounded. Idle workers steal
+ * from the top of other deques, which holds the oldest and usually biggest
+ * pieces of work.
+ */
+struct btrfs_pool;
+
+typedef void btrfs_task_fn(struct btrfs_pool *pool, void *arg);
+
+struct btrfs_pool *btrfs_pool_create(unsigned nthreads);
+// may be called from a task or from outside the pool
+int btrfs_pool_submit(struct btrfs_pool *pool, btrfs_task_fn *fn, void *arg);
+// returns once every submitted task, and everything they submitted, has run
+void btrfs_pool_wait(struct btrfs_pool *pool);
+void btrfs_pool_destroy(struct btrfs_pool *pool);
+
+unsigned btrfs_pool_nthreads(const struct btrfs_pool *pool);
+// index of the calling worker in [0, nthreads), for per-worker buffers
+unsigned btrfs_pool_self(void);
+
+/*
+ * Bounded FIFO between pipeline stages. push() blocks while the queue is full,
+ * so a slow consumer holds its producer back instead of letting work pile up
+ * in memory; pop() blocks while it is empty and returns NULL once the queue is
+ * closed and drained. Items may not be NULL.
+ */
+struct btrfs_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void **items;
+    size_t cap, head, count;
+    bool closed;
+};
+
+int btrfs_queue_init(struct btrfs_queue *q, size_t cap);
+// false when the queue was closed before the item could be added
+bool btrfs_queue_push(struct btrfs_queue *q, void *item);
+void *btrfs_queue_pop(struct btrfs_queue *q);
+// wakes everyone; later pushes fail and pops drain what is left
+void btrfs_queue_close(struct btrfs_queue *q);
+void btrfs_queue_destroy(struct btrfs_queue *q);
+
+#endif // _BTRFS_POOL_H
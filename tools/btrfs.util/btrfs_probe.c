@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_super.h"
+#include "btrfs_pool.h"
+#include "btrfs_probe.h"
+
+// a probe is one 4K read, so run as many at once as the devices will take
+#define PROBE_MAX_THREADS 128
+
+struct probe {
+	const char *path;
+	int error;
+	struct btrfs_superblock sb;
+};
+
+static void probe_one(void *arg, size_t i) {
+	struct probe *p = (struct probe *)arg + i;
+	int fd;
+
+	fd = open(p->path, O_RDONLY);
+	if(fd == -1) {
+		p->error = errno;
+		return;
+	}
+	p->error = btrfs_super_read(fd, superblock_addrs[0], &p->sb);
+	close(fd);
+}
+
+// by fsid, then devid
+static int probe_cmp(const void *a, const void *b) {
+	const struct probe *pa = *(const struct probe *const *)a;
+	const struct probe *pb = *(const struct probe *const *)b;
+	int c;
+
+	c = memcmp(&pa->sb.uuid, &pb->sb.uuid, sizeof(pa->sb.uuid));
+	if(c != 0)
+		return(c);
+	if(pa->sb.dev_item.dev_id != pb->sb.dev_item.dev_id)
+		return(pa->sb.dev_item.dev_id < pb->sb.dev_item.dev_id ? -1 : 1);
+	return(0);
+}
+
+static const char *probe_strerror(int error) {
+	switch(error) {
+	case EINVAL:
+		return("not a btrfs filesystem");
+	case ENOTSUP:
+		return("unsupported superblock checksum type");
+	case EBADMSG:
+		return("superblock checksum mismatch");
+	default:
+		return(strerror(error));
+	}
+}
+
+static void probe_print_group(struct probe **group, int count) {
+	const struct btrfs_superblock *sb = &group[0]->sb;
+	char fsid[BTRFS_UUID_STRLEN];
+	uint64_t generation = 0;
+
+	for(int i = 0; i < count; ++i) {
+		if(group[i]->sb.generation > generation)
+			generation = group[i]->sb.generation;
+	}
+	btrfs_uuid_format(&sb->uuid, fsid);
+	printf("%s label \"%.*s\" devices %d/%llu generation %llu\n", fsid, MAX_LABEL_SIZE, sb->label,
+	    count, (unsigned long long)sb->num_devices, (unsigned long long)generation);
+	for(int i = 0; i < count; ++i) {
+		sb = &group[i]->sb;
+		printf("\tdevid %llu generation %llu %s%s\n", (unsigned long long)sb->dev_item.dev_id,
+		    (unsigned long long)sb->generation, group[i]->path,
+		    sb->generation < generation ? " (stale)" : "");
+	}
+}
+
+int btrfs_probe_batch(char *const paths[], int count) {
+	struct probe *probes, **found;
+	int nfound = 0, error;
+
+	probes = calloc(count, sizeof(*probes));
+	found = calloc(count, sizeof(*found));
+	if(probes == NULL || found == NULL) {
+		free(probes);
+		free(found);
+		return(FSUR_IO_FAIL);
+	}
+	for(int i = 0; i < count; ++i)
+		probes[i].path = paths[i];
+
+	error = btrfs_parallel_for(PROBE_MAX_THREADS, count, probe_one, probes);
+	if(error) {
+		// nothing was probed, the zeroed entries would all look found
+		fprintf(stderr, "cannot start probe threads: %s\n", strerror(error));
+		free(found);
+		free(probes);
+		return(FSUR_IO_FAIL);
+	}
+
+	for(int i = 0; i < count; ++i) {
+		if(probes[i].error == 0)
+			found[nfound++] = &probes[i];
+		else
+			fprintf(stderr, "%s: %s\n", probes[i].path, probe_strerror(probes[i].error));
+	}
+	qsort(found, nfound, sizeof(*found), probe_cmp);
+	for(int i = 1, start = 0; i <= nfound; ++i) {
+		if(i == nfound || memcmp(&found[i]->sb.uuid, &found[start]->sb.uuid, sizeof(btrfs_uuid)) != 0) {
+			probe_print_group(&found[start], i - start);
+			start = i;
+		}
+	}
+
+	free(found);
+	free(probes);
+	return(nfound > 0 ? FSUR_RECOGNIZED : FSUR_UNRECOGNIZED);
+}
@@ -0,0 +1,430 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_volume.h"
+#include "btrfs_fs.h"
+#include "btrfs_pool.h"
+#include "btrfs_qgroup.h"
+
+#define QGROUP_SUBVOL_MASK ((1ULL << BTRFS_QGROUP_LEVEL_SHIFT) - 1)
+
+static struct btrfs_qgroup *qgroup_find(struct btrfs_qgroup *groups, size_t count, uint64_t id) {
+	size_t lo = 0, hi = count, mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(groups[mid].id == id)
+			return(&groups[mid]);
+		if(groups[mid].id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return(NULL);
+}
+
+int btrfs_qgroup_load(struct btrfs_volume *vol, struct btrfs_qgroup_status *status, struct btrfs_qgroup **groups,
+    size_t *count) {
+	// STATUS, then every INFO, then every LIMIT, all under objectid 0 and in id order
+	struct btrfs_key key = { .obj_id = 0, .obj_type = TYPE_QGROUP_STATUS, .offset = 0 };
+	struct btrfs_qgroup *list = NULL, *grown, *g;
+	struct btrfs_path path;
+	const uint8_t *item, *data;
+	size_t n = 0, cap = 0;
+	uint64_t bytenr;
+	uint8_t level;
+	bool have_status = false;
+	int error;
+
+	*groups = NULL;
+	*count = 0;
+	memset(status, 0, sizeof(*status));
+	error = btrfs_find_root(vol, BTRFS_ROOT_QUOTA, &bytenr, &level);
+	if(error)
+		return(error);
+
+	error = btrfs_search(vol, bytenr, level, &key, &path);
+	for(; error == 0; error = btrfs_next_item(vol, &path)) {
+		item = btrfs_path_key(&path);
+		data = btrfs_path_data(&path);
+		// relations are keyed on their member qgroup and follow
+		if(btrfs_disk_key_objectid(item) != 0)
+			break;
+		switch(btrfs_disk_key_type(item)) {
+		case TYPE_QGROUP_STATUS:
+			if(btrfs_path_size(&path) < sizeof(QGROUP_STATUS)) {
+				error = EIO;
+				break;
+			}
+			status->generation = BTRFS_GET_LE64(data, QGROUP_STATUS, generation);
+			status->flags = BTRFS_GET_LE64(data, QGROUP_STATUS, flags);
+			status->rescan = BTRFS_GET_LE64(data, QGROUP_STATUS, rescan);
+			have_status = true;
+			break;
+		case TYPE_QGROUP_INFO:
+			if(btrfs_path_size(&path) < sizeof(QGROUP_INFO)) {
+				error = EIO;
+				break;
+			}
+			if(n == cap) {
+				grown = realloc(list, (cap ? cap * 2 : 64) * sizeof(*grown));
+				if(grown == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				list = grown;
+				cap = cap ? cap * 2 : 64;
+			}
+			g = &list[n++];
+			memset(g, 0, sizeof(*g));
+			g->id = btrfs_disk_key_offset(item);
+			g->generation = BTRFS_GET_LE64(data, QGROUP_INFO, generation);
+			g->referenced = BTRFS_GET_LE64(data, QGROUP_INFO, rfer);
+			g->referenced_compressed = BTRFS_GET_LE64(data, QGROUP_INFO, rfer_cmpr);
+			g->exclusive = BTRFS_GET_LE64(data, QGROUP_INFO, excl);
+			g->exclusive_compressed = BTRFS_GET_LE64(data, QGROUP_INFO, excl_cmpr);
+			break;
+		case TYPE_QGROUP_LIMIT:
+			if(btrfs_path_size(&path) < sizeof(QGROUP_LIMIT)) {
+				error = EIO;
+				break;
+			}
+			g = qgroup_find(list, n, btrfs_disk_key_offset(item));
+			if(g != NULL) {
+				g->limit_flags = BTRFS_GET_LE64(data, QGROUP_LIMIT, flags);
+				g->max_referenced = BTRFS_GET_LE64(data, QGROUP_LIMIT, max_rfer);
+				g->max_exclusive = BTRFS_GET_LE64(data, QGROUP_LIMIT, max_excl);
+			}
+			break;
+		}
+		if(error)
+			break;
+	}
+	btrfs_path_release(&path);
+	if(error == ENOENT)
+		error = 0;
+	if(error == 0 && !have_status)
+		error = EIO;
+	if(error) {
+		free(list);
+		return(error);
+	}
+	*groups = list;
+	*count = n;
+	return(0);
+}
+
+/*
+ * The walk. Every block is a task on the pool, like the tree dump, and all the
+ * subvolumes' roots are submitted up front so small trees don't leave workers
+ * idle. Leaves add their totals to their subvolume's counters once.
+ */
+
+struct usage_ctx {
+	struct btrfs_volume *vol;
+	uint8_t **nodes;                        // one block buffer per worker
+	_Atomic uint64_t *inodes, *bytes;       // per subvolume
+	atomic_int error;                       // first one seen
+};
+
+struct usage_task {
+	struct usage_ctx *ctx;
+	size_t index;
+	uint64_t bytenr;
+	uint64_t generation;
+	int level;
+};
+
+static void usage_error(struct usage_ctx *ctx, int error) {
+	int expected = 0;
+
+	atomic_compare_exchange_strong(&ctx->error, &expected, error);
+}
+
+static void usage_block(struct btrfs_pool *pool, void *arg) {
+	struct usage_task *task = arg, *child;
+	struct usage_ctx *ctx = task->ctx;
+	uint8_t *node = ctx->nodes[btrfs_pool_self()];
+	uint64_t inodes = 0, bytes = 0, ino;
+	uint32_t num_items;
+	const uint8_t *key;
+	int error;
+
+	error = btrfs_read_node(ctx->vol, task->bytenr, task->level, task->generation, node);
+	if(error) {
+		fprintf(stderr, "block %" PRIu64 ": %s\n", task->bytenr, strerror(error));
+		usage_error(ctx, error);
+		free(task);
+		return;
+	}
+	num_items = btrfs_header_nritems(node);
+	for(uint32_t i = 0; task->level > 0 && i < num_items; ++i) {
+		child = malloc(sizeof(*child));
+		if(child == NULL) {
+			usage_error(ctx, ENOMEM);
+			break;
+		}
+		*child = (struct usage_task){ ctx, task->index, btrfs_node_blockptr(node, i),
+		    btrfs_node_ptr_generation(node, i), task->level - 1 };
+		if(btrfs_pool_submit(pool, usage_block, child) != 0) {
+			free(child);
+			usage_error(ctx, ENOMEM);
+			break;
+		}
+	}
+	for(uint32_t i = 0; task->level == 0 && i < num_items; ++i) {
+		key = btrfs_item_key(node, i);
+		ino = btrfs_disk_key_objectid(key);
+		if(btrfs_disk_key_type(key) != TYPE_INODE_ITEM || ino < BTRFS_FIRST_FREE_OBJECTID ||
+		    ino > BTRFS_LAST_FREE_OBJECTID || btrfs_item_size(node, i) < sizeof(btrfs_inode_item))
+			continue;
+		inodes++;
+		bytes += BTRFS_GET_LE64(btrfs_item_data(node, i), btrfs_inode_item, st_blocks);
+	}
+	if(inodes) {
+		atomic_fetch_add_explicit(&ctx->inodes[task->index], inodes, memory_order_relaxed);
+		atomic_fetch_add_explicit(&ctx->bytes[task->index], bytes, memory_order_relaxed);
+	}
+	free(task);
+}
+
+int btrfs_subvol_usage(struct btrfs_volume *vol, struct btrfs_subvol_usage *usage, size_t count, unsigned nthreads) {
+	struct usage_ctx ctx = { .vol = vol };
+	struct btrfs_subvol sv;
+	struct btrfs_pool *pool;
+	struct usage_task *task;
+	int error = 0;
+
+	pool = btrfs_pool_create(nthreads);
+	if(pool == NULL)
+		return(ENOMEM);
+	nthreads = btrfs_pool_nthreads(pool);
+	ctx.nodes = calloc(nthreads, sizeof(*ctx.nodes));
+	ctx.inodes = calloc(count, sizeof(*ctx.inodes));
+	ctx.bytes = calloc(count, sizeof(*ctx.bytes));
+	if(ctx.nodes == NULL || ctx.inodes == NULL || ctx.bytes == NULL)
+		error = ENOMEM;
+	for(unsigned i = 0; error == 0 && i < nthreads; ++i) {
+		ctx.nodes[i] = malloc(vol->node_size);
+		if(ctx.nodes[i] == NULL)
+			error = ENOMEM;
+	}
+
+	for(size_t i = 0; error == 0 && i < count; ++i) {
+		error = btrfs_subvol_open(vol, usage[i].id, &sv);
+		if(error) {
+			fprintf(stderr, "subvolume %" PRIu64 ": %s\n", usage[i].id, strerror(error));
+			break;
+		}
+		task = malloc(sizeof(*task));
+		if(task == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		*task = (struct usage_task){ &ctx, i, sv.root.bytenr, 0, sv.root.level };
+		if(btrfs_pool_submit(pool, usage_block, task) != 0) {
+			free(task);
+			error = ENOMEM;
+		}
+	}
+	// whatever was submitted has to finish before the buffers go
+	btrfs_pool_wait(pool);
+	btrfs_pool_destroy(pool);
+	if(error == 0)
+		error = atomic_load(&ctx.error);
+
+	for(size_t i = 0; ctx.inodes != NULL && ctx.bytes != NULL && i < count; ++i) {
+		usage[i].inodes = atomic_load(&ctx.inodes[i]);
+		usage[i].bytes = atomic_load(&ctx.bytes[i]);
+	}
+	for(unsigned i = 0; ctx.nodes != NULL && i < nthreads; ++i)
+		free(ctx.nodes[i]);
+	free(ctx.nodes);
+	free((void *)ctx.inodes);
+	free((void *)ctx.bytes);
+	return(error);
+}
+
+struct qgroup_ids {
+	struct btrfs_subvol_usage *usage;
+	size_t count, cap;
+};
+
+static int qgroup_add_subvol(void *arg, uint64_t id) {
+	struct qgroup_ids *ids = arg;
+	struct btrfs_subvol_usage *grown;
+
+	if(ids->count == ids->cap) {
+		grown = realloc(ids->usage, (ids->cap ? ids->cap * 2 : 64) * sizeof(*grown));
+		if(grown == NULL)
+			return(ENOMEM);
+		ids->usage = grown;
+		ids->cap = ids->cap ? ids->cap * 2 : 64;
+	}
+	ids->usage[ids->count++] = (struct btrfs_subvol_usage){ .id = id };
+	return(0);
+}
+
+static const char *qgroup_name(struct btrfs_volume *vol, uint64_t id, char *buf, size_t size) {
+	if(id == BTRFS_ROOT_FSTREE)
+		return("<top level>");
+	if(btrfs_subvol_name(vol, id, buf, size) != 0)
+		buf[0] = '\0';
+	return(buf);
+}
+
+static void qgroup_print(struct btrfs_volume *vol, const struct btrfs_qgroup_status *status,
+    const struct btrfs_qgroup *groups, size_t count) {
+	char id[48], name[BTRFS_NAME_MAX + 1];
+	const struct btrfs_qgroup *g;
+	uint64_t level, subvol;
+
+	printf("%-16s %16s %16s %16s %16s  %s\n", "qgroup", "referenced", "exclusive", "max referenced",
+	    "max exclusive", "subvolume");
+	for(size_t i = 0; i < count; ++i) {
+		g = &groups[i];
+		level = g->id >> BTRFS_QGROUP_LEVEL_SHIFT;
+		subvol = g->id & QGROUP_SUBVOL_MASK;
+		snprintf(id, sizeof(id), "%" PRIu64 "/%" PRIu64, level, subvol);
+		printf("%-16s %16" PRIu64 " %16" PRIu64, id, g->referenced, g->exclusive);
+		if(g->limit_flags & BTRFS_QGROUP_LIMIT_MAX_RFER)
+			printf(" %16" PRIu64, g->max_referenced);
+		else
+			printf(" %16s", "none");
+		if(g->limit_flags & BTRFS_QGROUP_LIMIT_MAX_EXCL)
+			printf(" %16" PRIu64, g->max_exclusive);
+		else
+			printf(" %16s", "none");
+		printf("  %s\n", level == 0 ? qgroup_name(vol, subvol, name, sizeof(name)) : "");
+	}
+	if(status->flags & BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT)
+		fprintf(stderr, "quota accounting is inconsistent, the numbers are stale until a rescan\n");
+	if(status->flags & BTRFS_QGROUP_STATUS_FLAG_RESCAN)
+		fprintf(stderr, "rescan in progress at objectid %" PRIu64 ", the numbers are partial\n", status->rescan);
+	if(status->flags & BTRFS_QGROUP_STATUS_FLAG_SIMPLE_MODE)
+		fprintf(stderr, "simple quotas: extents are charged to the subvolume that wrote them\n");
+}
+
+static double qgroup_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void qgroup_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -Q [-w] [-j threads] device ...\n");
+}
+
+int btrfs_qgroup_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct btrfs_qgroup_status status;
+	struct btrfs_qgroup *groups = NULL;
+	struct qgroup_ids ids = { 0 };
+	char name[BTRFS_NAME_MAX + 1];
+	size_t count = 0;
+	unsigned nthreads = 0;
+	bool walk = false;
+	double start;
+	char *end;
+	int ch, error;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "wj:")) != -1) {
+		switch(ch) {
+		case 'w':
+			walk = true;
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, &end, 0);
+			if(*end != '\0') {
+				qgroup_usage();
+				return(FSUR_INVAL);
+			}
+			break;
+		default:
+			qgroup_usage();
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1) {
+		qgroup_usage();
+		return(FSUR_INVAL);
+	}
+	if(btrfs_volume_open(&vol, argv, argc) != 0)
+		return(FSUR_IO_FAIL);
+
+	start = qgroup_now();
+	error = 0;
+	if(!walk) {
+		error = btrfs_qgroup_load(&vol, &status, &groups, &count);
+		if(error == ENOENT) {
+			fprintf(stderr, "quotas were never enabled, adding up inodes instead\n");
+			walk = true;
+			error = 0;
+		} else if(error == 0 && !(status.flags & BTRFS_QGROUP_STATUS_FLAG_ON)) {
+			fprintf(stderr, "quotas are disabled, adding up inodes instead\n");
+			walk = true;
+		} else if(error) {
+			fprintf(stderr, "reading the quota tree: %s\n", strerror(error));
+		} else {
+			qgroup_print(&vol, &status, groups, count);
+			fprintf(stderr, "%zu qgroups as of generation %" PRIu64 " in %.3fs\n", count, status.generation,
+			    qgroup_now() - start);
+		}
+	}
+	if(error == 0 && walk) {
+		error = btrfs_subvol_iterate(&vol, qgroup_add_subvol, &ids);
+		if(error == 0)
+			error = btrfs_subvol_usage(&vol, ids.usage, ids.count, nthreads);
+		if(error)
+			fprintf(stderr, "walking the subvolumes: %s\n", strerror(error));
+		printf("%-16s %16s %16s  %s\n", "subvolume", "inodes", "bytes", "name");
+		for(size_t i = 0; i < ids.count; ++i)
+			printf("%-16" PRIu64 " %16" PRIu64 " %16" PRIu64 "  %s\n", ids.usage[i].id, ids.usage[i].inodes,
+			    ids.usage[i].bytes, qgroup_name(&vol, ids.usage[i].id, name, sizeof(name)));
+		fprintf(stderr, "%zu subvolumes walked in %.3fs, shared extents counted in every file\n", ids.count,
+		    qgroup_now() - start);
+	}
+
+	free(groups);
+	free(ids.usage);
+	btrfs_volume_close(&vol);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
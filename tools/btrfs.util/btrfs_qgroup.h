@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_QGROUP_H
+#define _BTRFS_QGROUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "btrfs_volume.h"
+
+/*
+ * Disk usage per subvolume. With quotas enabled the kernel keeps referenced and
+ * exclusive bytes for every qgroup up to date in the quota tree, so the whole
+ * answer is a few leaves away. Without them the only source is the inodes
+ * themselves.
+ */
+struct btrfs_qgroup {
+    uint64_t id;                                // level << 48 | subvolume id for level 0
+    uint64_t generation;
+    uint64_t referenced, referenced_compressed;
+    uint64_t exclusive, exclusive_compressed;
+    uint64_t limit_flags;                       // BTRFS_QGROUP_LIMIT_*
+    uint64_t max_referenced, max_exclusive;
+};
+
+struct btrfs_qgroup_status {
+    uint64_t generation;
+    uint64_t flags;                             // BTRFS_QGROUP_STATUS_FLAG_*
+    uint64_t rescan;
+};
+
+/*
+ * Reads the status and every qgroup with its limits in one pass over the
+ * quota tree. *groups is sorted by id and freed by the caller. Returns 0,
+ * ENOENT when quotas were never enabled, EIO for a malformed tree or another
+ * errno. Quotas that were switched off leave a tree without FLAG_ON.
+ */
+int btrfs_qgroup_load(struct btrfs_volume *vol, struct btrfs_qgroup_status *status, struct btrfs_qgroup **groups,
+    size_t *count);
+
+struct btrfs_subvol_usage {
+    uint64_t id;                                // in: subvolume
+    uint64_t inodes;
+    uint64_t bytes;                             // sum of the inodes' nbytes, as du counts them
+};
+
+/*
+ * The fallback: walks the fs trees of `count` subvolumes at once on a pool of
+ * `nthreads` workers and adds up the INODE_ITEMs. Extents shared between files
+ * or snapshots are counted once per file, so nothing here is exclusive.
+ * Returns 0 or the first errno; the usage of a tree with read errors is short.
+ */
+int btrfs_subvol_usage(struct btrfs_volume *vol, struct btrfs_subvol_usage *usage, size_t count, unsigned nthreads);
+
+// btrfs.util -Q [-w] [-j threads] device ...
+//
+// Referenced and exclusive bytes of every qgroup from the quota tree, or with
+// -w or quotas off, the inode totals of every subvolume from a parallel walk.
+int btrfs_qgroup_main(int argc, char *argv[]);
+
+#endif // _BTRFS_QGROUP_H
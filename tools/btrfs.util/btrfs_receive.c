@@ -0,0 +1,772 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#elif defined(__APPLE__)
+#include <sys/xattr.h>
+#elif defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/extattr.h>
+#endif
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_copy.h"
+#include "btrfs_pool.h"
+#include "btrfs_send.h"
+#include "crc32.h"
+
+/*
+ * Three stages joined by bounded queues: the parser cuts the stream into
+ * commands, the verifier checks each crc32c and indexes its attributes, and
+ * the applier (the calling thread) turns them into file system calls. Command
+ * buffers cycle through a free queue, so at most RECV_NCMDS commands are in
+ * flight and a stalled applier backs the parser up instead of growing memory.
+ */
+
+#define RECV_NCMDS 64
+#define RECV_READ_SIZE (4 * 1024 * 1024)
+#define RECV_HEADER_SIZE sizeof(btrfs_send_command)
+#define RECV_TLV_SIZE sizeof(btrfs_send_tlv)
+#define RECV_NATTRS (BTRFS_SEND_TLV_CLONE_LENGTH + 1)
+
+struct recv_cmd {
+	uint16_t cmd;
+	uint32_t len;                           // attribute bytes after the header
+	uint32_t csum;                          // as sent; zeroed in buf for the check
+	const uint8_t *attr[RECV_NATTRS];
+	uint16_t attr_len[RECV_NATTRS];
+	uint8_t buf[RECV_HEADER_SIZE + BTRFS_SEND_BUF_SIZE];
+};
+
+struct recv_ctx {
+	int in;
+	uint8_t *rbuf;                          // parser's read buffer
+	size_t rpos, rlen;
+	struct btrfs_queue free, verify, apply;
+	struct recv_cmd *cmds;
+	atomic_bool stop;                       // the applier failed, stop reading
+	int parse_error, verify_error;
+
+	const char *dest;
+	char root[PATH_MAX];                    // subvolume being received
+	int root_fd;                            // and its directory, every path is resolved from it
+	uint8_t uuid[BTRFS_UUID_SIZE];
+	bool fsync;
+	// WRITEs come in runs for one file, keep it open between them
+	char open_path[PATH_MAX];
+	int open_fd;
+
+	uint64_t commands, stream_bytes, data_bytes, clone_bytes, reflinked, subvols;
+};
+
+// a path attribute, resolved down to the directory holding its last component
+struct recv_target {
+	int dir;                                // under the subvolume root, closed by recv_release()
+	const char *name;                       // last component, points into path
+	char path[PATH_MAX];                    // the whole path, for messages and xattrs
+};
+
+// fill `dst` from the stream; 0 at a clean end of stream (nothing read)
+static ssize_t recv_read(struct recv_ctx *ctx, uint8_t *dst, size_t len) {
+	size_t done = 0, n;
+	ssize_t r;
+
+	while(done < len) {
+		if(ctx->rpos == ctx->rlen) {
+			r = read(ctx->in, ctx->rbuf, RECV_READ_SIZE);
+			if(r < 0 && errno == EINTR)
+				continue;
+			if(r < 0)
+				return(-errno);
+			if(r == 0)
+				return(done == 0 ? 0 : -EPIPE);
+			ctx->rpos = 0;
+			ctx->rlen = r;
+		}
+		n = ctx->rlen - ctx->rpos < len - done ? ctx->rlen - ctx->rpos : len - done;
+		memcpy(dst + done, ctx->rbuf + ctx->rpos, n);
+		ctx->rpos += n;
+		done += n;
+	}
+	ctx->stream_bytes += done;
+	return(done);
+}
+
+static int recv_stream_header(struct recv_ctx *ctx, const uint8_t *hdr) {
+	uint8_t rest[sizeof(btrfs_send_header) - RECV_HEADER_SIZE];
+	uint32_t version;
+	ssize_t r;
+
+	// the header is longer than a command header, whose bytes we already have
+	r = recv_read(ctx, rest, sizeof(rest));
+	if(r <= 0)
+		return(r == 0 ? EPIPE : -r);
+	if(memcmp(hdr, BTRFS_SEND_MAGIC, RECV_HEADER_SIZE) != 0 ||
+	    memcmp(rest, BTRFS_SEND_MAGIC + RECV_HEADER_SIZE, sizeof(BTRFS_SEND_MAGIC) - RECV_HEADER_SIZE) != 0) {
+		fprintf(stderr, "not a btrfs-stream\n");
+		return(EINVAL);
+	}
+	version = btrfs_get_le32(rest + sizeof(BTRFS_SEND_MAGIC) - RECV_HEADER_SIZE);
+	if(version != BTRFS_SEND_STREAM_VERSION) {
+		fprintf(stderr, "btrfs-stream version %u is not supported\n", version);
+		return(ENOTSUP);
+	}
+	return(0);
+}
+
+static void *recv_parser(void *arg) {
+	struct recv_ctx *ctx = arg;
+	struct recv_cmd *cmd;
+	bool header = true;
+	ssize_t r;
+	int error = 0;
+
+	while(error == 0 && !atomic_load(&ctx->stop)) {
+		cmd = btrfs_queue_pop(&ctx->free);
+		if(cmd == NULL)
+			break;
+		r = recv_read(ctx, cmd->buf, RECV_HEADER_SIZE);
+		if(r <= 0) {
+			error = header ? EPIPE : -r;
+			btrfs_queue_push(&ctx->free, cmd);
+			break;
+		}
+		// streams for several subvolumes are sent back to back
+		if(memcmp(cmd->buf, BTRFS_SEND_MAGIC, RECV_HEADER_SIZE) == 0) {
+			error = recv_stream_header(ctx, cmd->buf);
+			header = false;
+			btrfs_queue_push(&ctx->free, cmd);
+			continue;
+		}
+		if(header) {
+			fprintf(stderr, "not a btrfs-stream\n");
+			error = EINVAL;
+			btrfs_queue_push(&ctx->free, cmd);
+			break;
+		}
+		cmd->len = BTRFS_GET_LE32(cmd->buf, btrfs_send_command, length);
+		cmd->cmd = BTRFS_GET_LE16(cmd->buf, btrfs_send_command, cmd);
+		cmd->csum = BTRFS_GET_LE32(cmd->buf, btrfs_send_command, csum);
+		memset(cmd->buf + __builtin_offsetof(btrfs_send_command, csum), 0, sizeof(uint32_t));
+		if(cmd->len > BTRFS_SEND_BUF_SIZE) {
+			fprintf(stderr, "command %u of %u bytes is too large\n", cmd->cmd, cmd->len);
+			error = EINVAL;
+		} else if(cmd->len > 0 && (r = recv_read(ctx, cmd->buf + RECV_HEADER_SIZE, cmd->len)) <= 0)
+			error = r == 0 ? EPIPE : -r;
+		if(error || !btrfs_queue_push(&ctx->verify, cmd)) {
+			btrfs_queue_push(&ctx->free, cmd);
+			break;
+		}
+	}
+	if(error == EPIPE)
+		fprintf(stderr, "stream ends in the middle of a command\n");
+	else if(error && error != EINVAL && error != ENOTSUP)
+		fprintf(stderr, "reading stream: %s\n", strerror(error));
+	ctx->parse_error = error;
+	btrfs_queue_close(&ctx->verify);
+	return(NULL);
+}
+
+static int recv_check(struct recv_cmd *cmd) {
+	const uint8_t *p = cmd->buf + RECV_HEADER_SIZE, *end = p + cmd->len;
+	uint16_t type, len;
+
+	if(calculate_crc32c(0, cmd->buf, RECV_HEADER_SIZE + cmd->len) != cmd->csum) {
+		fprintf(stderr, "command %u: checksum mismatch\n", cmd->cmd);
+		return(EBADMSG);
+	}
+	memset(cmd->attr, 0, sizeof(cmd->attr));
+	while(p < end) {
+		if(end - p < (ptrdiff_t)RECV_TLV_SIZE)
+			return(EBADMSG);
+		type = BTRFS_GET_LE16(p, btrfs_send_tlv, type);
+		len = BTRFS_GET_LE16(p, btrfs_send_tlv, length);
+		p += RECV_TLV_SIZE;
+		if(end - p < len)
+			return(EBADMSG);
+		if(type < RECV_NATTRS) {
+			cmd->attr[type] = p;
+			cmd->attr_len[type] = len;
+		}
+		p += len;
+	}
+	return(0);
+}
+
+static void *recv_verifier(void *arg) {
+	struct recv_ctx *ctx = arg;
+	struct recv_cmd *cmd;
+	int error = 0;
+
+	while((cmd = btrfs_queue_pop(&ctx->verify)) != NULL) {
+		if(error == 0)
+			error = recv_check(cmd);
+		if(error || !btrfs_queue_push(&ctx->apply, cmd))
+			btrfs_queue_push(&ctx->free, cmd);
+		// stop the parser, then keep draining so it never blocks on a full queue
+		if(error)
+			atomic_store(&ctx->stop, true);
+	}
+	ctx->verify_error = error;
+	btrfs_queue_close(&ctx->apply);
+	return(NULL);
+}
+
+/*
+ * Applying commands
+ */
+
+static int recv_u64(const struct recv_cmd *cmd, int type, uint64_t *v) {
+	if(cmd->attr[type] == NULL || cmd->attr_len[type] != sizeof(uint64_t))
+		return(EBADMSG);
+	*v = btrfs_get_le64(cmd->attr[type]);
+	return(0);
+}
+
+static int recv_time(const struct recv_cmd *cmd, int type, struct timespec *ts) {
+	if(cmd->attr[type] == NULL || cmd->attr_len[type] != sizeof(btrfs_timespec))
+		return(EBADMSG);
+	ts->tv_sec = BTRFS_GET_LE64(cmd->attr[type], btrfs_timespec, seconds);
+	ts->tv_nsec = BTRFS_GET_LE32(cmd->attr[type], btrfs_timespec, nanoseconds);
+	return(0);
+}
+
+// a string attribute as a C string, in `buf`
+static int recv_string(const struct recv_cmd *cmd, int type, char *buf, size_t size) {
+	if(cmd->attr[type] == NULL || cmd->attr_len[type] >= size || memchr(cmd->attr[type], '\0', cmd->attr_len[type]))
+		return(EBADMSG);
+	memcpy(buf, cmd->attr[type], cmd->attr_len[type]);
+	buf[cmd->attr_len[type]] = '\0';
+	return(0);
+}
+
+/*
+ * A path attribute under the subvolume root. Absolute paths and ".." would
+ * let a stream write outside of it and are refused. Every directory on the
+ * way is opened from the root with O_NOFOLLOW, so a symlink the stream made
+ * earlier cannot redirect the rest of the path either; callers work on the
+ * last component relative to t->dir.
+ */
+static int recv_path(struct recv_ctx *ctx, const struct recv_cmd *cmd, int type, struct recv_target *t) {
+	char rel[PATH_MAX], comp[NAME_MAX + 1];
+	const char *c, *last;
+	size_t len, dirlen;
+	int error, fd, nfd;
+
+	t->dir = -1;
+	t->path[0] = '\0';
+	error = recv_string(cmd, type, rel, sizeof(rel));
+	if(error)
+		return(error);
+	if(rel[0] == '/')
+		return(EPERM);
+	for(c = rel; *c != '\0'; c += len + (c[len] == '/')) {
+		len = strcspn(c, "/");
+		if(len == 2 && c[0] == '.' && c[1] == '.')
+			return(EPERM);
+	}
+	for(len = strlen(rel); len > 0 && rel[len - 1] == '/'; --len)
+		rel[len - 1] = '\0';
+	if(snprintf(t->path, sizeof(t->path), "%s%s%s", ctx->root, rel[0] ? "/" : "", rel) >= (int)sizeof(t->path))
+		return(ENAMETOOLONG);
+
+	// the subvolume root itself is "." in it
+	last = strrchr(rel, '/');
+	dirlen = last != NULL ? (size_t)(last - rel) : 0;
+	t->name = rel[0] == '\0' ? "." : t->path + strlen(ctx->root) + 1 + (last != NULL ? dirlen + 1 : 0);
+
+	fd = ctx->root_fd;
+	for(c = rel; c < rel + dirlen; c += len + 1) {
+		len = strcspn(c, "/");
+		if(len == 0)
+			continue;
+		if(len > NAME_MAX) {
+			if(fd != ctx->root_fd)
+				close(fd);
+			return(ENAMETOOLONG);
+		}
+		memcpy(comp, c, len);
+		comp[len] = '\0';
+		// a symlink on the way fails here with ELOOP or ENOTDIR
+		nfd = openat(fd, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if(nfd < 0)
+			error = errno;
+		if(fd != ctx->root_fd)
+			close(fd);
+		if(error)
+			return(error);
+		fd = nfd;
+	}
+	t->dir = fd;
+	return(0);
+}
+
+static void recv_release(struct recv_ctx *ctx, struct recv_target *t) {
+	if(t->dir >= 0 && t->dir != ctx->root_fd)
+		close(t->dir);
+	t->dir = -1;
+}
+
+static int recv_close_file(struct recv_ctx *ctx) {
+	int error = 0;
+
+	if(ctx->open_fd < 0)
+		return(0);
+	if(ctx->fsync && fsync(ctx->open_fd) != 0)
+		error = errno;
+	if(close(ctx->open_fd) != 0 && error == 0)
+		error = errno;
+	ctx->open_fd = -1;
+	ctx->open_path[0] = '\0';
+	return(error);
+}
+
+// keep `fd` open as the file at `path`, for the WRITEs that follow
+static int recv_keep_file(struct recv_ctx *ctx, const char *path, int fd) {
+	if(snprintf(ctx->open_path, sizeof(ctx->open_path), "%s", path) >= (int)sizeof(ctx->open_path)) {
+		close(fd);
+		ctx->open_path[0] = '\0';
+		return(ENAMETOOLONG);
+	}
+	ctx->open_fd = fd;
+	return(0);
+}
+
+static int recv_open_file(struct recv_ctx *ctx, const struct recv_target *t, int *fd) {
+	int error, nfd;
+
+	if(ctx->open_fd >= 0 && strcmp(ctx->open_path, t->path) == 0) {
+		*fd = ctx->open_fd;
+		return(0);
+	}
+	error = recv_close_file(ctx);
+	if(error)
+		return(error);
+	nfd = openat(t->dir, t->name, O_RDWR | O_NOFOLLOW);
+	if(nfd < 0)
+		return(errno);
+	error = recv_keep_file(ctx, t->path, nfd);
+	if(error)
+		return(error);
+	*fd = ctx->open_fd;
+	return(0);
+}
+
+static int recv_write(struct recv_ctx *ctx, const struct recv_cmd *cmd, const struct recv_target *t) {
+	const uint8_t *data = cmd->attr[BTRFS_SEND_TLV_DATA];
+	size_t len = cmd->attr_len[BTRFS_SEND_TLV_DATA];
+	uint64_t offset;
+	ssize_t n;
+	int fd, error;
+
+	error = recv_u64(cmd, BTRFS_SEND_TLV_OFFSET, &offset);
+	if(error == 0 && data == NULL)
+		error = EBADMSG;
+	if(error == 0)
+		error = recv_open_file(ctx, t, &fd);
+	while(error == 0 && len > 0) {
+		n = pwrite(fd, data, len, offset);
+		if(n < 0) {
+			error = errno == EINTR ? 0 : errno;
+			continue;
+		}
+		data += n;
+		offset += n;
+		len -= n;
+		ctx->data_bytes += n;
+	}
+	return(error);
+}
+
+// CLONE shares the extents when the target file system can, see btrfs_copy_range()
+static int recv_clone(struct recv_ctx *ctx, const struct recv_cmd *cmd, const struct recv_target *t) {
+	struct recv_target src_t;
+	uint64_t offset, len, src_off;
+	int src, dst, error;
+
+	error = recv_u64(cmd, BTRFS_SEND_TLV_OFFSET, &offset);
+	if(error == 0)
+		error = recv_u64(cmd, BTRFS_SEND_TLV_CLONE_LENGTH, &len);
+	if(error == 0)
+		error = recv_u64(cmd, BTRFS_SEND_TLV_CLONE_OFFSET, &src_off);
+	if(error == 0 && (cmd->attr[BTRFS_SEND_TLV_CLONE_UUID] == NULL ||
+	    cmd->attr_len[BTRFS_SEND_TLV_CLONE_UUID] != BTRFS_UUID_SIZE))
+		error = EBADMSG;
+	if(error)
+		return(error);
+	// sources in other subvolumes only exist on a btrfs receiver
+	if(memcmp(cmd->attr[BTRFS_SEND_TLV_CLONE_UUID], ctx->uuid, BTRFS_UUID_SIZE) != 0) {
+		fprintf(stderr, "%s: clone source is in another subvolume\n", t->path);
+		return(ENOTSUP);
+	}
+	error = recv_path(ctx, cmd, BTRFS_SEND_TLV_CLONE_PATH, &src_t);
+	if(error == 0)
+		error = recv_open_file(ctx, t, &dst);
+	if(error == 0) {
+		src = strcmp(src_t.path, t->path) == 0 ? dst : openat(src_t.dir, src_t.name, O_RDONLY | O_NOFOLLOW);
+		if(src < 0)
+			error = errno;
+	}
+	recv_release(ctx, &src_t);
+	if(error)
+		return(error);
+	ctx->clone_bytes += len;
+
+	error = btrfs_copy_range(src, src_off, dst, offset, len, &ctx->reflinked);
+	if(src != dst)
+		close(src);
+	return(error);
+}
+
+static int recv_xattr(const char *path, const char *name, const void *value, size_t len, bool remove) {
+#if defined(__linux__)
+	if(remove)
+		return(lremovexattr(path, name) == 0 ? 0 : errno);
+	return(lsetxattr(path, name, value, len, 0) == 0 ? 0 : errno);
+#elif defined(__APPLE__)
+	if(remove)
+		return(removexattr(path, name, XATTR_NOFOLLOW) == 0 ? 0 : errno);
+	return(setxattr(path, name, value, len, 0, XATTR_NOFOLLOW) == 0 ? 0 : errno);
+#elif defined(__FreeBSD__)
+	// Linux "user." maps onto the user namespace, everything else onto system
+	int ns = EXTATTR_NAMESPACE_SYSTEM;
+
+	if(strncmp(name, "user.", 5) == 0) {
+		ns = EXTATTR_NAMESPACE_USER;
+		name += 5;
+	}
+	if(remove)
+		return(extattr_delete_link(path, ns, name) == 0 ? 0 : errno);
+	return(extattr_set_link(path, ns, name, value, len) >= 0 ? 0 : errno);
+#else
+	(void)path, (void)name, (void)value, (void)len, (void)remove;
+	return(ENOTSUP);
+#endif
+}
+
+// Linux userspace device numbers, as the sender encodes them
+static dev_t recv_rdev(uint64_t rdev) {
+	return(makedev((rdev & 0xfff00) >> 8, (rdev & 0xff) | ((rdev >> 12) & 0xfff00)));
+}
+
+static int recv_subvol(struct recv_ctx *ctx, const struct recv_cmd *cmd) {
+	char name[NAME_MAX + 1];
+	int error;
+
+	error = recv_close_file(ctx);
+	if(error == 0)
+		error = recv_string(cmd, BTRFS_SEND_TLV_PATH, name, sizeof(name));
+	if(error == 0 && (cmd->attr[BTRFS_SEND_TLV_UUID] == NULL ||
+	    cmd->attr_len[BTRFS_SEND_TLV_UUID] != BTRFS_UUID_SIZE))
+		error = EBADMSG;
+	if(error == 0 && (name[0] == '\0' || strchr(name, '/') != NULL || strcmp(name, ".") == 0 ||
+	    strcmp(name, "..") == 0))
+		error = EPERM;
+	if(error)
+		return(error);
+	memcpy(ctx->uuid, cmd->attr[BTRFS_SEND_TLV_UUID], BTRFS_UUID_SIZE);
+	if(snprintf(ctx->root, sizeof(ctx->root), "%s/%s", ctx->dest, name) >= (int)sizeof(ctx->root))
+		return(ENAMETOOLONG);
+	if(mkdir(ctx->root, 0755) != 0)
+		return(errno);
+	ctx->root_fd = open(ctx->root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(ctx->root_fd < 0)
+		return(errno);
+	ctx->subvols++;
+	fprintf(stderr, "receiving %s\n", ctx->root);
+	return(0);
+}
+
+static int recv_apply(struct recv_ctx *ctx, const struct recv_cmd *cmd) {
+	struct recv_target t, o;
+	char other[PATH_MAX];
+	struct timespec times[3];
+	struct stat st;
+	uint64_t v, mode, uid, gid;
+	int error = 0, fd;
+
+	if(cmd->cmd == BTRFS_SEND_CMD_SUBVOL)
+		return(recv_subvol(ctx, cmd));
+	if(cmd->cmd == BTRFS_SEND_CMD_SNAPSHOT) {
+		fprintf(stderr, "incremental streams need a btrfs receiver\n");
+		return(ENOTSUP);
+	}
+	if(ctx->root[0] == '\0')
+		return(EBADMSG);
+	if(cmd->cmd == BTRFS_SEND_CMD_END) {
+		error = recv_close_file(ctx);
+		close(ctx->root_fd);
+		ctx->root_fd = -1;
+		ctx->root[0] = '\0';
+		return(error);
+	}
+	error = recv_path(ctx, cmd, BTRFS_SEND_TLV_PATH, &t);
+	if(error) {
+		if(t.path[0] != '\0')
+			fprintf(stderr, "%s: %s\n", t.path, strerror(error));
+		return(error);
+	}
+	o.dir = -1;
+
+	switch(cmd->cmd) {
+	case BTRFS_SEND_CMD_MKFILE:
+		error = recv_close_file(ctx);
+		if(error == 0) {
+			fd = openat(t.dir, t.name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+			error = fd < 0 ? errno : recv_keep_file(ctx, t.path, fd);
+		}
+		break;
+	case BTRFS_SEND_CMD_MKDIR:
+		error = mkdirat(t.dir, t.name, 0700) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_MKNOD:
+	case BTRFS_SEND_CMD_MKFIFO:
+	case BTRFS_SEND_CMD_MKSOCK:
+		error = recv_u64(cmd, BTRFS_SEND_TLV_MODE, &mode);
+		if(error == 0)
+			error = recv_u64(cmd, BTRFS_SEND_TLV_RDEV, &v);
+		if(error == 0 && cmd->cmd == BTRFS_SEND_CMD_MKFIFO)
+			error = mkfifoat(t.dir, t.name, mode & 07777) == 0 ? 0 : errno;
+		else if(error == 0)
+			error = mknodat(t.dir, t.name, mode, recv_rdev(v)) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_SYMLINK:
+		error = recv_string(cmd, BTRFS_SEND_TLV_PATH_LINK, other, sizeof(other));
+		if(error == 0)
+			error = symlinkat(other, t.dir, t.name) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_RENAME:
+		error = recv_close_file(ctx);
+		if(error == 0)
+			error = recv_path(ctx, cmd, BTRFS_SEND_TLV_PATH_TO, &o);
+		if(error == 0)
+			error = renameat(t.dir, t.name, o.dir, o.name) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_LINK:
+		error = recv_path(ctx, cmd, BTRFS_SEND_TLV_PATH_LINK, &o);
+		if(error == 0)
+			error = linkat(o.dir, o.name, t.dir, t.name, 0) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_UNLINK:
+		error = recv_close_file(ctx);
+		if(error == 0)
+			error = unlinkat(t.dir, t.name, 0) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_RMDIR:
+		error = unlinkat(t.dir, t.name, AT_REMOVEDIR) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_SET_XATTR:
+	case BTRFS_SEND_CMD_REMOVE_XATTR:
+		error = recv_string(cmd, BTRFS_SEND_TLV_XATTR_NAME, other, sizeof(other));
+		if(error == 0 && cmd->cmd == BTRFS_SEND_CMD_SET_XATTR && cmd->attr[BTRFS_SEND_TLV_XATTR_DATA] == NULL)
+			error = EBADMSG;
+		if(error == 0)
+			error = recv_xattr(t.path, other, cmd->attr[BTRFS_SEND_TLV_XATTR_DATA],
+			    cmd->attr_len[BTRFS_SEND_TLV_XATTR_DATA], cmd->cmd == BTRFS_SEND_CMD_REMOVE_XATTR);
+		// not every target file system has every namespace
+		if(error == ENOTSUP || error == EOPNOTSUPP || error == EPERM) {
+			fprintf(stderr, "%s: xattr %s: %s\n", t.path, other, strerror(error));
+			error = 0;
+		}
+		break;
+	case BTRFS_SEND_CMD_WRITE:
+		error = recv_write(ctx, cmd, &t);
+		break;
+	case BTRFS_SEND_CMD_CLONE:
+		error = recv_clone(ctx, cmd, &t);
+		break;
+	case BTRFS_SEND_CMD_TRUNCATE:
+		error = recv_u64(cmd, BTRFS_SEND_TLV_SIZE, &v);
+		if(error == 0)
+			error = recv_open_file(ctx, &t, &fd);
+		if(error == 0)
+			error = ftruncate(fd, v) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_CHMOD:
+		error = recv_u64(cmd, BTRFS_SEND_TLV_MODE, &mode);
+		// symlinks have no mode of their own and chmod would follow them
+		if(error == 0)
+			error = fstatat(t.dir, t.name, &st, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+		if(error == 0 && !S_ISLNK(st.st_mode))
+			error = fchmodat(t.dir, t.name, mode & 07777, 0) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_CHOWN:
+		error = recv_u64(cmd, BTRFS_SEND_TLV_UID, &uid);
+		if(error == 0)
+			error = recv_u64(cmd, BTRFS_SEND_TLV_GID, &gid);
+		if(error == 0)
+			error = fchownat(t.dir, t.name, uid, gid, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+		// unprivileged receivers keep their own ownership
+		if(error == EPERM)
+			error = 0;
+		break;
+	case BTRFS_SEND_CMD_UTIMES:
+		error = recv_time(cmd, BTRFS_SEND_TLV_ATIME, &times[0]);
+		if(error == 0)
+			error = recv_time(cmd, BTRFS_SEND_TLV_MTIME, &times[1]);
+		if(error == 0)
+			error = utimensat(t.dir, t.name, times, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : errno;
+		break;
+	case BTRFS_SEND_CMD_UPDATE_EXTENT:
+		break;
+	default:
+		fprintf(stderr, "unknown command %u\n", cmd->cmd);
+		error = EBADMSG;
+		break;
+	}
+	recv_release(ctx, &o);
+	recv_release(ctx, &t);
+	if(error)
+		fprintf(stderr, "%s: %s\n", t.path, strerror(error));
+	return(error);
+}
+
+static double recv_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void recv_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -R [-s] [-f file] directory\n");
+}
+
+int btrfs_receive_main(int argc, char *argv[]) {
+	struct recv_ctx ctx = { .in = STDIN_FILENO, .root_fd = -1, .open_fd = -1 };
+	const char *file = NULL;
+	pthread_t parser, verifier;
+	struct recv_cmd *cmd;
+	double start, elapsed;
+	int ch, error = 0;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "sf:")) != -1) {
+		switch(ch) {
+		case 's':
+			ctx.fsync = true;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			recv_usage();
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc != 1) {
+		recv_usage();
+		return(FSUR_INVAL);
+	}
+	ctx.dest = argv[0];
+	if(file != NULL && (ctx.in = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return(FSUR_IO_FAIL);
+	}
+
+	ctx.rbuf = malloc(RECV_READ_SIZE);
+	ctx.cmds = calloc(RECV_NCMDS, sizeof(*ctx.cmds));
+	if(ctx.rbuf == NULL || ctx.cmds == NULL || btrfs_queue_init(&ctx.free, RECV_NCMDS) != 0 ||
+	    btrfs_queue_init(&ctx.verify, RECV_NCMDS) != 0 || btrfs_queue_init(&ctx.apply, RECV_NCMDS) != 0) {
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		return(FSUR_IO_FAIL);
+	}
+	for(int i = 0; i < RECV_NCMDS; ++i)
+		btrfs_queue_push(&ctx.free, &ctx.cmds[i]);
+
+	start = recv_now();
+	if(pthread_create(&parser, NULL, recv_parser, &ctx) != 0) {
+		fprintf(stderr, "%s\n", strerror(EAGAIN));
+		return(FSUR_IO_FAIL);
+	}
+	if(pthread_create(&verifier, NULL, recv_verifier, &ctx) != 0) {
+		// run the verifier here once the parser is done
+		atomic_store(&ctx.stop, true);
+		recv_verifier(&ctx);
+		error = EAGAIN;
+	}
+	while((cmd = btrfs_queue_pop(&ctx.apply)) != NULL) {
+		if(error == 0) {
+			error = recv_apply(&ctx, cmd);
+			ctx.commands++;
+		}
+		btrfs_queue_push(&ctx.free, cmd);
+		if(error)
+			atomic_store(&ctx.stop, true);
+	}
+	if(error == 0)
+		error = recv_close_file(&ctx);
+	else
+		recv_close_file(&ctx);
+	// the parser may be waiting for a buffer the verifier already gave back
+	btrfs_queue_close(&ctx.free);
+	pthread_join(parser, NULL);
+	if(error != EAGAIN)
+		pthread_join(verifier, NULL);
+	elapsed = recv_now() - start;
+
+	if(error == 0)
+		error = ctx.parse_error ? ctx.parse_error : ctx.verify_error;
+	if(error == 0 && ctx.root[0] != '\0') {
+		fprintf(stderr, "stream ends without an END command\n");
+		error = EPIPE;
+	}
+	fprintf(stderr, "%" PRIu64 " subvolumes, %" PRIu64 " commands, %" PRIu64 " bytes in %.3fs, %.1f MiB/s\n",
+	    ctx.subvols, ctx.commands, ctx.stream_bytes, elapsed,
+	    elapsed > 0 ? ctx.stream_bytes / elapsed / (1024 * 1024) : 0.0);
+	fprintf(stderr, "%" PRIu64 " data bytes written, %" PRIu64 " bytes cloned (%" PRIu64 " reflinked)\n",
+	    ctx.data_bytes, ctx.clone_bytes, ctx.reflinked);
+
+	btrfs_queue_destroy(&ctx.free);
+	btrfs_queue_destroy(&ctx.verify);
+	btrfs_queue_destroy(&ctx.apply);
+	free(ctx.cmds);
+	free(ctx.rbuf);
+	if(ctx.root_fd >= 0)
+		close(ctx.root_fd);
+	if(file != NULL)
+		close(ctx.in);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
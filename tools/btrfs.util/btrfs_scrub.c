@@ -0,0 +1,430 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "btrfs_volume.h"
+#include "btrfs_super.h"
+#include "btrfs_pool.h"
+#include "btrfs_backref.h"
+#include "btrfs_scrub.h"
+#include "crc32.h"
+
+/*
+ * Work is one (block group, mirror) pair. Pairs are queued on the device that
+ * holds the start of that copy and each device is served by its own workers,
+ * so every disk streams through its block groups in large sequential reads
+ * while all disks run at once.
+ */
+
+#define SCRUB_WINDOW (4 * 1024 * 1024)
+// unused runs shorter than this are read through rather than seeked over
+#define SCRUB_GAP (128 * 1024)
+
+struct scrub_unit {
+	const struct btrfs_chunk_map *map;
+	int mirror;
+};
+
+struct scrub_queue {
+	struct scrub_unit *units;
+	size_t count;
+	atomic_size_t next;
+};
+
+struct scrub_ctx {
+	struct btrfs_volume *vol;
+	struct scrub_queue *queues;             // one per device
+	unsigned per_device;
+	atomic_uint_fast64_t meta_blocks, data_sectors, bytes;
+	atomic_uint_fast64_t meta_errors, data_errors, read_errors, super_errors;
+	// addresses that failed, mapped to files once the scrub is done
+	pthread_mutex_t bad_lock;
+	uint64_t *bad;
+	size_t nbad, bad_cap;
+};
+
+// what one block group holds that can be verified
+struct scrub_list {
+	uint64_t *meta;                         // tree block addresses
+	int8_t *meta_level;
+	size_t nmeta, meta_cap;
+	uint32_t *csums;                        // per sector of the block group
+	uint8_t *present;                       // sectors with a data checksum
+	uint8_t *want;                          // sectors with anything to check
+};
+
+#define SCRUB_BIT(map, n) ((map)[(n) / 8] & (1 << ((n) % 8)))
+
+static int scrub_collect_meta(struct btrfs_volume *vol, const struct btrfs_chunk_map *map, struct scrub_list *list) {
+	struct btrfs_key key = { map->logical, 0, 0 };
+	struct btrfs_path path;
+	const uint8_t *k;
+	uint64_t bytenr;
+	uint8_t type;
+	int error;
+
+	if(vol->extent_root.bytenr == 0)
+		return(ENOENT);
+	error = btrfs_search(vol, vol->extent_root.bytenr, vol->extent_root.level, &key, &path);
+	for(; error == 0; error = btrfs_next_item(vol, &path)) {
+		k = btrfs_path_key(&path);
+		bytenr = btrfs_disk_key_objectid(k);
+		type = btrfs_disk_key_type(k);
+		if(bytenr >= map->logical + map->length)
+			break;
+		if(type == TYPE_EXTENT_ITEM) {
+			if(btrfs_path_size(&path) < sizeof(EXTENT_ITEM) ||
+			    !(BTRFS_GET_LE64(btrfs_path_data(&path), EXTENT_ITEM, flags) & EXTENT_ITEM_TREE_BLOCK))
+				continue;
+		} else if(type != TYPE_METADATA_ITEM)
+			continue;
+		if(list->nmeta == list->meta_cap) {
+			list->meta_cap = list->meta_cap ? list->meta_cap * 2 : 1024;
+			list->meta = realloc(list->meta, list->meta_cap * sizeof(*list->meta));
+			list->meta_level = realloc(list->meta_level, list->meta_cap * sizeof(*list->meta_level));
+			if(list->meta == NULL || list->meta_level == NULL) {
+				error = ENOMEM;
+				break;
+			}
+		}
+		list->meta[list->nmeta] = bytenr;
+		// skinny items carry the level in the key offset
+		list->meta_level[list->nmeta] = type == TYPE_METADATA_ITEM ? (int8_t)btrfs_disk_key_offset(k) : -1;
+		list->nmeta++;
+	}
+	btrfs_path_release(&path);
+	return(error == ENOENT ? 0 : error);
+}
+
+static void scrub_report(struct scrub_ctx *ctx, const char *what, uint64_t logical, int mirror, const char *why) {
+	struct btrfs_device *dev;
+	uint64_t physical, contiguous;
+
+	if(btrfs_map_logical(ctx->vol, logical, mirror, &dev, &physical, &contiguous) == 0)
+		printf("%s %" PRIu64 " mirror %d devid %" PRIu64 " (%s) physical %" PRIu64 ": %s\n", what, logical,
+		    mirror, dev->devid, dev->path, physical, why);
+	else
+		printf("%s %" PRIu64 " mirror %d: %s\n", what, logical, mirror, why);
+	if(strcmp(what, "read") == 0)
+		return;
+	pthread_mutex_lock(&ctx->bad_lock);
+	if(ctx->nbad == ctx->bad_cap) {
+		uint64_t *bad = realloc(ctx->bad, (ctx->bad_cap ? ctx->bad_cap * 2 : 256) * sizeof(*bad));
+
+		if(bad != NULL) {
+			ctx->bad = bad;
+			ctx->bad_cap = ctx->bad_cap ? ctx->bad_cap * 2 : 256;
+		}
+	}
+	if(ctx->nbad < ctx->bad_cap)
+		ctx->bad[ctx->nbad++] = logical;
+	pthread_mutex_unlock(&ctx->bad_lock);
+}
+
+static int scrub_print_ref(void *arg, const struct btrfs_logical_ref *ref) {
+	(void)arg;
+	printf("  ");
+	btrfs_logical_ref_print(ref);
+	return(0);
+}
+
+/*
+ * End of the smallest piece of a window starting at `at` that can be checked on
+ * its own: a whole tree block if one starts there, otherwise one sector. Windows
+ * never split a tree block, so walking pieces from the window start stays on
+ * tree block boundaries.
+ */
+static uint64_t scrub_piece_end(struct btrfs_volume *vol, const struct scrub_list *list, size_t meta_pos,
+    uint64_t at, uint64_t end) {
+	while(meta_pos < list->nmeta && list->meta[meta_pos] < at)
+		meta_pos++;
+	if(meta_pos < list->nmeta && list->meta[meta_pos] == at)
+		return(at + vol->node_size < end ? at + vol->node_size : end);
+	return(at + vol->sector_size);
+}
+
+// read [start, end) of one copy and check everything that falls inside it
+static void scrub_window(struct scrub_ctx *ctx, const struct scrub_unit *unit, struct scrub_list *list,
+    uint8_t *buf, uint64_t start, uint64_t end, size_t *meta_pos) {
+	struct btrfs_volume *vol = ctx->vol;
+	const struct btrfs_chunk_map *map = unit->map;
+	uint64_t sector, piece;
+	int error;
+
+	error = btrfs_read_logical(vol, start, buf, end - start, unit->mirror);
+	if(error) {
+		// fall back to the pieces so one bad sector doesn't hide a whole window
+		if(scrub_piece_end(vol, list, *meta_pos, start, end) < end) {
+			for(uint64_t at = start; at < end; at = piece) {
+				piece = scrub_piece_end(vol, list, *meta_pos, at, end);
+				scrub_window(ctx, unit, list, buf, at, piece, meta_pos);
+			}
+			return;
+		}
+		atomic_fetch_add(&ctx->read_errors, 1);
+		scrub_report(ctx, "read", start, unit->mirror, strerror(error));
+		return;
+	}
+	atomic_fetch_add(&ctx->bytes, end - start);
+
+	for(; *meta_pos < list->nmeta && list->meta[*meta_pos] + vol->node_size <= end; ++*meta_pos) {
+		uint64_t bytenr = list->meta[*meta_pos];
+
+		if(bytenr < start)
+			continue;
+		atomic_fetch_add(&ctx->meta_blocks, 1);
+		error = btrfs_check_node(vol, buf + (bytenr - start), bytenr, list->meta_level[*meta_pos], 0);
+		if(error) {
+			atomic_fetch_add(&ctx->meta_errors, 1);
+			scrub_report(ctx, "metadata", bytenr, unit->mirror,
+			    error == EBADMSG ? "checksum mismatch" : "bad tree block header");
+		}
+	}
+	for(uint64_t at = start; at < end; at += vol->sector_size) {
+		sector = (at - map->logical) / vol->sector_size;
+		if(!SCRUB_BIT(list->present, sector))
+			continue;
+		atomic_fetch_add(&ctx->data_sectors, 1);
+		if(~calculate_crc32c(~0U, buf + (at - start), vol->sector_size) != list->csums[sector]) {
+			atomic_fetch_add(&ctx->data_errors, 1);
+			scrub_report(ctx, "data", at, unit->mirror, "checksum mismatch");
+		}
+	}
+}
+
+static void scrub_unit(struct scrub_ctx *ctx, const struct scrub_unit *unit, uint8_t *buf) {
+	struct btrfs_volume *vol = ctx->vol;
+	const struct btrfs_chunk_map *map = unit->map;
+	uint64_t nsectors = map->length / vol->sector_size, first, last, next, n;
+	uint32_t node_sectors = vol->node_size / vol->sector_size, gap = SCRUB_GAP / vol->sector_size;
+	uint32_t window = SCRUB_WINDOW / vol->sector_size;
+	struct scrub_list list = { 0 };
+	size_t meta_pos = 0;
+	int error;
+
+	list.csums = malloc(nsectors * sizeof(*list.csums));
+	list.present = malloc((nsectors + 7) / 8);
+	list.want = calloc((nsectors + 7) / 8, 1);
+	if(list.csums == NULL || list.present == NULL || list.want == NULL) {
+		error = ENOMEM;
+		goto out;
+	}
+	error = btrfs_csum_lookup(vol, map->logical, nsectors * vol->sector_size, list.csums, list.present);
+	if(error == 0 && (map->type & (BLOCK_FLAG_METADATA | BLOCK_FLAG_SYSTEM)))
+		error = scrub_collect_meta(vol, map, &list);
+	if(error)
+		goto out;
+	for(uint64_t i = 0; i < (nsectors + 7) / 8; ++i)
+		list.want[i] = list.present[i];
+	for(size_t i = 0; i < list.nmeta; ++i) {
+		n = (list.meta[i] - map->logical) / vol->sector_size;
+		for(uint32_t j = 0; j < node_sectors && n + j < nsectors; ++j)
+			list.want[(n + j) / 8] |= 1 << ((n + j) % 8);
+	}
+
+	/*
+	 * Read runs of wanted sectors, bridging short gaps, in windows of up to
+	 * SCRUB_WINDOW. A window may run up to one node past that so a tree block
+	 * is never split; the buffer has room for it.
+	 */
+	for(first = 0; first < nsectors; first = last) {
+		while(first < nsectors && !SCRUB_BIT(list.want, first))
+			first++;
+		if(first >= nsectors)
+			break;
+		last = first + 1;
+		for(next = last; next < nsectors && next - first < window && next - last <= gap; ++next) {
+			if(SCRUB_BIT(list.want, next))
+				last = next + 1;
+		}
+		while(meta_pos < list.nmeta && list.meta[meta_pos] < map->logical + first * vol->sector_size)
+			meta_pos++;
+		for(size_t i = meta_pos; i < list.nmeta; ++i) {
+			n = (list.meta[i] - map->logical) / vol->sector_size;
+			if(n >= last)
+				break;
+			if(n + node_sectors > last)
+				last = n + node_sectors < nsectors ? n + node_sectors : nsectors;
+		}
+		scrub_window(ctx, unit, &list, buf, map->logical + first * vol->sector_size,
+		    map->logical + last * vol->sector_size, &meta_pos);
+	}
+
+out:
+	if(error) {
+		atomic_fetch_add(&ctx->read_errors, 1);
+		fprintf(stderr, "block group %" PRIu64 ": %s\n", map->logical, strerror(error));
+	}
+	free(list.meta);
+	free(list.meta_level);
+	free(list.csums);
+	free(list.present);
+	free(list.want);
+}
+
+static void scrub_worker(void *arg, size_t index) {
+	struct scrub_ctx *ctx = arg;
+	struct scrub_queue *queue = &ctx->queues[index / ctx->per_device];
+	uint8_t *buf;
+	size_t i;
+
+	buf = malloc(SCRUB_WINDOW + ctx->vol->node_size);
+	if(buf == NULL)
+		return;
+	while((i = atomic_fetch_add(&queue->next, 1)) < queue->count)
+		scrub_unit(ctx, &queue->units[i], buf);
+	free(buf);
+}
+
+// every superblock copy that fits on each device
+static void scrub_supers(struct scrub_ctx *ctx) {
+	struct btrfs_volume *vol = ctx->vol;
+	struct btrfs_superblock sb;
+	struct stat st;
+	off_t size;
+	int error;
+
+	for(int d = 0; d < vol->ndevs; ++d) {
+		struct btrfs_device *dev = &vol->devs[d];
+
+		size = lseek(dev->fd, 0, SEEK_END);
+		if(size <= 0 && fstat(dev->fd, &st) == 0)
+			size = st.st_size;
+		for(int i = 0; superblock_addrs[i] != 0; ++i) {
+			if(superblock_addrs[i] + BTRFS_SUPERBLOCK_SIZE > (uint64_t)size)
+				break;
+			error = btrfs_super_read(dev->fd, superblock_addrs[i], &sb);
+			if(error == 0 && memcmp(&sb.uuid, &vol->sb.uuid, sizeof(sb.uuid)) != 0)
+				error = EXDEV;
+			if(error) {
+				atomic_fetch_add(&ctx->super_errors, 1);
+				printf("superblock %d devid %" PRIu64 " (%s) physical %" PRIu64 ": %s\n", i, dev->devid,
+				    dev->path, superblock_addrs[i], error == EBADMSG ? "checksum mismatch" :
+				    error == EINVAL ? "no superblock" : error == EXDEV ? "belongs to another filesystem" :
+				    strerror(error));
+			}
+		}
+	}
+}
+
+static double scrub_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int btrfs_scrub_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct scrub_ctx ctx = { .per_device = 1, .bad_lock = PTHREAD_MUTEX_INITIALIZER };
+	struct btrfs_device *dev;
+	uint64_t physical, contiguous, errors;
+	double start, elapsed;
+	int ch, error = 0, q;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "j:")) != -1) {
+		switch(ch) {
+		case 'j':
+			ctx.per_device = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "usage: btrfs.util -V [-j threads-per-device] device ...\n");
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1 || ctx.per_device == 0) {
+		fprintf(stderr, "usage: btrfs.util -V [-j threads-per-device] device ...\n");
+		return(FSUR_INVAL);
+	}
+	if(btrfs_volume_open(&vol, argv, argc) != 0)
+		return(FSUR_IO_FAIL);
+	ctx.vol = &vol;
+
+	ctx.queues = calloc(vol.ndevs, sizeof(*ctx.queues));
+	for(int d = 0; ctx.queues != NULL && d < vol.ndevs; ++d) {
+		ctx.queues[d].units = calloc(vol.nchunks * 4, sizeof(struct scrub_unit));
+		if(ctx.queues[d].units == NULL)
+			error = ENOMEM;
+	}
+	if(ctx.queues == NULL || error) {
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		error = ENOMEM;
+		goto out;
+	}
+	// RAID5/6 parity is not checked, only the data stripes
+	for(size_t c = 0; c < vol.nchunks; ++c) {
+		const struct btrfs_chunk_map *map = vol.chunks[c];
+
+		for(int m = 0; m < btrfs_chunk_mirrors(map); ++m) {
+			if(btrfs_map_logical(&vol, map->logical, m, &dev, &physical, &contiguous) != 0) {
+				printf("block group %" PRIu64 " mirror %d: device missing\n", map->logical, m);
+				continue;
+			}
+			q = dev - vol.devs;
+			ctx.queues[q].units[ctx.queues[q].count++] = (struct scrub_unit){ map, m };
+		}
+	}
+
+	start = scrub_now();
+	scrub_supers(&ctx);
+	btrfs_parallel_for(vol.ndevs * ctx.per_device, vol.ndevs * ctx.per_device, scrub_worker, &ctx);
+	elapsed = scrub_now() - start;
+	fflush(stdout);
+
+	errors = ctx.meta_errors + ctx.data_errors + ctx.read_errors + ctx.super_errors;
+	fprintf(stderr, "%" PRIu64 " tree blocks, %" PRIu64 " data sectors, %" PRIu64 " bytes in %.3fs, %.1f MiB/s\n",
+	    (uint64_t)ctx.meta_blocks, (uint64_t)ctx.data_sectors, (uint64_t)ctx.bytes, elapsed,
+	    elapsed > 0 ? ctx.bytes / elapsed / (1024 * 1024) : 0.0);
+	fprintf(stderr, "errors: %" PRIu64 " metadata, %" PRIu64 " data, %" PRIu64 " read, %" PRIu64 " superblock\n",
+	    (uint64_t)ctx.meta_errors, (uint64_t)ctx.data_errors, (uint64_t)ctx.read_errors,
+	    (uint64_t)ctx.super_errors);
+	if(ctx.nbad != 0) {
+		printf("affected:\n");
+		if(btrfs_logical_resolve(&vol, ctx.bad, ctx.nbad, scrub_print_ref, NULL) != 0)
+			printf("  could not be resolved\n");
+	}
+	if(errors)
+		error = EIO;
+
+out:
+	for(int d = 0; ctx.queues != NULL && d < vol.ndevs; ++d)
+		free(ctx.queues[d].units);
+	free(ctx.queues);
+	free(ctx.bad);
+	pthread_mutex_destroy(&ctx.bad_lock);
+	btrfs_volume_close(&vol);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
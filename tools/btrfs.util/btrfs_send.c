@@ -0,0 +1,687 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "btrfs_volume.h"
+#include "btrfs_fs.h"
+#include "btrfs_hash.h"
+#include "btrfs_send.h"
+#include "crc32.h"
+
+/*
+ * Full send. Directories are walked breadth first from the subvolume root, so
+ * every parent exists on the receiving side before anything is created in it
+ * and no orphan names or renames are needed. A regular file is created and
+ * filled in one go; directories get their owner, mode and times in a last pass
+ * since creating their entries would change them again.
+ *
+ * Commands are built back to back in one buffer and WRITE payloads are not
+ * copied into it: each command contributes its header and attributes, plus the
+ * caller's data buffer, to an iovec list that goes out in a single writev().
+ */
+
+#define SEND_HEADER_SIZE sizeof(btrfs_send_command)
+#define SEND_TLV_SIZE sizeof(btrfs_send_tlv)
+#define SEND_DATA_SIZE (48 * 1024)              // file data per WRITE, as the kernel sends it
+#define SEND_READ_SIZE (1024 * 1024)            // file data read per batch
+#define SEND_META_SIZE (1024 * 1024)
+#define SEND_FLUSH_SIZE (1024 * 1024)
+#define SEND_IOV_MAX 256
+#define SEND_PATH_MAX (BTRFS_SEND_BUF_SIZE / 2)
+
+struct send_stream {
+	int fd;
+	uint8_t *meta;                          // headers and attributes
+	size_t meta_used;
+	size_t cmd;                             // offset of the command being built
+	const uint8_t *data;                    // payload following its attributes
+	size_t data_len;
+	struct iovec iov[SEND_IOV_MAX];
+	int niov;
+	size_t pending;
+	uint64_t bytes, commands;
+	int error;
+};
+
+static void send_le16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void send_le32(uint8_t *p, uint32_t v) {
+	send_le16(p, v);
+	send_le16(p + 2, v >> 16);
+}
+
+static void send_le64(uint8_t *p, uint64_t v) {
+	send_le32(p, v);
+	send_le32(p + 4, v >> 32);
+}
+
+static int send_flush(struct send_stream *s) {
+	struct iovec *iov = s->iov;
+	int niov = s->niov;
+	ssize_t n;
+
+	while(niov > 0 && s->error == 0) {
+		n = writev(s->fd, iov, niov);
+		if(n < 0) {
+			if(errno != EINTR)
+				s->error = errno;
+			continue;
+		}
+		s->bytes += n;
+		// partial writes happen on pipes and sockets
+		while(niov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if(niov > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	s->niov = 0;
+	s->pending = 0;
+	s->meta_used = 0;
+	return(s->error);
+}
+
+static void send_begin(struct send_stream *s, uint16_t cmd) {
+	if(SEND_META_SIZE - s->meta_used < BTRFS_SEND_BUF_SIZE)
+		send_flush(s);
+	s->cmd = s->meta_used;
+	s->data = NULL;
+	s->data_len = 0;
+	memset(s->meta + s->cmd, 0, SEND_HEADER_SIZE);
+	send_le16(s->meta + s->cmd + __builtin_offsetof(btrfs_send_command, cmd), cmd);
+	s->meta_used += SEND_HEADER_SIZE;
+}
+
+static uint8_t *send_tlv(struct send_stream *s, uint16_t type, size_t len) {
+	uint8_t *p;
+
+	if(s->meta_used - s->cmd + SEND_TLV_SIZE + len > BTRFS_SEND_BUF_SIZE) {
+		if(s->error == 0)
+			s->error = ENAMETOOLONG;
+		return(NULL);
+	}
+	p = s->meta + s->meta_used;
+	send_le16(p + __builtin_offsetof(btrfs_send_tlv, type), type);
+	send_le16(p + __builtin_offsetof(btrfs_send_tlv, length), len);
+	s->meta_used += SEND_TLV_SIZE + len;
+	return(p + SEND_TLV_SIZE);
+}
+
+static void send_put(struct send_stream *s, uint16_t type, const void *data, size_t len) {
+	uint8_t *p = send_tlv(s, type, len);
+
+	if(p != NULL)
+		memcpy(p, data, len);
+}
+
+static void send_put_u64(struct send_stream *s, uint16_t type, uint64_t v) {
+	uint8_t *p = send_tlv(s, type, sizeof(v));
+
+	if(p != NULL)
+		send_le64(p, v);
+}
+
+static void send_put_path(struct send_stream *s, uint16_t type, const char *path) {
+	send_put(s, type, path, strlen(path));
+}
+
+static void send_put_time(struct send_stream *s, uint16_t type, const struct timespec *ts) {
+	uint8_t *p = send_tlv(s, type, sizeof(btrfs_timespec));
+
+	if(p != NULL) {
+		send_le64(p + __builtin_offsetof(btrfs_timespec, seconds), ts->tv_sec);
+		send_le32(p + __builtin_offsetof(btrfs_timespec, nanoseconds), ts->tv_nsec);
+	}
+}
+
+// last attribute of a command, sent from the caller's buffer, which must stay
+// untouched until the next send_flush()
+static void send_put_data(struct send_stream *s, uint16_t type, const uint8_t *data, size_t len) {
+	if(send_tlv(s, type, 0) == NULL)
+		return;
+	if(s->meta_used - s->cmd + len > BTRFS_SEND_BUF_SIZE) {
+		s->error = EINVAL;
+		return;
+	}
+	send_le16(s->meta + s->meta_used - SEND_TLV_SIZE + __builtin_offsetof(btrfs_send_tlv, length), len);
+	s->data = data;
+	s->data_len = len;
+}
+
+static int send_end(struct send_stream *s) {
+	uint8_t *hdr = s->meta + s->cmd;
+	size_t meta_len = s->meta_used - s->cmd;
+	struct iovec *last;
+	uint32_t crc;
+
+	if(s->error)
+		return(s->error);
+	send_le32(hdr + __builtin_offsetof(btrfs_send_command, length), meta_len - SEND_HEADER_SIZE + s->data_len);
+	crc = calculate_crc32c(0, hdr, meta_len);
+	if(s->data_len > 0)
+		crc = calculate_crc32c(crc, s->data, s->data_len);
+	send_le32(hdr + __builtin_offsetof(btrfs_send_command, csum), crc);
+
+	last = s->niov > 0 ? &s->iov[s->niov - 1] : NULL;
+	if(last != NULL && (uint8_t *)last->iov_base + last->iov_len == hdr)
+		last->iov_len += meta_len;
+	else
+		s->iov[s->niov++] = (struct iovec){ hdr, meta_len };
+	if(s->data_len > 0)
+		s->iov[s->niov++] = (struct iovec){ (void *)(uintptr_t)s->data, s->data_len };
+	s->pending += meta_len + s->data_len;
+	s->commands++;
+	if(s->niov > SEND_IOV_MAX - 2 || s->pending >= SEND_FLUSH_SIZE)
+		send_flush(s);
+	return(s->error);
+}
+
+// file range that holds an extent's data on the receiving side
+struct send_clone_src {
+	const char *path;
+	uint64_t file_offset;
+	uint64_t extent_offset;
+	uint64_t len;
+};
+
+struct send_dir {
+	uint64_t ino;
+	const char *path;
+};
+
+struct send_ctx {
+	struct btrfs_subvol sv;
+	struct send_stream out;
+	struct btrfs_arena arena;               // paths that outlive their directory entry
+	struct send_dir *dirs;                  // every directory, in the order they were created
+	size_t ndirs, dirs_cap;
+	struct btrfs_hash links;                // inode -> first path, for files with more than one
+	struct btrfs_hash extents;              // disk bytenr -> struct send_clone_src
+	bool no_clone;
+	uint8_t *data;                          // SEND_READ_SIZE of file data
+	char pathbuf[SEND_PATH_MAX];
+
+	// the file being sent
+	const char *path;
+	const char *saved_path;                 // arena copy, once something refers to it
+	struct btrfs_inode_attr attr;
+	uint64_t end;                           // bytes written or cloned so far
+
+	uint64_t files, dirs_sent, data_bytes, clone_bytes, clones;
+};
+
+static const char *send_save_path(struct send_ctx *ctx, const char *path) {
+	size_t len = strlen(path) + 1;
+	char *copy = btrfs_arena_alloc(&ctx->arena, len);
+
+	if(copy != NULL)
+		memcpy(copy, path, len);
+	return(copy);
+}
+
+// Linux device numbers go out in its userspace encoding
+static uint64_t send_rdev(uint64_t rdev) {
+	uint64_t major = rdev >> 20, minor = rdev & 0xfffff;
+
+	return((minor & 0xff) | (major << 8) | ((minor & ~0xffULL) << 12));
+}
+
+static int send_xattr(void *arg, const struct btrfs_xattr *xattr) {
+	struct send_ctx *ctx = arg;
+
+	send_begin(&ctx->out, BTRFS_SEND_CMD_SET_XATTR);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, ctx->path);
+	send_put(&ctx->out, BTRFS_SEND_TLV_XATTR_NAME, xattr->name, xattr->name_len);
+	send_put(&ctx->out, BTRFS_SEND_TLV_XATTR_DATA, xattr->value, xattr->value_len);
+	return(send_end(&ctx->out));
+}
+
+static int send_attrs(struct send_ctx *ctx, const char *path, const struct btrfs_inode_attr *attr) {
+	send_begin(&ctx->out, BTRFS_SEND_CMD_CHOWN);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_UID, attr->uid);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_GID, attr->gid);
+	send_end(&ctx->out);
+	if(!S_ISLNK(attr->mode)) {
+		send_begin(&ctx->out, BTRFS_SEND_CMD_CHMOD);
+		send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+		send_put_u64(&ctx->out, BTRFS_SEND_TLV_MODE, attr->mode & 07777);
+		send_end(&ctx->out);
+	}
+	return(ctx->out.error);
+}
+
+static int send_utimes(struct send_ctx *ctx, const char *path, const struct btrfs_inode_attr *attr) {
+	send_begin(&ctx->out, BTRFS_SEND_CMD_UTIMES);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+	send_put_time(&ctx->out, BTRFS_SEND_TLV_ATIME, &attr->atime);
+	send_put_time(&ctx->out, BTRFS_SEND_TLV_MTIME, &attr->mtime);
+	send_put_time(&ctx->out, BTRFS_SEND_TLV_CTIME, &attr->ctime);
+	return(send_end(&ctx->out));
+}
+
+static int send_write(struct send_ctx *ctx, const struct btrfs_file_extent *ext, uint64_t skip, uint64_t offset,
+    uint64_t len) {
+	size_t n, chunk, hdr;
+	int error;
+
+	hdr = SEND_HEADER_SIZE + 3 * SEND_TLV_SIZE + strlen(ctx->path) + sizeof(uint64_t);
+	chunk = BTRFS_SEND_BUF_SIZE - hdr < SEND_DATA_SIZE ? BTRFS_SEND_BUF_SIZE - hdr : SEND_DATA_SIZE;
+	while(len > 0) {
+		n = len < SEND_READ_SIZE ? len : SEND_READ_SIZE;
+		error = btrfs_extent_read(ctx->sv.vol, ext, skip, ctx->data, n);
+		if(error)
+			return(error);
+		for(size_t at = 0; at < n; at += chunk) {
+			send_begin(&ctx->out, BTRFS_SEND_CMD_WRITE);
+			send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, ctx->path);
+			send_put_u64(&ctx->out, BTRFS_SEND_TLV_OFFSET, offset + at);
+			send_put_data(&ctx->out, BTRFS_SEND_TLV_DATA, ctx->data + at, n - at < chunk ? n - at : chunk);
+			send_end(&ctx->out);
+		}
+		// the next read reuses the buffer
+		error = send_flush(&ctx->out);
+		if(error)
+			return(error);
+		ctx->data_bytes += n;
+		skip += n;
+		offset += n;
+		len -= n;
+	}
+	return(0);
+}
+
+/*
+ * Clone the sector aligned head of [offset, offset + len) from where this
+ * extent's bytes were first sent, if they were. Returns the bytes cloned.
+ */
+static uint64_t send_clone(struct send_ctx *ctx, const struct btrfs_file_extent *ext, uint64_t offset, uint64_t len) {
+	const struct send_clone_src *src;
+	uint64_t n = len & ~(uint64_t)(ctx->sv.vol->sector_size - 1), src_offset;
+
+	src = btrfs_hash_get(&ctx->extents, ext->disk_bytenr);
+	if(src == NULL || n == 0 || ext->extent_offset < src->extent_offset)
+		return(0);
+	if(ext->extent_offset + n > src->extent_offset + src->len)
+		n = (src->extent_offset + src->len - ext->extent_offset) & ~(uint64_t)(ctx->sv.vol->sector_size - 1);
+	if(n == 0 || ext->extent_offset >= src->extent_offset + src->len)
+		return(0);
+	src_offset = src->file_offset + (ext->extent_offset - src->extent_offset);
+	// ranges of one file may not overlap
+	if(strcmp(src->path, ctx->path) == 0 && src_offset < offset + n && offset < src_offset + n)
+		return(0);
+
+	send_begin(&ctx->out, BTRFS_SEND_CMD_CLONE);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, ctx->path);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_OFFSET, offset);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_CLONE_LENGTH, n);
+	send_put(&ctx->out, BTRFS_SEND_TLV_CLONE_UUID, ctx->sv.uuid, BTRFS_UUID_SIZE);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_CLONE_CTRANSID, ctx->sv.ctransid);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_CLONE_PATH, src->path);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_CLONE_OFFSET, src_offset);
+	if(send_end(&ctx->out))
+		return(0);
+	ctx->clones++;
+	ctx->clone_bytes += n;
+	return(n);
+}
+
+static int send_extent(void *arg, const struct btrfs_file_extent *ext) {
+	struct send_ctx *ctx = arg;
+	struct send_clone_src *src;
+	uint64_t offset = ext->file_offset, len = ext->num_bytes, cloned = 0;
+	int error;
+
+	if(offset >= ctx->attr.size)
+		return(0);
+	if(len > ctx->attr.size - offset)
+		len = ctx->attr.size - offset;
+	// holes and preallocated ranges stay sparse
+	if(ext->type == EXTENT_TYPE_PREALLOC || (ext->type == EXTENT_TYPE_REGULAR && ext->disk_bytenr == 0))
+		return(0);
+
+	if(ext->type == EXTENT_TYPE_REGULAR && !ctx->no_clone)
+		cloned = send_clone(ctx, ext, offset, len);
+	if(cloned < len) {
+		error = send_write(ctx, ext, cloned, offset + cloned, len - cloned);
+		if(error)
+			return(error);
+	}
+	ctx->end = offset + len;
+
+	if(ext->type != EXTENT_TYPE_REGULAR || ctx->no_clone || cloned > 0 ||
+	    btrfs_hash_get(&ctx->extents, ext->disk_bytenr) != NULL)
+		return(0);
+	if(ctx->saved_path == NULL)
+		ctx->saved_path = send_save_path(ctx, ctx->path);
+	src = btrfs_arena_alloc(&ctx->arena, sizeof(*src));
+	if(src == NULL || ctx->saved_path == NULL)
+		return(ENOMEM);
+	*src = (struct send_clone_src){ ctx->saved_path, offset, ext->extent_offset,
+	    len & ~(uint64_t)(ctx->sv.vol->sector_size - 1) };
+	return(btrfs_hash_put(&ctx->extents, ext->disk_bytenr, src));
+}
+
+static int send_symlink_target(void *arg, const struct btrfs_file_extent *ext) {
+	struct send_ctx *ctx = arg;
+
+	if(ext->file_offset != 0 || ext->type != EXTENT_TYPE_INLINE || ctx->attr.size >= SEND_PATH_MAX)
+		return(EIO);
+	return(btrfs_extent_read(ctx->sv.vol, ext, 0, ctx->data, ctx->attr.size));
+}
+
+static int send_create(struct send_ctx *ctx, const char *path, const struct btrfs_inode_attr *attr) {
+	int error;
+
+	switch(attr->mode & S_IFMT) {
+	case S_IFDIR:
+		send_begin(&ctx->out, BTRFS_SEND_CMD_MKDIR);
+		break;
+	case S_IFREG:
+		send_begin(&ctx->out, BTRFS_SEND_CMD_MKFILE);
+		break;
+	case S_IFLNK:
+		// the target is read into ctx->data, and has to fit a single TLV
+		if(attr->size >= SEND_PATH_MAX) {
+			fprintf(stderr, "%s: symlink target of %" PRIu64 " bytes is too long\n", path, attr->size);
+			return(EIO);
+		}
+		memset(ctx->data, 0, attr->size + 1);
+		error = btrfs_extent_iterate(&ctx->sv, attr->ino, send_symlink_target, ctx);
+		if(error)
+			return(error);
+		send_begin(&ctx->out, BTRFS_SEND_CMD_SYMLINK);
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+		send_begin(&ctx->out, BTRFS_SEND_CMD_MKNOD);
+		break;
+	case S_IFIFO:
+		send_begin(&ctx->out, BTRFS_SEND_CMD_MKFIFO);
+		break;
+	case S_IFSOCK:
+		send_begin(&ctx->out, BTRFS_SEND_CMD_MKSOCK);
+		break;
+	default:
+		fprintf(stderr, "%s: unknown file type %o\n", path, attr->mode & S_IFMT);
+		return(EIO);
+	}
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_INODE, attr->ino);
+	if(S_ISLNK(attr->mode))
+		send_put(&ctx->out, BTRFS_SEND_TLV_PATH_LINK, ctx->data, strlen((char *)ctx->data));
+	else if(!S_ISDIR(attr->mode) && !S_ISREG(attr->mode)) {
+		send_put_u64(&ctx->out, BTRFS_SEND_TLV_RDEV, send_rdev(attr->rdev));
+		send_put_u64(&ctx->out, BTRFS_SEND_TLV_MODE, attr->mode);
+	}
+	return(send_end(&ctx->out));
+}
+
+static int send_dirent(void *arg, const struct btrfs_dirent *ent) {
+	struct send_ctx *ctx = arg;
+	const struct send_dir *parent = &ctx->dirs[ctx->dirs_sent];
+	const char *linked;
+	char *path;
+	size_t plen = strlen(parent->path);
+	int error;
+
+	// nested subvolumes are not part of this one's stream
+	if(ent->key_type != TYPE_INODE_ITEM)
+		return(0);
+	if(plen + 1 + ent->name_len >= SEND_PATH_MAX)
+		return(ENAMETOOLONG);
+	path = ctx->pathbuf;
+	memcpy(path, parent->path, plen);
+	if(plen > 0)
+		path[plen++] = '/';
+	memcpy(path + plen, ent->name, ent->name_len);
+	path[plen + ent->name_len] = '\0';
+
+	error = btrfs_inode_get(&ctx->sv, ent->ino, &ctx->attr);
+	if(error) {
+		fprintf(stderr, "%s: inode %" PRIu64 ": %s\n", path, ent->ino, strerror(error));
+		return(error);
+	}
+	if(ctx->attr.nlink > 1 && (linked = btrfs_hash_get(&ctx->links, ent->ino)) != NULL) {
+		send_begin(&ctx->out, BTRFS_SEND_CMD_LINK);
+		send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+		send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH_LINK, linked);
+		return(send_end(&ctx->out));
+	}
+
+	ctx->path = path;
+	ctx->saved_path = NULL;
+	ctx->end = 0;
+	error = send_create(ctx, path, &ctx->attr);
+	if(error == 0 && S_ISDIR(ctx->attr.mode)) {
+		if(ctx->ndirs == ctx->dirs_cap) {
+			struct send_dir *grown;
+
+			grown = realloc(ctx->dirs, (ctx->dirs_cap ? ctx->dirs_cap * 2 : 256) * sizeof(*grown));
+			if(grown == NULL)
+				return(ENOMEM);
+			ctx->dirs = grown;
+			ctx->dirs_cap = ctx->dirs_cap ? ctx->dirs_cap * 2 : 256;
+		}
+		ctx->saved_path = send_save_path(ctx, path);
+		if(ctx->saved_path == NULL)
+			return(ENOMEM);
+		ctx->dirs[ctx->ndirs++] = (struct send_dir){ ent->ino, ctx->saved_path };
+		return(btrfs_xattr_iterate(&ctx->sv, ent->ino, send_xattr, ctx));
+	}
+	if(error == 0 && S_ISREG(ctx->attr.mode)) {
+		ctx->files++;
+		error = btrfs_extent_iterate(&ctx->sv, ent->ino, send_extent, ctx);
+		if(error == 0 && ctx->end != ctx->attr.size) {
+			send_begin(&ctx->out, BTRFS_SEND_CMD_TRUNCATE);
+			send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, path);
+			send_put_u64(&ctx->out, BTRFS_SEND_TLV_SIZE, ctx->attr.size);
+			error = send_end(&ctx->out);
+		}
+	}
+	// chown clears file capabilities, so xattrs come after it
+	if(error == 0)
+		error = send_attrs(ctx, path, &ctx->attr);
+	if(error == 0)
+		error = btrfs_xattr_iterate(&ctx->sv, ent->ino, send_xattr, ctx);
+	if(error == 0)
+		error = send_utimes(ctx, path, &ctx->attr);
+	if(error == 0 && ctx->attr.nlink > 1) {
+		if(ctx->saved_path == NULL)
+			ctx->saved_path = send_save_path(ctx, path);
+		error = ctx->saved_path == NULL ? ENOMEM : btrfs_hash_put(&ctx->links, ent->ino, (void *)ctx->saved_path);
+	}
+	if(error)
+		fprintf(stderr, "%s: %s\n", path, strerror(error));
+	return(error);
+}
+
+static int send_subvol(struct send_ctx *ctx, const char *name) {
+	struct btrfs_inode_attr attr;
+	uint8_t header[sizeof(btrfs_send_header)];
+	int error;
+
+	memcpy(header, BTRFS_SEND_MAGIC, sizeof(BTRFS_SEND_MAGIC));
+	send_le32(header + __builtin_offsetof(btrfs_send_header, version), BTRFS_SEND_STREAM_VERSION);
+	memcpy(ctx->out.meta, header, sizeof(header));
+	ctx->out.meta_used = sizeof(header);
+	ctx->out.iov[ctx->out.niov++] = (struct iovec){ ctx->out.meta, sizeof(header) };
+
+	send_begin(&ctx->out, BTRFS_SEND_CMD_SUBVOL);
+	send_put_path(&ctx->out, BTRFS_SEND_TLV_PATH, name);
+	send_put(&ctx->out, BTRFS_SEND_TLV_UUID, ctx->sv.uuid, BTRFS_UUID_SIZE);
+	send_put_u64(&ctx->out, BTRFS_SEND_TLV_TRANSID, ctx->sv.ctransid);
+	error = send_end(&ctx->out);
+
+	// the root directory is the subvolume itself, with an empty path
+	ctx->dirs = malloc(256 * sizeof(*ctx->dirs));
+	if(ctx->dirs == NULL)
+		return(ENOMEM);
+	ctx->dirs_cap = 256;
+	ctx->dirs[ctx->ndirs++] = (struct send_dir){ BTRFS_FIRST_FREE_OBJECTID, "" };
+	ctx->path = "";
+	if(error == 0)
+		error = btrfs_xattr_iterate(&ctx->sv, BTRFS_FIRST_FREE_OBJECTID, send_xattr, ctx);
+
+	for(ctx->dirs_sent = 0; error == 0 && ctx->dirs_sent < ctx->ndirs; ctx->dirs_sent++)
+		error = btrfs_dir_iterate(&ctx->sv, ctx->dirs[ctx->dirs_sent].ino, send_dirent, ctx);
+
+	// directories last and deepest first, now that nothing will be added to them
+	for(size_t i = ctx->ndirs; error == 0 && i-- > 0;) {
+		error = btrfs_inode_get(&ctx->sv, ctx->dirs[i].ino, &attr);
+		if(error == 0)
+			error = send_attrs(ctx, ctx->dirs[i].path, &attr);
+		if(error == 0)
+			error = send_utimes(ctx, ctx->dirs[i].path, &attr);
+	}
+
+	if(error == 0) {
+		send_begin(&ctx->out, BTRFS_SEND_CMD_END);
+		error = send_end(&ctx->out);
+	}
+	if(error == 0)
+		error = send_flush(&ctx->out);
+	return(error);
+}
+
+static double send_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void send_usage(void) {
+	fprintf(stderr, "usage: btrfs.util -S [-C] [-f file] [-n name] subvolume device ...\n");
+}
+
+int btrfs_send_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct send_ctx ctx = { .out.fd = STDOUT_FILENO };
+	const char *file = NULL, *name = NULL;
+	char namebuf[256];
+	uint64_t id;
+	double start, elapsed;
+	int ch, error;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "Cf:n:")) != -1) {
+		switch(ch) {
+		case 'C':
+			ctx.no_clone = true;
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		default:
+			send_usage();
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 2) {
+		send_usage();
+		return(FSUR_INVAL);
+	}
+	if(file == NULL && isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "not writing a send stream to a terminal\n");
+		return(FSUR_INVAL);
+	}
+
+	if(btrfs_volume_open(&vol, argv + 1, argc - 1) != 0)
+		return(FSUR_IO_FAIL);
+	error = btrfs_subvol_resolve(&vol, argv[0], &id);
+	if(error == 0)
+		error = btrfs_subvol_open(&vol, id, &ctx.sv);
+	if(error) {
+		fprintf(stderr, "subvolume %s: %s\n", argv[0], strerror(error));
+		btrfs_volume_close(&vol);
+		return(FSUR_IO_FAIL);
+	}
+	if(name == NULL) {
+		if(btrfs_subvol_name(&vol, id, namebuf, sizeof(namebuf)) != 0)
+			snprintf(namebuf, sizeof(namebuf), "subvol%" PRIu64, id);
+		name = namebuf;
+	}
+	if(file != NULL) {
+		ctx.out.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(ctx.out.fd < 0) {
+			fprintf(stderr, "%s: %s\n", file, strerror(errno));
+			btrfs_volume_close(&vol);
+			return(FSUR_IO_FAIL);
+		}
+	}
+
+	btrfs_arena_init(&ctx.arena);
+	ctx.out.meta = malloc(SEND_META_SIZE);
+	ctx.data = malloc(SEND_READ_SIZE);
+	start = send_now();
+	if(ctx.out.meta == NULL || ctx.data == NULL)
+		error = ENOMEM;
+	else
+		error = send_subvol(&ctx, name);
+	elapsed = send_now() - start;
+	if(error)
+		fprintf(stderr, "send failed: %s\n", strerror(error));
+
+	fprintf(stderr, "%" PRIu64 " files, %zu directories, %" PRIu64 " commands, %" PRIu64 " bytes in %.3fs, "
+	    "%.1f MiB/s\n", ctx.files, ctx.ndirs, ctx.out.commands, ctx.out.bytes, elapsed,
+	    elapsed > 0 ? ctx.out.bytes / elapsed / (1024 * 1024) : 0.0);
+	fprintf(stderr, "%" PRIu64 " data bytes written, %" PRIu64 " bytes in %" PRIu64 " clones\n", ctx.data_bytes,
+	    ctx.clone_bytes, ctx.clones);
+
+	if(file != NULL && close(ctx.out.fd) != 0 && error == 0)
+		error = errno;
+	free(ctx.out.meta);
+	free(ctx.data);
+	free(ctx.dirs);
+	btrfs_hash_free(&ctx.links);
+	btrfs_hash_free(&ctx.extents);
+	btrfs_arena_destroy(&ctx.arena);
+	btrfs_volume_close(&vol);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,426 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_volume.h"
+#include "btrfs_space.h"
+
+/*
+ * Bitmap counting. Bit i of a FREE_SPACE_BITMAP item is sector i of the range
+ * in its key, set when free. The bitmap is loaded into 64-bit words and the
+ * number of free sectors and of free runs (set bits whose lower neighbour is
+ * clear) are both popcounts over the words. Each word only looks at its
+ * predecessor, so the loop vectorizes; the hardware popcount variants are
+ * picked at run time since the tool is built for the baseline ISA.
+ */
+
+static inline __attribute__((always_inline)) uint64_t space_count_words(const uint64_t *w, size_t n,
+    uint64_t *starts) {
+	uint64_t bits = 0, runs = 0;
+
+	if(n == 0) {
+		*starts = 0;
+		return(0);
+	}
+	bits = __builtin_popcountll(w[0]);
+	runs = __builtin_popcountll(w[0] & ~(w[0] << 1));
+	for(size_t i = 1; i < n; ++i) {
+		bits += __builtin_popcountll(w[i]);
+		runs += __builtin_popcountll(w[i] & ~((w[i] << 1) | (w[i - 1] >> 63)));
+	}
+	*starts = runs;
+	return(bits);
+}
+
+static uint64_t space_count_generic(const uint64_t *w, size_t n, uint64_t *starts) {
+	return(space_count_words(w, n, starts));
+}
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 8)
+__attribute__((target("popcnt")))
+static uint64_t space_count_popcnt(const uint64_t *w, size_t n, uint64_t *starts) {
+	return(space_count_words(w, n, starts));
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static uint64_t space_count_avx512(const uint64_t *w, size_t n, uint64_t *starts) {
+	return(space_count_words(w, n, starts));
+}
+#endif
+
+btrfs_space_count_fn *btrfs_space_counter(void) {
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 8)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512vpopcntdq"))
+		return(space_count_avx512);
+	if(__builtin_cpu_supports("popcnt"))
+		return(space_count_popcnt);
+#endif
+	// elsewhere (arm64) the builtin is already the vector instruction
+	return(space_count_generic);
+}
+
+// set bits from bit 0 up
+static uint64_t space_leading(const uint64_t *w, uint64_t nbits) {
+	uint64_t n = 0;
+
+	for(size_t i = 0; n < nbits; ++i, n += 64) {
+		if(w[i] != UINT64_MAX) {
+			n += __builtin_ctzll(~w[i]);
+			break;
+		}
+	}
+	return(n < nbits ? n : nbits);
+}
+
+// set bits from bit nbits - 1 down; bits past nbits are clear
+static uint64_t space_trailing(const uint64_t *w, uint64_t nbits) {
+	uint64_t n = 0, word;
+	size_t i = (nbits + 63) / 64;
+	unsigned pad = (64 - nbits % 64) % 64;
+
+	word = w[--i] << pad;
+	if(word != (UINT64_MAX << pad))
+		return(word == 0 ? 0 : __builtin_clzll(~word));
+	n = 64 - pad;
+	while(i > 0 && w[i - 1] == UINT64_MAX) {
+		n += 64;
+		--i;
+	}
+	if(i > 0)
+		n += __builtin_clzll(~w[i - 1]);
+	return(n);
+}
+
+// longest run of set bits in [from, to)
+static uint64_t space_longest(const uint64_t *w, uint64_t from, uint64_t to) {
+	uint64_t run = 0, best = 0, word;
+	unsigned pos, n;
+
+	for(uint64_t base = from & ~63ULL; base < to; base += 64) {
+		word = w[base / 64];
+		if(base < from)
+			word &= UINT64_MAX << (from - base);
+		if(to - base < 64)
+			word &= (1ULL << (to - base)) - 1;
+		if(word == UINT64_MAX) {
+			run += 64;
+			continue;
+		}
+		for(pos = 0; pos < 64; pos += n) {
+			if((word >> pos) & 1) {
+				n = __builtin_ctzll(~(word >> pos));
+				run += n;
+			} else {
+				best = run > best ? run : best;
+				run = 0;
+				n = (word >> pos) == 0 ? 64 - pos : (unsigned)__builtin_ctzll(word >> pos);
+			}
+		}
+	}
+	return(run > best ? run : best);
+}
+
+/*
+ * Walking the tree
+ */
+
+struct space_walk {
+	struct btrfs_volume *vol;
+	btrfs_space_count_fn *count;
+	uint64_t *words;                            // one bitmap item, as host words
+	struct btrfs_bg_space bg;
+	bool open;
+	// the free range still growing, extents and bitmaps join where they touch
+	uint64_t run_start, run_len;
+};
+
+static void space_close_run(struct space_walk *w) {
+	if(w->run_len == 0)
+		return;
+	w->bg.extents++;
+	if(w->run_len > w->bg.largest)
+		w->bg.largest = w->run_len;
+	w->run_len = 0;
+}
+
+static void space_add_run(struct space_walk *w, uint64_t start, uint64_t len) {
+	if(w->run_len != 0 && start == w->run_start + w->run_len) {
+		w->run_len += len;
+		return;
+	}
+	space_close_run(w);
+	w->run_start = start;
+	w->run_len = len;
+}
+
+static int space_bitmap(struct space_walk *w, uint64_t start, uint64_t len, const uint8_t *data, uint32_t size) {
+	uint64_t sector = w->vol->sector_size, nbits = len / sector, bits, starts, lead, trail, longest;
+	size_t nwords = (nbits + 63) / 64;
+
+	if(len % sector != 0 || (uint64_t)size * 8 < nbits || nwords * 8 > w->vol->node_size)
+		return(EIO);
+	memset(w->words, 0, nwords * 8);
+	memcpy(w->words, data, (nbits + 7) / 8);
+	for(size_t i = 0; i < nwords; ++i)
+		w->words[i] = le64toh(w->words[i]);
+	if(nbits % 64)
+		w->words[nwords - 1] &= (1ULL << (nbits % 64)) - 1;
+
+	bits = w->count(w->words, nwords, &starts);
+	w->bg.free += bits * sector;
+	if(bits == 0)
+		return(0);
+	lead = space_leading(w->words, nbits);
+	if(lead == nbits) {
+		space_add_run(w, start, len);
+		return(0);
+	}
+	trail = space_trailing(w->words, nbits);
+	// the runs at either end may continue into the neighbouring items
+	if(lead != 0)
+		space_add_run(w, start, lead * sector);
+	starts -= (lead != 0) + (trail != 0);
+	w->bg.extents += starts;
+	// the interior can only hold a new largest run if it has that many free bits
+	if(starts != 0 && (bits - lead - trail) * sector > w->bg.largest) {
+		longest = space_longest(w->words, lead, nbits - trail) * sector;
+		if(longest > w->bg.largest)
+			w->bg.largest = longest;
+	}
+	if(trail != 0)
+		space_add_run(w, start + len - trail * sector, trail * sector);
+	return(0);
+}
+
+static int space_finish(struct space_walk *w, int (*fn)(void *, const struct btrfs_bg_space *), void *arg) {
+	if(!w->open)
+		return(0);
+	space_close_run(w);
+	w->open = false;
+	return(fn(arg, &w->bg));
+}
+
+int btrfs_space_iterate(struct btrfs_volume *vol, int (*fn)(void *arg, const struct btrfs_bg_space *bg),
+    void *arg) {
+	struct space_walk w = { .vol = vol };
+	struct btrfs_key key = { 0 };
+	const struct btrfs_chunk_map *map;
+	struct btrfs_path path;
+	const uint8_t *k, *data;
+	uint64_t root, offset, len;
+	uint8_t level, type;
+	int error;
+
+	error = btrfs_find_root(vol, BTRFS_ROOT_FREE_SPACE, &root, &level);
+	if(error)
+		return(error);
+	w.words = malloc(vol->node_size);
+	if(w.words == NULL)
+		return(ENOMEM);
+	w.count = btrfs_space_counter();
+
+	for(error = btrfs_search(vol, root, level, &key, &path); error == 0; error = btrfs_next_item(vol, &path)) {
+		k = btrfs_path_key(&path);
+		data = btrfs_path_data(&path);
+		type = btrfs_disk_key_type(k);
+		offset = btrfs_disk_key_objectid(k);
+		len = btrfs_disk_key_offset(k);
+
+		if(type == TYPE_FREE_SPACE_INFO) {
+			error = space_finish(&w, fn, arg);
+			if(error)
+				break;
+			if(btrfs_path_size(&path) < sizeof(FREE_SPACE_INFO)) {
+				error = EIO;
+				break;
+			}
+			map = btrfs_chunk_lookup(vol, offset);
+			memset(&w.bg, 0, sizeof(w.bg));
+			w.bg.start = offset;
+			w.bg.length = len;
+			w.bg.type = map != NULL ? map->type : 0;
+			w.bg.recorded = BTRFS_GET_LE32(data, FREE_SPACE_INFO, count);
+			w.bg.flags = BTRFS_GET_LE32(data, FREE_SPACE_INFO, flags);
+			w.open = true;
+			continue;
+		}
+		if(type != TYPE_FREE_SPACE_EXTENT && type != TYPE_FREE_SPACE_BITMAP)
+			continue;
+		// free ranges come after their block group's info and stay inside it
+		if(!w.open || offset < w.bg.start || len > w.bg.start + w.bg.length - offset) {
+			fprintf(stderr, "free space tree: range %" PRIu64 "+%" PRIu64 " outside its block group\n", offset,
+			    len);
+			error = EIO;
+			break;
+		}
+		if(type == TYPE_FREE_SPACE_EXTENT) {
+			w.bg.free += len;
+			space_add_run(&w, offset, len);
+		} else if((error = space_bitmap(&w, offset, len, data, btrfs_path_size(&path))) != 0) {
+			fprintf(stderr, "free space tree: bad bitmap at %" PRIu64 "\n", offset);
+			break;
+		}
+	}
+	btrfs_path_release(&path);
+	if(error == ENOENT)
+		error = space_finish(&w, fn, arg);
+	free(w.words);
+	return(error);
+}
+
+/*
+ * btrfs.util -F
+ */
+
+enum {
+	SPACE_DATA,
+	SPACE_METADATA,
+	SPACE_SYSTEM,
+	SPACE_NTYPES
+};
+
+static const char *space_type_names[SPACE_NTYPES] = { "data", "metadata", "system" };
+
+struct space_report {
+	struct btrfs_volume *vol;
+	bool quiet;
+	uint64_t groups, mismatches;
+	struct space_total {
+		uint64_t groups, size, free, extents, largest;
+	} totals[SPACE_NTYPES];
+	size_t next_chunk;                          // for block groups the tree does not know
+};
+
+static int space_type_index(uint64_t type) {
+	if(type & BLOCK_FLAG_SYSTEM)
+		return(SPACE_SYSTEM);
+	if(type & BLOCK_FLAG_METADATA)
+		return(SPACE_METADATA);
+	return(SPACE_DATA);
+}
+
+// how scattered the free space is: 0 when it is one range, near 100 when it is all small ones
+static double space_fragmentation(uint64_t free, uint64_t largest) {
+	return(free != 0 ? 100.0 * (free - largest) / free : 0.0);
+}
+
+static int space_report_bg(void *arg, const struct btrfs_bg_space *bg) {
+	struct space_report *r = arg;
+	struct space_total *t = &r->totals[space_type_index(bg->type)];
+
+	while(r->next_chunk < r->vol->nchunks && r->vol->chunks[r->next_chunk]->logical < bg->start) {
+		printf("block group %" PRIu64 ": missing from the free space tree\n",
+		    r->vol->chunks[r->next_chunk]->logical);
+		r->mismatches++;
+		r->next_chunk++;
+	}
+	if(r->next_chunk < r->vol->nchunks && r->vol->chunks[r->next_chunk]->logical == bg->start)
+		r->next_chunk++;
+
+	r->groups++;
+	t->groups++;
+	t->size += bg->length;
+	t->free += bg->free;
+	t->extents += bg->extents;
+	if(bg->largest > t->largest)
+		t->largest = bg->largest;
+	if(!r->quiet)
+		printf("block group %" PRIu64 " %s %" PRIu64 " bytes: %" PRIu64 " free (%.1f%%) in %" PRIu64
+		    " extents, largest %" PRIu64 ", %.1f%% fragmented%s\n", bg->start, space_type_names[space_type_index(bg->type)],
+		    bg->length, bg->free, bg->length ? 100.0 * bg->free / bg->length : 0.0, bg->extents, bg->largest,
+		    space_fragmentation(bg->free, bg->largest), bg->flags & BTRFS_FREE_SPACE_USING_BITMAPS ? ", bitmaps" : "");
+	if(bg->free > bg->length)
+		printf("block group %" PRIu64 ": more free space than its length\n", bg->start);
+	if(bg->extents != bg->recorded)
+		printf("block group %" PRIu64 ": %" PRIu64 " free extents, free space info says %u\n", bg->start,
+		    bg->extents, bg->recorded);
+	r->mismatches += (bg->free > bg->length) + (bg->extents != bg->recorded);
+	return(0);
+}
+
+int btrfs_space_main(int argc, char *argv[]) {
+	struct btrfs_volume vol;
+	struct space_report r = { 0 };
+	uint64_t size = 0, free = 0;
+	int ch, error;
+
+	optind = 1;
+	while((ch = getopt(argc, argv, "q")) != -1) {
+		switch(ch) {
+		case 'q':
+			r.quiet = true;
+			break;
+		default:
+			fprintf(stderr, "usage: btrfs.util -F [-q] device ...\n");
+			return(FSUR_INVAL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if(argc < 1) {
+		fprintf(stderr, "usage: btrfs.util -F [-q] device ...\n");
+		return(FSUR_INVAL);
+	}
+	if(btrfs_volume_open(&vol, argv, argc) != 0)
+		return(FSUR_IO_FAIL);
+	r.vol = &vol;
+
+	error = btrfs_space_iterate(&vol, space_report_bg, &r);
+	if(error == ENOENT) {
+		fprintf(stderr, "no free space tree (space_cache=v2 was never enabled)\n");
+	} else if(error) {
+		fprintf(stderr, "reading the free space tree: %s\n", strerror(error));
+	} else {
+		for(; r.next_chunk < vol.nchunks; r.next_chunk++, r.mismatches++)
+			printf("block group %" PRIu64 ": missing from the free space tree\n", vol.chunks[r.next_chunk]->logical);
+		for(int t = 0; t < SPACE_NTYPES; ++t) {
+			const struct space_total *tot = &r.totals[t];
+
+			if(tot->groups == 0)
+				continue;
+			printf("%s: %" PRIu64 " block groups, %" PRIu64 " bytes, %" PRIu64 " used, %" PRIu64 " free in %" PRIu64
+			    " extents, largest %" PRIu64 ", %.1f%% fragmented\n", space_type_names[t], tot->groups, tot->size,
+			    tot->size - tot->free, tot->free, tot->extents, tot->largest,
+			    space_fragmentation(tot->free, tot->largest));
+			size += tot->size;
+			free += tot->free;
+		}
+		printf("total: %" PRIu64 " bytes in block groups, %" PRIu64 " free\n", size, free);
+		if(r.mismatches)
+			error = EIO;
+	}
+	btrfs_volume_close(&vol);
+	return(error ? FSUR_IO_FAIL : FSUR_IO_SUCCESS);
+}
@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_SPACE_H
+#define _BTRFS_SPACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "btrfs_volume.h"
+
+/*
+ * Free space per block group from the free space tree (space_cache=v2). The
+ * tree holds one FREE_SPACE_INFO per block group followed by either extent
+ * items or bitmap items for its free ranges, so exact free space and its
+ * fragmentation come out of a few leaves per block group instead of a walk of
+ * the extent tree.
+ */
+struct btrfs_bg_space {
+    uint64_t start;
+    uint64_t length;
+    uint64_t type;                              // BLOCK_FLAG_* of the chunk
+    uint64_t free;                              // bytes
+    uint64_t extents;                           // contiguous free ranges
+    uint64_t largest;                           // longest free range, bytes
+    uint32_t recorded;                          // extent count kept in FREE_SPACE_INFO
+    uint32_t flags;                             // BTRFS_FREE_SPACE_USING_BITMAPS
+};
+
+// Calls fn for every block group in address order, stopping when it returns
+// nonzero (which is returned). Returns 0, ENOENT when the filesystem has no
+// free space tree, EIO for an inconsistent tree, or another errno.
+int btrfs_space_iterate(struct btrfs_volume *vol, int (*fn)(void *arg, const struct btrfs_bg_space *bg),
+    void *arg);
+
+// Counts the set bits in `n` bitmap words, bit i of word j being bit 64 * j + i
+// of the bitmap, and stores the number of runs of set bits in *starts. The
+// variant returned uses the fastest popcount the CPU has.
+typedef uint64_t btrfs_space_count_fn(const uint64_t *w, size_t n, uint64_t *starts);
+btrfs_space_count_fn *btrfs_space_counter(void);
+
+// btrfs.util -F [-q] device ...
+//
+// Prints free space, free extent count and largest free extent for every block
+// group (only the totals per type with -q).
+int btrfs_space_main(int argc, char *argv[]);
+
+#endif // _BTRFS_SPACE_H
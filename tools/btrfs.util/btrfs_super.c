@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_super.h"
+#include "btrfs_accessors.h"
+#include "crc32.h"
+
+uint32_t btrfs_csum_block(const uint8_t *block, size_t size) {
+	return(~calculate_crc32c(~0U, block + BTRFS_CSUM_SIZE, size - BTRFS_CSUM_SIZE));
+}
+
+int btrfs_super_verify(const uint8_t *block) {
+	const struct btrfs_superblock *sb = (const struct btrfs_superblock *)block;
+
+	if(btrfs_get_le64(BTRFS_FIELD(sb, struct btrfs_superblock, magic)) != BTRFS_MAGIC)
+		return(EINVAL);
+	if(btrfs_get_le16(BTRFS_FIELD(sb, struct btrfs_superblock, csum_type)) != CSUM_TYPE_CRC32C)
+		return(ENOTSUP);
+	if(btrfs_csum_block(block, BTRFS_SUPERBLOCK_SIZE) != btrfs_get_le32(block))
+		return(EBADMSG);
+	return(0);
+}
+
+int btrfs_super_read(int fd, uint64_t offset, struct btrfs_superblock *sb) {
+	void *buf;
+	ssize_t n;
+	int error;
+
+	// raw devices want sector aligned buffers
+	if(posix_memalign(&buf, BTRFS_SUPERBLOCK_SIZE, BTRFS_SUPERBLOCK_SIZE) != 0)
+		return(ENOMEM);
+	n = pread(fd, buf, BTRFS_SUPERBLOCK_SIZE, offset);
+	if(n < 0)
+		error = errno;
+	else if(n != BTRFS_SUPERBLOCK_SIZE)
+		error = EINVAL;
+	else
+		error = btrfs_super_verify(buf);
+	// an unverified checksum type still has the magic, let the caller decide
+	if(error == 0 || error == ENOTSUP)
+		memcpy(sb, buf, sizeof(*sb));
+	free(buf);
+	return(error);
+}
+
+void btrfs_uuid_format(const btrfs_uuid *uuid, char *out) {
+	const uint8_t *u = uuid->uuid;
+
+	snprintf(out, BTRFS_UUID_STRLEN, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+	    u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+	    u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+static int uuid_nibble(char c) {
+	if(c >= '0' && c <= '9')
+		return(c - '0');
+	if(c >= 'a' && c <= 'f')
+		return(c - 'a' + 10);
+	if(c >= 'A' && c <= 'F')
+		return(c - 'A' + 10);
+	return(-1);
+}
+
+int btrfs_uuid_parse(const char *str, btrfs_uuid *uuid) {
+	int hi, lo;
+
+	if(strlen(str) != BTRFS_UUID_STRLEN - 1)
+		return(EINVAL);
+	for(int i = 0; i < BTRFS_UUID_SIZE; ++i) {
+		// dashes after bytes 4, 6, 8 and 10
+		if(i == 4 || i == 6 || i == 8 || i == 10) {
+			if(*str++ != '-')
+				return(EINVAL);
+		}
+		hi = uuid_nibble(str[0]);
+		lo = uuid_nibble(str[1]);
+		if(hi < 0 || lo < 0)
+			return(EINVAL);
+		uuid->uuid[i] = hi << 4 | lo;
+		str += 2;
+	}
+	return(0);
+}
@@ -0,0 +1,51 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_SUPER_H
+#define _BTRFS_SUPER_H
+
+#include <stdint.h>
+#include "btrfs_filesystem.h"
+
+#define BTRFS_UUID_STRLEN 37                    // 36 characters and the terminator
+
+// Reads the superblock copy at `offset` from `fd` into `sb`. Returns 0, an errno
+// from the read, EINVAL when there is no btrfs magic, ENOTSUP for checksum types
+// other than crc32c (`sb` is still filled in) and EBADMSG when the checksum does
+// not match.
+int btrfs_super_read(int fd, uint64_t offset, struct btrfs_superblock *sb);
+
+// `block` is the full BTRFS_SUPERBLOCK_SIZE bytes as read from the disk
+int btrfs_super_verify(const uint8_t *block);
+
+// crc32c of a metadata block past its csum field, as stored in the first four bytes
+uint32_t btrfs_csum_block(const uint8_t *block, size_t size);
+
+void btrfs_uuid_format(const btrfs_uuid *uuid, char *out);
+// Reads a UUID as btrfs_uuid_format() writes it. Returns 0 or EINVAL.
+int btrfs_uuid_parse(const char *str, btrfs_uuid *uuid);
+
+#endif // _BTRFS_SUPER_H
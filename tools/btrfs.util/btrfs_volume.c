@@ -0,0 +1,686 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "btrfs_volume.h"
+#include "btrfs_super.h"
+#include "crc32.h"
+
+#define BTRFS_PROFILE_MASK (BLOCK_FLAG_RAID0 | BLOCK_FLAG_RAID1 | BLOCK_FLAG_DUPLICATE | BLOCK_FLAG_RAID10 | \
+    BLOCK_FLAG_RAID5 | BLOCK_FLAG_RAID6 | BLOCK_FLAG_RAID1C3 | BLOCK_FLAG_RAID1C4)
+
+struct chunk_list {
+	struct btrfs_chunk_map **v;
+	size_t n, cap;
+};
+
+static struct btrfs_device *volume_find_device(struct btrfs_volume *vol, uint64_t devid) {
+	for(int i = 0; i < vol->ndevs; ++i) {
+		if(vol->devs[i].devid == devid)
+			return(&vol->devs[i]);
+	}
+	return(NULL);
+}
+
+// decode a CHUNK_ITEM of `size` bytes at `logical` and append it to `list`
+static int chunk_list_add(struct btrfs_volume *vol, struct chunk_list *list, uint64_t logical,
+    const uint8_t *chunk, size_t size) {
+	struct btrfs_chunk_map *map, **grown;
+	uint16_t num_stripes;
+
+	if(size < btrfs_chunk_item_size(1))
+		return(EIO);
+	num_stripes = btrfs_chunk_num_stripes(chunk);
+	if(num_stripes == 0 || size < btrfs_chunk_item_size(num_stripes))
+		return(EIO);
+
+	map = btrfs_arena_alloc(&vol->arena, sizeof(*map) + num_stripes * sizeof(map->stripes[0]));
+	if(map == NULL)
+		return(ENOMEM);
+	map->logical = logical;
+	map->length = btrfs_chunk_length(chunk);
+	map->type = btrfs_chunk_type(chunk);
+	map->stripe_len = BTRFS_GET_LE64(chunk, struct btrfs_chunk_item, stripe_length);
+	map->num_stripes = num_stripes;
+	map->sub_stripes = BTRFS_GET_LE16(chunk, struct btrfs_chunk_item, sub_stripes);
+	if(map->stripe_len == 0 || map->length == 0)
+		return(EIO);
+	if((map->type & BLOCK_FLAG_RAID10) && (map->sub_stripes == 0 || num_stripes % map->sub_stripes != 0))
+		return(EIO);
+	if((map->type & BLOCK_FLAG_RAID5) && num_stripes < 2)
+		return(EIO);
+	if((map->type & BLOCK_FLAG_RAID6) && num_stripes < 3)
+		return(EIO);
+	for(uint16_t i = 0; i < num_stripes; ++i) {
+		const uint8_t *stripe = btrfs_chunk_stripe(chunk, i);
+
+		map->stripes[i].devid = btrfs_stripe_devid(stripe);
+		map->stripes[i].offset = btrfs_stripe_offset(stripe);
+		map->stripes[i].dev = volume_find_device(vol, map->stripes[i].devid);
+	}
+
+	if(list->n == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		grown = realloc(list->v, list->cap * sizeof(*grown));
+		if(grown == NULL)
+			return(ENOMEM);
+		list->v = grown;
+	}
+	list->v[list->n++] = map;
+	return(0);
+}
+
+static int chunk_cmp(const void *a, const void *b) {
+	const struct btrfs_chunk_map *ca = *(const struct btrfs_chunk_map *const *)a;
+	const struct btrfs_chunk_map *cb = *(const struct btrfs_chunk_map *const *)b;
+
+	if(ca->logical != cb->logical)
+		return(ca->logical < cb->logical ? -1 : 1);
+	return(0);
+}
+
+// make `list` the volume's chunk map
+static int chunk_list_publish(struct btrfs_volume *vol, struct chunk_list *list) {
+	qsort(list->v, list->n, sizeof(*list->v), chunk_cmp);
+	for(size_t i = 1; i < list->n; ++i) {
+		if(list->v[i - 1]->logical + list->v[i - 1]->length > list->v[i]->logical) {
+			fprintf(stderr, "overlapping chunks at %llu\n", (unsigned long long)list->v[i]->logical);
+			return(EIO);
+		}
+	}
+	free(vol->chunks);
+	vol->chunks = list->v;
+	vol->nchunks = list->n;
+	list->v = NULL;
+	list->n = list->cap = 0;
+	return(0);
+}
+
+static int volume_load_sys_chunks(struct btrfs_volume *vol, struct chunk_list *list) {
+	const uint8_t *array = vol->sb.sys_chunk_array;
+	uint32_t array_size = vol->sb.sys_chunk_array_valid;
+	size_t size;
+	int error;
+
+	if(array_size > SYS_CHUNK_ARRAY_SIZE)
+		return(EIO);
+	// a packed run of (key, chunk item, stripes) entries
+	for(uint32_t i = 0; i < array_size;) {
+		const uint8_t *key = array + i, *chunk = key + sizeof(struct btrfs_key);
+
+		if(i + sizeof(struct btrfs_key) + btrfs_chunk_item_size(1) > array_size)
+			return(EIO);
+		if(btrfs_disk_key_type(key) != TYPE_CHUNK_ITEM)
+			return(EIO);
+		size = btrfs_chunk_item_size(btrfs_chunk_num_stripes(chunk));
+		if(i + sizeof(struct btrfs_key) + size > array_size)
+			return(EIO);
+		error = chunk_list_add(vol, list, btrfs_disk_key_offset(key), chunk, size);
+		if(error)
+			return(error);
+		i += sizeof(struct btrfs_key) + size;
+	}
+	return(chunk_list_publish(vol, list));
+}
+
+static int volume_walk_chunk_tree(struct btrfs_volume *vol, struct chunk_list *list, uint64_t logical, int level,
+    uint64_t generation) {
+	uint8_t *node;
+	uint32_t num_items;
+	int error;
+
+	node = malloc(vol->node_size);
+	if(node == NULL)
+		return(ENOMEM);
+	error = btrfs_read_node(vol, logical, level, generation, node);
+	num_items = error ? 0 : btrfs_header_nritems(node);
+	for(uint32_t i = 0; i < num_items && error == 0; ++i) {
+		if(level > 0) {
+			error = volume_walk_chunk_tree(vol, list, btrfs_node_blockptr(node, i), level - 1,
+			    btrfs_node_ptr_generation(node, i));
+		} else if(btrfs_disk_key_type(btrfs_item_key(node, i)) == TYPE_CHUNK_ITEM) {
+			error = chunk_list_add(vol, list, btrfs_disk_key_offset(btrfs_item_key(node, i)),
+			    btrfs_item_data(node, i), btrfs_item_size(node, i));
+		}
+	}
+	free(node);
+	return(error);
+}
+
+int btrfs_volume_open(struct btrfs_volume *vol, char *const paths[], int count) {
+	struct chunk_list list = { 0 };
+	struct btrfs_superblock sb;
+	int error = 0;
+
+	memset(vol, 0, sizeof(*vol));
+	btrfs_arena_init(&vol->arena);
+	for(int i = 0; i < BTRFS_NSTATS; ++i)
+		atomic_init(&vol->stats[i], 0);
+	vol->devs = calloc(count, sizeof(*vol->devs));
+	if(vol->devs == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	for(int i = 0; i < count; ++i) {
+		struct btrfs_device *dev = &vol->devs[vol->ndevs];
+
+		dev->path = paths[i];
+		dev->fd = open(paths[i], O_RDONLY);
+		if(dev->fd == -1) {
+			error = errno;
+			fprintf(stderr, "%s: %s\n", paths[i], strerror(error));
+			goto fail;
+		}
+		error = btrfs_super_read(dev->fd, superblock_addrs[0], &sb);
+		if(error) {
+			fprintf(stderr, "%s: %s\n", paths[i], error == EINVAL ? "not a btrfs filesystem" : strerror(error));
+			close(dev->fd);
+			goto fail;
+		}
+		if(vol->ndevs > 0 && memcmp(&sb.uuid, &vol->sb.uuid, sizeof(sb.uuid)) != 0) {
+			fprintf(stderr, "%s: belongs to a different filesystem\n", paths[i]);
+			close(dev->fd);
+			error = EINVAL;
+			goto fail;
+		}
+		if(volume_find_device(vol, sb.dev_item.dev_id) != NULL) {
+			fprintf(stderr, "%s: devid %llu given twice, ignored\n", paths[i],
+			    (unsigned long long)sb.dev_item.dev_id);
+			close(dev->fd);
+			continue;
+		}
+		dev->devid = sb.dev_item.dev_id;
+		if(vol->ndevs == 0 || sb.generation > vol->sb.generation)
+			vol->sb = sb;
+		vol->ndevs++;
+	}
+	if(vol->ndevs == 0) {
+		error = EINVAL;
+		goto fail;
+	}
+
+	vol->node_size = vol->sb.node_size;
+	vol->sector_size = vol->sb.sector_size;
+	if((vol->node_size & (vol->node_size - 1)) != 0 || vol->node_size < 4096 || vol->node_size > 65536 ||
+	    (vol->sector_size & (vol->sector_size - 1)) != 0 || vol->sector_size < 512) {
+		fprintf(stderr, "unsupported node size %u or sector size %u\n", vol->node_size, vol->sector_size);
+		error = EINVAL;
+		goto fail;
+	}
+
+	// sys_chunk_array maps the chunk tree, the chunk tree maps everything
+	error = volume_load_sys_chunks(vol, &list);
+	if(error == 0)
+		error = volume_walk_chunk_tree(vol, &list, vol->sb.chunk_tree_addr, vol->sb.chunk_root_level,
+		    vol->sb.chunk_root_generation);
+	if(error == 0)
+		error = chunk_list_publish(vol, &list);
+	if(error) {
+		fprintf(stderr, "cannot load the chunk tree: %s\n", strerror(error));
+		goto fail;
+	}
+	// looked up often enough to keep, missing ones stay zero
+	btrfs_find_root(vol, BTRFS_ROOT_EXTENT, &vol->extent_root.bytenr, &vol->extent_root.level);
+	btrfs_find_root(vol, BTRFS_ROOT_CHECKSUM, &vol->csum_root.bytenr, &vol->csum_root.level);
+	if((uint64_t)vol->ndevs < vol->sb.num_devices)
+		fprintf(stderr, "%llu of %llu devices missing\n", (unsigned long long)(vol->sb.num_devices - vol->ndevs),
+		    (unsigned long long)vol->sb.num_devices);
+	return(0);
+
+fail:
+	free(list.v);
+	btrfs_volume_close(vol);
+	return(error);
+}
+
+void btrfs_volume_close(struct btrfs_volume *vol) {
+	for(int i = 0; i < vol->ndevs; ++i)
+		close(vol->devs[i].fd);
+	free(vol->devs);
+	free(vol->chunks);
+	btrfs_arena_destroy(&vol->arena);
+	vol->devs = NULL;
+	vol->chunks = NULL;
+	vol->ndevs = 0;
+	vol->nchunks = 0;
+}
+
+const struct btrfs_chunk_map *btrfs_chunk_lookup(struct btrfs_volume *vol, uint64_t logical) {
+	size_t lo = 0, hi = vol->nchunks, mid;
+	const struct btrfs_chunk_map *map;
+
+	BTRFS_VOLUME_STAT(vol, BTRFS_STAT_CHUNK_LOOKUP, 1);
+	// last chunk starting at or below `logical`
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(vol->chunks[mid]->logical <= logical)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo > 0) {
+		map = vol->chunks[lo - 1];
+		if(logical - map->logical < map->length)
+			return(map);
+	}
+	BTRFS_VOLUME_STAT(vol, BTRFS_STAT_CHUNK_MISS, 1);
+	return(NULL);
+}
+
+int btrfs_chunk_mirrors(const struct btrfs_chunk_map *map) {
+	switch(map->type & BTRFS_PROFILE_MASK) {
+	case BLOCK_FLAG_RAID1:
+	case BLOCK_FLAG_DUPLICATE:
+		return(2);
+	case BLOCK_FLAG_RAID1C3:
+		return(3);
+	case BLOCK_FLAG_RAID1C4:
+		return(4);
+	case BLOCK_FLAG_RAID10:
+		return(map->sub_stripes);
+	default:
+		return(1);
+	}
+}
+
+int btrfs_map_logical(struct btrfs_volume *vol, uint64_t logical, int mirror, struct btrfs_device **dev,
+    uint64_t *physical, uint64_t *contiguous) {
+	const struct btrfs_chunk_map *map;
+	uint64_t offset, stripe_nr, stripe_offset, in_stripe, full, avail;
+	uint32_t index, factor, ndata;
+
+	map = btrfs_chunk_lookup(vol, logical);
+	if(map == NULL)
+		return(EIO);
+	if(mirror < 0 || mirror >= btrfs_chunk_mirrors(map))
+		return(EINVAL);
+	offset = logical - map->logical;
+	stripe_nr = offset / map->stripe_len;
+	in_stripe = offset % map->stripe_len;
+	avail = map->stripe_len - in_stripe;
+
+	switch(map->type & BTRFS_PROFILE_MASK) {
+	case BLOCK_FLAG_RAID0:
+		index = stripe_nr % map->num_stripes;
+		stripe_offset = (stripe_nr / map->num_stripes) * map->stripe_len + in_stripe;
+		break;
+	case BLOCK_FLAG_RAID10:
+		factor = map->num_stripes / map->sub_stripes;
+		index = (stripe_nr % factor) * map->sub_stripes + mirror;
+		stripe_offset = (stripe_nr / factor) * map->stripe_len + in_stripe;
+		break;
+	case BLOCK_FLAG_RAID5:
+	case BLOCK_FLAG_RAID6:
+		// parity rotates one device per full stripe
+		ndata = map->num_stripes - ((map->type & BLOCK_FLAG_RAID6) ? 2 : 1);
+		full = stripe_nr / ndata;
+		index = (stripe_nr % ndata + full) % map->num_stripes;
+		stripe_offset = full * map->stripe_len + in_stripe;
+		break;
+	default:
+		index = mirror;
+		stripe_offset = offset;
+		avail = map->length - offset;
+		break;
+	}
+	if(map->stripes[index].dev == NULL)
+		return(ENXIO);
+	*dev = map->stripes[index].dev;
+	*physical = map->stripes[index].offset + stripe_offset;
+	*contiguous = avail < map->length - offset ? avail : map->length - offset;
+	return(0);
+}
+
+int btrfs_read_logical(struct btrfs_volume *vol, uint64_t logical, void *buf, size_t size, int mirror) {
+	struct btrfs_device *dev;
+	uint64_t physical, contiguous;
+	uint8_t *dest = buf;
+	ssize_t n;
+	int error;
+
+	while(size > 0) {
+		error = btrfs_map_logical(vol, logical, mirror, &dev, &physical, &contiguous);
+		if(error)
+			return(error);
+		if(contiguous > size)
+			contiguous = size;
+		n = pread(dev->fd, dest, contiguous, physical);
+		if(n < 0)
+			return(errno);
+		if((uint64_t)n != contiguous)
+			return(EIO);
+		BTRFS_VOLUME_STAT(vol, BTRFS_STAT_BREAD, 1);
+		BTRFS_VOLUME_STAT(vol, BTRFS_STAT_BREAD_BYTES, n);
+		logical += n;
+		dest += n;
+		size -= n;
+	}
+	return(0);
+}
+
+int btrfs_check_node(struct btrfs_volume *vol, const uint8_t *buf, uint64_t logical, int level,
+    uint64_t generation) {
+	const btrfs_uuid *fsid = (vol->sb.incompat_flags & BTRFS_INCOMPAT_FLAGS_METADATA_UUID) ?
+	    &vol->sb.metadata_uuid : &vol->sb.uuid;
+	uint32_t data_size = vol->node_size - sizeof(struct btrfs_tree_header);
+	uint32_t num_items = btrfs_header_nritems(buf);
+	uint8_t node_level = btrfs_header_level(buf);
+	size_t entry_size;
+
+	if(btrfs_csum_block(buf, vol->node_size) != btrfs_get_le32(buf)) {
+		BTRFS_VOLUME_STAT(vol, BTRFS_STAT_CSUM_FAIL, 1);
+		return(EBADMSG);
+	}
+	if(btrfs_header_bytenr(buf) != logical)
+		return(EIO);
+	if(memcmp(BTRFS_FIELD(buf, struct btrfs_tree_header, fs_uuid), fsid, sizeof(*fsid)) != 0)
+		return(EIO);
+	if(generation != 0 && btrfs_header_generation(buf) != generation)
+		return(EIO);
+	if(node_level >= BTRFS_MAX_LEVEL || (level >= 0 && node_level != level))
+		return(EIO);
+	entry_size = node_level ? sizeof(struct btrfs_internal_node) : sizeof(struct btrfs_leaf_node);
+	if((uint64_t)num_items * entry_size > data_size)
+		return(EIO);
+	if(node_level == 0) {
+		for(uint32_t i = 0; i < num_items; ++i) {
+			if((uint64_t)btrfs_item_offset(buf, i) + btrfs_item_size(buf, i) > data_size)
+				return(EIO);
+		}
+	}
+	return(0);
+}
+
+int btrfs_read_node(struct btrfs_volume *vol, uint64_t logical, int level, uint64_t generation, uint8_t *buf) {
+	const struct btrfs_chunk_map *map;
+	int mirrors, error = EIO;
+
+	map = btrfs_chunk_lookup(vol, logical);
+	if(map == NULL)
+		return(EIO);
+	mirrors = btrfs_chunk_mirrors(map);
+	BTRFS_VOLUME_STAT(vol, BTRFS_STAT_TREE_CACHE_MISS, 1);
+	for(int mirror = 0; mirror < mirrors; ++mirror) {
+		error = btrfs_read_logical(vol, logical, buf, vol->node_size, mirror);
+		if(error == 0)
+			error = btrfs_check_node(vol, buf, logical, level, generation);
+		if(error == 0)
+			return(0);
+	}
+	return(error == EBADMSG ? EIO : error);
+}
+
+int btrfs_find_root(struct btrfs_volume *vol, uint64_t tree_id, uint64_t *bytenr, uint8_t *level) {
+	struct btrfs_key key = { .obj_id = tree_id, .obj_type = TYPE_ROOT_ITEM, .offset = 0 };
+	struct btrfs_path path;
+	const uint8_t *item;
+	int error;
+
+	if(tree_id == BTRFS_ROOT_ROOT) {
+		*bytenr = vol->sb.root_tree_addr;
+		*level = vol->sb.root_level;
+		return(0);
+	}
+	if(tree_id == BTRFS_ROOT_CHUNK) {
+		*bytenr = vol->sb.chunk_tree_addr;
+		*level = vol->sb.chunk_root_level;
+		return(0);
+	}
+	// snapshots carry their creation transid in the key offset, take the first
+	error = btrfs_search(vol, vol->sb.root_tree_addr, vol->sb.root_level, &key, &path);
+	if(error == 0) {
+		item = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(item) != tree_id || btrfs_disk_key_type(item) != TYPE_ROOT_ITEM ||
+		    btrfs_path_size(&path) < __builtin_offsetof(struct btrfs_root_item, generation2))
+			error = ENOENT;
+	}
+	if(error == 0) {
+		item = btrfs_path_data(&path);
+		*bytenr = BTRFS_GET_LE64(item, struct btrfs_root_item, block_number);
+		*level = BTRFS_GET_U8(item, struct btrfs_root_item, root_level);
+	}
+	btrfs_path_release(&path);
+	return(error);
+}
+
+int btrfs_csum_lookup(struct btrfs_volume *vol, uint64_t start, uint64_t len, uint32_t *csums, uint8_t *present) {
+	// an item holds less than a node's worth of 4 byte sums, so one starting
+	// this far before `start` is the earliest that can still reach it
+	uint64_t span = (uint64_t)(vol->node_size / sizeof(uint32_t)) * vol->sector_size;
+	struct btrfs_key key = { EXTENT_CSUM_ID, TYPE_EXTENT_CSUM, start > span ? start - span : 0 };
+	uint64_t end = start + len, item_start, item_end, sector;
+	struct btrfs_path path;
+	const uint8_t *k, *sums;
+	int error;
+
+	memset(present, 0, (len / vol->sector_size + 7) / 8);
+	if(vol->csum_root.bytenr == 0)
+		return(0);
+	error = btrfs_search(vol, vol->csum_root.bytenr, vol->csum_root.level, &key, &path);
+	for(; error == 0; error = btrfs_next_item(vol, &path)) {
+		k = btrfs_path_key(&path);
+		if(btrfs_disk_key_objectid(k) != EXTENT_CSUM_ID || btrfs_disk_key_type(k) != TYPE_EXTENT_CSUM)
+			break;
+		item_start = btrfs_disk_key_offset(k);
+		if(item_start >= end)
+			break;
+		item_end = item_start + (uint64_t)(btrfs_path_size(&path) / sizeof(uint32_t)) * vol->sector_size;
+		sums = btrfs_path_data(&path);
+		for(uint64_t at = item_start > start ? item_start : start; at < item_end && at < end; at += vol->sector_size) {
+			sector = (at - start) / vol->sector_size;
+			csums[sector] = btrfs_get_le32(sums + (at - item_start) / vol->sector_size * sizeof(uint32_t));
+			present[sector / 8] |= 1 << (sector % 8);
+		}
+	}
+	btrfs_path_release(&path);
+	return(error == ENOENT ? 0 : error);
+}
+
+int btrfs_read_data(struct btrfs_volume *vol, uint64_t logical, void *buf, size_t size) {
+	const struct btrfs_chunk_map *map;
+	size_t nsectors = size / vol->sector_size;
+	uint8_t *dest = buf, *sector, *present;
+	uint32_t *csums;
+	bool whole, has_csum;
+	int mirrors, mirror, error;
+
+	map = btrfs_chunk_lookup(vol, logical);
+	if(map == NULL)
+		return(EIO);
+	mirrors = btrfs_chunk_mirrors(map);
+	csums = malloc(nsectors * sizeof(*csums) + (nsectors + 7) / 8);
+	if(csums == NULL)
+		return(ENOMEM);
+	present = (uint8_t *)(csums + nsectors);
+	error = btrfs_csum_lookup(vol, logical, size, csums, present);
+	if(error)
+		goto out;
+
+	for(mirror = 0; mirror < mirrors; ++mirror) {
+		if(btrfs_read_logical(vol, logical, buf, size, mirror) == 0)
+			break;
+	}
+	// when no copy reads in one piece, every sector is fetched on its own
+	whole = mirror < mirrors;
+	for(size_t i = 0; i < nsectors; ++i) {
+		sector = dest + i * vol->sector_size;
+		has_csum = present[i / 8] & (1 << (i % 8));
+		if(whole && (!has_csum || ~calculate_crc32c(~0U, sector, vol->sector_size) == csums[i]))
+			continue;
+		if(whole)
+			BTRFS_VOLUME_STAT(vol, BTRFS_STAT_CSUM_FAIL, 1);
+		error = EIO;
+		for(int m = 0; m < mirrors && error; ++m) {
+			if(btrfs_read_logical(vol, logical + i * vol->sector_size, sector, vol->sector_size, m) != 0)
+				continue;
+			if(!has_csum || ~calculate_crc32c(~0U, sector, vol->sector_size) == csums[i])
+				error = 0;
+		}
+		if(error)
+			goto out;
+	}
+out:
+	free(csums);
+	return(error);
+}
+
+static int path_read_child(struct btrfs_volume *vol, struct btrfs_path *path, int level) {
+	const uint8_t *parent = path->nodes[level];
+	uint32_t slot = path->slots[level];
+
+	if(path->nodes[level - 1] == NULL) {
+		path->nodes[level - 1] = malloc(vol->node_size);
+		if(path->nodes[level - 1] == NULL)
+			return(ENOMEM);
+	}
+	path->slots[level - 1] = 0;
+	return(btrfs_read_node(vol, btrfs_node_blockptr(parent, slot), level - 1,
+	    btrfs_node_ptr_generation(parent, slot), path->nodes[level - 1]));
+}
+
+int btrfs_search(struct btrfs_volume *vol, uint64_t root, uint8_t root_level, const struct btrfs_key *key,
+    struct btrfs_path *path) {
+	uint32_t lo, hi, mid;
+	int error;
+
+	memset(path, 0, sizeof(*path));
+	if(root_level >= BTRFS_MAX_LEVEL)
+		return(EIO);
+	path->root_level = root_level;
+	path->nodes[root_level] = malloc(vol->node_size);
+	if(path->nodes[root_level] == NULL)
+		return(ENOMEM);
+	error = btrfs_read_node(vol, root, root_level, 0, path->nodes[root_level]);
+	if(error)
+		return(error);
+
+	for(int level = root_level; level > 0; --level) {
+		// last pointer whose key is <= `key`
+		lo = 0;
+		hi = btrfs_header_nritems(path->nodes[level]);
+		while(lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if(btrfs_comp_disk_key(btrfs_node_key(path->nodes[level], mid), key) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if(btrfs_header_nritems(path->nodes[level]) == 0)
+			return(EIO);
+		path->slots[level] = lo > 0 ? lo - 1 : 0;
+		error = path_read_child(vol, path, level);
+		if(error)
+			return(error);
+	}
+
+	// first item whose key is >= `key`
+	lo = 0;
+	hi = btrfs_header_nritems(path->nodes[0]);
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(btrfs_comp_disk_key(btrfs_item_key(path->nodes[0], mid), key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	path->slots[0] = lo;
+	if(lo < btrfs_header_nritems(path->nodes[0]))
+		return(0);
+	if(lo == 0)
+		return(ENOENT);
+	// everything in this leaf is smaller, the answer starts the next one
+	path->slots[0] = lo - 1;
+	return(btrfs_next_item(vol, path));
+}
+
+int btrfs_next_item(struct btrfs_volume *vol, struct btrfs_path *path) {
+	int level, error;
+
+	for(;;) {
+		if(++path->slots[0] < btrfs_header_nritems(path->nodes[0]))
+			return(0);
+		// climb to the first ancestor with a pointer to the right
+		for(level = 1; level <= path->root_level; ++level) {
+			if(++path->slots[level] < btrfs_header_nritems(path->nodes[level]))
+				break;
+		}
+		if(level > path->root_level) {
+			path->slots[0] = btrfs_header_nritems(path->nodes[0]);
+			return(ENOENT);
+		}
+		for(; level > 0; --level) {
+			error = path_read_child(vol, path, level);
+			if(error)
+				return(error);
+		}
+		if(btrfs_header_nritems(path->nodes[0]) > 0)
+			return(0);
+		// an empty leaf is only legal as a root, skip it
+		path->slots[0] = 0;
+	}
+}
+
+int btrfs_prev_item(struct btrfs_volume *vol, struct btrfs_path *path) {
+	int level, error;
+
+	for(;;) {
+		if(path->slots[0] > 0) {
+			path->slots[0]--;
+			return(0);
+		}
+		// climb to the first ancestor with a pointer to the left
+		for(level = 1; level <= path->root_level; ++level) {
+			if(path->slots[level] > 0)
+				break;
+		}
+		if(level > path->root_level)
+			return(ENOENT);
+		path->slots[level]--;
+		for(; level > 0; --level) {
+			error = path_read_child(vol, path, level);
+			if(error)
+				return(error);
+			path->slots[level - 1] = btrfs_header_nritems(path->nodes[level - 1]);
+			if(level > 1 && path->slots[level - 1]-- == 0)
+				return(EIO);
+		}
+		// slot 0 now sits past the last item, the top of the loop steps onto it
+	}
+}
+
+void btrfs_path_release(struct btrfs_path *path) {
+	for(int i = 0; i < BTRFS_MAX_LEVEL; ++i) {
+		free(path->nodes[i]);
+		path->nodes[i] = NULL;
+	}
+}
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2024, Yehia Hafez 
+All rights reserved. 
+
+Redistribution and use in source and binary forms, with or without 
+modification, are permitted provided that the following conditions are met: 
+
+ * Redistributions of source code must retain the above copyright notice, 
+   this list of conditions and the following disclaimer. 
+ * Redistributions in binary form must reproduce the above copyright 
+   notice, this list of conditions and the following disclaimer in the 
+   documentation and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND ANY 
+EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE FOR ANY 
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT 
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY 
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH 
+DAMAGE.
+*/
+
+#ifndef _BTRFS_VOLUME_H
+#define _BTRFS_VOLUME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "btrfs_filesystem.h"
+#include "btrfs_accessors.h"
+#include "btrfs_stats.h"
+#include "btrfs_arena.h"
+
+/*
+ * Read-only access to a btrfs filesystem from userspace: the member devices,
+ * the logical -> physical chunk map and verified tree block reads. Everything
+ * here is safe to call from several threads once btrfs_volume_open() returns.
+ */
+
+#ifndef BTRFS_MAX_LEVEL
+#define BTRFS_MAX_LEVEL 8
+#endif
+
+struct btrfs_device {
+    const char *path;
+    int fd;
+    uint64_t devid;
+};
+
+struct btrfs_stripe_map {
+    uint64_t devid;
+    uint64_t offset;                            // physical start of the stripe on its device
+    struct btrfs_device *dev;                   // NULL when the device was not given
+};
+
+struct btrfs_chunk_map {
+    uint64_t logical;
+    uint64_t length;
+    uint64_t type;                              // BLOCK_FLAG_*
+    uint64_t stripe_len;
+    uint16_t num_stripes;
+    uint16_t sub_stripes;
+    struct btrfs_stripe_map stripes[];
+};
+
+struct btrfs_volume {
+    struct btrfs_superblock sb;                 // copy with the newest generation
+    struct btrfs_device *devs;
+    int ndevs;
+    struct btrfs_chunk_map **chunks;            // sorted by logical address
+    size_t nchunks;
+    uint32_t node_size;
+    uint32_t sector_size;
+    struct btrfs_tree_root {
+        uint64_t bytenr;                        // 0 when the tree does not exist
+        uint8_t level;
+    } extent_root, csum_root;
+    struct btrfs_arena arena;                   // chunk maps, lives as long as the volume
+    _Atomic uint64_t stats[BTRFS_NSTATS];
+};
+
+#define BTRFS_VOLUME_STAT(vol, stat, n) atomic_fetch_add_explicit(&(vol)->stats[(stat)], (n), memory_order_relaxed)
+
+// Opens every path, checks they belong to the same filesystem and loads the
+// chunk tree. Returns 0 or an errno, reporting the reason on stderr.
+int btrfs_volume_open(struct btrfs_volume *vol, char *const paths[], int count);
+void btrfs_volume_close(struct btrfs_volume *vol);
+
+const struct btrfs_chunk_map *btrfs_chunk_lookup(struct btrfs_volume *vol, uint64_t logical);
+
+// copies of the data kept by a chunk (1 for single, RAID0 and RAID5/6)
+int btrfs_chunk_mirrors(const struct btrfs_chunk_map *map);
+
+// Where `logical` lives in copy `mirror` of its chunk, and how many bytes from
+// there are contiguous on that device.
+int btrfs_map_logical(struct btrfs_volume *vol, uint64_t logical, int mirror, struct btrfs_device **dev,
+    uint64_t *physical, uint64_t *contiguous);
+
+// Reads from copy `mirror` only, split at stripe boundaries. Returns 0 or an errno.
+int btrfs_read_logical(struct btrfs_volume *vol, uint64_t logical, void *buf, size_t size, int mirror);
+
+// Reads the tree block at `logical` and checks its checksum, address, fsid,
+// level (`level` < 0 accepts any) and generation (0 accepts any), falling back to
+// the other copies when one is bad. Returns 0, EIO for an unreadable or corrupt
+// block, or another errno.
+int btrfs_read_node(struct btrfs_volume *vol, uint64_t logical, int level, uint64_t generation, uint8_t *buf);
+
+// Checks a block already in memory the same way. Returns 0, EBADMSG for a
+// checksum mismatch or EIO for a bad header.
+int btrfs_check_node(struct btrfs_volume *vol, const uint8_t *buf, uint64_t logical, int level,
+    uint64_t generation);
+
+/*
+ * Data checksums for the sectors of [start, start + len), both sector aligned,
+ * from the csum tree. csums[i] is the crc32c stored for sector i, and bit i of
+ * `present` is set when one is stored at all (nodatasum files and unallocated
+ * space have none). Returns 0 or an errno.
+ */
+int btrfs_csum_lookup(struct btrfs_volume *vol, uint64_t start, uint64_t len, uint32_t *csums, uint8_t *present);
+
+// Reads file data at `logical` (sector aligned, as is `size`), checking every
+// sector that has a checksum and taking bad sectors from the other copies.
+// Returns 0, EIO when some sector has no good copy, or another errno.
+int btrfs_read_data(struct btrfs_volume *vol, uint64_t logical, void *buf, size_t size);
+
+// root node address and level of tree `tree_id`, looked up in the root tree
+int btrfs_find_root(struct btrfs_volume *vol, uint64_t tree_id, uint64_t *bytenr, uint8_t *level);
+
+/*
+ * Positioned search. btrfs_search() leaves the path on the first item whose key
+ * is >= `key` (returning 0), or past the end of the tree (returning ENOENT).
+ * btrfs_next_item() moves to the following item and returns ENOENT at the end;
+ * btrfs_prev_item() moves to the one before and returns ENOENT at the start,
+ * and also works from past the end. All return other errnos for read errors.
+ */
+struct btrfs_path {
+    uint8_t *nodes[BTRFS_MAX_LEVEL];
+    uint32_t slots[BTRFS_MAX_LEVEL];
+    int root_level;
+};
+
+int btrfs_search(struct btrfs_volume *vol, uint64_t root, uint8_t root_level, const struct btrfs_key *key,
+    struct btrfs_path *path);
+int btrfs_next_item(struct btrfs_volume *vol, struct btrfs_path *path);
+int btrfs_prev_item(struct btrfs_volume *vol, struct btrfs_path *path);
+void btrfs_path_release(struct btrfs_path *path);
+
+// the item under the path
+static inline const uint8_t *btrfs_path_key(const struct btrfs_path *path) {
+    return(btrfs_item_key(path->nodes[0], path->slots[0]));
+}
+
+static inline const uint8_t *btrfs_path_data(const struct btrfs_path *path) {
+    return(btrfs_item_data(path->nodes[0], path->slots[0]));
+}
+
+static inline uint32_t btrfs_path_size(const struct btrfs_path *path) {
+    return(btrfs_item_size(path->nodes[0], path->slots[0]));
+}
+
+#endif // _BTRFS_VOLUME_H